@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+/* Micro-benchmark of the PAM round-trips of xa_auth.c (the conversation
+   included), against the stand-in libpam in fake_pam.c. See bench.h. */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "xa_auth.h"
+#include "bench.h"
+
+#define USER "root"
+#define PASSWORD "xenroot"
+
+static int authorize(void *arg)
+{
+    const char *error = NULL;
+
+    (void)arg;
+    return XA_mh_authorize(USER, PASSWORD, &error) != XA_SUCCESS;
+}
+
+/* A wrong password must be refused, and reported */
+static int authorize_refused(void *arg)
+{
+    const char *error = NULL;
+
+    (void)arg;
+    return XA_mh_authorize(USER, "wrong", &error) != XA_ERR_EXTERNAL ||
+        error == NULL;
+}
+
+static int chpasswd(void *arg)
+{
+    const char *error = NULL;
+
+    (void)arg;
+    return XA_mh_chpasswd(USER, PASSWORD, &error) != XA_SUCCESS;
+}
+
+int main(void)
+{
+    int failures = 0;
+
+    setenv("FAKE_PAM_USER", USER, 1);
+    setenv("FAKE_PAM_PASSWORD", PASSWORD, 1);
+    failures -= bench_run("auth", "authorize", authorize, NULL);
+    failures -= bench_run("auth", "authorize_refused", authorize_refused,
+                          NULL);
+    failures -= bench_run("auth", "chpasswd", chpasswd, NULL);
+    return failures ? 1 : 0;
+}
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
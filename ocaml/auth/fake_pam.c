@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+/* An in-process stand-in for libpam with one service and one account,
+   for exercising xa_auth.c without a PAM configuration. It holds the
+   same conversation with the application as pam_unix: the password is
+   asked for with echo off (and the user name with echo on if pam_start
+   was not given one), a new password twice. The account is set by
+   FAKE_PAM_USER and FAKE_PAM_PASSWORD (default root/xenroot);
+   pam_chauthtok changes the password for the rest of the process. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <security/pam_appl.h>
+
+struct pam_handle {
+    char *user;
+    struct pam_conv conv;
+};
+
+static pthread_mutex_t account_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *account_password;
+
+static const char *account_user(void)
+{
+    const char *user = getenv("FAKE_PAM_USER");
+
+    return user ? user : "root";
+}
+
+int pam_start(const char *service_name, const char *user,
+              const struct pam_conv *pam_conversation, pam_handle_t **pamh)
+{
+    pam_handle_t *h = calloc(1, sizeof(*h));
+
+    *pamh = h;
+    if (h == NULL)
+        return PAM_BUF_ERR;
+    if (user != NULL && (h->user = strdup(user)) == NULL)
+        return PAM_BUF_ERR;
+    h->conv = *pam_conversation;
+    return PAM_SUCCESS;
+}
+
+int pam_end(pam_handle_t *pamh, int pam_status)
+{
+    if (pamh == NULL)
+        return PAM_SYSTEM_ERR;
+    free(pamh->user);
+    free(pamh);
+    return PAM_SUCCESS;
+}
+
+/* Ask one question; the answer must be freed */
+static int ask(pam_handle_t *pamh, int style, const char *prompt,
+               char **answer)
+{
+    struct pam_message msg = { style, prompt };
+    const struct pam_message *msgs = &msg;
+    struct pam_response *resp = NULL;
+    int rc;
+
+    rc = pamh->conv.conv(1, &msgs, &resp, pamh->conv.appdata_ptr);
+    if (rc != PAM_SUCCESS)
+        return rc;
+    if (resp == NULL || resp->resp == NULL) {
+        free(resp);
+        return PAM_CONV_ERR;
+    }
+    *answer = resp->resp;
+    free(resp);
+    return PAM_SUCCESS;
+}
+
+int pam_authenticate(pam_handle_t *pamh, int flags)
+{
+    const char *expected;
+    char *password;
+    int rc, ok;
+
+    if (pamh->user == NULL &&
+        (rc = ask(pamh, PAM_PROMPT_ECHO_ON, "login: ", &pamh->user)))
+        return rc;
+    if ((rc = ask(pamh, PAM_PROMPT_ECHO_OFF, "Password: ", &password)))
+        return rc;
+
+    pthread_mutex_lock(&account_lock);
+    expected = account_password ? account_password
+        : getenv("FAKE_PAM_PASSWORD") ? getenv("FAKE_PAM_PASSWORD")
+        : "xenroot";
+    ok = !strcmp(pamh->user, account_user()) && !strcmp(password, expected);
+    pthread_mutex_unlock(&account_lock);
+    if (!ok)
+        rc = strcmp(pamh->user, account_user()) ? PAM_USER_UNKNOWN
+            : PAM_AUTH_ERR;
+    free(password);
+    return rc;
+}
+
+int pam_acct_mgmt(pam_handle_t *pamh, int flags)
+{
+    return strcmp(pamh->user, account_user()) ? PAM_USER_UNKNOWN
+        : PAM_SUCCESS;
+}
+
+int pam_chauthtok(pam_handle_t *pamh, int flags)
+{
+    char *password, *again;
+    int rc;
+
+    if (strcmp(pamh->user, account_user()))
+        return PAM_USER_UNKNOWN;
+    if ((rc = ask(pamh, PAM_PROMPT_ECHO_OFF, "New password: ", &password)))
+        return rc;
+    if ((rc = ask(pamh, PAM_PROMPT_ECHO_OFF, "Retype new password: ",
+                  &again))) {
+        free(password);
+        return rc;
+    }
+    if (strcmp(password, again)) {
+        free(password);
+        free(again);
+        return PAM_AUTHTOK_ERR;
+    }
+    free(again);
+    pthread_mutex_lock(&account_lock);
+    free(account_password);
+    account_password = password;
+    pthread_mutex_unlock(&account_lock);
+    return PAM_SUCCESS;
+}
+
+/* Not the handle: xa_auth.c asks after pam_end */
+const char *pam_strerror(pam_handle_t *pamh, int errnum)
+{
+    switch (errnum) {
+    case PAM_SUCCESS:
+        return "Success";
+    case PAM_AUTH_ERR:
+        return "Authentication failure";
+    case PAM_USER_UNKNOWN:
+        return "User not known to the underlying authentication module";
+    case PAM_AUTHTOK_ERR:
+        return "Authentication token manipulation error";
+    case PAM_CONV_ERR:
+        return "Conversation error";
+    case PAM_BUF_ERR:
+        return "Memory buffer error";
+    default:
+        return "System error";
+    }
+}
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -14,6 +14,7 @@
 #include <stdarg.h>
 
 #include "xa_auth.h"
+#include "trace_stub.h"
 #include <security/pam_appl.h>
 #include <security/pam_misc.h>
 
@@ -76,16 +77,19 @@ int XA_mh_authorize (const char *username, const char *password,
     pam_handle_t *pamh;
     int rc = XA_SUCCESS;
 
-    if ((rc = pam_start(SERVICE_NAME, username, &xa_conv, &pamh))
-        != PAM_SUCCESS) {
+    TRACE("pam", "pam_start",
+          rc = pam_start(SERVICE_NAME, username, &xa_conv, &pamh));
+    if (rc != PAM_SUCCESS) {
         goto exit;
     }
-    if ((rc = pam_authenticate(pamh, PAM_DISALLOW_NULL_AUTHTOK))
-        != PAM_SUCCESS) {
+    TRACE("pam", "pam_authenticate",
+          rc = pam_authenticate(pamh, PAM_DISALLOW_NULL_AUTHTOK));
+    if (rc != PAM_SUCCESS) {
         goto exit;
     }
 
-    rc = pam_acct_mgmt(pamh, PAM_DISALLOW_NULL_AUTHTOK);
+    TRACE("pam", "pam_acct_mgmt",
+          rc = pam_acct_mgmt(pamh, PAM_DISALLOW_NULL_AUTHTOK));
 
  exit:
     pam_end(pamh, rc);
@@ -106,11 +110,12 @@ int XA_mh_chpasswd (const char *username, const char *new_passwd, const char **e
     pam_handle_t *pamh;
     int rc = XA_SUCCESS;
 
-    if ((rc = pam_start(SERVICE_NAME, username, &xa_conv, &pamh))
-        != PAM_SUCCESS) {
+    TRACE("pam", "pam_start",
+          rc = pam_start(SERVICE_NAME, username, &xa_conv, &pamh));
+    if (rc != PAM_SUCCESS) {
         goto exit;
     }
-    rc = pam_chauthtok(pamh, 0);
+    TRACE("pam", "pam_chauthtok", rc = pam_chauthtok(pamh, 0));
 
  exit:
     if (rc != PAM_SUCCESS) {
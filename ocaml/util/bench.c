@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/utsname.h>
+
+#include "bench.h"
+
+#define WARMUP_CALLS 100
+#define MAX_CALLS (16 * 1024 * 1024)
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of n sorted samples */
+static uint64_t percentile(const uint64_t *s, size_t n, double p)
+{
+    size_t i = (size_t)(p / 100 * n + 0.5);
+
+    return s[i == 0 ? 0 : i > n ? n - 1 : i - 1];
+}
+
+int bench_run(const char *suite, const char *name, bench_fn fn, void *arg)
+{
+    const char *env = getenv("BENCH_SECONDS");
+    double seconds = env ? atof(env) : 1.0;
+    size_t n = 0, size = 4096, i;
+    uint64_t *samples = malloc(size * sizeof(*samples)), *bigger;
+    uint64_t start, end, t;
+    double total;
+    struct utsname u;
+    FILE *f;
+    int failed = 0;
+
+    if (samples == NULL) {
+        fprintf(stderr, "%s/%s: %s\n", suite, name, strerror(errno));
+        return -1;
+    }
+    for (i = 0; i < WARMUP_CALLS && !failed; i++)
+        failed = fn(arg);
+
+    start = now_ns();
+    end = start + (uint64_t)(seconds * 1e9);
+    for (t = start; !failed && t < end && n < MAX_CALLS; ) {
+        if (n == size) {
+            bigger = realloc(samples, 2 * size * sizeof(*samples));
+            if (bigger == NULL)
+                break;
+            samples = bigger;
+            size *= 2;
+        }
+        failed = fn(arg);
+        samples[n] = now_ns() - t;
+        t += samples[n++];
+    }
+    total = (t - start) / 1e9;
+
+    if (failed || n == 0) {
+        fprintf(stderr, "%-10s %-24s FAILED after %zu calls\n",
+                suite, name, n);
+        free(samples);
+        return -1;
+    }
+    qsort(samples, n, sizeof(*samples), cmp_u64);
+    fprintf(stderr, "%-10s %-24s %10.0f/s  p50 %8.2fus  p99 %8.2fus  "
+            "p99.9 %8.2fus\n", suite, name, n / total,
+            percentile(samples, n, 50) / 1e3,
+            percentile(samples, n, 99) / 1e3,
+            percentile(samples, n, 99.9) / 1e3);
+
+    env = getenv("BENCH_RESULTS");
+    if (env != NULL && *env) {
+        if (uname(&u))
+            strcpy(u.nodename, "unknown");
+        f = fopen(env, "a");
+        if (f == NULL) {
+            fprintf(stderr, "%s: %s\n", env, strerror(errno));
+        } else {
+            fprintf(f, "{\"suite\":\"%s\",\"case\":\"%s\",\"host\":\"%s\","
+                    "\"time\":%ld,\"calls\":%zu,\"seconds\":%.3f,"
+                    "\"per_second\":%.1f,\"p50_ns\":%"PRIu64","
+                    "\"p99_ns\":%"PRIu64",\"p999_ns\":%"PRIu64","
+                    "\"max_ns\":%"PRIu64"}\n",
+                    suite, name, u.nodename, (long)time(NULL), n, total,
+                    n / total, percentile(samples, n, 50),
+                    percentile(samples, n, 99),
+                    percentile(samples, n, 99.9), samples[n - 1]);
+            fclose(f);
+        }
+    }
+    free(samples);
+    return 0;
+}
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <stdint.h>
+
+/* Micro-benchmarks of the C stubs (omake bench). Each case is run
+   repeatedly for BENCH_SECONDS (default 1) after a short warm-up, timing
+   every call, and reported as throughput and p50/p99/p99.9 latency: on
+   stderr, and as one JSON object per line appended to the file named by
+   BENCH_RESULTS, if set, so that runs can be compared. */
+
+/* One call of the code under test: 0 on success */
+typedef int (*bench_fn)(void *arg);
+
+/* Run and report one case. Returns 0, or -1 if a call failed. */
+extern int bench_run(const char *suite, const char *name,
+                     bench_fn fn, void *arg);
+
+#endif /* _BENCH_H_ */
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+/* Per-domain exclusion of log-dirty mode users, see domain_lock.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "domain_lock.h"
+
+int domain_lock(int domid, int wait)
+{
+    const char *dir = getenv("XENGUEST_LOCK_DIR");
+    char path[256];
+    int fd, r, saved_errno;
+
+    if (dir == NULL || *dir == '\0')
+        dir = DOMAIN_LOCK_DIR;
+    if (mkdir(dir, 0700) && errno != EEXIST)
+        return -1;
+    snprintf(path, sizeof(path), "%s/%d", dir, domid);
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return -1;
+    do
+        r = flock(fd, LOCK_EX | (wait ? 0 : LOCK_NB));
+    while (r && errno == EINTR);
+    if (r) {
+        saved_errno = errno == EWOULDBLOCK ? EBUSY : errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    return fd;
+}
+
+void domain_unlock(int fd)
+{
+    int saved_errno = errno;
+
+    if (fd >= 0)
+        close(fd);
+    errno = saved_errno;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+#ifndef _DOMAIN_LOCK_H_
+#define _DOMAIN_LOCK_H_
+
+/* A domain has a single log-dirty mode and a single dirty bitmap, so a
+   save (xenguest) and a dirty rate sample (xenops' logdirty_stubs.c)
+   which used them at the same time would clear each other's dirty bits,
+   and whichever finished first would switch the mode off under the
+   other. Each holds this lock, a flock on a file named after the domid,
+   for as long as it uses the mode.
+
+   The files live in DOMAIN_LOCK_DIR, or in $XENGUEST_LOCK_DIR if set
+   (e.g. to run against the simulated libxc without root). */
+#define DOMAIN_LOCK_DIR "/var/run/xenguest"
+
+/* Lock domid, waiting for the lock if wait, otherwise failing with EBUSY
+   if it is held. Returns the fd which holds the lock, or -1 with errno
+   set. */
+extern int domain_lock(int domid, int wait);
+
+/* Release a lock taken by domain_lock (the file is left in place, since
+   removing it would race with another locker). Preserves errno. */
+extern void domain_unlock(int fd);
+
+#endif /* _DOMAIN_LOCK_H_ */
@@ -0,0 +1,30 @@
+(*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *)
+(** Spans recorded by the C stubs (see trace_stub.h), written out in the
+    Chrome trace event format *)
+
+(** Start recording, in every thread of this process and its children *)
+external start : unit -> unit = "stub_trace_start"
+
+external stop : unit -> unit = "stub_trace_stop"
+
+(** [dump path] appends the spans recorded since the last dump to [path],
+    which is created if needed. Several processes may append to the same
+    file. *)
+external dump : string -> unit = "stub_trace_dump"
+
+(** [dump_at_exit path] dumps to [path] when this process (or a forked
+    child of it) exits, passing any failure to [on_error] *)
+let dump_at_exit ?(on_error = fun _ -> ()) path =
+	at_exit (fun () -> try dump path with Failure msg -> on_error msg)
@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "trace_stub.h"
+
+struct trace_event {
+    const char *cat, *name;
+    uint64_t start, end;        /* ns, CLOCK_MONOTONIC */
+};
+
+/* Written only by the owning thread, which publishes each event by
+   advancing head. The dumper only reads, so a thread which records
+   TRACE_RING_SIZE events while a dump is in progress may have some of
+   them garbled in it. */
+struct trace_ring {
+    struct trace_ring *next;
+    pid_t tid;
+    uint64_t head;              /* events recorded */
+    uint64_t dumped;            /* ... of which dumped (under dump_lock) */
+    struct trace_event ev[TRACE_RING_SIZE];
+};
+
+volatile int trace_on;
+
+static struct trace_ring *rings;
+static __thread struct trace_ring *ring;
+static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t trace_begin(void)
+{
+    return trace_on ? now_ns() : 0;
+}
+
+/* This thread's ring, created on its first event. Rings are never freed:
+   a thread which exits leaves its events to be dumped. */
+static struct trace_ring *get_ring(void)
+{
+    struct trace_ring *r = ring;
+
+    if (r != NULL)
+        return r;
+    r = calloc(1, sizeof(*r));
+    if (r == NULL)
+        return NULL;
+    r->tid = syscall(SYS_gettid);
+    do
+        r->next = rings;
+    while (!__sync_bool_compare_and_swap(&rings, r->next, r));
+    ring = r;
+    return r;
+}
+
+void trace_end(const char *cat, const char *name, uint64_t start)
+{
+    struct trace_ring *r;
+    struct trace_event *e;
+
+    if (start == 0 || (r = get_ring()) == NULL)
+        return;
+    e = &r->ev[r->head % TRACE_RING_SIZE];
+    e->cat = cat;
+    e->name = name;
+    e->start = start;
+    e->end = now_ns();
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/* The child of a fork starts with copies of its parent's events, which
+   the parent will dump itself */
+static void forget_parent(void)
+{
+    struct trace_ring *r;
+
+    pthread_mutex_init(&dump_lock, NULL);
+    for (r = rings; r != NULL; r = r->next)
+        r->dumped = r->head;
+    if (ring != NULL)
+        ring->tid = syscall(SYS_gettid);
+}
+
+void trace_start(void)
+{
+    static int done;
+
+    if (!done) {
+        pthread_atfork(NULL, NULL, forget_parent);
+        done = 1;
+    }
+    trace_on = 1;
+}
+
+void trace_stop(void)
+{
+    trace_on = 0;
+}
+
+int trace_dump(const char *path)
+{
+    struct trace_ring *r;
+    struct trace_event *e;
+    uint64_t head, i;
+    struct stat st;
+    FILE *f = NULL;
+    int fd = -1, pid = getpid(), saved;
+
+    pthread_mutex_lock(&dump_lock);
+    for (r = rings; r != NULL; r = r->next) {
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if (head == r->dumped)
+            continue;
+        if (f == NULL) {
+            /* Other processes (the parent or child of a fork) may be
+               appending to the same file */
+            fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (fd < 0 || flock(fd, LOCK_EX) || fstat(fd, &st) ||
+                (f = fdopen(fd, "a")) == NULL)
+                goto err;
+            if (st.st_size == 0)
+                fputs("[\n", f);
+            fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                    "\"args\":{\"name\":\"%s\"}},\n",
+                    pid, program_invocation_short_name);
+        }
+        i = head - r->dumped > TRACE_RING_SIZE ?
+            head - TRACE_RING_SIZE : r->dumped;
+        for (; i < head; i++) {
+            e = &r->ev[i % TRACE_RING_SIZE];
+            fprintf(f, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+                    "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d},\n",
+                    e->name, e->cat, e->start / 1000.0,
+                    (e->end - e->start) / 1000.0, pid, (int)r->tid);
+        }
+        r->dumped = head;
+    }
+    if (f != NULL && fclose(f)) {
+        f = NULL;
+        fd = -1;
+        goto err;
+    }
+    pthread_mutex_unlock(&dump_lock);
+    return 0;
+
+ err:
+    saved = errno;
+    if (f != NULL)
+        fclose(f);
+    else if (fd >= 0)
+        close(fd);
+    pthread_mutex_unlock(&dump_lock);
+    errno = saved;
+    return -1;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+/* OCaml bindings of trace_ring.c */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/fail.h>
+
+#include "trace_stub.h"
+
+CAMLprim value stub_trace_start(value unit)
+{
+    trace_start();
+    return Val_unit;
+}
+
+CAMLprim value stub_trace_stop(value unit)
+{
+    trace_stop();
+    return Val_unit;
+}
+
+CAMLprim value stub_trace_dump(value path)
+{
+    CAMLparam1(path);
+    char msg[256];
+
+    if (trace_dump(String_val(path))) {
+        snprintf(msg, sizeof(msg), "trace: %s: %s", String_val(path),
+                 strerror(errno));
+        caml_failwith(msg);
+    }
+    CAMLreturn(Val_unit);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
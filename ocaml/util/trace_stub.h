@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+#ifndef _TRACE_STUB_H_
+#define _TRACE_STUB_H_
+
+#include <stdint.h>
+
+/* Timing of the C stubs' hot paths. While tracing is on (see trace.ml),
+   each span is recorded into a ring owned by the calling thread, without
+   locking; the oldest spans are overwritten once TRACE_RING_SIZE have
+   been recorded. The rings are written out in the Chrome trace event
+   format (chrome://tracing, Perfetto), as a JSON array which several
+   processes may append to.
+
+   Names and categories must be string literals: only the pointers are
+   recorded. */
+#define TRACE_RING_SIZE 4096
+
+extern volatile int trace_on;
+
+/* Start (and stop) recording, in every thread */
+extern void trace_start(void);
+extern void trace_stop(void);
+
+/* The start of a span: 0 if tracing is off */
+extern uint64_t trace_begin(void);
+
+/* Record a span from start (as returned by trace_begin) until now */
+extern void trace_end(const char *cat, const char *name, uint64_t start);
+
+/* Time one statement */
+#define TRACE(cat, name, ...) do {              \
+        uint64_t __trace_start = trace_begin(); \
+        __VA_ARGS__;                            \
+        trace_end(cat, name, __trace_start);    \
+    } while (0)
+
+/* Append the recorded spans to the file at path and forget them.
+   Returns 0, or -1 with errno set. */
+extern int trace_dump(const char *path);
+
+#endif /* _TRACE_STUB_H_ */
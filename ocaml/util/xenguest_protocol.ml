@@ -0,0 +1,225 @@
+(*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *)
+(* Messages from the xenguest helper to its parent (xenguest_main.ml to
+   xenguestHelper.ml) *)
+
+(** A measurement of a live save by xenguest_converge.c *)
+type convergence = {
+	sent: int;        (** pages/s sent *)
+	dirtied: int;     (** pages/s dirtied by the guest *)
+	downtime_ms: int; (** predicted, if the guest were stopped now; -1 if unknown *)
+	budget_ms: int;
+	throttle: int;    (** % of the guest's vCPU time withheld *)
+	decision: string;
+}
+
+(** As xenguest_converge.c prints it *)
+let string_of_convergence c =
+	Printf.sprintf "converge: %d pages/s sent, %d pages/s dirtied, downtime %dms (budget %dms), throttle %d%%: %s"
+		c.sent c.dirtied c.downtime_ms c.budget_ms c.throttle c.decision
+
+let convergence_of_string x =
+	Scanf.sscanf x "converge: %d pages/s sent, %d pages/s dirtied, downtime %dms (budget %dms), throttle %d%%: %[^\n]"
+		(fun sent dirtied downtime_ms budget_ms throttle decision ->
+			{ sent = sent; dirtied = dirtied; downtime_ms = downtime_ms;
+			  budget_ms = budget_ms; throttle = throttle; decision = decision })
+
+(** The pages a domain was built or restored with *)
+type domain_pages = {
+	store_mfn: nativeint;
+	console_mfn: nativeint;
+	protocol: string option; (** PV builds only: the guest's native protocol *)
+}
+
+(** The result of each mode of the helper *)
+type result =
+	| Done                            (** save, resume *)
+	| Domain of domain_pages          (** build or restore *)
+	| Postcopy_ready of domain_pages  (** the guest can run: the restore goes
+	                                      on in the background and ends with
+	                                      Domain *)
+	| Clones of (int * domain_pages option) list
+	                                  (** fan-out restore: each clone by
+	                                      domid, None if it failed *)
+
+type message =
+	| Stdout of string (* captured stdout from libxenguest *)
+	| Stderr of string (* captured stderr from libxenguest *)
+	| Error of string  (* an actual error that we detected *)
+	| Suspend          (* request the caller suspends the domain *)
+	| Info of string   (* some info that we want to send back *)
+	| Result of result (* the result of the operation *)
+	| Progress of int  (* percentage of the memory sent (framed only) *)
+	| Convergence of convergence (* a live save measured (framed only) *)
+
+(** The original protocol is one line per message, escaped. The parent
+    offers the framed one by setting [offer_env] to "framed" in the
+    helper's environment, which helpers that predate it ignore; the helper
+    accepts by sending [ack] as its first line and then sends each message
+    as a tag byte, a 4-byte big-endian length and the payload as it is. *)
+type protocol = Text | Framed
+
+let offer_env = "XENGUEST_CONTROL_PROTOCOL"
+let ack = "protocol:framed"
+
+(* Results in the text protocol are the space-separated words which
+   helpers have always sent, told apart by their shape *)
+
+let words_of_pages p =
+	Printf.sprintf "%nd" p.store_mfn :: Printf.sprintf "%nd" p.console_mfn ::
+	(match p.protocol with Some x -> [ x ] | None -> [])
+
+let string_of_clone (domid, pages) = match pages with
+	| Some p -> Printf.sprintf "%d:%nd:%nd" domid p.store_mfn p.console_mfn
+	| None -> Printf.sprintf "%d:failed" domid
+
+let clone_of_string x = match Stringext.String.split ':' x with
+	| [ domid; "failed" ] -> int_of_string domid, None
+	| [ domid; store; console ] ->
+		int_of_string domid,
+		Some { store_mfn = Nativeint.of_string store; console_mfn = Nativeint.of_string console; protocol = None }
+	| _ -> failwith (Printf.sprintf "invalid clone result from xenguesthelper: %s" x)
+
+let text_of_result = function
+	| Done -> ""
+	| Domain p -> String.concat " " (words_of_pages p)
+	| Postcopy_ready p -> String.concat " " (words_of_pages p @ [ "postcopy" ])
+	| Clones cs -> String.concat " " (List.map string_of_clone cs)
+
+let pages store console protocol =
+	{ store_mfn = Nativeint.of_string store; console_mfn = Nativeint.of_string console; protocol = protocol }
+
+let result_of_text x =
+	match Stringext.String.split_f Stringext.String.isspace x with
+	| [] | [ "" ] -> Done
+	| [ store; console; "postcopy" ] -> Postcopy_ready (pages store console None)
+	| (c :: _) as cs when String.contains c ':' -> Clones (List.map clone_of_string cs)
+	| [ store; console ] -> Domain (pages store console None)
+	| [ store; console; protocol ] -> Domain (pages store console (Some protocol))
+	| _ -> failwith (Printf.sprintf "invalid result from xenguesthelper: %s" x)
+
+(* In the framed protocol, the first word says which result it is *)
+
+let payload_of_result = function
+	| Done -> "done"
+	| Domain p -> String.concat " " ("domain" :: words_of_pages p)
+	| Postcopy_ready p -> String.concat " " ("postcopy" :: words_of_pages p)
+	| Clones cs -> String.concat " " ("clones" :: List.map string_of_clone cs)
+
+let result_of_payload x =
+	match Stringext.String.split_f Stringext.String.isspace x with
+	| [ "done" ] -> Done
+	| [ "domain"; store; console ] -> Domain (pages store console None)
+	| [ "domain"; store; console; protocol ] -> Domain (pages store console (Some protocol))
+	| [ "postcopy"; store; console ] -> Postcopy_ready (pages store console None)
+	| "clones" :: cs -> Clones (List.map clone_of_string cs)
+	| _ -> failwith (Printf.sprintf "invalid result from xenguesthelper: %s" x)
+
+let string_of_result = payload_of_result
+
+let string_of_message = function
+	| Stdout x -> "stdout:" ^ (String.escaped x)
+	| Stderr x -> "stderr:" ^ (String.escaped x)
+	| Error x  -> "error:" ^ (String.escaped x)
+	| Suspend  -> "suspend:"
+	| Info x   -> "info:" ^ (String.escaped x)
+	| Result x -> "result:" ^ (String.escaped (text_of_result x))
+	| Progress x -> "progress:" ^ (string_of_int x)
+	| Convergence x -> "convergence:" ^ (String.escaped (string_of_convergence x))
+
+let message_of_string x =
+	if not(String.contains x ':')
+	then failwith (Printf.sprintf "Failed to parse message from xenguesthelper [%s]" x);
+	let i = String.index x ':' in
+	let prefix = String.sub x 0 i
+	and suffix = String.sub x (i + 1) (String.length x - i - 1) in match prefix with
+	| "stdout" -> Stdout suffix
+	| "stderr" -> Stderr suffix
+	| "error" -> Error suffix
+	| "suspend" -> Suspend
+	| "info" -> Info suffix
+	| "result" -> Result (result_of_text suffix)
+	| "progress" -> Progress (int_of_string suffix)
+	| "convergence" -> Convergence (convergence_of_string suffix)
+	| _ -> Error "uncaught exception"
+
+(* Framed messages *)
+
+(* A corrupt length must not make the parent allocate gigabytes *)
+let max_payload = 16 * 1024 * 1024
+
+let tag_of_message = function
+	| Stdout _ -> 'o'
+	| Stderr _ -> 'e'
+	| Error _ -> 'E'
+	| Suspend -> 'S'
+	| Info _ -> 'i'
+	| Result _ -> 'R'
+	| Progress _ -> 'P'
+	| Convergence _ -> 'C'
+
+let payload_of_message = function
+	| Stdout x | Stderr x | Error x | Info x -> x
+	| Result x -> payload_of_result x
+	| Suspend -> ""
+	| Progress x -> string_of_int x
+	| Convergence x -> string_of_convergence x
+
+let message_of_frame tag payload = match tag with
+	| 'o' -> Stdout payload
+	| 'e' -> Stderr payload
+	| 'E' -> Error payload
+	| 'S' -> Suspend
+	| 'i' -> Info payload
+	| 'R' -> Result (result_of_payload payload)
+	| 'P' -> Progress (int_of_string payload)
+	| 'C' -> Convergence (convergence_of_string payload)
+	| c -> failwith (Printf.sprintf "Unknown message tag from xenguesthelper: %C" c)
+
+(** A message as one string, to be sent with a single write *)
+let frame_of_message x =
+	let payload = payload_of_message x in
+	let len = String.length payload in
+	let header = String.create 5 in
+	header.[0] <- tag_of_message x;
+	header.[1] <- char_of_int ((len lsr 24) land 0xff);
+	header.[2] <- char_of_int ((len lsr 16) land 0xff);
+	header.[3] <- char_of_int ((len lsr 8) land 0xff);
+	header.[4] <- char_of_int (len land 0xff);
+	header ^ payload
+
+let read_framed ic =
+	let header = String.create 5 in
+	really_input ic header 0 5;
+	let byte i = int_of_char header.[i] in
+	let len = (byte 1 lsl 24) lor (byte 2 lsl 16) lor (byte 3 lsl 8) lor (byte 4) in
+	if len > max_payload
+	then failwith (Printf.sprintf "Oversized message from xenguesthelper (%d bytes)" len);
+	let payload = String.create len in
+	really_input ic payload 0 len;
+	message_of_frame header.[0] payload
+
+(** libxc reports the progress of a save as "\b\b\b\b" and a percentage *)
+let progress_of_output x =
+	let prefix = "\b\b\b\b" in
+	let n = String.length prefix in
+	if String.length x > n && String.sub x 0 n = prefix && String.contains x '%' then begin
+		let i = String.index x '%' in
+		try Some (Scanf.sscanf (String.sub x n (i - n)) " %d" (fun p -> p))
+		with _ -> None
+	end else None
+
+(** xenguest_converge.c prints each measurement by itself *)
+let convergence_of_output x =
+	try Some (convergence_of_string x) with _ -> None
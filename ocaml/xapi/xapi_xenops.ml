@@ -54,6 +54,9 @@ module Platform = struct
 	let usb = "usb"
 	let usb_tablet = "usb_tablet"
 	let parallel = "parallel"
+	let populate_threads = "populate_threads"
+	(* Prefix of the virtual NUMA topology keys (vnuma/nodes, vnuma/<i>/...) *)
+	let vnuma = "vnuma/"
 
 	(* This is only used to block the 'present multiple physical cores as one big hyperthreaded core' feature *)
 	let filtered_flags = [
@@ -77,6 +80,7 @@ module Platform = struct
 		usb;
 		usb_tablet;
 		parallel;
+		populate_threads;
 	]
 
 	(* Other keys we might want to write to the platform map. *)
@@ -97,7 +101,7 @@ module Platform = struct
 		(* Filter out unknown flags, if applicable *)
 		let platformdata =
 			if filter_out_unknowns
-			then List.filter (fun (k, v) -> List.mem k filtered_flags) platformdata
+			then List.filter (fun (k, v) -> List.mem k filtered_flags || String.startswith vnuma k) platformdata
 			else platformdata
 		in
 		(* Filter out invalid TSC modes. *)
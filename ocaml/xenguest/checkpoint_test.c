@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+/* Loopback test of checkpoint mode against the simulated libxc
+   (fake_xenctrl.c): a primary domain is replicated to a standby restore
+   over a pipe which is cut in the middle of an epoch, as if the primary
+   host had died. The standby must come up with exactly the memory the
+   primary had at the last complete checkpoint. Epochs are sent as
+   deltas (XCFLAGS_CHECKPOINT_COMPRESS) of pages the guest only partly
+   rewrites. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <xenctrl.h>
+#include <xenguest.h>
+
+#include "xenguest_checkpoint.h"
+
+#define PRIMARY 1
+#define STANDBY 2
+#define MEM_MIB "8"
+#define INTERVAL_MS 20
+#define EPOCHS 5
+#define CUT_AFTER 1024            /* bytes: epochs are mostly deltas */
+
+static int failures;
+
+#define check(cond, what) do {                              \
+        if (cond) printf("ok: %s\n", what);                 \
+        else { printf("FAIL: %s\n", what); failures++; }   \
+    } while (0)
+
+static xc_interface *xch;
+static int save_fd[2], restore_fd[2];
+static size_t mem_size;
+
+/* The relay forwards the stream until cut_at bytes, then breaks it. It
+   reads under the lock so that relayed plus what is still in the pipe
+   is exactly what the primary has written. */
+static pthread_mutex_t relay_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t relayed, cut_at = UINT64_MAX;
+
+static struct checkpoint cp;
+static void *snapshot;          /* primary memory at the last checkpoint */
+
+static void *relay(void *arg)
+{
+    struct pollfd pfd = { .fd = save_fd[0], .events = POLLIN };
+    char buf[65536];
+    uint64_t limit;
+    ssize_t n;
+
+    for (;;) {
+        if (poll(&pfd, 1, -1) == -1 && errno == EINTR)
+            continue;
+        pthread_mutex_lock(&relay_lock);
+        n = read(save_fd[0], buf, sizeof(buf));
+        if (n <= 0) {
+            pthread_mutex_unlock(&relay_lock);
+            break;
+        }
+        limit = cut_at - relayed;
+        if ((uint64_t)n > limit)
+            n = limit;
+        relayed += n;
+        pthread_mutex_unlock(&relay_lock);
+        if (n == 0 || write(restore_fd[1], buf, n) != n)
+            break;
+    }
+    close(save_fd[0]);
+    close(restore_fd[1]);
+    return NULL;
+}
+
+static void *standby(void *arg)
+{
+    unsigned long store_mfn, console_mfn;
+    int *r = arg;
+
+    *r = xc_domain_restore(xch, restore_fd[0], STANDBY, 0, &store_mfn, 0,
+                           0, &console_mfn, 0, 0, 0, 0, 0, NULL, NULL);
+    return NULL;
+}
+
+/* Called with relay_lock held */
+static uint64_t stream_bytes(void)
+{
+    int pending = 0;
+
+    ioctl(save_fd[0], FIONREAD, &pending);
+    return relayed + pending;
+}
+
+static int suspend_cb(void *data)
+{
+    checkpoint_suspend(&cp);
+    return 1;
+}
+
+/* The epoch has been sent and the guest is still paused: this is the
+   state the standby must recover if the primary dies from now on */
+static int postcopy_cb(void *data)
+{
+    void *mem = xc_map_foreign_range(xch, PRIMARY, mem_size, PROT_READ, 0);
+
+    if (mem != NULL) {
+        memcpy(snapshot, mem, mem_size);
+        munmap(mem, mem_size);
+    }
+    pthread_mutex_lock(&relay_lock);
+    checkpoint_resumed(&cp, stream_bytes());
+    pthread_mutex_unlock(&relay_lock);
+    printf("\n");
+    return 0;
+}
+
+static int checkpoint_cb(void *data)
+{
+    if (cp.epoch == EPOCHS) {
+        /* Let the primary die a little way into the next epoch */
+        pthread_mutex_lock(&relay_lock);
+        cut_at = stream_bytes() + CUT_AFTER;
+        pthread_mutex_unlock(&relay_lock);
+    }
+    return checkpoint_next(&cp);
+}
+
+int main(void)
+{
+    struct save_callbacks callbacks;
+    pthread_t relay_thread, standby_thread;
+    void *restored, *primary;
+    int save_r, restore_r = -1;
+
+    signal(SIGPIPE, SIG_IGN);
+    setenv("FAKE_XC_MEM_MIB", MEM_MIB, 1);
+    setenv("FAKE_XC_DIRTY_RATE", "20000", 1);
+    setenv("FAKE_XC_REWRITE_BYTES", "256", 1);
+    mem_size = (size_t)atoi(MEM_MIB) << 20;
+    snapshot = malloc(mem_size);
+
+    xch = xc_interface_open(NULL, NULL, 0);
+    if (pipe(save_fd) || pipe(restore_fd) || xch == NULL || snapshot == NULL)
+        return 1;
+    pthread_create(&relay_thread, NULL, relay, NULL);
+    pthread_create(&standby_thread, NULL, standby, &restore_r);
+
+    checkpoint_init(&cp, INTERVAL_MS, 0);
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.suspend = suspend_cb;
+    callbacks.postcopy = postcopy_cb;
+    callbacks.checkpoint = checkpoint_cb;
+    save_r = xc_domain_save(xch, save_fd[1], PRIMARY, 0, 0,
+                            XCFLAGS_LIVE | XCFLAGS_CHECKPOINT_COMPRESS,
+                            &callbacks, 0, 0);
+    close(save_fd[1]);
+    printf("\n");
+    check(save_r != 0, "primary fails once the stream is cut");
+
+    pthread_join(relay_thread, NULL);
+    pthread_join(standby_thread, NULL);
+    printf("\n");
+    check(restore_r == 0, "standby completes after failover");
+    check(cp.epoch == EPOCHS, "the cut happened during the next epoch");
+
+    restored = xc_map_foreign_range(xch, STANDBY, mem_size, PROT_READ, 0);
+    check(restored != NULL && memcmp(restored, snapshot, mem_size) == 0,
+          "standby has the memory of the last complete checkpoint");
+    primary = xc_map_foreign_range(xch, PRIMARY, mem_size, PROT_READ, 0);
+    check(primary != NULL && memcmp(primary, snapshot, mem_size) != 0,
+          "the primary had moved on since");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+/* The convergence monitor against the simulated libxc (fake_xenctrl.c),
+   whose guest dirties pages in wall-clock time while log-dirty mode is
+   on: a guest dirtying memory faster than it is sent is throttled, and
+   gets its cap back at the end; one which can be stopped within the
+   budget is left alone. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <xenctrl.h>
+
+#include "xenguest_converge.h"
+
+#define DOMID 1
+
+static int failures;
+
+#define check(cond, what) do {                              \
+        if (cond) printf("ok: %s\n", what);                 \
+        else { printf("FAIL: %s\n", what); failures++; }   \
+    } while (0)
+
+/* A stream sending pages_per_s since it started */
+struct stream {
+    struct timespec start;
+    double pages_per_s;
+};
+
+static uint64_t bytes_sent(void *arg)
+{
+    struct stream *s = arg;
+    struct timespec now;
+    double elapsed;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - s->start.tv_sec) +
+        (now.tv_nsec - s->start.tv_nsec) / 1e9;
+    return elapsed * s->pages_per_s * XC_PAGE_SIZE;
+}
+
+static unsigned int cap(xc_interface *xch)
+{
+    struct xen_domctl_sched_credit sdom;
+
+    memset(&sdom, 0, sizeof(sdom));
+    xc_sched_credit_domain_get(xch, DOMID, &sdom);
+    return sdom.cap;
+}
+
+/* Watch a save at this rate for ms; returns the highest cap seen */
+static unsigned int watch(xc_interface *xch, double pages_per_s,
+                          unsigned int ms)
+{
+    struct converge_policy policy = { 100, 1, 50 };
+    struct stream s = { { 0, 0 }, pages_per_s };
+    struct converge *c;
+    unsigned int t, seen = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &s.start);
+    c = converge_start(DOMID, &policy, bytes_sent, &s);
+    if (c == NULL)
+        return -1;
+    for (t = 0; t < ms; t += 10) {
+        usleep(10000);
+        if (cap(xch) > seen)
+            seen = cap(xch);
+    }
+    converge_finish(c);
+    printf("\n");
+    return seen;
+}
+
+int main(void)
+{
+    xc_interface *xch = xc_interface_open(NULL, NULL, 0);
+    unsigned int seen;
+
+    if (xch == NULL)
+        return 1;
+    setenv("FAKE_XC_MEM_MIB", "256", 1);
+    setenv("FAKE_XC_DIRTY_RATE", "20000", 1);
+    if (xc_shadow_control(xch, DOMID, XEN_DOMCTL_SHADOW_OP_ENABLE_LOGDIRTY,
+                          NULL, 0, NULL, 0, NULL))
+        return 1;
+
+    seen = watch(xch, 2000, 500);
+    check(seen > 0 && seen <= 100 - CONVERGE_THROTTLE_INITIAL,
+          "a guest which does not converge is throttled");
+    check(cap(xch) == 0, "and gets its cap back");
+
+    seen = watch(xch, 10000000, 300);
+    check(seen == 0, "a guest within the budget is left alone");
+
+    xc_shadow_control(xch, DOMID, XEN_DOMCTL_SHADOW_OP_OFF,
+                      NULL, 0, NULL, 0, NULL);
+    xc_interface_close(xch);
+    return failures ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
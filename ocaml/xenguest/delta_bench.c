@@ -0,0 +1,236 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+/* Benchmark of the delta encoding of re-sent pages (xenguest_delta.c) on
+   synthetic rewrite patterns. A guest of GUEST_MIB is sent whole, then
+   for ROUNDS rounds a hot set of HOT_MIB is rewritten with the pattern
+   and re-sent, as during pre-copy iterations. Every page is decoded into
+   a copy of the guest, which must match it at the end.
+
+   usage: delta_bench [cache MiB (default 32)] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "xenguest_delta.h"
+
+#define GUEST_MIB 256
+#define HOT_MIB 32
+#define ROUNDS 8
+#define NR_PAGES ((GUEST_MIB << 20) / DELTA_PAGE_SIZE)
+#define NR_HOT ((HOT_MIB << 20) / DELTA_PAGE_SIZE)
+
+static uint64_t rng = 1;
+
+static uint64_t rnd(void)
+{
+    /* xorshift64* */
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return rng * 2685821657736338717ULL;
+}
+
+static void random_fill(uint8_t *p, size_t len)
+{
+    uint64_t r;
+    size_t i;
+
+    for (i = 0; i + sizeof(r) <= len; i += sizeof(r)) {
+        r = rnd();
+        memcpy(p + i, &r, sizeof(r));
+    }
+}
+
+/* Statistics counters and reference counts: a few words */
+static void counters(uint8_t *page, unsigned long pfn)
+{
+    int n = 1 + rnd() % 4;
+    uint64_t *w = (uint64_t *)page;
+
+    (void)pfn;
+    while (n--)
+        w[rnd() % (DELTA_PAGE_SIZE / 8)]++;
+}
+
+/* Log buffers: a short record appended after the previous one */
+static void log_append(uint8_t *page, unsigned long pfn)
+{
+    static unsigned int tail[NR_HOT];
+    unsigned int *t = &tail[pfn % NR_HOT];
+    size_t len = 64 + rnd() % 192;
+
+    if (*t + len > DELTA_PAGE_SIZE)
+        *t = 0;
+    random_fill(page + *t, len);
+    *t += len;
+}
+
+/* An object updated in place: one contiguous 256-byte record */
+static void record(uint8_t *page, unsigned long pfn)
+{
+    (void)pfn;
+    random_fill(page + (rnd() % (DELTA_PAGE_SIZE / 256)) * 256, 256);
+}
+
+/* Scattered updates: 32 random words */
+static void scatter(uint8_t *page, unsigned long pfn)
+{
+    uint64_t *w = (uint64_t *)page;
+    int n;
+
+    (void)pfn;
+    for (n = 0; n < 32; n++)
+        w[rnd() % (DELTA_PAGE_SIZE / 8)] = rnd();
+}
+
+/* The worst case: new contents throughout (e.g. page cache refill) */
+static void rewrite(uint8_t *page, unsigned long pfn)
+{
+    (void)pfn;
+    random_fill(page, DELTA_PAGE_SIZE);
+}
+
+/* Rewritten with the same data: dirty as far as Xen can tell */
+static void same(uint8_t *page, unsigned long pfn)
+{
+    (void)page;
+    (void)pfn;
+}
+
+static const struct {
+    const char *name;
+    void (*write)(uint8_t *page, unsigned long pfn);
+} workloads[] = {
+    { "counters", counters },
+    { "log", log_append },
+    { "record", record },
+    { "scatter", scatter },
+    { "rewrite", rewrite },
+    { "same", same },
+};
+
+static double now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Send (and receive) the given pages; returns 0 or -1 on a decode error */
+static int send_pages(struct delta_cache *c, uint8_t *src, uint8_t *dst,
+                      const unsigned long *pfns, unsigned long n,
+                      double *encode_s, double *decode_s)
+{
+    uint8_t out[DELTA_PAGE_SIZE];
+    unsigned long i;
+    ssize_t len;
+    double t0, t1;
+
+    for (i = 0; i < n; i++) {
+        uint8_t *s = src + pfns[i] * DELTA_PAGE_SIZE;
+        uint8_t *d = dst + pfns[i] * DELTA_PAGE_SIZE;
+
+        t0 = now_s();
+        len = delta_encode(c, pfns[i], s, out);
+        t1 = now_s();
+        if (len < 0)
+            memcpy(d, s, DELTA_PAGE_SIZE);
+        else if (delta_decode(d, out, len))
+            return -1;
+        *encode_s += t1 - t0;
+        *decode_s += now_s() - t1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    size_t cache_mib = argc > 1 ? strtoul(argv[1], NULL, 0) : 32;
+    uint8_t *src = malloc((size_t)NR_PAGES * DELTA_PAGE_SIZE);
+    uint8_t *dst = malloc((size_t)NR_PAGES * DELTA_PAGE_SIZE);
+    unsigned long *pfns = malloc(NR_PAGES * sizeof(*pfns));
+    unsigned long i, hot_base;
+    unsigned int w, round;
+    int failures = 0;
+
+    if (src == NULL || dst == NULL || pfns == NULL)
+        return 1;
+
+    printf("guest %d MiB, hot set %d MiB rewritten %d times, "
+           "cache %zu MiB\n", GUEST_MIB, HOT_MIB, ROUNDS, cache_mib);
+    printf("%-10s %9s %9s %9s %12s %12s\n", "workload", "deltas",
+           "sent", "ratio", "encode MB/s", "decode MB/s");
+
+    for (w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        struct delta_cache *c = delta_cache_create(NR_PAGES,
+                                                   cache_mib << 20);
+        const struct delta_stats *st;
+        double encode_s = 0, decode_s = 0, first_in = 0, first_out = 0;
+        uint64_t resent;
+
+        if (c == NULL)
+            return 1;
+        random_fill(src, (size_t)NR_PAGES * DELTA_PAGE_SIZE);
+        memset(dst, 0, (size_t)NR_PAGES * DELTA_PAGE_SIZE);
+
+        /* The first round sends everything */
+        for (i = 0; i < NR_PAGES; i++)
+            pfns[i] = i;
+        if (send_pages(c, src, dst, pfns, NR_PAGES, &encode_s, &decode_s))
+            failures++;
+        st = delta_cache_stats(c);
+        first_in = st->bytes_in;
+        first_out = st->bytes_out;
+        encode_s = decode_s = 0;
+
+        /* Then the hot set, somewhere in the middle of memory */
+        hot_base = NR_PAGES / 4;
+        for (round = 0; round < ROUNDS; round++) {
+            for (i = 0; i < NR_HOT; i++) {
+                pfns[i] = hot_base + i;
+                workloads[w].write(src + pfns[i] * DELTA_PAGE_SIZE, i);
+            }
+            if (send_pages(c, src, dst, pfns, NR_HOT, &encode_s, &decode_s))
+                failures++;
+        }
+
+        resent = st->bytes_in - first_in;
+        printf("%-10s %8.1f%% %7.1fMiB %8.3f %12.0f %12.0f\n",
+               workloads[w].name, 100.0 * st->deltas / (st->pages - NR_PAGES),
+               (st->bytes_out - first_out) / 1048576.0,
+               (st->bytes_out - first_out) / (double)resent,
+               resent / encode_s / 1e6, resent / decode_s / 1e6);
+        if (memcmp(src, dst, (size_t)NR_PAGES * DELTA_PAGE_SIZE)) {
+            printf("FAIL: %s: the receiver's copy differs\n",
+                   workloads[w].name);
+            failures++;
+        }
+        delta_cache_destroy(c);
+    }
+    return failures ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+#ifndef _FAKE_XEN_H_
+#define _FAKE_XEN_H_
+
+#include <stdint.h>
+
+/* Controls for the simulated libxenctrl/libxenguest/libxenstore
+   (fake_xenctrl.c, fake_xenstore.c) which are not part of the real
+   library interfaces. */
+
+/* When enabled, the fake xenstore behaves like qemu and acknowledges
+   every device-model/<domid>/logdirty/cmd write on logdirty/ret. */
+extern void fake_xs_set_device_model(int enabled);
+
+/* Make the next n transactions fail to commit with EAGAIN, as if they
+   had conflicted with another; returns how many ended so far. */
+extern int fake_xs_fail_transactions(int n);
+
+/* Overwrite a page of a simulated domain, unsharing it. */
+extern int fake_dom_write_page(uint32_t domid, unsigned long pfn,
+                               const void *page);
+
+/* Whether a page of a simulated domain was shared by
+   xc_memshr_share_gfns. */
+extern int fake_dom_page_shared(uint32_t domid, unsigned long pfn);
+
+#endif /* _FAKE_XEN_H_ */
@@ -0,0 +1,1927 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+/* A simulated libxenctrl/libxenguest providing the calls made by
+   xenguest_stubs.c, so that the build, save, restore and dumpcore paths
+   can run on a machine without Xen. Linked instead of the real libraries
+   when the helper is built with XENGUEST_FAKE=true.
+
+   Guest memory lives in this process. A domain unknown to the current
+   process (e.g. the source of a save) is created on first use with
+   deterministic contents. The simulation is tuned by environment
+   variables:
+
+     FAKE_XC_MEM_MIB        memory of implicitly created domains (64)
+     FAKE_XC_ZERO_PERCENT   percentage of guest pages which are zero (25)
+     FAKE_XC_DIRTY_RATE     pages the guest dirties per second (0)
+     FAKE_XC_BANDWIDTH_MIB  simulated link speed in MiB/s (1024)
+     FAKE_XC_SEED           seed for page contents and dirtying (1)
+     FAKE_XC_PCPUS          number of host pCPUs (8)
+     FAKE_XC_SCHEDULER      scheduler id reported by xc_sched_id (credit)
+     FAKE_XC_WSS_MIB        if set, the guest only writes to this much of
+                            its memory, and reads from it 90% of the time
+     FAKE_XC_ACCESS_RATE    pages a paging guest reads per second (50000)
+     FAKE_XC_REWRITE_BYTES  if set, a guest write changes this many bytes
+                            of the page rather than all of it
+     FAKE_XC_DELTA_CACHE_MIB  page cache of XCFLAGS_CHECKPOINT_COMPRESS (64)
+     FAKE_XC_NODES          number of host NUMA nodes (1)
+     FAKE_XC_MAX_ORDER      largest extent xc_domain_populate_physmap can
+                            allocate, as a page order (18: 1GiB)
+
+   Dirtying is driven by simulated time (bytes sent / bandwidth) rather
+   than wall-clock time, so page counts and the simulated downtime are
+   reproducible from run to run; wall-clock throughput is reported too.
+
+   A domain with paging enabled gets a simulated vCPU while it is
+   unpaused, which reads pages at FAKE_XC_ACCESS_RATE and blocks on the
+   paging ring whenever it finds one paged out. */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <xenctrl.h>
+#include <xenguest.h>
+#include <xen/hvm/params.h>
+#include <xen/mem_event.h>
+
+#include "fake_xen.h"
+#include "xenguest_delta.h"
+
+#define FAKE_MAGIC "FAKEXC01"
+#define FAKE_END_OF_ROUND 0
+#define FAKE_END_OF_STREAM (-1)
+#define FAKE_CHECKPOINT (-2)
+#define FAKE_DELTA_BATCH (-3)
+#define FAKE_BATCH 1024
+#define FAKE_NR_HVM_PARAMS 64
+#define FAKE_HVM_CTX_LEN 2048
+#define FAKE_PAGING_PORT 7
+#define FAKE_LOCAL_PORT 5
+
+/* libxc defaults for a zero max_iters/max_factor */
+#define FAKE_DEF_MAX_ITERS 29
+#define FAKE_DEF_MAX_FACTOR 3
+/* Stop iterating once fewer pages than this are dirty */
+#define FAKE_MIN_DIRTY 50
+
+struct xc_interface_core {
+    xc_error last_error;
+    int evtchn[2];              /* xc_evtchn: pipe carrying pending ports */
+    struct fake_dom *bound;     /* xc_evtchn: domain of the paging port */
+};
+
+struct fake_dom {
+    uint32_t domid;
+    unsigned long nr_pages;
+    uint8_t *mem;
+    uint8_t *dirty;             /* one byte per page */
+    unsigned long nr_dirty;
+    uint64_t rng;
+    unsigned long hvm_params[FAKE_NR_HVM_PARAMS];
+    uint16_t weight, cap;
+    uint64_t period, slice, latency;
+    uint16_t extratime;
+    int paused;
+    uint8_t *hvm_ctx;
+    uint32_t hvm_ctx_len;
+    double logdirty_since;      /* 0 if log-dirty is off */
+
+    /* populate-on-demand: a PoD entry reads as a zero page */
+    uint8_t *pod;               /* one byte per page, NULL if none yet */
+    unsigned long nr_pod, pod_entries;
+    uint64_t pod_target;
+
+    /* page sharing: a shared page has the contents of its source */
+    int memshr;
+    uint8_t *shared;            /* one byte per page, NULL if none yet */
+
+    /* paging, all under paging_lock */
+    int paging;
+    uint8_t *paged;             /* one byte per page */
+    int ring_fd;                /* memfd of the ring page, or -1 */
+    mem_event_sring_t *sring;
+    mem_event_front_ring_t ring;
+    xc_evtchn *xce;             /* bound to the paging port */
+    int vcpu_running, vcpu_stop, vcpu_blocked;
+    pthread_t vcpu;
+    unsigned long accesses, faults;
+    double stalled;
+
+    struct fake_dom *next;
+};
+
+struct xc_dom_image {
+    char *cmdline;
+    char *features;
+    size_t kernel_max_size, ramdisk_max_size;
+};
+
+static pthread_mutex_t fake_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fake_dom *doms;
+
+static pthread_mutex_t paging_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t paging_cond = PTHREAD_COND_INITIALIZER;
+
+static unsigned long env_ul(const char *name, unsigned long def)
+{
+    const char *s = getenv(name);
+
+    return s ? strtoul(s, NULL, 0) : def;
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t rng_next(uint64_t *s)
+{
+    /* xorshift64* */
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 2685821657736338717ULL;
+}
+
+static void fake_error(xc_interface *xch, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (xch == NULL)
+        return;
+    xch->last_error.code = XC_INTERNAL_ERROR;
+    va_start(ap, fmt);
+    vsnprintf(xch->last_error.message, sizeof(xch->last_error.message), fmt, ap);
+    va_end(ap);
+}
+
+/* Fill a page with either zeroes or (compressible) pseudo-random text */
+static void fill_page(struct fake_dom *d, unsigned long pfn)
+{
+    static long zero_percent = -1;
+    uint8_t *page = d->mem + pfn * XC_PAGE_SIZE;
+    uint64_t r = rng_next(&d->rng);
+    size_t i;
+
+    if (zero_percent < 0)
+        zero_percent = env_ul("FAKE_XC_ZERO_PERCENT", 25);
+
+    if (r % 100 < zero_percent) {
+        memset(page, 0, XC_PAGE_SIZE);
+        return;
+    }
+    for (i = 0; i < XC_PAGE_SIZE; i += sizeof(r)) {
+        if ((i & 63) == 0)
+            r = rng_next(&d->rng);
+        memcpy(page + i, &r, sizeof(r));
+    }
+}
+
+static void free_dom_mem(struct fake_dom *d)
+{
+    if (d->mem)
+        munmap(d->mem, d->nr_pages * XC_PAGE_SIZE);
+    free(d->dirty);
+    free(d->pod);
+    free(d->shared);
+    d->mem = NULL;
+    d->dirty = NULL;
+    d->pod = NULL;
+    d->shared = NULL;
+    d->nr_pages = d->nr_dirty = 0;
+    d->nr_pod = d->pod_entries = 0;
+}
+
+static int alloc_dom_mem(struct fake_dom *d, unsigned long nr_pages)
+{
+    free_dom_mem(d);
+    d->mem = mmap(NULL, nr_pages * XC_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (d->mem == MAP_FAILED) {
+        d->mem = NULL;
+        return -1;
+    }
+    d->dirty = calloc(nr_pages, 1);
+    if (d->dirty == NULL) {
+        free_dom_mem(d);
+        return -1;
+    }
+    d->nr_pages = nr_pages;
+    return 0;
+}
+
+/* Look up a domain, creating it if it is not known to this process yet.
+   New domains get FAKE_XC_MEM_MIB of populated memory if populate is set
+   and no memory otherwise. */
+static struct fake_dom *fake_dom_lookup(uint32_t domid, int populate)
+{
+    struct fake_dom *d;
+    unsigned long pfn;
+
+    pthread_mutex_lock(&fake_lock);
+    for (d = doms; d; d = d->next)
+        if (d->domid == domid)
+            goto out;
+
+    d = calloc(1, sizeof(*d));
+    if (d == NULL)
+        goto out;
+    d->domid = domid;
+    d->rng = env_ul("FAKE_XC_SEED", 1) * 0x9E3779B97F4A7C15ULL + domid + 1;
+    d->weight = 256;
+    d->ring_fd = -1;
+    if (populate) {
+        if (alloc_dom_mem(d, env_ul("FAKE_XC_MEM_MIB", 64) << (20 - XC_PAGE_SHIFT))) {
+            free(d);
+            d = NULL;
+            goto out;
+        }
+        for (pfn = 0; pfn < d->nr_pages; pfn++)
+            fill_page(d, pfn);
+        /* Special pages at the top, as the restore reports them */
+        d->hvm_params[HVM_PARAM_STORE_PFN] = d->nr_pages - 2;
+        d->hvm_params[HVM_PARAM_CONSOLE_PFN] = d->nr_pages - 1;
+        d->hvm_params[HVM_PARAM_PAGING_RING_PFN] = d->nr_pages - 3;
+    }
+    d->next = doms;
+    doms = d;
+out:
+    pthread_mutex_unlock(&fake_lock);
+    return d;
+}
+
+static struct fake_dom *fake_dom_get(uint32_t domid)
+{
+    return fake_dom_lookup(domid, 1);
+}
+
+/* Rebuild a domain's memory with nr_pages freshly populated pages */
+static int fake_dom_populate(struct fake_dom *d, unsigned long nr_pages)
+{
+    unsigned long pfn;
+
+    if (alloc_dom_mem(d, nr_pages))
+        return -1;
+    for (pfn = 0; pfn < nr_pages; pfn++)
+        fill_page(d, pfn);
+    return 0;
+}
+
+/* A random page the guest writes to (hot) or reads from */
+static unsigned long fake_dom_pick(struct fake_dom *d, uint64_t *rng, int hot)
+{
+    unsigned long wss = env_ul("FAKE_XC_WSS_MIB", 0) << (20 - XC_PAGE_SHIFT);
+    uint64_t r = rng_next(rng);
+
+    if (wss == 0 || wss > d->nr_pages || (!hot && (r >> 32) % 10 == 0))
+        wss = d->nr_pages;
+    return r % wss;
+}
+
+/* Change len bytes (rounded up to words) somewhere in the page */
+static void rewrite_page(struct fake_dom *d, unsigned long pfn, size_t len)
+{
+    uint8_t *page = d->mem + pfn * XC_PAGE_SIZE;
+    size_t off = (rng_next(&d->rng) % XC_PAGE_SIZE) & ~7UL;
+    uint64_t r;
+
+    for (; len && off < XC_PAGE_SIZE; off += sizeof(r)) {
+        r = rng_next(&d->rng);
+        memcpy(page + off, &r, sizeof(r));
+        len = len > sizeof(r) ? len - sizeof(r) : 0;
+    }
+}
+
+/* The guest writes to n random pages */
+static void fake_dom_dirty(struct fake_dom *d, unsigned long n)
+{
+    size_t rewrite = env_ul("FAKE_XC_REWRITE_BYTES", 0);
+    unsigned long pfn;
+
+    while (n--) {
+        pfn = fake_dom_pick(d, &d->rng, 1);
+        if (rewrite)
+            rewrite_page(d, pfn, rewrite);
+        else
+            fill_page(d, pfn);
+        if (!d->dirty[pfn]) {
+            d->dirty[pfn] = 1;
+            d->nr_dirty++;
+        }
+    }
+}
+
+/* A capped guest (auto-converge) runs, and dirties pages, proportionally
+   slower */
+static double fake_dom_speed(struct fake_dom *d)
+{
+    return d->cap && d->cap < 100 ? d->cap / 100.0 : 1.0;
+}
+
+/* Interface **************************************************************/
+
+xc_interface *xc_interface_open(xentoollog_logger *logger,
+                                xentoollog_logger *dombuild_logger,
+                                unsigned open_flags)
+{
+    /* The stand-in xenstore answers for qemu as well */
+    fake_xs_set_device_model(1);
+    return calloc(1, sizeof(struct xc_interface_core));
+}
+
+int xc_interface_close(xc_interface *xch)
+{
+    free(xch);
+    return 0;
+}
+
+const xc_error *xc_get_last_error(xc_interface *xch)
+{
+    static xc_error none;
+
+    return xch ? &xch->last_error : &none;
+}
+
+void xc_clear_last_error(xc_interface *xch)
+{
+    if (xch)
+        memset(&xch->last_error, 0, sizeof(xch->last_error));
+}
+
+/* vCPUs and scheduling ***************************************************/
+
+int xc_get_cpumap_size(xc_interface *xch)
+{
+    return (env_ul("FAKE_XC_PCPUS", 8) + 7) / 8;
+}
+
+xc_cpumap_t xc_cpumap_alloc(xc_interface *xch)
+{
+    return calloc(1, xc_get_cpumap_size(xch));
+}
+
+#ifdef XEN_VCPUAFFINITY_SOFT
+int xc_vcpu_setaffinity(xc_interface *xch, uint32_t domid, int vcpu,
+                        xc_cpumap_t cpumap_hard_inout,
+                        xc_cpumap_t cpumap_soft_inout, uint32_t flags)
+#else
+int xc_vcpu_setaffinity(xc_interface *xch, uint32_t domid, int vcpu,
+                        xc_cpumap_t cpumap)
+#endif
+{
+    return fake_dom_get(domid) ? 0 : -1;
+}
+
+int xc_domain_getinfo(xc_interface *xch, uint32_t first_domid,
+                      unsigned int max_doms, xc_dominfo_t *info)
+{
+    struct fake_dom *d = fake_dom_get(first_domid);
+
+    if (d == NULL || max_doms == 0)
+        return 0;
+    memset(info, 0, sizeof(*info));
+    info->domid = d->domid;
+    info->paused = d->paused;
+    info->nr_pages = d->nr_pages;
+    info->max_vcpu_id = 0;
+    return 1;
+}
+
+int xc_sched_id(xc_interface *xch, int *sched_id)
+{
+    *sched_id = env_ul("FAKE_XC_SCHEDULER", XEN_SCHEDULER_CREDIT);
+    return 0;
+}
+
+int xc_sched_credit_domain_get(xc_interface *xch, uint32_t domid,
+                               struct xen_domctl_sched_credit *sdom)
+{
+    struct fake_dom *d = fake_dom_get(domid);
+
+    if (d == NULL)
+        return -1;
+    sdom->weight = d->weight;
+    sdom->cap = d->cap;
+    return 0;
+}
+
+int xc_sched_credit_domain_set(xc_interface *xch, uint32_t domid,
+                               struct xen_domctl_sched_credit *sdom)
+{
+    struct fake_dom *d = fake_dom_get(domid);
+
+    if (d == NULL)
+        return -1;
+    d->weight = sdom->weight;
+    d->cap = sdom->cap;
+    return 0;
+}
+
+int xc_sched_credit2_domain_get(xc_interface *xch, uint32_t domid,
+                                struct xen_domctl_sched_credit2 *sdom)
+{
+    struct fake_dom *d = fake_dom_get(domid);
+
+    if (d == NULL)
+        return -1;
+    sdom->weight = d->weight;
+    return 0;
+}
+
+int xc_sched_credit2_domain_set(xc_interface *xch, uint32_t domid,
+                                struct xen_domctl_sched_credit2 *sdom)
+{
+    struct fake_dom *d = fake_dom_get(domid);
+
+    if (d == NULL)
+        return -1;
+    d->weight = sdom->weight;
+    return 0;
+}
+
+int xc_sedf_domain_get(xc_interface *xch, uint32_t domid, uint64_t *period,
+                       uint64_t *slice, uint64_t *latency,
+                       uint16_t *extratime, uint16_t *weight)
+{
+    struct fake_dom *d = fake_dom_get(domid);
+
+    if (d == NULL)
+        return -1;
+    *period = d->period;
+    *slice = d->slice;
+    *latency = d->latency;
+    *extratime = d->extratime;
+    *weight = d->weight;
+    return 0;
+}
+
+int xc_sedf_domain_set(xc_interface *xch, uint32_t domid, uint64_t period,
+                       uint64_t slice, uint64_t latency, uint16_t extratime,
+                       uint16_t weight)
+{
+    struct fake_dom *d = fake_dom_get(domid);
+
+    if (d == NULL)
+        return -1;
+    d->period = period;
+    d->slice = slice;
+    d->latency = latency;
+    d->extratime = extratime;
+    d->weight = weight;
+    return 0;
+}
+
+#ifdef XEN_SCHEDULER_RTDS
+int xc_sched_rtds_domain_get(xc_interface *xch, uint32_t domid,
+                             struct xen_domctl_sched_rtds *sdom)
+{
+    struct fake_dom *d = fake_dom_get(domid);
+
+    if (d == NULL)
+        return -1;
+    sdom->period = d->period;
+    sdom->budget = d->slice;
+    return 0;
+}
+
+int xc_sched_rtds_domain_set(xc_interface *xch, uint32_t domid,
+                             struct xen_domctl_sched_rtds *sdom)
+{
+    struct fake_dom *d = fake_dom_get(domid);
+
+    if (d == NULL)
+        return -1;
+    d->period = sdom->period;
+    d->slice = sdom->budget;
+    return 0;
+}
+#endif
+
+int xc_domain_set_tsc_info(xc_interface *xch, uint32_t domid,
+                           uint32_t tsc_mode, uint64_t elapsed_nsec,
+                           uint32_t gtsc_khz, uint32_t incarnation)
+{
+    return 0;
+}
+
+/* Memory and parameters **************************************************/
+
+/* Mappings are private copies: callers munmap() them, and only ever
+   touch the hvm_info page through them. The paging ring page is the
+   exception (see fake_ring_fd). */
+static int fake_ring_fd(struct fake_dom *d);
+
+void *xc_map_foreign_range(xc_interface *xch, uint32_t dom, int size,
+                           int prot, unsigned long mfn)
+{
+    struct fake_dom *d = fake_dom_get(dom);
+    void *p;
+
+    if (d != NULL && mfn && mfn == d->hvm_params[HVM_PARAM_PAGING_RING_PFN]) {
+        pthread_mutex_lock(&paging_lock);
+        p = fake_ring_fd(d) < 0 ? MAP_FAILED
+            : mmap(NULL, XC_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   d->ring_fd, 0);
+        pthread_mutex_unlock(&paging_lock);
+        return p == MAP_FAILED ? NULL : p;
+    }
+    if (d == NULL || mfn >= d->nr_pages) {
+        fake_error(xch, "xc_map_foreign_range: bad pfn %lu", mfn);
+        return NULL;
+    }
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    memcpy(p, d->mem + mfn * XC_PAGE_SIZE, size);
+    return p;
+}
+
+int xc_get_hvm_param(xc_interface *handle, domid_t dom, int param,
+                     unsigned long *value)
+{
+    struct fake_dom *d = fake_dom_get(dom);
+
+    if (d == NULL || param < 0 || param >= FAKE_NR_HVM_PARAMS)
+        return -1;
+    *value = d->hvm_params[param];
+    return 0;
+}
+
+int xc_set_hvm_param(xc_interface *handle, domid_t dom, int param,
+                     unsigned long value)
+{
+    struct fake_dom *d = fake_dom_get(dom);
+
+    if (d == NULL || param < 0 || param >= FAKE_NR_HVM_PARAMS)
+        return -1;
+    d->hvm_params[param] = value;
+    return 0;
+}
+
+int xc_domain_resume(xc_interface *xch, uint32_t domid, int fast)
+{
+    struct fake_dom *d = fake_dom_get(domid);
+
+    if (d == NULL)
+        return -1;
+    d->paused = 0;
+    return 0;
+}
+
+int xc_domain_dumpcore(xc_interface *xch, uint32_t domid,
+                       const char *corename)
+{
+    struct fake_dom *d = fake_dom_get(domid);
+    FILE *f;
+    int r = 0;
+
+    if (d == NULL)
+        return -1;
+    f = fopen(corename, "w");
+    if (f == NULL) {
+        fake_error(xch, "xc_domain_dumpcore: %s: %s", corename, strerror(errno));
+        return -1;
+    }
+    if (fwrite(d->mem, XC_PAGE_SIZE, d->nr_pages, f) != d->nr_pages)
+        r = -1;
+    if (fclose(f))
+        r = -1;
+    return r;
+}
+
+/* Domain building ********************************************************/
+
+void xc_dom_loginit(xc_interface *xch)
+{
+}
+
+struct xc_dom_image *xc_dom_allocate(xc_interface *xch, const char *cmdline,
+                                     const char *features)
+{
+    struct xc_dom_image *dom = calloc(1, sizeof(*dom));
+
+    if (dom == NULL)
+        return NULL;
+    dom->cmdline = strdup(cmdline ? cmdline : "");
+    dom->features = strdup(features ? features : "");
+    return dom;
+}
+
+void xc_dom_release(struct xc_dom_image *dom)
+{
+    if (dom == NULL)
+        return;
+    free(dom->cmdline);
+    free(dom->features);
+    free(dom);
+}
+
+int xc_dom_kernel_max_size(struct xc_dom_image *dom, size_t sz)
+{
+    dom->kernel_max_size = sz;
+    return 0;
+}
+
+int xc_dom_ramdisk_max_size(struct xc_dom_image *dom, size_t sz)
+{
+    dom->ramdisk_max_size = sz;
+    return 0;
+}
+
+const char *xc_dom_get_native_protocol(struct xc_dom_image *dom)
+{
+    return "x86_64-abi";
+}
+
+/* Build a domain of mem_mb MiB; the last two pages hold the rings */
+static int fake_build(xc_interface *xch, uint32_t domid, uint64_t mem_bytes,
+                      const char *image, unsigned long *store_mfn,
+                      unsigned long *console_mfn)
+{
+    struct fake_dom *d;
+    double t0 = now_s();
+
+    if (access(image, R_OK)) {
+        fake_error(xch, "cannot read image %s: %s", image, strerror(errno));
+        return -1;
+    }
+    d = fake_dom_lookup(domid, 0);
+    if (d == NULL || fake_dom_populate(d, mem_bytes >> XC_PAGE_SHIFT)) {
+        fake_error(xch, "failed to allocate %"PRIu64" bytes", mem_bytes);
+        return -1;
+    }
+    *store_mfn = d->nr_pages - 2;
+    *console_mfn = d->nr_pages - 1;
+    printf("fake-xc: built domain %u with %lu pages in %.3fs",
+           domid, d->nr_pages, now_s() - t0);
+    return 0;
+}
+
+int xc_dom_linux_build(xc_interface *xch, struct xc_dom_image *dom,
+                       uint32_t domid, unsigned int mem_mb,
+                       const char *image_name, const char *ramdisk_name,
+                       unsigned long flags, unsigned int store_evtchn,
+                       unsigned long *store_mfn, unsigned int console_evtchn,
+                       unsigned long *console_mfn)
+{
+    return fake_build(xch, domid, (uint64_t)mem_mb << 20, image_name,
+                      store_mfn, console_mfn);
+}
+
+int xc_dom_gnttab_seed(xc_interface *xch, domid_t domid,
+                       xen_pfn_t console_gmfn, xen_pfn_t xenstore_gmfn,
+                       domid_t console_domid, domid_t xenstore_domid)
+{
+    return 0;
+}
+
+int xc_dom_gnttab_hvm_seed(xc_interface *xch, domid_t domid,
+                           xen_pfn_t console_gpfn, xen_pfn_t xenstore_gpfn,
+                           domid_t console_domid, domid_t xenstore_domid)
+{
+    return 0;
+}
+
+static int fake_hvm_build(xc_interface *xch, uint32_t domid,
+                          uint64_t mem_size, const char *image)
+{
+    unsigned long store_mfn, console_mfn;
+    struct fake_dom *d;
+
+    if (fake_build(xch, domid, mem_size, image, &store_mfn, &console_mfn))
+        return -1;
+    d = fake_dom_get(domid);
+    d->hvm_params[HVM_PARAM_STORE_PFN] = store_mfn;
+#ifdef HVM_PARAM_CONSOLE_PFN
+    d->hvm_params[HVM_PARAM_CONSOLE_PFN] = console_mfn;
+#endif
+    return 0;
+}
+
+int xc_hvm_build(xc_interface *xch, uint32_t domid,
+                 struct xc_hvm_build_args *args)
+{
+    return fake_hvm_build(xch, domid, args->mem_size, args->image_file_name);
+}
+
+int xc_hvm_build_target_mem(xc_interface *xch, uint32_t domid, int memsize,
+                            int target, const char *image_name)
+{
+    return fake_hvm_build(xch, domid, (uint64_t)memsize << 20, image_name);
+}
+
+/* Save and restore *******************************************************/
+
+/* The stream is the magic, the number of pages and the hvm flag followed
+   by batches, each an int32 count, count uint64 pfns and count pages.
+   A zero count ends a round and FAKE_END_OF_STREAM ends the stream.
+   With a checkpoint callback the final round of each epoch is followed
+   by FAKE_CHECKPOINT instead; the receiver applies an epoch only once
+   it has seen its marker, and if the stream breaks it keeps the last
+   complete checkpoint, as libxc does for Remus streams.
+
+   With XCFLAGS_CHECKPOINT_COMPRESS and a checkpoint callback (libxc
+   ignores the flag otherwise), batches are FAKE_DELTA_BATCH, the
+   count and the pfns, and each page is preceded by an int32 length: -1
+   for the page itself, otherwise that many bytes of delta against the
+   version the receiver already has (see xenguest_delta.h). Every round
+   of a checkpointed save is encoded, where libxc starts with the
+   second epoch. */
+
+static int write_exact(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    ssize_t n;
+
+    while (len) {
+        n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_exact(int fd, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    ssize_t n;
+
+    while (len) {
+        n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n == 0)
+                errno = EPIPE;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int send_batch(int fd, struct fake_dom *d, const uint64_t *pfns,
+                      int32_t count, struct delta_cache *delta,
+                      uint64_t *bytes)
+{
+    int32_t i, marker = FAKE_DELTA_BATCH, len;
+    uint8_t buf[XC_PAGE_SIZE], *page;
+
+    if ((delta && write_exact(fd, &marker, sizeof(marker))) ||
+        write_exact(fd, &count, sizeof(count)) ||
+        write_exact(fd, pfns, count * sizeof(*pfns)))
+        return -1;
+    for (i = 0; i < count; i++) {
+        page = d->mem + pfns[i] * XC_PAGE_SIZE;
+        len = delta ? delta_encode(delta, pfns[i], page, buf) : -1;
+        if (delta && write_exact(fd, &len, sizeof(len)))
+            return -1;
+        if (len < 0 ? write_exact(fd, page, XC_PAGE_SIZE)
+            : write_exact(fd, buf, len))
+            return -1;
+        *bytes += len < 0 ? XC_PAGE_SIZE : len;
+    }
+    return 0;
+}
+
+/* Send every page (all = 1) or every dirty page, clearing the dirty
+   bits, adding what was written to *bytes. Returns the number of pages
+   sent or -1. */
+static long send_round(int fd, struct fake_dom *d, int all,
+                       struct delta_cache *delta, uint64_t *bytes)
+{
+    uint64_t pfns[FAKE_BATCH];
+    int32_t count = 0, end = FAKE_END_OF_ROUND;
+    unsigned long pfn;
+    long sent = 0;
+
+    for (pfn = 0; pfn < d->nr_pages; pfn++) {
+        if (!all && !d->dirty[pfn])
+            continue;
+        d->dirty[pfn] = 0;
+        pfns[count++] = pfn;
+        if (count == FAKE_BATCH) {
+            if (send_batch(fd, d, pfns, count, delta, bytes))
+                return -1;
+            sent += count;
+            count = 0;
+        }
+    }
+    if (count && send_batch(fd, d, pfns, count, delta, bytes))
+        return -1;
+    sent += count;
+    d->nr_dirty = 0;
+    if (write_exact(fd, &end, sizeof(end)))
+        return -1;
+    return sent;
+}
+
+int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
+                   uint32_t max_iters, uint32_t max_factor, uint32_t flags,
+                   struct save_callbacks *callbacks, int hvm,
+                   unsigned long vm_generationid_addr)
+{
+    struct fake_dom *d;
+    uint64_t nr_pages;
+    int32_t end = FAKE_END_OF_STREAM, mark = FAKE_CHECKPOINT;
+    int32_t c_hvm = hvm;
+    double bandwidth = env_ul("FAKE_XC_BANDWIDTH_MIB", 1024) * 1048576.0;
+    double dirty_rate = env_ul("FAKE_XC_DIRTY_RATE", 0);
+    double sim_time = 0, round_time, downtime, t0, t_suspend, t_resume;
+    unsigned long total_sent = 0;
+    uint64_t bytes = 0, round_bytes;
+    struct delta_cache *delta = NULL;
+    const struct delta_stats *ds;
+    long sent;
+    int live = !!(flags & XCFLAGS_LIVE), round = 0, logdirty = 0, epochs = 0;
+
+    if (max_iters == 0)
+        max_iters = FAKE_DEF_MAX_ITERS;
+    if (max_factor == 0)
+        max_factor = FAKE_DEF_MAX_FACTOR;
+
+    d = fake_dom_get(dom);
+    if (d == NULL) {
+        fake_error(xch, "xc_domain_save: no such domain %u", dom);
+        return -1;
+    }
+    nr_pages = d->nr_pages;
+    t0 = now_s();
+
+    if ((flags & XCFLAGS_CHECKPOINT_COMPRESS) && callbacks->checkpoint) {
+        delta = delta_cache_create(nr_pages,
+                                   env_ul("FAKE_XC_DELTA_CACHE_MIB", 64) << 20);
+        if (delta == NULL) {
+            fake_error(xch, "xc_domain_save: failed to allocate the page cache");
+            goto err;
+        }
+    }
+
+    if (write_exact(io_fd, FAKE_MAGIC, strlen(FAKE_MAGIC)) ||
+        write_exact(io_fd, &nr_pages, sizeof(nr_pages)) ||
+        write_exact(io_fd, &c_hvm, sizeof(c_hvm)))
+        goto io_err;
+
+    if (live && hvm && callbacks->switch_qemu_logdirty) {
+        if (callbacks->switch_qemu_logdirty(dom, 1, callbacks->data)) {
+            fake_error(xch, "Couldn't enable qemu log-dirty mode");
+            goto err;
+        }
+        logdirty = 1;
+    }
+
+    if (!live)
+        goto suspend;
+
+    for (;;) {
+        round_bytes = 0;
+        sent = send_round(io_fd, d, round == 0, delta, &round_bytes);
+        if (sent < 0)
+            goto io_err;
+        total_sent += sent;
+        bytes += round_bytes;
+        round_time = round_bytes / bandwidth;
+        sim_time += round_time;
+        fake_dom_dirty(d, dirty_rate * round_time * fake_dom_speed(d));
+        fprintf(stderr, "fake-xc: round %d: sent %ld pages, %lu dirtied\n",
+                round, sent, d->nr_dirty);
+        fprintf(stderr, "\b\b\b\b%3d%%",
+                (int)(100 * (round + 1) / (max_iters + 1)));
+
+        round++;
+        if (round >= max_iters || d->nr_dirty < FAKE_MIN_DIRTY ||
+            total_sent > max_factor * nr_pages)
+            break;
+    }
+
+suspend:
+    if (!callbacks->suspend || !callbacks->suspend(callbacks->data)) {
+        fake_error(xch, "Suspend request failed");
+        goto err;
+    }
+    d->paused = 1;
+    t_suspend = now_s();
+
+    round_bytes = 0;
+    sent = send_round(io_fd, d, !live && epochs == 0, delta, &round_bytes);
+    if (sent < 0)
+        goto io_err;
+    total_sent += sent;
+    bytes += round_bytes;
+    downtime = round_bytes / bandwidth;
+    sim_time += downtime;
+    if (callbacks->checkpoint) {
+        if (write_exact(io_fd, &mark, sizeof(mark)))
+            goto io_err;
+        epochs++;
+        if (callbacks->postcopy)
+            callbacks->postcopy(callbacks->data);
+        d->paused = 0;
+        t_resume = now_s();
+        if (callbacks->checkpoint(callbacks->data) > 0) {
+            /* The guest ran (in wall-clock time) until the next epoch */
+            fake_dom_dirty(d, dirty_rate * (now_s() - t_resume));
+            goto suspend;
+        }
+    }
+    if (write_exact(io_fd, &end, sizeof(end)))
+        goto io_err;
+
+    if (logdirty && callbacks->switch_qemu_logdirty(dom, 0, callbacks->data)) {
+        fake_error(xch, "Couldn't disable qemu log-dirty mode");
+        return -1;
+    }
+
+    if (epochs)
+        printf("fake-xc: replicated domain %u: %d checkpoints", dom, epochs);
+    printf("fake-xc: saved domain %u: %d rounds, %lu of %"PRIu64" pages sent "
+           "(%.1f MiB), simulated time %.3fs, simulated downtime %.3fms, "
+           "wall-clock %.3fs (%.1f MiB/s), stop-and-copy %.3fms",
+           dom, round, total_sent, nr_pages,
+           bytes / 1048576.0, sim_time, downtime * 1000,
+           now_s() - t0, bytes / 1048576.0 / (now_s() - t0),
+           (now_s() - t_suspend) * 1000);
+    if (delta) {
+        ds = delta_cache_stats(delta);
+        printf("fake-xc: delta: %"PRIu64" of %"PRIu64" pages sent as deltas "
+               "(%"PRIu64" unchanged, %"PRIu64" not smaller), %.1f MiB "
+               "instead of %.1f MiB, %"PRIu64" cache evictions",
+               ds->deltas, ds->pages, ds->unchanged, ds->too_big,
+               ds->bytes_out / 1048576.0, ds->bytes_in / 1048576.0,
+               ds->evictions);
+    }
+    delta_cache_destroy(delta);
+    return 0;
+
+io_err:
+    fake_error(xch, "xc_domain_save: write failed: %s", strerror(errno));
+err:
+    delta_cache_destroy(delta);
+    return -1;
+}
+
+/* Pages of a checkpoint epoch received but not yet applied */
+struct fake_epoch {
+    uint64_t *pfns;
+    uint8_t *pages;
+    unsigned long count, size;
+};
+
+/* Room for one more page of the epoch, or NULL */
+static uint8_t *epoch_add(struct fake_epoch *e, uint64_t pfn)
+{
+    if (e->count == e->size) {
+        unsigned long size = e->size ? e->size * 2 : FAKE_BATCH;
+        uint64_t *pfns = realloc(e->pfns, size * sizeof(*pfns));
+        uint8_t *pages;
+
+        if (pfns == NULL)
+            return NULL;
+        e->pfns = pfns;
+        pages = realloc(e->pages, size * XC_PAGE_SIZE);
+        if (pages == NULL)
+            return NULL;
+        e->pages = pages;
+        e->size = size;
+    }
+    e->pfns[e->count] = pfn;
+    return e->pages + e->count++ * XC_PAGE_SIZE;
+}
+
+static void epoch_apply(struct fake_epoch *e, struct fake_dom *d)
+{
+    unsigned long i;
+
+    for (i = 0; i < e->count; i++)
+        memcpy(d->mem + e->pfns[i] * XC_PAGE_SIZE,
+               e->pages + i * XC_PAGE_SIZE, XC_PAGE_SIZE);
+    e->count = 0;
+}
+
+int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
+                      unsigned int store_evtchn, unsigned long *store_mfn,
+                      domid_t store_domid, unsigned int console_evtchn,
+                      unsigned long *console_mfn, domid_t console_domid,
+                      unsigned int hvm, unsigned int pae, int superpages,
+                      int no_incr_generationid,
+                      unsigned long *vm_generationid_addr,
+                      struct restore_callbacks *callbacks)
+{
+    char magic[sizeof(FAKE_MAGIC) - 1];
+    uint64_t nr_pages, pfns[FAKE_BATCH];
+    unsigned long received = 0;
+    struct fake_epoch epoch = { NULL, NULL, 0, 0 };
+    struct fake_dom *d;
+    int32_t c_hvm, count, i, len;
+    uint8_t buf[XC_PAGE_SIZE], *page, *base;
+    int checkpoints = 0, deltas;
+    double t0 = now_s();
+
+    if (read_exact(io_fd, magic, sizeof(magic)) ||
+        read_exact(io_fd, &nr_pages, sizeof(nr_pages)) ||
+        read_exact(io_fd, &c_hvm, sizeof(c_hvm)))
+        goto io_err;
+    if (memcmp(magic, FAKE_MAGIC, sizeof(magic))) {
+        fake_error(xch, "xc_domain_restore: not a fake-xc stream");
+        return -1;
+    }
+
+    d = fake_dom_lookup(dom, 0);
+    if (d == NULL || alloc_dom_mem(d, nr_pages)) {
+        fake_error(xch, "xc_domain_restore: failed to allocate memory");
+        return -1;
+    }
+
+    for (;;) {
+        if (read_exact(io_fd, &count, sizeof(count)))
+            goto io_err;
+        if (count == FAKE_END_OF_STREAM)
+            break;
+        if (count == FAKE_END_OF_ROUND)
+            continue;
+        if (count == FAKE_CHECKPOINT) {
+            epoch_apply(&epoch, d);
+            checkpoints++;
+            continue;
+        }
+        deltas = count == FAKE_DELTA_BATCH;
+        if (deltas && read_exact(io_fd, &count, sizeof(count)))
+            goto io_err;
+        if (count < 0 || count > FAKE_BATCH) {
+            fake_error(xch, "xc_domain_restore: corrupt batch");
+            goto err;
+        }
+        if (read_exact(io_fd, pfns, count * sizeof(*pfns)))
+            goto io_err;
+        for (i = 0; i < count; i++) {
+            if (pfns[i] >= nr_pages) {
+                fake_error(xch, "xc_domain_restore: pfn %"PRIu64" out of range",
+                           pfns[i]);
+                goto err;
+            }
+            /* After the first checkpoint, hold pages until their epoch
+               is complete */
+            base = d->mem + pfns[i] * XC_PAGE_SIZE;
+            page = checkpoints ? epoch_add(&epoch, pfns[i]) : base;
+            if (page == NULL) {
+                fake_error(xch, "xc_domain_restore: out of memory");
+                goto err;
+            }
+            if (!deltas)
+                len = -1;
+            else if (read_exact(io_fd, &len, sizeof(len)))
+                goto io_err;
+            if (len < 0) {
+                if (read_exact(io_fd, page, XC_PAGE_SIZE))
+                    goto io_err;
+                continue;
+            }
+            /* A delta against the last version of the page we have */
+            if (len > XC_PAGE_SIZE) {
+                fake_error(xch, "xc_domain_restore: corrupt delta");
+                goto err;
+            }
+            if (read_exact(io_fd, buf, len))
+                goto io_err;
+            if (page != base)
+                memcpy(page, base, XC_PAGE_SIZE);
+            if (delta_decode(page, buf, len)) {
+                fake_error(xch, "xc_domain_restore: corrupt delta for pfn %"
+                           PRIu64, pfns[i]);
+                goto err;
+            }
+        }
+        received += count;
+    }
+
+done:
+    free(epoch.pfns);
+    free(epoch.pages);
+    *store_mfn = nr_pages - 2;
+    *console_mfn = nr_pages - 1;
+    if (vm_generationid_addr)
+        *vm_generationid_addr = 0;
+    d->paused = 1;
+    printf("fake-xc: restored domain %u: %lu pages received for %"PRIu64
+           " pages in %.3fs (%.1f MiB/s)", dom, received, nr_pages,
+           now_s() - t0,
+           received * XC_PAGE_SIZE / 1048576.0 / (now_s() - t0));
+    if (checkpoints)
+        printf("fake-xc: restored checkpoint %d", checkpoints);
+    return 0;
+
+io_err:
+    if (checkpoints) {
+        printf("fake-xc: stream broken (%s), discarding %lu pages of an "
+               "incomplete epoch", strerror(errno), epoch.count);
+        goto done;
+    }
+    fake_error(xch, "xc_domain_restore: read failed: %s", strerror(errno));
+err:
+    free(epoch.pfns);
+    free(epoch.pages);
+    return -1;
+}
+
+/* Post-copy: memory map, log-dirty, HVM context and paging ***************/
+
+/* Grow a domain to nr_pages, new pages being zero */
+static int fake_dom_grow(struct fake_dom *d, unsigned long nr_pages)
+{
+    uint8_t *mem, *dirty;
+
+    if (nr_pages <= d->nr_pages)
+        return 0;
+    mem = d->mem ? mremap(d->mem, d->nr_pages * XC_PAGE_SIZE,
+                          nr_pages * XC_PAGE_SIZE, MREMAP_MAYMOVE)
+        : mmap(NULL, nr_pages * XC_PAGE_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return -1;
+    d->mem = mem;
+    dirty = realloc(d->dirty, nr_pages);
+    if (dirty == NULL)
+        return -1;
+    memset(dirty + d->nr_pages, 0, nr_pages - d->nr_pages);
+    d->dirty = dirty;
+    d->nr_pages = nr_pages;
+    return 0;
+}
+
+int xc_domain_maximum_gpfn(xc_interface *xch, domid_t domid)
+{
+    struct fake_dom *d = fake_dom_get(domid);
+
+    return d ? (int)d->nr_pages - 1 : -1;
+}
+
+/* Whether pfn is a PoD entry; clear says to populate it, as Xen does for
+   any lookup which may allocate */
+static int fake_pod_test(struct fake_dom *d, unsigned long pfn, int clear)
+{
+    if (pfn >= d->nr_pod || !d->pod[pfn])
+        return 0;
+    if (clear) {
+        d->pod[pfn] = 0;
+        d->pod_entries--;
+    }
+    return 1;
+}
+
+static int fake_pod_set(struct fake_dom *d, unsigned long pfn)
+{
+    uint8_t *pod;
+
+    if (pfn >= d->nr_pod) {
+        pod = realloc(d->pod, d->nr_pages);
+        if (pod == NULL)
+            return -1;
+        memset(pod + d->nr_pod, 0, d->nr_pages - d->nr_pod);
+        d->pod = pod;
+        d->nr_pod = d->nr_pages;
+    }
+    if (!d->pod[pfn]) {
+        d->pod[pfn] = 1;
+        d->pod_entries++;
+    }
+    memset(d->mem + pfn * XC_PAGE_SIZE, 0, XC_PAGE_SIZE);
+    return 0;
+}
+
+int xc_get_pfn_type_batch(xc_interface *xch, uint32_t dom,
+                          unsigned int num, xen_pfn_t *arr)
+{
+    struct fake_dom *d = fake_dom_get(dom);
+    unsigned int i;
+
+    if (d == NULL)
+        return -1;
+    for (i = 0; i < num; i++) {
+        if (arr[i] >= d->nr_pages) {
+            arr[i] = XEN_DOMCTL_PFINFO_XTAB;
+            continue;
+        }
+        fake_pod_test(d, arr[i], 1);
+        arr[i] = 0;
+    }
+    return 0;
+}
+
+int xc_domain_populate_physmap_exact(xc_interface *xch, uint32_t domid,
+                                     unsigned long nr_extents,
+                                     unsigned int extent_order,
+                                     unsigned int mem_flags,
+                                     xen_pfn_t *extent_start)
+{
+    struct fake_dom *d = fake_dom_lookup(domid, 0);
+    unsigned long i, top = 0;
+
+    if (d == NULL)
+        return -1;
+    for (i = 0; i < nr_extents; i++)
+        if (extent_start[i] + (1UL << extent_order) > top)
+            top = extent_start[i] + (1UL << extent_order);
+    if (fake_dom_grow(d, top)) {
+        fake_error(xch, "xc_domain_populate_physmap_exact: out of memory");
+        return -1;
+    }
+    if (mem_flags & XENMEMF_populate_on_demand)
+        for (i = 0; i < nr_extents; i++)
+            if (fake_pod_set(d, extent_start[i])) {
+                fake_error(xch, "xc_domain_populate_physmap_exact: "
+                           "out of memory");
+                return -1;
+            }
+    return 0;
+}
+
+/* Unlike the _exact variant, populates as many extents as it can, which
+   is none if they are larger than FAKE_XC_MAX_ORDER. May be called from
+   several threads at once. */
+int xc_domain_populate_physmap(xc_interface *xch, uint32_t domid,
+                               unsigned long nr_extents,
+                               unsigned int extent_order,
+                               unsigned int mem_flags,
+                               xen_pfn_t *extent_start)
+{
+    struct fake_dom *d = fake_dom_lookup(domid, 0);
+    unsigned long i, top = 0;
+    int rc;
+
+    if (d == NULL)
+        return -1;
+    if (extent_order > env_ul("FAKE_XC_MAX_ORDER", 18))
+        return 0;
+    for (i = 0; i < nr_extents; i++) {
+        if (extent_start[i] & ((1UL << extent_order) - 1))
+            break;
+        if (extent_start[i] + (1UL << extent_order) > top)
+            top = extent_start[i] + (1UL << extent_order);
+    }
+    pthread_mutex_lock(&fake_lock);
+    rc = fake_dom_grow(d, top);
+    pthread_mutex_unlock(&fake_lock);
+    if (rc) {
+        fake_error(xch, "xc_domain_populate_physmap: out of memory");
+        return -1;
+    }
+    return i;
+}
+
+#ifdef XENMEM_get_vnumainfo
+int xc_domain_setvnuma(xc_interface *xch, uint32_t domid, uint32_t nr_vnodes,
+                       uint32_t nr_regions, uint32_t nr_vcpus,
+                       xen_vmemrange_t *vmemrange, unsigned int *vdistance,
+                       unsigned int *vcpu_to_vnode,
+                       unsigned int *vnode_to_pnode)
+{
+    uint32_t i;
+
+    for (i = 0; i < nr_regions; i++)
+        if (vmemrange[i].nid >= nr_vnodes) {
+            fake_error(xch, "xc_domain_setvnuma: range %u on no node", i);
+            return -1;
+        }
+    for (i = 0; i < nr_vcpus; i++)
+        if (vcpu_to_vnode[i] >= nr_vnodes) {
+            fake_error(xch, "xc_domain_setvnuma: vCPU %u on no node", i);
+            return -1;
+        }
+    return 0;
+}
+#endif
+
+int xc_physinfo(xc_interface *xch, xc_physinfo_t *info)
+{
+    info->nr_cpus = env_ul("FAKE_XC_PCPUS", 8);
+    info->nr_nodes = env_ul("FAKE_XC_NODES", 1);
+    return 0;
+}
+
+int xc_domain_decrease_reservation_exact(xc_interface *xch, uint32_t domid,
+                                         unsigned long nr_extents,
+                                         unsigned int extent_order,
+                                         xen_pfn_t *extent_start)
+{
+    struct fake_dom *d = fake_dom_get(domid);
+    unsigned long i;
+
+    if (d == NULL)
+        return -1;
+    for (i = 0; i < nr_extents; i++)
+        if (extent_start[i] < d->nr_pages) {
+            fake_pod_test(d, extent_start[i], 1);
+            memset(d->mem + extent_start[i] * XC_PAGE_SIZE, 0,
+                   XC_PAGE_SIZE << extent_order);
+        }
+    return 0;
+}
+
+/* The PoD cache is what the target allows beyond the populated pages, up
+   to the number of entries */
+static void fake_pod_counts(struct fake_dom *d, uint64_t *tot_pages,
+                            uint64_t *pod_cache_pages, uint64_t *pod_entries)
+{
+    uint64_t populated = d->nr_pages - d->pod_entries, cache = 0;
+
+    if (d->pod_target > populated)
+        cache = d->pod_target - populated;
+    if (cache > d->pod_entries)
+        cache = d->pod_entries;
+    if (tot_pages)
+        *tot_pages = populated + cache;
+    if (pod_cache_pages)
+        *pod_cache_pages = cache;
+    if (pod_entries)
+        *pod_entries = d->pod_entries;
+}
+
+int xc_domain_get_pod_target(xc_interface *xch, uint32_t domid,
+                             uint64_t *tot_pages, uint64_t *pod_cache_pages,
+                             uint64_t *pod_entries)
+{
+    struct fake_dom *d = fake_dom_get(domid);
+
+    if (d == NULL)
+        return -1;
+    fake_pod_counts(d, tot_pages, pod_cache_pages, pod_entries);
+    return 0;
+}
+
+/* Like Xen, ignored for a domain without PoD entries */
+int xc_domain_set_pod_target(xc_interface *xch, uint32_t domid,
+                             uint64_t target_pages, uint64_t *tot_pages,
+                             uint64_t *pod_cache_pages, uint64_t *pod_entries)
+{
+    struct fake_dom *d = fake_dom_get(domid);
+
+    if (d == NULL)
+        return -1;
+    if (d->pod_entries)
+        d->pod_target = target_pages;
+    fake_pod_counts(d, tot_pages, pod_cache_pages, pod_entries);
+    return 0;
+}
+
+/* Private copies, like xc_map_foreign_range; paged-out pages fail with
+   ENOENT as they do with the real thing */
+void *xc_map_foreign_bulk(xc_interface *xch, uint32_t dom, int prot,
+                          const xen_pfn_t *arr, int *err, unsigned int num)
+{
+    struct fake_dom *d = fake_dom_get(dom);
+    uint8_t *p;
+    unsigned int i;
+
+    if (d == NULL)
+        return NULL;
+    p = mmap(NULL, num * XC_PAGE_SIZE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    pthread_mutex_lock(&paging_lock);
+    for (i = 0; i < num; i++) {
+        err[i] = 0;
+        if (arr[i] >= d->nr_pages)
+            err[i] = -EINVAL;
+        else if (d->paging && d->paged[arr[i]])
+            err[i] = -ENOENT;
+        else
+            memcpy(p + i * XC_PAGE_SIZE, d->mem + arr[i] * XC_PAGE_SIZE,
+                   XC_PAGE_SIZE);
+    }
+    pthread_mutex_unlock(&paging_lock);
+    return p;
+}
+
+void *xc__hypercall_buffer_alloc_pages(xc_interface *xch,
+                                       xc_hypercall_buffer_t *b, int nr_pages)
+{
+    b->hbuf = calloc(nr_pages, XC_PAGE_SIZE);
+    return b->hbuf;
+}
+
+void xc__hypercall_buffer_free_pages(xc_interface *xch,
+                                     xc_hypercall_buffer_t *b, int nr_pages)
+{
+    free(b->hbuf);
+    b->hbuf = NULL;
+}
+
+/* While log-dirty is on, the guest dirties pages in wall-clock time
+   whenever it is not paused. PEEK without a bitmap only reads the
+   statistics, as Xen's does. */
+int xc_shadow_control(xc_interface *xch, uint32_t domid, unsigned int sop,
+                      xc_hypercall_buffer_t *dirty_bitmap,
+                      unsigned long pages, unsigned long *mb,
+                      uint32_t mode, xc_shadow_op_stats_t *stats)
+{
+    struct fake_dom *d = fake_dom_get(domid);
+    unsigned long pfn, *bitmap, bits = 8 * sizeof(*bitmap);
+    double now = now_s();
+
+    if (d == NULL)
+        return -1;
+    switch (sop) {
+    case XEN_DOMCTL_SHADOW_OP_ENABLE_LOGDIRTY:
+        d->logdirty_since = now;
+        memset(d->dirty, 0, d->nr_pages);
+        d->nr_dirty = 0;
+        return 0;
+    case XEN_DOMCTL_SHADOW_OP_CLEAN:
+    case XEN_DOMCTL_SHADOW_OP_PEEK:
+        if (d->logdirty_since == 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (!d->paused)
+            fake_dom_dirty(d, env_ul("FAKE_XC_DIRTY_RATE", 0) *
+                           (now - d->logdirty_since) * fake_dom_speed(d));
+        d->logdirty_since = now;
+        if (stats) {
+            stats->fault_count = 0;
+            stats->dirty_count = d->nr_dirty;
+        }
+        bitmap = dirty_bitmap ? dirty_bitmap->hbuf : NULL;
+        for (pfn = 0; pfn < d->nr_pages && pfn < pages; pfn++) {
+            if (bitmap && d->dirty[pfn])
+                bitmap[pfn / bits] |= 1UL << (pfn % bits);
+            if (sop == XEN_DOMCTL_SHADOW_OP_CLEAN)
+                d->dirty[pfn] = 0;
+        }
+        if (sop == XEN_DOMCTL_SHADOW_OP_CLEAN)
+            d->nr_dirty = 0;
+        return d->nr_pages;
+    case XEN_DOMCTL_SHADOW_OP_OFF:
+        d->logdirty_since = 0;
+        return 0;
+    }
+    errno = ENOSYS;
+    return -1;
+}
+
+/* The context is opaque: a domain which has none gets a deterministic
+   one */
+int xc_domain_hvm_getcontext(xc_interface *xch, uint32_t domid,
+                             uint8_t *ctxt_buf, uint32_t size)
+{
+    struct fake_dom *d = fake_dom_get(domid);
+    uint64_t rng = domid + 1;
+    uint32_t i;
+
+    if (d == NULL)
+        return -1;
+    if (d->hvm_ctx == NULL) {
+        d->hvm_ctx = malloc(FAKE_HVM_CTX_LEN);
+        if (d->hvm_ctx == NULL)
+            return -1;
+        d->hvm_ctx_len = FAKE_HVM_CTX_LEN;
+        for (i = 0; i < d->hvm_ctx_len; i++)
+            d->hvm_ctx[i] = rng_next(&rng) >> 56;
+    }
+    if (ctxt_buf == NULL)
+        return d->hvm_ctx_len;
+    if (size < d->hvm_ctx_len) {
+        fake_error(xch, "xc_domain_hvm_getcontext: buffer too small");
+        return -1;
+    }
+    memcpy(ctxt_buf, d->hvm_ctx, d->hvm_ctx_len);
+    return d->hvm_ctx_len;
+}
+
+int xc_domain_hvm_setcontext(xc_interface *xch, uint32_t domid,
+                             uint8_t *hvm_ctxt, uint32_t size)
+{
+    struct fake_dom *d = fake_dom_lookup(domid, 0);
+    uint8_t *ctx = malloc(size);
+
+    if (d == NULL || ctx == NULL) {
+        free(ctx);
+        return -1;
+    }
+    memcpy(ctx, hvm_ctxt, size);
+    free(d->hvm_ctx);
+    d->hvm_ctx = ctx;
+    d->hvm_ctx_len = size;
+    return 0;
+}
+
+/* The paging ring page is shared between the guest (here) and whoever
+   maps it (see xc_map_foreign_range) */
+static int fake_ring_fd(struct fake_dom *d)
+{
+    if (d->ring_fd >= 0)
+        return d->ring_fd;
+    d->ring_fd = syscall(SYS_memfd_create, "fake-xc-paging-ring", 0);
+    if (d->ring_fd < 0)
+        return -1;
+    if (ftruncate(d->ring_fd, XC_PAGE_SIZE) ||
+        (d->sring = mmap(NULL, XC_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, d->ring_fd, 0)) == MAP_FAILED) {
+        close(d->ring_fd);
+        d->ring_fd = -1;
+        d->sring = NULL;
+        return -1;
+    }
+    return d->ring_fd;
+}
+
+int xc_mem_paging_enable(xc_interface *xch, domid_t domain_id, uint32_t *port)
+{
+    struct fake_dom *d = fake_dom_lookup(domain_id, 0);
+    int r = -1;
+
+    if (d == NULL)
+        return -1;
+    pthread_mutex_lock(&paging_lock);
+    if (d->hvm_params[HVM_PARAM_PAGING_RING_PFN] == 0 || d->paging ||
+        fake_ring_fd(d) < 0) {
+        fake_error(xch, "xc_mem_paging_enable: no ring or already enabled");
+        errno = EINVAL;
+        goto out;
+    }
+    d->paged = calloc(d->nr_pages, 1);
+    if (d->paged == NULL)
+        goto out;
+    FRONT_RING_INIT(&d->ring, d->sring, XC_PAGE_SIZE);
+    d->paging = 1;
+    *port = FAKE_PAGING_PORT;
+    r = 0;
+out:
+    pthread_mutex_unlock(&paging_lock);
+    return r;
+}
+
+int xc_mem_paging_disable(xc_interface *xch, domid_t domain_id)
+{
+    struct fake_dom *d = fake_dom_lookup(domain_id, 0);
+
+    if (d == NULL)
+        return -1;
+    pthread_mutex_lock(&paging_lock);
+    d->paging = 0;
+    free(d->paged);
+    d->paged = NULL;
+    if (d->sring)
+        munmap(d->sring, XC_PAGE_SIZE);
+    if (d->ring_fd >= 0)
+        close(d->ring_fd);
+    d->sring = NULL;
+    d->ring_fd = -1;
+    pthread_cond_broadcast(&paging_cond);
+    pthread_mutex_unlock(&paging_lock);
+    return 0;
+}
+
+static int fake_paging_op(xc_interface *xch, domid_t domain_id,
+                          unsigned long gfn, int paged, const void *buffer)
+{
+    struct fake_dom *d = fake_dom_lookup(domain_id, 0);
+    int r = -1;
+
+    if (d == NULL)
+        return -1;
+    pthread_mutex_lock(&paging_lock);
+    if (!d->paging || gfn >= d->nr_pages) {
+        errno = EINVAL;
+        goto out;
+    }
+    if (paged < 0) {            /* nominate */
+        r = d->paged[gfn] ? -1 : 0;
+        errno = EBUSY;
+        goto out;
+    }
+    if (d->paged[gfn] == paged) {
+        errno = EINVAL;
+        goto out;
+    }
+    if (buffer)
+        memcpy(d->mem + gfn * XC_PAGE_SIZE, buffer, XC_PAGE_SIZE);
+    else
+        memset(d->mem + gfn * XC_PAGE_SIZE, 0, XC_PAGE_SIZE);
+    d->paged[gfn] = paged;
+    r = 0;
+out:
+    pthread_mutex_unlock(&paging_lock);
+    return r;
+}
+
+int xc_mem_paging_nominate(xc_interface *xch, domid_t domain_id,
+                           unsigned long gfn)
+{
+    return fake_paging_op(xch, domain_id, gfn, -1, NULL);
+}
+
+int xc_mem_paging_evict(xc_interface *xch, domid_t domain_id,
+                        unsigned long gfn)
+{
+    return fake_paging_op(xch, domain_id, gfn, 1, NULL);
+}
+
+int xc_mem_paging_load(xc_interface *xch, domid_t domain_id,
+                       unsigned long gfn, void *buffer)
+{
+    return fake_paging_op(xch, domain_id, gfn, 0, buffer);
+}
+
+/* Page sharing, within the domains this process knows: like Xen, the
+   client's page simply takes the contents of the source's, whatever they
+   were. A handle names the domain and gfn it was nominated for. */
+int xc_memshr_control(xc_interface *xch, domid_t domid, int enable)
+{
+    struct fake_dom *d = fake_dom_get(domid);
+
+    if (d == NULL) {
+        fake_error(xch, "xc_memshr_control: no domain %u", domid);
+        errno = ESRCH;
+        return -1;
+    }
+    d->memshr = enable;
+    return 0;
+}
+
+static uint64_t fake_memshr_handle(uint32_t domid, unsigned long gfn)
+{
+    return ((uint64_t)domid << 40) | gfn;
+}
+
+int xc_memshr_nominate_gfn(xc_interface *xch, domid_t domid,
+                           unsigned long gfn, uint64_t *handle)
+{
+    struct fake_dom *d = fake_dom_get(domid);
+
+    if (d == NULL || !d->memshr || gfn >= d->nr_pages ||
+        fake_pod_test(d, gfn, 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    *handle = fake_memshr_handle(domid, gfn);
+    return 0;
+}
+
+int xc_memshr_share_gfns(xc_interface *xch, domid_t source_domain,
+                         unsigned long source_gfn, uint64_t source_handle,
+                         domid_t client_domain, unsigned long client_gfn,
+                         uint64_t client_handle)
+{
+    struct fake_dom *s = fake_dom_get(source_domain);
+    struct fake_dom *c = fake_dom_get(client_domain);
+
+    if (s == NULL || c == NULL || !s->memshr || !c->memshr ||
+        source_handle != fake_memshr_handle(source_domain, source_gfn) ||
+        client_handle != fake_memshr_handle(client_domain, client_gfn) ||
+        source_gfn >= s->nr_pages || client_gfn >= c->nr_pages) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (s->shared == NULL)
+        s->shared = calloc(s->nr_pages, 1);
+    if (c->shared == NULL)
+        c->shared = calloc(c->nr_pages, 1);
+    if (s->shared == NULL || c->shared == NULL)
+        return -1;
+    memcpy(c->mem + client_gfn * XC_PAGE_SIZE,
+           s->mem + source_gfn * XC_PAGE_SIZE, XC_PAGE_SIZE);
+    s->shared[source_gfn] = c->shared[client_gfn] = 1;
+    return 0;
+}
+
+int fake_dom_write_page(uint32_t domid, unsigned long pfn, const void *page)
+{
+    struct fake_dom *d = fake_dom_get(domid);
+
+    if (d == NULL || pfn >= d->nr_pages) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(d->mem + pfn * XC_PAGE_SIZE, page, XC_PAGE_SIZE);
+    if (d->shared)
+        d->shared[pfn] = 0;
+    return 0;
+}
+
+int fake_dom_page_shared(uint32_t domid, unsigned long pfn)
+{
+    struct fake_dom *d = fake_dom_get(domid);
+
+    return d && d->shared && pfn < d->nr_pages && d->shared[pfn];
+}
+
+/* Event channels: only the paging port exists. The fd carries the
+   pending port numbers. */
+xc_evtchn *xc_evtchn_open(xentoollog_logger *logger, unsigned open_flags)
+{
+    xc_evtchn *xce = calloc(1, sizeof(*xce));
+
+    if (xce && pipe2(xce->evtchn, O_CLOEXEC)) {
+        free(xce);
+        return NULL;
+    }
+    return xce;
+}
+
+int xc_evtchn_close(xc_evtchn *xce)
+{
+    close(xce->evtchn[0]);
+    close(xce->evtchn[1]);
+    free(xce);
+    return 0;
+}
+
+int xc_evtchn_fd(xc_evtchn *xce)
+{
+    return xce->evtchn[0];
+}
+
+evtchn_port_or_error_t xc_evtchn_bind_interdomain(xc_evtchn *xce, int domid,
+                                                  evtchn_port_t remote_port)
+{
+    struct fake_dom *d = fake_dom_lookup(domid, 0);
+
+    if (d == NULL || remote_port != FAKE_PAGING_PORT) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&paging_lock);
+    d->xce = xce;
+    xce->bound = d;
+    pthread_mutex_unlock(&paging_lock);
+    return FAKE_LOCAL_PORT;
+}
+
+int xc_evtchn_unbind(xc_evtchn *xce, evtchn_port_t port)
+{
+    pthread_mutex_lock(&paging_lock);
+    if (xce->bound)
+        xce->bound->xce = NULL;
+    xce->bound = NULL;
+    pthread_mutex_unlock(&paging_lock);
+    return 0;
+}
+
+evtchn_port_or_error_t xc_evtchn_pending(xc_evtchn *xce)
+{
+    uint32_t port;
+
+    if (read_exact(xce->evtchn[0], &port, sizeof(port)))
+        return -1;
+    return port;
+}
+
+int xc_evtchn_unmask(xc_evtchn *xce, evtchn_port_t port)
+{
+    return 0;
+}
+
+/* Responses on the ring wake the vCPU */
+int xc_evtchn_notify(xc_evtchn *xce, evtchn_port_t port)
+{
+    struct fake_dom *d = xce->bound;
+
+    pthread_mutex_lock(&paging_lock);
+    if (d && d->sring) {
+        while (RING_HAS_UNCONSUMED_RESPONSES(&d->ring)) {
+            d->ring.rsp_cons++;
+            d->vcpu_blocked = 0;
+        }
+        pthread_cond_broadcast(&paging_cond);
+    }
+    pthread_mutex_unlock(&paging_lock);
+    return 0;
+}
+
+/* Called with paging_lock held: ask for pfn and wait for the answer */
+static void fake_vcpu_fault(struct fake_dom *d, unsigned long pfn)
+{
+    mem_event_request_t *req;
+    uint32_t port = FAKE_LOCAL_PORT;
+    double t0 = now_s();
+
+    req = RING_GET_REQUEST(&d->ring, d->ring.req_prod_pvt);
+    memset(req, 0, sizeof(*req));
+    req->gfn = pfn;
+    req->vcpu_id = 0;
+    req->flags = MEM_EVENT_FLAG_VCPU_PAUSED;
+    d->ring.req_prod_pvt++;
+    RING_PUSH_REQUESTS(&d->ring);
+    d->vcpu_blocked = 1;
+    d->faults++;
+    if (d->xce && write_exact(d->xce->evtchn[1], &port, sizeof(port)))
+        return;
+    while (d->vcpu_blocked && !d->vcpu_stop && d->paging)
+        pthread_cond_wait(&paging_cond, &paging_lock);
+    d->stalled += now_s() - t0;
+}
+
+static void *fake_vcpu(void *arg)
+{
+    struct fake_dom *d = arg;
+    unsigned long rate = env_ul("FAKE_XC_ACCESS_RATE", 50000), i, pfn;
+    uint64_t rng = d->rng ^ 0x5DEECE66DULL;
+    volatile uint8_t sink;
+
+    pthread_mutex_lock(&paging_lock);
+    while (!d->vcpu_stop) {
+        /* A millisecond's worth of reads */
+        for (i = 0; i < rate / 1000 + 1 && !d->vcpu_stop; i++) {
+            pfn = fake_dom_pick(d, &rng, 0);
+            if (d->paging && d->paged[pfn])
+                fake_vcpu_fault(d, pfn);
+            sink = d->mem[pfn * XC_PAGE_SIZE];
+            d->accesses++;
+        }
+        pthread_mutex_unlock(&paging_lock);
+        usleep(1000);
+        pthread_mutex_lock(&paging_lock);
+    }
+    pthread_mutex_unlock(&paging_lock);
+    (void)sink;
+    return NULL;
+}
+
+int xc_domain_unpause(xc_interface *xch, uint32_t domid)
+{
+    struct fake_dom *d = fake_dom_get(domid);
+
+    if (d == NULL)
+        return -1;
+    if (d->logdirty_since && d->paused)
+        d->logdirty_since = now_s();
+    d->paused = 0;
+    if (d->paging && !d->vcpu_running) {
+        d->vcpu_stop = 0;
+        if (pthread_create(&d->vcpu, NULL, fake_vcpu, d))
+            return -1;
+        d->vcpu_running = 1;
+    }
+    return 0;
+}
+
+int xc_domain_pause(xc_interface *xch, uint32_t domid)
+{
+    struct fake_dom *d = fake_dom_get(domid);
+
+    if (d == NULL)
+        return -1;
+    /* Whatever the guest dirtied while it ran */
+    if (d->logdirty_since && !d->paused) {
+        fake_dom_dirty(d, env_ul("FAKE_XC_DIRTY_RATE", 0) *
+                       (now_s() - d->logdirty_since));
+        d->logdirty_since = now_s();
+    }
+    d->paused = 1;
+    if (d->vcpu_running) {
+        pthread_mutex_lock(&paging_lock);
+        d->vcpu_stop = 1;
+        pthread_cond_broadcast(&paging_cond);
+        pthread_mutex_unlock(&paging_lock);
+        pthread_join(d->vcpu, NULL);
+        d->vcpu_running = 0;
+        printf("fake-xc: domain %u vcpu: %lu reads, %lu page faults, "
+               "stalled %.3fms", domid, d->accesses, d->faults,
+               d->stalled * 1000);
+    }
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,445 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+/* An in-process stand-in for libxenstore, for exercising the stubs
+   without a running xenstored. All handles share one store. Watches
+   are delivered through a per-handle pipe, so xs_fileno() can be
+   polled exactly like the real thing. Transactions are not isolated:
+   writes inside a transaction are applied immediately (and stay if it
+   then fails). Optionally it also plays the part of qemu for the
+   log-dirty handshake. */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <xenstore.h>
+
+#include "fake_xen.h"
+
+struct fake_node {
+    char *path;
+    char *val;
+    unsigned int len;
+    struct fake_node *next;
+};
+
+struct fake_event {
+    char *path;
+    char *token;
+    struct fake_event *next;
+};
+
+struct fake_watch {
+    struct xs_handle *h;
+    char *path;
+    char *token;
+    struct fake_watch *next;
+};
+
+struct xs_handle {
+    int pipe[2];
+    struct fake_event *head, *tail; /* pending watch events */
+};
+
+static pthread_mutex_t fake_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fake_node *nodes;
+static struct fake_watch *watches;
+static int device_model;
+
+void fake_xs_set_device_model(int enabled)
+{
+    device_model = enabled;
+}
+
+static struct fake_node *find_node(const char *path)
+{
+    struct fake_node *n;
+
+    for (n = nodes; n; n = n->next)
+        if (!strcmp(n->path, path))
+            return n;
+    return NULL;
+}
+
+/* A watch on "a/b" fires for "a/b" and for anything below it */
+static int watch_matches(const char *watch, const char *path)
+{
+    size_t len = strlen(watch);
+
+    return !strncmp(watch, path, len) && (path[len] == '\0' || path[len] == '/');
+}
+
+static void queue_event(struct xs_handle *h, const char *path, const char *token)
+{
+    struct fake_event *e;
+    char c = 0;
+
+    e = calloc(1, sizeof(*e));
+    if (e == NULL)
+        return;
+    e->path = strdup(path);
+    e->token = strdup(token);
+    if (h->tail)
+        h->tail->next = e;
+    else
+        h->head = e;
+    h->tail = e;
+    if (write(h->pipe[1], &c, 1) != 1)
+        fprintf(stderr, "fake_xenstore: failed to signal watch");
+}
+
+static void fire_watches(const char *path)
+{
+    struct fake_watch *w;
+
+    for (w = watches; w; w = w->next)
+        if (watch_matches(w->path, path))
+            queue_event(w->h, path, w->token);
+}
+
+struct xs_handle *xs_daemon_open(void)
+{
+    struct xs_handle *h;
+
+    h = calloc(1, sizeof(*h));
+    if (h == NULL)
+        return NULL;
+    if (pipe(h->pipe)) {
+        free(h);
+        return NULL;
+    }
+    fcntl(h->pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(h->pipe[1], F_SETFD, FD_CLOEXEC);
+    return h;
+}
+
+struct xs_handle *xs_open(unsigned long flags)
+{
+    return xs_daemon_open();
+}
+
+void xs_daemon_close(struct xs_handle *h)
+{
+    struct fake_watch **pw, *w;
+    struct fake_event *e;
+
+    if (h == NULL)
+        return;
+    pthread_mutex_lock(&fake_lock);
+    for (pw = &watches; (w = *pw); ) {
+        if (w->h == h) {
+            *pw = w->next;
+            free(w->path);
+            free(w->token);
+            free(w);
+        } else
+            pw = &w->next;
+    }
+    pthread_mutex_unlock(&fake_lock);
+    while ((e = h->head)) {
+        h->head = e->next;
+        free(e->path);
+        free(e->token);
+        free(e);
+    }
+    close(h->pipe[0]);
+    close(h->pipe[1]);
+    free(h);
+}
+
+void xs_close(struct xs_handle *h)
+{
+    xs_daemon_close(h);
+}
+
+char *xs_get_domain_path(struct xs_handle *h, unsigned int domid)
+{
+    char *path;
+
+    if (asprintf(&path, "/local/domain/%u", domid) == -1)
+        return NULL;
+    return path;
+}
+
+void *xs_read(struct xs_handle *h, xs_transaction_t t,
+              const char *path, unsigned int *len)
+{
+    struct fake_node *n;
+    char *val = NULL;
+
+    pthread_mutex_lock(&fake_lock);
+    n = find_node(path);
+    if (n) {
+        val = malloc(n->len + 1);
+        if (val) {
+            memcpy(val, n->val, n->len);
+            val[n->len] = '\0';
+            if (len)
+                *len = n->len;
+        }
+    } else
+        errno = ENOENT;
+    pthread_mutex_unlock(&fake_lock);
+    return val;
+}
+
+/* Called with fake_lock held */
+static bool write_node(const char *path, const void *data, unsigned int len)
+{
+    struct fake_node *n;
+    char *val;
+
+    val = malloc(len + 1);
+    if (val == NULL)
+        return false;
+    memcpy(val, data, len);
+    val[len] = '\0';
+
+    n = find_node(path);
+    if (n == NULL) {
+        n = calloc(1, sizeof(*n));
+        if (n == NULL) {
+            free(val);
+            return false;
+        }
+        n->path = strdup(path);
+        n->next = nodes;
+        nodes = n;
+    }
+    free(n->val);
+    n->val = val;
+    n->len = len;
+    fire_watches(path);
+    return true;
+}
+
+bool xs_write(struct xs_handle *h, xs_transaction_t t,
+              const char *path, const void *data, unsigned int len)
+{
+    static const char suffix[] = "/logdirty/cmd";
+    size_t plen = strlen(path), slen = strlen(suffix);
+    char *ret_path;
+    bool ok;
+
+    pthread_mutex_lock(&fake_lock);
+    ok = write_node(path, data, len);
+    if (ok && device_model && plen > slen &&
+        !strcmp(path + plen - slen, suffix) &&
+        (ret_path = strdup(path))) {
+        strcpy(ret_path + plen - strlen("cmd"), "ret");
+        write_node(ret_path, data, len);
+        free(ret_path);
+    }
+    pthread_mutex_unlock(&fake_lock);
+    return ok;
+}
+
+bool xs_rm(struct xs_handle *h, xs_transaction_t t, const char *path)
+{
+    struct fake_node **pn, *n;
+    int found = 0;
+
+    pthread_mutex_lock(&fake_lock);
+    for (pn = &nodes; (n = *pn); ) {
+        if (watch_matches(path, n->path)) {
+            *pn = n->next;
+            free(n->path);
+            free(n->val);
+            free(n);
+            found = 1;
+        } else
+            pn = &n->next;
+    }
+    if (found)
+        fire_watches(path);
+    pthread_mutex_unlock(&fake_lock);
+    return true;
+}
+
+/* As with libxenstore, the returned vector and its strings are a
+   single allocation. */
+char **xs_directory(struct xs_handle *h, xs_transaction_t t,
+                    const char *path, unsigned int *num)
+{
+    struct fake_node *n;
+    size_t plen = strlen(path), count = 0, bytes = 0, len, i;
+    const char **names, *child;
+    char **vec = NULL, *p;
+
+    pthread_mutex_lock(&fake_lock);
+    for (n = nodes; n; n = n->next)
+        count++;
+    names = calloc(count + 1, sizeof(char *));
+    if (names == NULL)
+        goto out;
+    *num = 0;
+    for (n = nodes; n; n = n->next) {
+        if (strncmp(n->path, path, plen) || n->path[plen] != '/')
+            continue;
+        child = n->path + plen + 1;
+        len = strcspn(child, "/");
+        for (i = 0; i < *num; i++)
+            if (strlen(names[i]) == len && !strncmp(names[i], child, len))
+                break;
+        if (i == *num) {
+            names[(*num)++] = strndup(child, len);
+            bytes += len + 1;
+        }
+    }
+    vec = malloc(*num * sizeof(char *) + bytes);
+    p = (char *)(vec + *num);
+    for (i = 0; i < *num; i++) {
+        if (vec) {
+            vec[i] = p;
+            p = stpcpy(p, names[i]) + 1;
+        }
+        free((char *)names[i]);
+    }
+    free(names);
+out:
+    pthread_mutex_unlock(&fake_lock);
+    return vec;
+}
+
+bool xs_watch(struct xs_handle *h, const char *path, const char *token)
+{
+    struct fake_watch *w;
+
+    w = calloc(1, sizeof(*w));
+    if (w == NULL)
+        return false;
+    w->h = h;
+    w->path = strdup(path);
+    w->token = strdup(token);
+    pthread_mutex_lock(&fake_lock);
+    w->next = watches;
+    watches = w;
+    /* Like xenstored, fire every new watch once */
+    queue_event(h, path, token);
+    pthread_mutex_unlock(&fake_lock);
+    return true;
+}
+
+bool xs_unwatch(struct xs_handle *h, const char *path, const char *token)
+{
+    struct fake_watch **pw, *w;
+
+    pthread_mutex_lock(&fake_lock);
+    for (pw = &watches; (w = *pw); pw = &w->next) {
+        if (w->h == h && !strcmp(w->path, path) && !strcmp(w->token, token)) {
+            *pw = w->next;
+            free(w->path);
+            free(w->token);
+            free(w);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fake_lock);
+    return true;
+}
+
+int xs_fileno(struct xs_handle *h)
+{
+    return h->pipe[0];
+}
+
+/* As with libxenstore, the returned vector and its strings are a
+   single allocation. */
+char **xs_read_watch(struct xs_handle *h, unsigned int *num)
+{
+    struct fake_event *e;
+    char **vec;
+    char c;
+    size_t plen, tlen;
+
+    if (read(h->pipe[0], &c, 1) != 1)
+        return NULL;
+    pthread_mutex_lock(&fake_lock);
+    e = h->head;
+    if (e) {
+        h->head = e->next;
+        if (h->head == NULL)
+            h->tail = NULL;
+    }
+    pthread_mutex_unlock(&fake_lock);
+    if (e == NULL)
+        return NULL;
+
+    plen = strlen(e->path) + 1;
+    tlen = strlen(e->token) + 1;
+    vec = malloc(2 * sizeof(char *) + plen + tlen);
+    if (vec) {
+        vec[XS_WATCH_PATH] = (char *)(vec + 2);
+        vec[XS_WATCH_TOKEN] = vec[XS_WATCH_PATH] + plen;
+        memcpy(vec[XS_WATCH_PATH], e->path, plen);
+        memcpy(vec[XS_WATCH_TOKEN], e->token, tlen);
+        if (num)
+            *num = 2;
+    }
+    free(e->path);
+    free(e->token);
+    free(e);
+    return vec;
+}
+
+xs_transaction_t xs_transaction_start(struct xs_handle *h)
+{
+    return 1;
+}
+
+static int transactions_to_fail, transactions_ended;
+
+int fake_xs_fail_transactions(int n)
+{
+    int ended;
+
+    pthread_mutex_lock(&fake_lock);
+    transactions_to_fail = n;
+    ended = transactions_ended;
+    pthread_mutex_unlock(&fake_lock);
+    return ended;
+}
+
+bool xs_transaction_end(struct xs_handle *h, xs_transaction_t t, bool abort)
+{
+    bool ok = true;
+
+    pthread_mutex_lock(&fake_lock);
+    transactions_ended++;
+    if (!abort && transactions_to_fail > 0) {
+        transactions_to_fail--;
+        ok = false;
+    }
+    pthread_mutex_unlock(&fake_lock);
+    if (!ok)
+        errno = EAGAIN;
+    return ok;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,239 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+/* Restore clones from one image with a stand-in for libxc's restore,
+   which reads a length-prefixed stream and checksums it; then share the
+   memory of clones in the simulated libxc (fake_xenctrl.c). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "xenguest_fanout.h"
+#include "fake_xen.h"
+
+#define STREAM_BYTES (3 * FANOUT_BUFFER_SIZE + 12345)
+#define TAIL "QEMU-RECORD"
+#define FAILING_DOMID 13
+#define SHARE_DOMID 20
+#define DIFFERENT_GFN 5
+#define GENID_GFN 7
+
+static int failures;
+
+#define check(cond, what) do {                              \
+        if (cond) printf("ok: %s\n", what);                 \
+        else { printf("FAIL: %s\n", what); failures++; }   \
+    } while (0)
+
+static int read_exact(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    ssize_t n;
+
+    while (len) {
+        n = read(fd, p, len);
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static unsigned long checksum(const uint8_t *p, size_t len)
+{
+    unsigned long sum = 0;
+
+    while (len--)
+        sum = sum * 31 + *p++;
+    return sum;
+}
+
+/* Read exactly the stream, as libxc does */
+static int fake_restore(int fd, struct fanout_clone *c, void *data)
+{
+    uint8_t *buf;
+    uint64_t len;
+
+    (void)data;
+    if (read_exact(fd, &len, sizeof(len)) || len != STREAM_BYTES)
+        return -1;
+    buf = malloc(len);
+    if (buf == NULL)
+        return -1;
+    if (c->domid == FAILING_DOMID) {
+        read_exact(fd, buf, len / 2);
+        free(buf);
+        errno = EIO;
+        return -1;
+    }
+    if (read_exact(fd, buf, len)) {
+        free(buf);
+        return -1;
+    }
+    c->store_mfn = checksum(buf, len);
+    c->console_mfn = c->domid + c->console_evtchn;
+    free(buf);
+    return 0;
+}
+
+/* Clone SHARE_DOMID's memory into the next two domains, but for one page
+   of the first of them */
+static int make_clones(xc_interface *xch, unsigned long nr)
+{
+    xen_pfn_t gfn;
+    uint8_t *page;
+    unsigned int i;
+    int err;
+
+    for (gfn = 0; gfn < nr; gfn++) {
+        page = xc_map_foreign_bulk(xch, SHARE_DOMID, PROT_READ, &gfn, &err, 1);
+        if (page == NULL || err)
+            return -1;
+        for (i = 1; i < 3; i++)
+            if (fake_dom_write_page(SHARE_DOMID + i, gfn, page))
+                return -1;
+        if (gfn == DIFFERENT_GFN) {
+            page[0] ^= 0xff;
+            fake_dom_write_page(SHARE_DOMID + 1, gfn, page);
+        }
+        munmap(page, XC_PAGE_SIZE);
+    }
+    return 0;
+}
+
+static void test_share(void)
+{
+    xc_interface *xch = xc_interface_open(NULL, NULL, 0);
+    struct fanout_clone clones[4];
+    unsigned long nr;
+    uint8_t *src, *page;
+    xen_pfn_t gfn = DIFFERENT_GFN;
+    unsigned int i;
+    int err;
+    long n;
+
+    setenv("FAKE_XC_MEM_MIB", "1", 1);
+    nr = xc_domain_maximum_gpfn(xch, SHARE_DOMID) + 1;
+    if (xch == NULL || make_clones(xch, nr)) {
+        check(0, "clones made");
+        return;
+    }
+    memset(clones, 0, sizeof(clones));
+    for (i = 0; i < 4; i++) {
+        clones[i].domid = SHARE_DOMID + i;
+        clones[i].genid_addr = GENID_GFN * XC_PAGE_SIZE + 16;
+    }
+    clones[3].error = EIO;
+
+    n = fanout_share(xch, clones, 4);
+    check(n == (long)(nr - 2 + nr - 1),
+          "every page in common but the generation ID shared");
+    check(fake_dom_page_shared(SHARE_DOMID + 1, 0) &&
+          fake_dom_page_shared(SHARE_DOMID + 2, DIFFERENT_GFN),
+          "identical pages shared");
+    check(!fake_dom_page_shared(SHARE_DOMID + 1, DIFFERENT_GFN),
+          "a page which differs stays private");
+    src = xc_map_foreign_bulk(xch, SHARE_DOMID, PROT_READ, &gfn, &err, 1);
+    page = xc_map_foreign_bulk(xch, SHARE_DOMID + 1, PROT_READ, &gfn, &err, 1);
+    check(src && page && memcmp(src, page, XC_PAGE_SIZE),
+          "and keeps its own contents");
+    if (src)
+        munmap(src, XC_PAGE_SIZE);
+    if (page)
+        munmap(page, XC_PAGE_SIZE);
+    check(!fake_dom_page_shared(SHARE_DOMID, GENID_GFN) &&
+          !fake_dom_page_shared(SHARE_DOMID + 1, GENID_GFN) &&
+          !fake_dom_page_shared(SHARE_DOMID + 2, GENID_GFN),
+          "the generation ID pages stay private");
+    check(!fake_dom_page_shared(SHARE_DOMID + 3, 0),
+          "a clone which failed is left alone");
+    xc_interface_close(xch);
+}
+
+int main(void)
+{
+    struct fanout_ops ops = { fake_restore, NULL };
+    struct fanout_clone clones[4];
+    char path[] = "/tmp/fanout_testXXXXXX", tail[sizeof(TAIL)];
+    uint8_t *stream = malloc(STREAM_BYTES);
+    uint64_t len = STREAM_BYTES;
+    unsigned long sum;
+    unsigned int i;
+    int fd = mkstemp(path), n, ok, p[2];
+
+    if (fd < 0 || stream == NULL)
+        return 1;
+    unlink(path);
+    srand(1);
+    for (i = 0; i < STREAM_BYTES; i++)
+        stream[i] = rand();
+    sum = checksum(stream, STREAM_BYTES);
+    /* Something before the stream too, as xenops writes its signature */
+    if (write(fd, "SIG", 3) != 3 ||
+        write(fd, &len, sizeof(len)) != sizeof(len) ||
+        write(fd, stream, STREAM_BYTES) != STREAM_BYTES ||
+        write(fd, TAIL, sizeof(TAIL)) != sizeof(TAIL))
+        return 1;
+    lseek(fd, 3, SEEK_SET);
+
+    memset(clones, 0, sizeof(clones));
+    for (i = 0; i < 4; i++) {
+        clones[i].domid = 10 + i;
+        clones[i].console_evtchn = 100 * i;
+    }
+    clones[3].domid = FAILING_DOMID;
+
+    n = fanout_restore(fd, clones, 4, &ops);
+    check(n == 3, "three clones restored");
+    for (i = 0, ok = 1; i < 3; i++)
+        ok = ok && clones[i].error == 0 && clones[i].store_mfn == sum &&
+            clones[i].console_mfn == clones[i].domid + 100 * i;
+    check(ok, "each clone saw the whole stream");
+    check(clones[3].error == EIO, "the failure is the clone's own");
+    check(read(fd, tail, sizeof(tail)) == sizeof(tail) &&
+          !memcmp(tail, TAIL, sizeof(TAIL)),
+          "the image is left at the end of the stream");
+
+    lseek(fd, 3, SEEK_SET);
+    clones[0].domid = FAILING_DOMID;
+    check(fanout_restore(fd, clones, 1, &ops) == 0 && clones[0].error == EIO,
+          "no clone restored");
+    if (pipe(p))
+        return 1;
+    check(fanout_restore(p[0], clones, 1, &ops) == -1 && errno == ENOTSUP,
+          "a stream which is not a file is refused");
+    close(p[0]);
+    close(p[1]);
+
+    close(fd);
+    free(stream);
+
+    test_share();
+    return failures ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
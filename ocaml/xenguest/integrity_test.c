@@ -0,0 +1,221 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+/* CRC32C against a bit-at-a-time reference, and a stream framed by the
+   pump and checked on the way back, intact and corrupted; and the pump
+   giving up on a destination which has gone away. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "xenguest_integrity.h"
+#include "xenguest_pump.h"
+
+static int failures;
+
+#define check(cond, what) do {                              \
+        if (cond) printf("ok: %s\n", what);                 \
+        else { printf("FAIL: %s\n", what); failures++; }   \
+    } while (0)
+
+#define STREAM_LEN (3 * 1024 * 1024 + 4321)
+#define TRAILER "QEMU record"
+
+static uint32_t crc32c_ref(const uint8_t *p, size_t len)
+{
+    uint32_t crc = ~0U;
+    int k;
+
+    while (len--) {
+        crc ^= *p++;
+        for (k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+    }
+    return ~crc;
+}
+
+static void test_crc(void)
+{
+    static const size_t lens[] = { 0, 1, 7, 8, 9, 767, 768, 769, 24575,
+                                   24576, 24577, 100003 };
+    uint8_t *buf = malloc(100003 + 8);
+    unsigned int i, off, ok = 1;
+    uint32_t crc;
+
+    for (i = 0; i < 100003 + 8; i++)
+        buf[i] = rand();
+    check(crc32c(0, "123456789", 9) == 0xe3069283, "check value");
+    for (off = 0; off < 8; off++)
+        for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++)
+            ok &= crc32c(0, buf + off, lens[i]) ==
+                crc32c_ref(buf + off, lens[i]);
+    check(ok, crc32c_hw() ? "sse4.2 matches the reference"
+          : "table matches the reference");
+    crc = crc32c(0, buf, 50000);
+    check(crc32c(crc, buf + 50000, 50003) == crc32c(0, buf, 100003),
+          "continued");
+    free(buf);
+}
+
+static void test_header(void)
+{
+    static const unsigned char wire[INTEGRITY_HEADER_SIZE] =
+        { 0x04, 0x03, 0x02, 0x01, 0xd4, 0xc3, 0xb2, 0xa1 };
+    struct integrity_header h = { 0x01020304, 0xa1b2c3d4 }, back;
+    unsigned char buf[INTEGRITY_HEADER_SIZE];
+
+    integrity_header_put(buf, &h);
+    check(!memcmp(buf, wire, sizeof(wire)), "header is little-endian");
+    integrity_header_get(wire, &back);
+    check(back.len == h.len && back.crc == h.crc, "header read back");
+}
+
+/* The stream framed by the pump into a file, followed by a trailer */
+static FILE *framed(const uint8_t *data)
+{
+    struct pump_limits limits = { 0, 0 };
+    struct pump *p;
+    FILE *f = tmpfile();
+    int in_fd;
+
+    p = pump_start(fileno(f), &limits, -1, 1, &in_fd);
+    if (p == NULL || write(in_fd, data, STREAM_LEN) != STREAM_LEN ||
+        pump_finish(p))
+        return NULL;
+    if (write(fileno(f), TRAILER, sizeof(TRAILER)) != sizeof(TRAILER))
+        return NULL;
+    lseek(fileno(f), 0, SEEK_SET);
+    return f;
+}
+
+/* Read the stream back through the checker into out. Returns what
+   integrity_reader_finish returned. */
+static int unframe(FILE *f, uint8_t *out, size_t *len, char *why,
+                   size_t why_len)
+{
+    struct integrity_reader *r;
+    ssize_t n;
+    int fd;
+
+    *len = 0;
+    r = integrity_reader_start(fileno(f), &fd);
+    if (r == NULL)
+        return -2;
+    while ((n = read(fd, out + *len, STREAM_LEN - *len)) > 0)
+        *len += n;
+    return integrity_reader_finish(r, 0, why, why_len);
+}
+
+static void test_stream(void)
+{
+    uint8_t *data = malloc(STREAM_LEN), *out = malloc(STREAM_LEN);
+    char why[160], trailer[sizeof(TRAILER)];
+    size_t i, len;
+    uint8_t byte;
+    FILE *f;
+    int rc;
+
+    for (i = 0; i < STREAM_LEN; i++)
+        data[i] = rand() % 3 ? rand() : 0;
+    f = framed(data);
+    check(f != NULL, "framed");
+    if (f == NULL)
+        return;
+    check(integrity_is_stream(fileno(f)), "recognised");
+
+    rc = unframe(f, out, &len, why, sizeof(why));
+    check(rc == 0 && len == STREAM_LEN && !memcmp(data, out, len), "intact");
+    check(read(fileno(f), trailer, sizeof(trailer)) == sizeof(trailer) &&
+          !memcmp(trailer, TRAILER, sizeof(trailer)),
+          "the stream ends where it was cut");
+
+    /* One bit flipped well into the stream */
+    if (pread(fileno(f), &byte, 1, 2000000) != 1)
+        return;
+    byte ^= 0x10;
+    if (pwrite(fileno(f), &byte, 1, 2000000) != 1)
+        return;
+    lseek(fileno(f), 0, SEEK_SET);
+    rc = unframe(f, out, &len, why, sizeof(why));
+    printf("%s\n", why);
+    check(rc == -1 && errno == EBADMSG && strstr(why, "corrupt"),
+          "corruption detected");
+    check(len < 2000000 && !memcmp(data, out, len),
+          "nothing from the corrupt chunk on");
+
+    /* Cut short: no end marker */
+    if (ftruncate(fileno(f), 1000000))
+        return;
+    lseek(fileno(f), 0, SEEK_SET);
+    rc = unframe(f, out, &len, why, sizeof(why));
+    printf("%s\n", why);
+    check(rc == -1 && strstr(why, "truncated"), "truncation detected");
+
+    lseek(fileno(f), 8, SEEK_SET);
+    check(!integrity_is_stream(fileno(f)), "not a stream elsewhere");
+    fclose(f);
+    free(data);
+    free(out);
+}
+
+/* The writer sees EPIPE soon after the destination goes away, rather
+   than once it has written everything */
+static void test_dead_destination(void)
+{
+    struct pump_limits limits = { 0, 0 };
+    static char chunk[64 * 1024];
+    struct pump *p;
+    size_t written = 0;
+    int out[2], in_fd, err = 0;
+
+    if (pipe(out))
+        return;
+    close(out[0]);
+    p = pump_start(out[1], &limits, -1, 1, &in_fd);
+    check(p != NULL, "pump started");
+    if (p == NULL)
+        return;
+    while (written < 256 * sizeof(chunk)) {
+        if (write(in_fd, chunk, sizeof(chunk)) == -1) {
+            err = errno;
+            break;
+        }
+        written += sizeof(chunk);
+    }
+    check(err == EPIPE && written < 256 * sizeof(chunk),
+          "the writer is stopped by EPIPE");
+    check(pump_finish(p) == -1 && errno == EPIPE, "the pump reports it");
+    close(out[1]);
+}
+
+int main(void)
+{
+    test_crc();
+    test_header();
+    test_stream();
+    test_dead_destination();
+    return failures ? 1 : 0;
+}
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
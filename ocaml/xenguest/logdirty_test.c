@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+/* Exercise the log-dirty handshake against a fake device model which
+   answers over the in-process xenstore stand-in (fake_xenstore.c). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include <xenstore.h>
+
+#include "xenguest_logdirty.h"
+
+#define DOMID 7
+#define CMD_PATH "/local/domain/0/device-model/7/logdirty/cmd"
+#define RET_PATH "/local/domain/0/device-model/7/logdirty/ret"
+
+static int failures;
+
+#define check(cond, what) do {                              \
+        if (cond) printf("ok: %s\n", what);                 \
+        else { printf("FAIL: %s\n", what); failures++; }   \
+    } while (0)
+
+/* Behaves like qemu: acknowledges each command by copying it to ret */
+static void *fake_device_model(void *arg)
+{
+    int replies = *(int *)arg;
+    struct xs_handle *xsh = xs_daemon_open();
+    unsigned int len;
+    char **vec, *cmd;
+
+    xs_watch(xsh, CMD_PATH, "dm");
+    while (replies > 0 && (vec = xs_read_watch(xsh, NULL))) {
+        free(vec);
+        cmd = xs_read(xsh, XBT_NULL, CMD_PATH, &len);
+        if (cmd == NULL)
+            continue;
+        xs_write(xsh, XBT_NULL, RET_PATH, cmd, len);
+        free(cmd);
+        replies--;
+    }
+    xs_daemon_close(xsh);
+    return NULL;
+}
+
+int main(void)
+{
+    struct logdirty_ctl *ctl;
+    pthread_t dm;
+    uint64_t elapsed_us;
+    int replies = 2, r;
+
+    pthread_create(&dm, NULL, fake_device_model, &replies);
+
+    ctl = logdirty_open(DOMID, 1000);
+    check(ctl != NULL, "logdirty_open");
+    if (ctl == NULL)
+        return 1;
+
+    r = logdirty_switch(ctl, 1, &elapsed_us);
+    check(r == 0, "enable acknowledged");
+    printf("enable took %" PRIu64 "us\n", elapsed_us);
+
+    r = logdirty_switch(ctl, 0, &elapsed_us);
+    check(r == 0, "disable acknowledged");
+    printf("disable took %" PRIu64 "us\n", elapsed_us);
+
+    pthread_join(dm, NULL);
+
+    /* With nobody answering, a stale ret must not count as an ack */
+    logdirty_close(ctl);
+    ctl = logdirty_open(DOMID, 100);
+    r = logdirty_switch(ctl, 0, &elapsed_us);
+    check(r == -1 && errno == ETIMEDOUT, "unanswered disable times out");
+    logdirty_close(ctl);
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+/* Turning a restored guest's zero pages back into PoD entries, against
+   the simulated libxc (fake_xenctrl.c). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <xenctrl.h>
+#include <xen/hvm/params.h>
+
+#include "xenguest_pod.h"
+
+static int failures;
+
+#define check(cond, what) do {                              \
+        if (cond) printf("ok: %s\n", what);                 \
+        else { printf("FAIL: %s\n", what); failures++; }   \
+    } while (0)
+
+#define DOMID 1
+
+/* The number of zero pages of the guest, the first of them and a hash of
+   its contents */
+static uint64_t scan(xc_interface *xch, unsigned long nr, unsigned long *first,
+                     uint64_t *hash)
+{
+    xen_pfn_t *pfns = calloc(nr, sizeof(*pfns));
+    int *err = calloc(nr, sizeof(*err));
+    const uint64_t *w;
+    uint64_t zero = 0;
+    unsigned long i, j;
+    uint8_t *p;
+    int nonzero;
+
+    for (i = 0; i < nr; i++)
+        pfns[i] = i;
+    p = xc_map_foreign_bulk(xch, DOMID, PROT_READ, pfns, err, nr);
+    *hash = 1469598103934665603ULL;
+    *first = nr;
+    for (i = 0; p && i < nr; i++) {
+        w = (const uint64_t *)(p + i * XC_PAGE_SIZE);
+        nonzero = 0;
+        for (j = 0; j < XC_PAGE_SIZE / sizeof(*w); j++) {
+            *hash = (*hash ^ w[j]) * 1099511628211ULL;
+            nonzero |= w[j] != 0;
+        }
+        if (!nonzero && zero++ == 0)
+            *first = i;
+    }
+    if (p)
+        munmap(p, nr * XC_PAGE_SIZE);
+    free(pfns);
+    free(err);
+    return zero;
+}
+
+int main(void)
+{
+    xc_interface *xch = xc_interface_open(NULL, NULL, 0);
+    struct pod_stats st;
+    unsigned long nr, first, special;
+    uint64_t zero, target, hash, hash2;
+    int rc;
+
+    if (xch == NULL)
+        return 1;
+    setenv("FAKE_XC_MEM_MIB", "64", 1);
+    setenv("FAKE_XC_ZERO_PERCENT", "40", 1);
+    nr = xc_domain_maximum_gpfn(xch, DOMID) + 1;
+    /* No special pages until the last check */
+    xc_set_hvm_param(xch, DOMID, HVM_PARAM_STORE_PFN, 0);
+    xc_set_hvm_param(xch, DOMID, HVM_PARAM_CONSOLE_PFN, 0);
+    xc_set_hvm_param(xch, DOMID, HVM_PARAM_PAGING_RING_PFN, 0);
+    zero = scan(xch, nr, &first, &hash);
+    check(nr == 16384 && zero > 0, "a guest with zero pages");
+    target = nr - zero / 2;
+
+    rc = pod_restore_sparse(xch, DOMID, target, &st);
+    check(rc == 0, "restored sparse");
+    check(st.gfns == nr && st.unpopulated == 0, "every gfn scanned");
+    check(st.reclaimed == zero && st.populated == nr - zero,
+          "every zero page returned to PoD");
+    check(st.pod_entries == zero && st.tot_pages == target,
+          "PoD entries and target");
+    scan(xch, nr, &first, &hash2);
+    check(hash == hash2, "the guest sees the same memory");
+
+    rc = pod_save_stats(xch, DOMID, &st);
+    check(rc == 0 && st.populated == nr - zero && st.pod_entries == zero &&
+          st.unpopulated == 0, "save accounts for populated and PoD pages");
+
+    rc = pod_restore_sparse(xch, DOMID, target, &st);
+    check(rc == 0 && st.reclaimed == zero && st.pod_entries == zero,
+          "a second pass finds the same entries");
+
+    special = first;
+    xc_set_hvm_param(xch, DOMID, HVM_PARAM_STORE_PFN, special);
+    rc = pod_restore_sparse(xch, DOMID, target, &st);
+    check(rc == 0 && st.reclaimed == zero - 1 && st.pod_entries == zero - 1,
+          "the xenstore page stays populated");
+
+    xc_interface_close(xch);
+    return failures ? 1 : 0;
+}
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
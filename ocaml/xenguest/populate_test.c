@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+/* Populate guest memory in parallel against the simulated libxc
+   (fake_xenctrl.c), with and without superpages. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include <xenctrl.h>
+
+#include "xenguest_populate.h"
+
+static int failures;
+
+#define check(cond, what) do {                              \
+        if (cond) printf("ok: %s\n", what);                 \
+        else { printf("FAIL: %s\n", what); failures++; }   \
+    } while (0)
+
+/* 3GiB, 3 x 2MiB and 5 pages above 1GiB, so that every extent size is
+   needed and the last chunk is partial */
+#define BASE_PFN POPULATE_CHUNK_PAGES
+#define NR_PFNS (3 * POPULATE_CHUNK_PAGES + 3 * 512 + 5)
+
+static void run(xc_interface *xch, uint32_t domid, const char *max_order,
+                uint64_t want_1g, uint64_t want_2m, uint64_t want_4k)
+{
+    struct populate_stats st;
+    char what[128];
+    int rc;
+
+    setenv("FAKE_XC_MAX_ORDER", max_order, 1);
+    rc = populate_parallel(xch, domid, BASE_PFN, NR_PFNS, 4, &st);
+    printf("\n");
+    snprintf(what, sizeof(what), "max order %s: populated", max_order);
+    check(rc == 0, what);
+    snprintf(what, sizeof(what), "max order %s: every chunk", max_order);
+    check(st.chunks == 4 && st.threads == 4 && st.nodes == 2, what);
+    snprintf(what, sizeof(what), "max order %s: extents %"PRIu64"/%"PRIu64
+             "/%"PRIu64, max_order, st.extents_1g, st.extents_2m, st.pages_4k);
+    check(st.extents_1g == want_1g && st.extents_2m == want_2m &&
+          st.pages_4k == want_4k, what);
+    snprintf(what, sizeof(what), "max order %s: top of memory", max_order);
+    check(xc_domain_maximum_gpfn(xch, domid) == BASE_PFN + NR_PFNS - 1, what);
+}
+
+int main(void)
+{
+    xc_interface *xch = xc_interface_open(NULL, NULL, 0);
+
+    if (xch == NULL)
+        return 1;
+    setenv("FAKE_XC_NODES", "2", 1);
+    run(xch, 1, "18", 3, 3, 5);
+    run(xch, 2, "9", 0, 3 * 512 + 3, 5);
+    run(xch, 3, "0", 0, 0, NR_PFNS);
+    xc_interface_close(xch);
+    return failures ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+/* Loopback test of post-copy migration against the simulated libxc
+   (fake_xenctrl.c): a domain is sent over a socketpair and the
+   destination is unpaused as soon as the restore allows it, with a
+   simulated vCPU faulting on the pages which have not arrived yet. The
+   caller's own record (qemu's state, in xenops) must come through at
+   the transition, and the destination must end up with exactly the
+   source's memory and context. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include <xenctrl.h>
+#include <xen/hvm/params.h>
+
+#include "xenguest_postcopy.h"
+
+#define SOURCE 1
+#define DEST 2
+#define MEM_MIB "32"
+#define SAMPLE_MS 50
+#define RECORD "qemu-state"
+
+static int failures;
+
+#define check(cond, what) do {                              \
+        if (cond) printf("ok: %s\n", what);                 \
+        else { printf("FAIL: %s\n", what); failures++; }   \
+    } while (0)
+
+static xc_interface *xch;
+static int sv[2];
+static size_t mem_size;
+
+static int record_ok, missing_at_start;
+static unsigned long store_mfn, console_mfn;
+
+static int suspend_cb(void *data)
+{
+    return xc_domain_pause(xch, SOURCE) == 0;
+}
+
+static int save_transition(void *data)
+{
+    return write(sv[0], RECORD, strlen(RECORD)) == strlen(RECORD) ? 0 : -1;
+}
+
+/* Read the caller's record, count what is still missing and start the
+   guest */
+static int restore_transition(unsigned long store, unsigned long console,
+                              void *data)
+{
+    char buf[sizeof(RECORD) - 1];
+    unsigned long nr = mem_size / XC_PAGE_SIZE, i;
+    xen_pfn_t *pfns = malloc(nr * sizeof(*pfns));
+    int *err = malloc(nr * sizeof(*err));
+    void *mem;
+
+    record_ok = read(sv[1], buf, sizeof(buf)) == sizeof(buf) &&
+        !memcmp(buf, RECORD, sizeof(buf));
+    for (i = 0; i < nr; i++)
+        pfns[i] = i;
+    mem = xc_map_foreign_bulk(xch, DEST, PROT_READ, pfns, err, nr);
+    for (i = 0; mem && i < nr; i++)
+        if (err[i] == -ENOENT)
+            missing_at_start++;
+    if (mem)
+        munmap(mem, nr * XC_PAGE_SIZE);
+    free(pfns);
+    free(err);
+    printf("\n");
+    return xc_domain_unpause(xch, DEST);
+}
+
+static void *dest(void *arg)
+{
+    struct postcopy_restore_ops ops = { restore_transition, NULL };
+    int *r = arg;
+
+    *r = postcopy_restore(xch, sv[1], DEST, 1, &store_mfn, &console_mfn,
+                          &ops);
+    printf("\n");
+    return NULL;
+}
+
+int main(void)
+{
+    struct postcopy_save_ops ops = { suspend_cb, save_transition, NULL };
+    pthread_t dest_thread;
+    unsigned long ring_pfn, pfn;
+    int save_r, restore_r = -1, ctx_len, same = 1;
+    uint8_t *ctx_s, *ctx_d, *src, *dst;
+
+    signal(SIGPIPE, SIG_IGN);
+    setenv("FAKE_XC_MEM_MIB", MEM_MIB, 1);
+    setenv("FAKE_XC_DIRTY_RATE", "20000", 1);
+    setenv("FAKE_XC_WSS_MIB", "4", 1);
+    mem_size = (size_t)atoi(MEM_MIB) << 20;
+
+    xch = xc_interface_open(NULL, NULL, 0);
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) || xch == NULL)
+        return 1;
+    xc_get_hvm_param(xch, SOURCE, HVM_PARAM_PAGING_RING_PFN, &ring_pfn);
+
+    pthread_create(&dest_thread, NULL, dest, &restore_r);
+    save_r = postcopy_save(xch, sv[0], SOURCE, SAMPLE_MS, &ops);
+    printf("\n");
+    pthread_join(dest_thread, NULL);
+    xc_domain_pause(xch, DEST);
+    printf("\n");
+
+    check(save_r == 0, "the source completes");
+    check(restore_r == 0, "the destination completes");
+    check(record_ok, "the caller's record comes through at the transition");
+    check(missing_at_start > 0, "the guest starts with pages missing");
+    check(store_mfn == mem_size / XC_PAGE_SIZE - 2 &&
+          console_mfn == mem_size / XC_PAGE_SIZE - 1,
+          "store and console pages are reported");
+
+    ctx_len = xc_domain_hvm_getcontext(xch, SOURCE, NULL, 0);
+    ctx_s = malloc(ctx_len);
+    ctx_d = malloc(ctx_len);
+    check(xc_domain_hvm_getcontext(xch, SOURCE, ctx_s, ctx_len) == ctx_len &&
+          xc_domain_hvm_getcontext(xch, DEST, ctx_d, ctx_len) == ctx_len &&
+          memcmp(ctx_s, ctx_d, ctx_len) == 0, "the context is restored");
+
+    /* The ring page is removed from the destination guest */
+    src = xc_map_foreign_range(xch, SOURCE, mem_size, PROT_READ, 0);
+    dst = xc_map_foreign_range(xch, DEST, mem_size, PROT_READ, 0);
+    for (pfn = 0; src && dst && pfn < mem_size / XC_PAGE_SIZE; pfn++)
+        if (pfn != ring_pfn && memcmp(src + pfn * XC_PAGE_SIZE,
+                                      dst + pfn * XC_PAGE_SIZE, XC_PAGE_SIZE))
+            same = 0;
+    check(src && dst && same, "the destination has the source's memory");
+    return failures ? 1 : 0;
+}
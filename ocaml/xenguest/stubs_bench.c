@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+/* Micro-benchmark of the xenstore helpers, the loading of a domain's
+   build parameters and the parsing of vCPU affinities, against the
+   in-process xenstore and the simulated libxc (fake_xenstore.c,
+   fake_xenctrl.c). See bench.h. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <xenctrl.h>
+
+#include "xenguest_flags.h"
+#include "bench.h"
+
+#define DOMID 1
+#define VCPUS 8
+#define PCPUS 256
+
+static xc_interface *xch;
+static char mask[PCPUS + 1];
+
+static int xenstore_read(void *arg)
+{
+    char *s = xenstore_gets(DOMID, "platform/vcpu/number");
+    int r = s == NULL;
+
+    (void)arg;
+    free(s);
+    return r;
+}
+
+static int xenstore_write(void *arg)
+{
+    (void)arg;
+    return xenstore_puts(DOMID, "1", "data/updated");
+}
+
+static int load_flags(void *arg)
+{
+    struct flags f;
+    int r;
+
+    (void)arg;
+    get_flags(&f, DOMID);
+    r = f.vcpus != VCPUS || f.vcpu_affinity[VCPUS - 1] == NULL;
+    free_flags(&f);
+    return r;
+}
+
+static int parse_affinity(void *arg)
+{
+    xc_cpumap_t map = cpumap_of_string(xch, mask);
+    int r = map == NULL || !(map[PCPUS / 8 - 1] & 0x80);
+
+    (void)arg;
+    free(map);
+    return r;
+}
+
+int main(void)
+{
+    char n[16];
+    int i, failures = 0;
+
+    /* get_flags logs every value, for the helper to capture */
+    if (freopen("/dev/null", "w", stdout) == NULL)
+        return 1;
+    snprintf(n, sizeof(n), "%d", PCPUS);
+    setenv("FAKE_XC_PCPUS", n, 1);
+    xch = xc_interface_open(NULL, NULL, 0);
+    if (xch == NULL)
+        return 1;
+
+    /* A typical HVM guest, pinned to alternate pCPUs */
+    for (i = 0; i < PCPUS; i++)
+        mask[i] = i % 2 ? '1' : '0';
+    snprintf(n, sizeof(n), "%d", VCPUS);
+    xenstore_puts(DOMID, n, "platform/vcpu/number");
+    xenstore_puts(DOMID, n, "platform/vcpu/current");
+    for (i = 0; i < VCPUS; i++) {
+        xenstore_puts(DOMID, mask, "platform/vcpu/%d/affinity", i);
+        xenstore_puts(DOMID, mask, "platform/vcpu/%d/soft-affinity", i);
+    }
+    xenstore_puts(DOMID, "256", "platform/vcpu/weight");
+    xenstore_puts(DOMID, "true", "platform/nx");
+    xenstore_puts(DOMID, "true", "platform/viridian");
+    xenstore_puts(DOMID, "true", "platform/apic");
+    xenstore_puts(DOMID, "true", "platform/acpi");
+    xenstore_puts(DOMID, "true", "platform/pae");
+    xenstore_puts(DOMID, "256", "platform/mmio_size_mib");
+
+    failures -= bench_run("xenguest", "xenstore_read", xenstore_read, NULL);
+    failures -= bench_run("xenguest", "xenstore_write", xenstore_write, NULL);
+    failures -= bench_run("xenguest", "get_flags", load_flags, NULL);
+    failures -= bench_run("xenguest", "parse_affinity", parse_affinity, NULL);
+    xc_interface_close(xch);
+    return failures ? 1 : 0;
+}
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
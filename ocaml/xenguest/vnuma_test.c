@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+/* Load virtual NUMA topologies from the in-process xenstore stand-in
+   (fake_xenstore.c) and lay them out in guest memory. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "xenguest_flags.h"
+#include "xenguest_vnuma.h"
+
+#define GIB (1ULL << 30)
+#define MMIO_START (3 * GIB)
+
+static int failures;
+
+#define check(cond, what) do {                              \
+        if (cond) printf("ok: %s\n", what);                 \
+        else { printf("FAIL: %s\n", what); failures++; }   \
+    } while (0)
+
+int main(void)
+{
+    struct vnuma v;
+    struct vnuma_range r[VNUMA_MAX_NODES + 1];
+    int n;
+
+    check(vnuma_load(&v, 1, 4) == 0 && v.nr_nodes == 0,
+          "no keys: no topology");
+    vnuma_free(&v);
+
+    /* Two nodes of 2GiB and 6GiB, defaults for the rest */
+    xenstore_puts(2, "2", "platform/vnuma/nodes");
+    xenstore_puts(2, "2048", "platform/vnuma/0/memory_mib");
+    xenstore_puts(2, "6144", "platform/vnuma/1/memory_mib");
+    xenstore_puts(2, "1", "platform/vnuma/1/pnode");
+    check(vnuma_load(&v, 2, 4) == 0 && v.nr_nodes == 2, "two nodes loaded");
+    check(v.pnode[0] == VNUMA_NO_NODE && v.pnode[1] == 1, "pnodes");
+    check(v.distance[0] == 10 && v.distance[1] == 20 &&
+          v.distance[2] == 20 && v.distance[3] == 10, "default distances");
+    check(v.vcpu_to_vnode[0] == 0 && v.vcpu_to_vnode[1] == 0 &&
+          v.vcpu_to_vnode[2] == 1 && v.vcpu_to_vnode[3] == 1,
+          "vCPUs shared out in order");
+
+    /* Node 1 straddles the MMIO hole */
+    n = vnuma_layout(&v, 8 * GIB, MMIO_START, r);
+    check(n == 3, "three ranges");
+    check(n == 3 &&
+          r[0].start == 0 && r[0].end == 2 * GIB && r[0].node == 0 &&
+          r[1].start == 2 * GIB && r[1].end == MMIO_START && r[1].node == 1 &&
+          r[2].start == 4 * GIB && r[2].end == 9 * GIB && r[2].node == 1,
+          "node 1 split around the MMIO hole");
+    check(vnuma_layout(&v, 4 * GIB, MMIO_START, r) == -1,
+          "memory which does not add up");
+    vnuma_free(&v);
+
+    /* Explicit distances and vCPUs */
+    xenstore_puts(2, "10 30", "platform/vnuma/0/distances");
+    xenstore_puts(2, "30 10", "platform/vnuma/1/distances");
+    xenstore_puts(2, "1 0 1 0", "platform/vnuma/vcpus");
+    check(vnuma_load(&v, 2, 4) == 0 && v.distance[1] == 30 &&
+          v.vcpu_to_vnode[0] == 1 && v.vcpu_to_vnode[1] == 0,
+          "explicit distances and vCPUs");
+    vnuma_free(&v);
+
+    /* Inconsistent keys */
+    xenstore_puts(2, "1 0 2 0", "platform/vnuma/vcpus");
+    check(vnuma_load(&v, 2, 4) == -1 && v.nr_nodes == 0,
+          "vCPU on a node which does not exist");
+    printf("  (%s)\n", v.error);
+    vnuma_free(&v);
+    xenstore_puts(2, "1 0 1", "platform/vnuma/vcpus");
+    check(vnuma_load(&v, 2, 4) == -1, "too few vCPUs");
+    vnuma_free(&v);
+    xenstore_puts(2, "1 0 1 0", "platform/vnuma/vcpus");
+    xenstore_puts(2, "10", "platform/vnuma/1/distances");
+    check(vnuma_load(&v, 2, 4) == -1, "too few distances");
+    vnuma_free(&v);
+    xenstore_puts(2, "30 10", "platform/vnuma/1/distances");
+    xenstore_puts(2, "0", "platform/vnuma/1/memory_mib");
+    check(vnuma_load(&v, 2, 4) == -1, "node without memory");
+    vnuma_free(&v);
+
+    return failures ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
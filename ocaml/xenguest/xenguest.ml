@@ -11,7 +11,13 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  * GNU Lesser General Public License for more details.
  *)
-type suspend_flags = Debug | Live
+type suspend_flags =
+	| Debug
+	| Live
+	| Delta (** send the pages of each checkpoint as deltas against the
+	            version sent before, from a bounded cache: libxc 4.2 only
+	            does this for checkpoints (see set_checkpoint), and ignores
+	            it in an ordinary save *)
 
 type handle
 type domid = int
@@ -22,6 +28,46 @@ external init : unit -> handle = "stub_xenguest_init"
 (** close a xenguest handle *)
 external close : handle -> unit = "stub_xenguest_close"
 
+(** route the save suspend callback through a pair of pipes: the domid is
+    written (as 4 bytes, most significant first) to the first and a single
+    byte (1 = suspended) is read back from the second *)
+external set_suspend_fds : Unix.file_descr -> Unix.file_descr -> unit
+       = "stub_xenguest_set_suspend_fds"
+
+(** make a live domain_save measure, every second, the predicted downtime
+    against a budget in milliseconds (0 to stop measuring) and, if the
+    flag is set, throttle the guest's vCPUs while it dirties memory faster
+    than it is sent. libxc still stops the guest within max_iters and
+    max_factors. Each measurement is printed, as Xenguest_protocol's
+    Convergence. *)
+external set_convergence_policy : int -> bool -> unit
+       = "stub_xenguest_set_convergence_policy"
+
+(** limit domain_save to the given bytes/s for this stream and for all
+    rate-limited streams on the host (shared equally; 0 for no limit).
+    New per-stream limits can be written to the file descriptor as
+    decimal numbers, one per line, while the save runs *)
+external set_rate_limit : int -> int -> Unix.file_descr -> unit
+       = "stub_xenguest_set_rate_limit"
+
+(** make domain_save replicate the domain continuously: after the first
+    full image, resume the guest and send the memory it has dirtied every
+    given number of milliseconds, for the given number of epochs (0 for
+    as long as the stream lasts). 0 ms switches back to a one-off save *)
+external set_checkpoint : int -> int -> unit = "stub_xenguest_set_checkpoint"
+
+(** make domain_save of an HVM guest post-copy: sample its working set for
+    the given number of milliseconds, suspend it and send the working set,
+    then the rest of its memory while it runs at the destination. Needs
+    the suspend fast path and a socket. domain_restore recognises such a
+    stream and calls the "postcopy_callback" once the guest can start *)
+external set_postcopy : int -> unit = "stub_xenguest_set_postcopy"
+
+(** make domain_save send a CRC32C with every chunk of the stream, which
+    domain_restore checks before the data reaches libxc: a corrupt stream
+    fails the restore, saying where, rather than corrupting the guest *)
+external set_integrity : bool -> unit = "stub_xenguest_set_integrity"
+
 (** build a linux domain *)
 external linux_build : handle -> domid -> int -> int -> string ->
                        string option -> string -> string -> int ->
@@ -37,12 +83,25 @@ external hvm_build : handle -> domid -> int -> int -> string -> int -> int -> in
 external domain_resume_slow : handle -> domid -> unit
                             = "stub_xc_domain_resume_slow"
 
-(** restore a domain *)
+(** restore a domain. A non-zero target (MiB) gives an HVM guest its
+    populate-on-demand entries back in place of its zero pages *)
 external domain_restore : handle -> Unix.file_descr -> domid
-                       -> int -> int -> int -> int -> bool -> bool
+                       -> int -> int -> int -> int -> bool -> bool -> int
                        -> nativeint * nativeint
        = "stub_xc_domain_restore_bytecode" "stub_xc_domain_restore"
 
+(** restore several clones of a domain from one suspend image, which is read
+    once: each clone is (domid, store_port, store_domid, console_port,
+    console_domid). For each clone the result is an error message ("" if it
+    was restored), its store mfn and its console mfn. If the last flag is
+    set (HVM, Xen 4.2 and later), the clones share the pages they still have
+    in common *)
+external domain_restore_fanout : handle -> Unix.file_descr
+                              -> (domid * int * int * int * int) array
+                              -> bool -> bool -> bool
+                              -> (string * nativeint * nativeint) array
+       = "stub_xc_domain_restore_fanout_bytecode" "stub_xc_domain_restore_fanout"
+
 (** save a domain *)
 external domain_save : handle -> Unix.file_descr -> domid
                     -> int -> int -> suspend_flags list -> bool
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xenguest_checkpoint.h"
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void checkpoint_init(struct checkpoint *cp, unsigned int interval_ms,
+                     unsigned int max_epochs)
+{
+    memset(cp, 0, sizeof(*cp));
+    cp->interval_ms = interval_ms;
+    cp->max_epochs = max_epochs;
+}
+
+void checkpoint_suspend(struct checkpoint *cp)
+{
+    cp->suspend_us = now_us();
+}
+
+void checkpoint_resumed(struct checkpoint *cp, uint64_t bytes)
+{
+    uint64_t paused_us = now_us() - cp->suspend_us;
+
+    cp->epoch++;
+    printf("checkpoint %u: guest paused %"PRIu64"us, %"PRIu64" bytes",
+           cp->epoch, paused_us, bytes - cp->bytes);
+    cp->bytes = bytes;
+}
+
+int checkpoint_next(struct checkpoint *cp)
+{
+    uint64_t next_us, now;
+
+    if (cp->max_epochs && cp->epoch >= cp->max_epochs)
+        return 0;
+    next_us = cp->suspend_us + (uint64_t)cp->interval_ms * 1000;
+    now = now_us();
+    if (now < next_us)
+        usleep(next_us - now);
+    else
+        printf("checkpoint %u: overran the %ums interval by %"PRIu64"us",
+               cp->epoch, cp->interval_ms, now - next_us);
+    return 1;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
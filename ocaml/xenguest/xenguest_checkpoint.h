@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+#ifndef _XENGUEST_CHECKPOINT_H_
+#define _XENGUEST_CHECKPOINT_H_
+
+#include <stdint.h>
+
+/* Pacing and accounting of continuous checkpoints. In checkpoint mode
+   libxc does not finish after the stop-and-copy round: it calls the
+   postcopy callback (which resumes the guest) and then the checkpoint
+   callback, and as long as that returns a positive value it suspends
+   the guest again and sends the pages dirtied since as a new epoch. */
+struct checkpoint {
+    unsigned int interval_ms;   /* from the start of one epoch to the next */
+    unsigned int max_epochs;    /* 0 to continue until the stream breaks */
+    unsigned int epoch;         /* epochs completed */
+    uint64_t suspend_us;        /* when the current epoch began */
+    uint64_t bytes;             /* stream bytes when the last one ended */
+};
+
+extern void checkpoint_init(struct checkpoint *cp, unsigned int interval_ms,
+                            unsigned int max_epochs);
+
+/* The guest has been asked to suspend for a new epoch */
+extern void checkpoint_suspend(struct checkpoint *cp);
+
+/* The guest is running again; bytes is the total written to the stream
+   so far. Reports the time the guest was paused and the epoch size. */
+extern void checkpoint_resumed(struct checkpoint *cp, uint64_t bytes);
+
+/* Wait for the start of the next epoch. Returns 1 to take it, or 0 once
+   max_epochs have been sent. */
+extern int checkpoint_next(struct checkpoint *cp);
+
+#endif /* _XENGUEST_CHECKPOINT_H_ */
@@ -0,0 +1,253 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+/* Convergence of a live save, watched from outside libxc: see
+   xenguest_converge.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <xenctrl.h>
+
+#include "xenguest_converge.h"
+
+struct converge {
+    xc_interface *xch;          /* our own: the save is using libxc's */
+    uint32_t domid;
+    struct converge_policy policy;
+    uint64_t (*bytes_sent)(void *);
+    void *arg;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int stopping, stopped;
+
+    uint64_t last_us, last_bytes;
+    uint32_t last_dirty;
+    int throttle;               /* % of vCPU time withheld, -1 if we can't */
+    struct xen_domctl_sched_credit saved;  /* the parameters before */
+};
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Withhold another step of the guest's vCPU time */
+static void throttle(struct converge *c)
+{
+    struct xen_domctl_sched_credit sdom;
+    xc_dominfo_t info;
+    unsigned int cap;
+
+    if (c->throttle < 0 || c->throttle >= CONVERGE_THROTTLE_MAX)
+        return;
+    if (c->throttle == 0 &&
+        xc_sched_credit_domain_get(c->xch, c->domid, &c->saved)) {
+        printf("auto-converge: cannot read credit scheduler parameters, "
+               "not throttling: %s", strerror(errno));
+        c->throttle = -1;
+        return;
+    }
+    if (xc_domain_getinfo(c->xch, c->domid, 1, &info) != 1 ||
+        info.domid != c->domid)
+        return;
+    c->throttle = c->throttle ? c->throttle + CONVERGE_THROTTLE_STEP
+                              : CONVERGE_THROTTLE_INITIAL;
+    if (c->throttle > CONVERGE_THROTTLE_MAX)
+        c->throttle = CONVERGE_THROTTLE_MAX;
+    /* cap is a percentage of one pCPU, so scale by the number of vCPUs */
+    cap = (info.max_vcpu_id + 1) * (100 - c->throttle);
+    sdom = c->saved;
+    if (sdom.cap == 0 || cap < sdom.cap)
+        sdom.cap = cap;
+    if (xc_sched_credit_domain_set(c->xch, c->domid, &sdom))
+        printf("auto-converge: failed to set cap %u: %s", cap,
+               strerror(errno));
+}
+
+static void unthrottle(struct converge *c)
+{
+    if (c->throttle <= 0)
+        return;
+    if (xc_sched_credit_domain_set(c->xch, c->domid, &c->saved))
+        printf("auto-converge: failed to restore cap %u: %s",
+               c->saved.cap, strerror(errno));
+    else
+        printf("auto-converge: restored cap %u", c->saved.cap);
+    c->throttle = 0;
+}
+
+static void measure(struct converge *c)
+{
+    xc_shadow_op_stats_t stats;
+    uint64_t now, bytes;
+    double elapsed_s, sent, dirtied;
+    long downtime_ms = -1;
+    uint32_t delta;
+    const char *decision;
+
+    /* Without a bitmap this only reads the statistics, in which
+       dirty_count is the number of pages dirtied since libxc last
+       cleaned the bitmap, at the start of the current round. It fails
+       until libxc has switched log-dirty mode on. */
+    memset(&stats, 0, sizeof(stats));
+    if (xc_shadow_control(c->xch, c->domid, XEN_DOMCTL_SHADOW_OP_PEEK,
+                          NULL, 0, NULL, 0, &stats) < 0)
+        return;
+    now = now_us();
+    bytes = c->bytes_sent(c->arg);
+    elapsed_s = (now - c->last_us) / 1000000.0;
+    if (elapsed_s <= 0)
+        return;
+    /* A lower count than last time was reset by a new round */
+    delta = stats.dirty_count >= c->last_dirty
+        ? stats.dirty_count - c->last_dirty : stats.dirty_count;
+    sent = (bytes - c->last_bytes) / XC_PAGE_SIZE / elapsed_s;
+    dirtied = delta / elapsed_s;
+    c->last_us = now;
+    c->last_bytes = bytes;
+    c->last_dirty = stats.dirty_count;
+
+    if (sent > 0)
+        downtime_ms = stats.dirty_count * 1000.0 / sent;
+    if (sent <= 0)
+        decision = "nothing sent";
+    else if (downtime_ms <= c->policy.downtime_ms)
+        decision = "within budget";
+    else if (dirtied < sent)
+        decision = "converging";
+    else {
+        decision = "not converging";
+        if (c->policy.auto_throttle)
+            throttle(c);
+    }
+    printf("converge: %.0f pages/s sent, %.0f pages/s dirtied, "
+           "downtime %ldms (budget %ums), throttle %d%%: %s", sent, dirtied,
+           downtime_ms, c->policy.downtime_ms,
+           c->throttle > 0 ? c->throttle : 0, decision);
+    /* One measurement per read of our stdout, see xenguest_main.ml */
+    fflush(stdout);
+}
+
+static void *converge_thread(void *arg)
+{
+    struct converge *c = arg;
+    struct timespec until;
+
+    pthread_mutex_lock(&c->lock);
+    while (!c->stopping) {
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += c->policy.interval_ms / 1000;
+        until.tv_nsec += (c->policy.interval_ms % 1000) * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        while (!c->stopping &&
+               pthread_cond_timedwait(&c->cond, &c->lock, &until) != ETIMEDOUT)
+            ;
+        if (c->stopping)
+            break;
+        pthread_mutex_unlock(&c->lock);
+        measure(c);
+        pthread_mutex_lock(&c->lock);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+struct converge *converge_start(uint32_t domid,
+                                const struct converge_policy *policy,
+                                uint64_t (*bytes_sent)(void *), void *arg)
+{
+    xc_shadow_op_stats_t stats;
+    struct converge *c;
+    int saved_errno;
+
+    c = calloc(1, sizeof(*c));
+    if (c == NULL)
+        return NULL;
+    c->xch = xc_interface_open(NULL, NULL, 0);
+    if (c->xch == NULL) {
+        free(c);
+        return NULL;
+    }
+    c->domid = domid;
+    c->policy = *policy;
+    if (c->policy.interval_ms == 0)
+        c->policy.interval_ms = CONVERGE_INTERVAL_MS;
+    c->bytes_sent = bytes_sent;
+    c->arg = arg;
+    c->last_us = now_us();
+    c->last_bytes = bytes_sent(arg);
+    memset(&stats, 0, sizeof(stats));
+    if (xc_shadow_control(c->xch, domid, XEN_DOMCTL_SHADOW_OP_PEEK,
+                          NULL, 0, NULL, 0, &stats) == 0)
+        c->last_dirty = stats.dirty_count;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->cond, NULL);
+
+    errno = pthread_create(&c->thread, NULL, converge_thread, c);
+    if (errno) {
+        saved_errno = errno;
+        xc_interface_close(c->xch);
+        free(c);
+        errno = saved_errno;
+        return NULL;
+    }
+    return c;
+}
+
+void converge_stop(struct converge *c)
+{
+    if (c == NULL || c->stopped)
+        return;
+    pthread_mutex_lock(&c->lock);
+    c->stopping = 1;
+    pthread_cond_signal(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+    pthread_join(c->thread, NULL);
+    c->stopped = 1;
+}
+
+void converge_finish(struct converge *c)
+{
+    if (c == NULL)
+        return;
+    converge_stop(c);
+    unthrottle(c);
+    fflush(stdout);
+    xc_interface_close(c->xch);
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->cond);
+    free(c);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
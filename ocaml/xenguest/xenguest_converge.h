@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+#ifndef _XENGUEST_CONVERGE_H_
+#define _XENGUEST_CONVERGE_H_
+
+#include <stdint.h>
+
+/* Watching a live save converge. libxc 4.2 decides by itself when to
+   stop the guest (after max_iters rounds, max_factors times its memory,
+   or once a round finds few dirty pages) and tells us nothing between
+   rounds, so a thread measures from outside instead: the rate at which
+   the stream is sent (from a byte counter, e.g. the pump's) and the rate
+   at which the guest dirties pages (the log-dirty statistics, read
+   without touching the bitmap libxc is using). From them it predicts the
+   downtime if the guest were stopped now, compares it with the budget
+   and, with auto-converge, lowers the guest's credit scheduler cap a step
+   at a time while the guest dirties memory faster than it is sent.
+
+   Each measurement is printed, in the form Xenguest_protocol parses into
+   a Convergence message:
+   "converge: S pages/s sent, D pages/s dirtied, downtime Tms (budget
+   Bms), throttle P%: decision" */
+struct converge_policy {
+    unsigned int downtime_ms;   /* budget */
+    int auto_throttle;
+    unsigned int interval_ms;   /* between measurements */
+};
+
+#define CONVERGE_INTERVAL_MS      1000
+#define CONVERGE_THROTTLE_INITIAL 20    /* % of vCPU time withheld */
+#define CONVERGE_THROTTLE_STEP    10
+#define CONVERGE_THROTTLE_MAX     99
+
+struct converge;
+
+/* Start watching domid, whose save has written bytes_sent(arg) bytes so
+   far. Returns NULL with errno set on failure. */
+extern struct converge *converge_start(uint32_t domid,
+                                       const struct converge_policy *policy,
+                                       uint64_t (*bytes_sent)(void *),
+                                       void *arg);
+
+/* Stop measuring (the guest is being stopped); a throttle stays on */
+extern void converge_stop(struct converge *c);
+
+/* Stop, give the guest its cap back and free c (which may be NULL) */
+extern void converge_finish(struct converge *c);
+
+#endif /* _XENGUEST_CONVERGE_H_ */
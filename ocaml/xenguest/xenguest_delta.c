@@ -0,0 +1,273 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "xenguest_delta.h"
+
+#define WORDS (DELTA_PAGE_SIZE / sizeof(uint64_t))
+#define NONE UINT32_MAX
+
+struct delta_slot {
+    unsigned long pfn;
+    uint32_t prev, next;        /* towards the most/least recently used */
+};
+
+struct delta_cache {
+    unsigned long nr_pfns;
+    uint32_t *slot_of;          /* per pfn: its slot, or NONE */
+    uint8_t *seen;              /* per pfn: sent before */
+    uint8_t *pages;             /* nr_slots page copies */
+    struct delta_slot *slots;
+    uint32_t nr_slots, used;
+    uint32_t head, tail;        /* most and least recently used */
+    struct delta_stats stats;
+};
+
+struct delta_cache *delta_cache_create(unsigned long nr_pfns,
+                                       size_t max_bytes)
+{
+    struct delta_cache *c = calloc(1, sizeof(*c));
+    unsigned long i;
+
+    if (c == NULL)
+        return NULL;
+    c->nr_pfns = nr_pfns;
+    c->nr_slots = max_bytes / DELTA_PAGE_SIZE;
+    if (c->nr_slots > nr_pfns)
+        c->nr_slots = nr_pfns;
+    c->head = c->tail = NONE;
+    c->slot_of = malloc(nr_pfns * sizeof(*c->slot_of));
+    c->seen = calloc(nr_pfns, 1);
+    c->slots = malloc((c->nr_slots ? c->nr_slots : 1) * sizeof(*c->slots));
+    c->pages = malloc((c->nr_slots ? c->nr_slots : 1) * DELTA_PAGE_SIZE);
+    if (c->slot_of == NULL || c->seen == NULL || c->slots == NULL ||
+        c->pages == NULL) {
+        delta_cache_destroy(c);
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (i = 0; i < nr_pfns; i++)
+        c->slot_of[i] = NONE;
+    return c;
+}
+
+void delta_cache_destroy(struct delta_cache *c)
+{
+    if (c == NULL)
+        return;
+    free(c->slot_of);
+    free(c->seen);
+    free(c->slots);
+    free(c->pages);
+    free(c);
+}
+
+const struct delta_stats *delta_cache_stats(struct delta_cache *c)
+{
+    return &c->stats;
+}
+
+static void lru_unlink(struct delta_cache *c, uint32_t s)
+{
+    struct delta_slot *slot = &c->slots[s];
+
+    if (slot->prev != NONE)
+        c->slots[slot->prev].next = slot->next;
+    else
+        c->head = slot->next;
+    if (slot->next != NONE)
+        c->slots[slot->next].prev = slot->prev;
+    else
+        c->tail = slot->prev;
+}
+
+static void lru_push(struct delta_cache *c, uint32_t s)
+{
+    c->slots[s].prev = NONE;
+    c->slots[s].next = c->head;
+    if (c->head != NONE)
+        c->slots[c->head].prev = s;
+    c->head = s;
+    if (c->tail == NONE)
+        c->tail = s;
+}
+
+/* A free slot for pfn, evicting the least recently used page if needed */
+static uint32_t slot_alloc(struct delta_cache *c, unsigned long pfn)
+{
+    uint32_t s;
+
+    if (c->used < c->nr_slots) {
+        s = c->used++;
+    } else {
+        s = c->tail;
+        lru_unlink(c, s);
+        c->slot_of[c->slots[s].pfn] = NONE;
+        c->stats.evictions++;
+    }
+    c->slots[s].pfn = pfn;
+    c->slot_of[pfn] = s;
+    lru_push(c, s);
+    return s;
+}
+
+/* Index of the first word from i on which differs, or WORDS. Most of a
+   re-dirtied page is usually unchanged, so this is where the time goes:
+   compare 64 bytes at a time where we can. */
+static unsigned int next_diff(const uint64_t *a, const uint64_t *b,
+                              unsigned int i)
+{
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    __m128i x;
+
+    while (i % 8 && i < WORDS) {
+        if (a[i] != b[i])
+            return i;
+        i++;
+    }
+    for (; i < WORDS; i += 8) {
+        x = _mm_or_si128(
+            _mm_or_si128(
+                _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i)),
+                              _mm_loadu_si128((const __m128i *)(b + i))),
+                _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i + 2)),
+                              _mm_loadu_si128((const __m128i *)(b + i + 2)))),
+            _mm_or_si128(
+                _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i + 4)),
+                              _mm_loadu_si128((const __m128i *)(b + i + 4))),
+                _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i + 6)),
+                              _mm_loadu_si128((const __m128i *)(b + i + 6)))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, zero)) != 0xffff)
+            break;
+    }
+#endif
+    while (i < WORDS && a[i] == b[i])
+        i++;
+    return i;
+}
+
+/* Delta of page against old into out, or -1 once it is no smaller */
+static ssize_t encode(const uint64_t *old, const uint64_t *page, uint8_t *out)
+{
+    unsigned int i = 0, start, end;
+    uint16_t hdr[2];
+    size_t len = 0;
+
+    for (;;) {
+        start = next_diff(old, page, i);
+        if (start == WORDS)
+            return len;
+        for (end = start + 1; end < WORDS && old[end] != page[end]; end++)
+            ;
+        if (len + sizeof(hdr) + (end - start) * sizeof(uint64_t)
+            >= DELTA_PAGE_SIZE)
+            return -1;
+        hdr[0] = start - i;
+        hdr[1] = end - start;
+        memcpy(out + len, hdr, sizeof(hdr));
+        len += sizeof(hdr);
+        for (; start < end; start++, len += sizeof(uint64_t)) {
+            uint64_t x = old[start] ^ page[start];
+
+            memcpy(out + len, &x, sizeof(x));
+        }
+        i = end;
+    }
+}
+
+ssize_t delta_encode(struct delta_cache *c, unsigned long pfn,
+                     const void *page, uint8_t *out)
+{
+    uint32_t s = pfn < c->nr_pfns ? c->slot_of[pfn] : NONE;
+    uint8_t *copy;
+    ssize_t len = -1;
+
+    c->stats.pages++;
+    c->stats.bytes_in += DELTA_PAGE_SIZE;
+    if (pfn >= c->nr_pfns || c->nr_slots == 0) {
+        c->stats.bytes_out += DELTA_PAGE_SIZE;
+        return -1;
+    }
+
+    if (s != NONE) {
+        copy = c->pages + (size_t)s * DELTA_PAGE_SIZE;
+        len = encode((const uint64_t *)copy, page, out);
+        lru_unlink(c, s);
+        lru_push(c, s);
+        if (len < 0)
+            c->stats.too_big++;
+    } else if (c->seen[pfn] || c->used < c->nr_slots) {
+        c->seen[pfn] = 1;
+        s = slot_alloc(c, pfn);
+        copy = c->pages + (size_t)s * DELTA_PAGE_SIZE;
+    } else {
+        c->seen[pfn] = 1;
+        c->stats.bytes_out += DELTA_PAGE_SIZE;
+        return -1;
+    }
+    memcpy(copy, page, DELTA_PAGE_SIZE);
+
+    if (len < 0) {
+        c->stats.bytes_out += DELTA_PAGE_SIZE;
+        return -1;
+    }
+    c->stats.deltas++;
+    if (len == 0)
+        c->stats.unchanged++;
+    c->stats.bytes_out += len;
+    return len;
+}
+
+int delta_decode(void *page, const uint8_t *delta, size_t len)
+{
+    uint64_t *words = page, x;
+    unsigned int i = 0;
+    uint16_t hdr[2];
+    size_t off = 0;
+
+    while (off < len) {
+        if (len - off < sizeof(hdr))
+            return -1;
+        memcpy(hdr, delta + off, sizeof(hdr));
+        off += sizeof(hdr);
+        i += hdr[0];
+        if (hdr[1] == 0 || i + hdr[1] > WORDS ||
+            len - off < hdr[1] * sizeof(uint64_t))
+            return -1;
+        for (; hdr[1]; hdr[1]--, i++, off += sizeof(x)) {
+            memcpy(&x, delta + off, sizeof(x));
+            words[i] ^= x;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
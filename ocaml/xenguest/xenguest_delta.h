@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+#ifndef _XENGUEST_DELTA_H_
+#define _XENGUEST_DELTA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Delta encoding of pages which are sent more than once. The sender
+   keeps the last version it sent of recently re-sent pages in a cache of
+   bounded size (least recently used pages are dropped first), and sends
+   a page it finds there as the XOR against that version, run-length
+   encoded, if that is smaller than the page. The receiver applies the
+   delta to the page it already has.
+
+   A delta is a sequence of records, each made of the number of 8-byte
+   words to leave alone and the number of words which follow (both
+   uint16_t), followed by that many words to XOR in. An empty delta
+   means the page has not changed. This is the scheme of libxc's
+   checkpoint compression (XCFLAGS_CHECKPOINT_COMPRESS). */
+#define DELTA_PAGE_SIZE 4096
+
+struct delta_stats {
+    uint64_t pages;             /* pages given to delta_encode */
+    uint64_t deltas;            /* ... sent as deltas */
+    uint64_t unchanged;         /* ... of which were identical */
+    uint64_t too_big;           /* cached, but the delta was not smaller */
+    uint64_t evictions;
+    uint64_t bytes_in;          /* what would have been sent */
+    uint64_t bytes_out;         /* what was sent instead */
+};
+
+struct delta_cache;
+
+/* A cache for a guest of nr_pfns pages, holding at most max_bytes of page
+   copies (plus 5 bytes of index per guest page). Returns NULL with
+   errno set on failure. */
+extern struct delta_cache *delta_cache_create(unsigned long nr_pfns,
+                                              size_t max_bytes);
+extern void delta_cache_destroy(struct delta_cache *c);
+
+/* Encode page, which is about to be sent as pfn, into out (which must
+   hold DELTA_PAGE_SIZE bytes). Returns the length of the delta, or -1 if
+   the page must be sent whole. Either way the cache now holds this
+   version. Once the cache is full a page only enters it the second time
+   it is sent, so that the first pass over a large guest does not push
+   out the pages which are actually being rewritten. */
+extern ssize_t delta_encode(struct delta_cache *c, unsigned long pfn,
+                            const void *page, uint8_t *out);
+
+/* Apply a delta to the previous version of a page. Returns 0, or -1 if
+   the delta is corrupt (the page is then undefined). */
+extern int delta_decode(void *page, const uint8_t *delta, size_t len);
+
+extern const struct delta_stats *delta_cache_stats(struct delta_cache *c);
+
+#endif /* _XENGUEST_DELTA_H_ */
@@ -0,0 +1,296 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "xenguest_direct.h"
+
+struct direct_writer {
+    int fd;                     /* as passed in, for unaligned pieces */
+    int dfd;                    /* O_DIRECT descriptor, or fd */
+    int direct;                 /* dfd is O_DIRECT */
+    off_t sparse_from;          /* beyond this the file reads as zeroes */
+    off_t head_offset;          /* unaligned start, written without O_DIRECT */
+    size_t head_len;
+    off_t offset;               /* file offset of buf[fill] */
+    size_t len;                 /* bytes in buf[fill] */
+    char *buf[2];
+    int fill;                   /* buffer being filled */
+
+    /* handed to the writer thread */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int busy, stop;
+    int wbuf;
+    size_t wlen;
+    off_t woffset;
+
+    int error;                  /* errno of the first failure */
+    uint64_t written, holes;
+    pthread_t thread;
+};
+
+static int is_zero(const char *buf)
+{
+    const uint64_t *p = (const uint64_t *)buf;
+    size_t i;
+
+    for (i = 0; i < DIRECT_BLOCK_SIZE / sizeof(*p); i++)
+        if (p[i])
+            return 0;
+    return 1;
+}
+
+static int pwrite_exact(int fd, const char *buf, size_t len, off_t offset)
+{
+    ssize_t n;
+
+    while (len) {
+        n = pwrite(fd, buf, len, offset);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/* Write whole blocks, skipping blocks of zeroes where the file already
+   reads as zeroes */
+static int write_blocks(struct direct_writer *w, const char *buf, size_t len,
+                        off_t offset)
+{
+    size_t start = 0, end;
+
+    while (start < len) {
+        if (offset + (off_t)start >= w->sparse_from && is_zero(buf + start)) {
+            w->holes += DIRECT_BLOCK_SIZE;
+            start += DIRECT_BLOCK_SIZE;
+            continue;
+        }
+        for (end = start + DIRECT_BLOCK_SIZE; end < len; end += DIRECT_BLOCK_SIZE)
+            if (offset + (off_t)end >= w->sparse_from && is_zero(buf + end))
+                break;
+        if (pwrite_exact(w->dfd, buf + start, end - start, offset + start))
+            return -1;
+        if (!w->direct)
+            posix_fadvise(w->dfd, offset + start, end - start,
+                          POSIX_FADV_DONTNEED);
+        w->written += end - start;
+        start = end;
+    }
+    return 0;
+}
+
+static void *writer_thread(void *arg)
+{
+    struct direct_writer *w = arg;
+    int r;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (!w->busy && !w->stop)
+            pthread_cond_wait(&w->cond, &w->lock);
+        if (!w->busy)
+            break;
+        pthread_mutex_unlock(&w->lock);
+        r = w->error ? 0 : write_blocks(w, w->buf[w->wbuf], w->wlen, w->woffset);
+        pthread_mutex_lock(&w->lock);
+        if (r && !w->error)
+            w->error = errno;
+        w->busy = 0;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+/* Pass the (block-aligned) filled buffer to the writer thread */
+static void submit(struct direct_writer *w)
+{
+    pthread_mutex_lock(&w->lock);
+    while (w->busy)
+        pthread_cond_wait(&w->cond, &w->lock);
+    w->wbuf = w->fill;
+    w->wlen = w->len;
+    w->woffset = w->offset;
+    w->busy = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+
+    w->offset += w->len;
+    w->len = 0;
+    w->fill = !w->fill;
+}
+
+struct direct_writer *direct_open(int fd)
+{
+    struct direct_writer *w;
+    struct stat st;
+    char path[64];
+    int i;
+
+    if (fstat(fd, &st) == -1)
+        return NULL;
+    if (!S_ISREG(st.st_mode)) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+    w = calloc(1, sizeof(*w));
+    if (w == NULL)
+        return NULL;
+    w->fd = fd;
+    w->sparse_from = st.st_size;
+    w->offset = lseek(fd, 0, SEEK_CUR);
+    if (w->offset == -1)
+        goto err;
+    for (i = 0; i < 2; i++) {
+        errno = posix_memalign((void **)&w->buf[i], DIRECT_BLOCK_SIZE,
+                               DIRECT_BUFFER_SIZE);
+        if (errno)
+            goto err;
+    }
+
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    w->dfd = open(path, O_WRONLY | O_DIRECT | O_CLOEXEC);
+    w->direct = w->dfd != -1;
+    if (!w->direct)
+        w->dfd = fd;
+
+    /* Up to the first block boundary the block is shared with what is
+       already in the file, so that part is written as it comes */
+    w->head_offset = w->offset;
+    w->head_len = (DIRECT_BLOCK_SIZE - w->offset % DIRECT_BLOCK_SIZE)
+        % DIRECT_BLOCK_SIZE;
+    w->offset += w->head_len;
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    errno = pthread_create(&w->thread, NULL, writer_thread, w);
+    if (errno) {
+        if (w->direct)
+            close(w->dfd);
+        goto err;
+    }
+    return w;
+
+err:
+    free(w->buf[0]);
+    free(w->buf[1]);
+    free(w);
+    return NULL;
+}
+
+int direct_write(struct direct_writer *w, const void *buf, size_t len)
+{
+    size_t n;
+
+    if (w->head_len && len) {
+        n = w->head_len < len ? w->head_len : len;
+        if (pwrite_exact(w->fd, buf, n, w->head_offset)) {
+            w->error = errno;
+            return -1;
+        }
+        w->head_offset += n;
+        w->head_len -= n;
+        buf = (const char *)buf + n;
+        len -= n;
+    }
+    while (len) {
+        n = DIRECT_BUFFER_SIZE - w->len;
+        if (n > len)
+            n = len;
+        memcpy(w->buf[w->fill] + w->len, buf, n);
+        w->len += n;
+        buf = (const char *)buf + n;
+        len -= n;
+        if (w->len == DIRECT_BUFFER_SIZE)
+            submit(w);
+    }
+    return w->error ? -1 : 0;
+}
+
+int direct_close(struct direct_writer *w)
+{
+    char *buf = w->buf[w->fill];
+    size_t len = w->len, aligned = len - len % DIRECT_BLOCK_SIZE;
+    off_t offset = w->offset, end = w->offset + len;
+    int error;
+
+    /* The stream may have ended within the first block */
+    if (w->head_len)
+        end = w->head_offset;
+
+    pthread_mutex_lock(&w->lock);
+    while (w->busy)
+        pthread_cond_wait(&w->cond, &w->lock);
+    w->stop = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+
+    if (!w->error && aligned && write_blocks(w, buf, aligned, offset))
+        w->error = errno;
+    if (!w->error && len > aligned &&
+        pwrite_exact(w->fd, buf + aligned, len - aligned, offset + aligned))
+        w->error = errno;
+    if (!w->error && end > w->sparse_from && ftruncate(w->fd, end) == -1)
+        w->error = errno;
+    if (!w->error && fsync(w->fd) == -1)
+        w->error = errno;
+    if (!w->error && lseek(w->fd, end, SEEK_SET) == -1)
+        w->error = errno;
+
+    printf("suspend image: %"PRIu64" bytes written%s, %"PRIu64" bytes of "
+           "zeroes left as holes", w->written, w->direct ? " (O_DIRECT)" : "",
+           w->holes);
+    error = w->error;
+    if (w->direct)
+        close(w->dfd);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+    free(w->buf[0]);
+    free(w->buf[1]);
+    free(w);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
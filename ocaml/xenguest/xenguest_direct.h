@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+#ifndef _XENGUEST_DIRECT_H_
+#define _XENGUEST_DIRECT_H_
+
+#include <stddef.h>
+
+/* Writing a suspend image to a regular file: the data goes to disk with
+   O_DIRECT (so it does not fill the page cache with an image which will
+   not be read before resume), 4KiB blocks of zeroes beyond the original
+   end of the file are left as holes, and the file is synced once at the
+   end. Two buffers are used so that one is filled while the other is
+   being written. */
+#define DIRECT_BLOCK_SIZE 4096
+#define DIRECT_BUFFER_SIZE (1024 * 1024)
+
+struct direct_writer;
+
+/* Start writing to fd at its current offset. Returns NULL with errno set
+   if fd is not a regular file (ENOTSUP) or on failure. Falls back to
+   buffered writes, dropped from the cache as they complete, if the file
+   system does not support O_DIRECT. */
+extern struct direct_writer *direct_open(int fd);
+
+extern int direct_write(struct direct_writer *w, const void *buf, size_t len);
+
+/* Write out what is left, sync, leave fd's offset at the end of the data
+   and free the writer. Returns 0, or -1 with errno set if any write
+   failed. */
+extern int direct_close(struct direct_writer *w);
+
+#endif /* _XENGUEST_DIRECT_H_ */
@@ -0,0 +1,308 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+
+#include "xenguest_fanout.h"
+#include "trace_stub.h"
+
+/* What a clone's process reports back */
+struct fanout_result {
+    unsigned int index;
+    int error;
+    unsigned long store_mfn, console_mfn, genid_addr;
+    uint64_t left;              /* bytes after the end of its stream */
+};
+
+static int write_exact(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (len) {
+        n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static uint64_t now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* In the clone's process: restore, drain and report */
+static void clone_main(int in_fd, int result_fd, unsigned int index,
+                       struct fanout_clone *c, const struct fanout_ops *ops)
+{
+    struct fanout_result res;
+    char buf[4096];
+    ssize_t n;
+
+    memset(&res, 0, sizeof(res));
+    res.index = index;
+    if (ops->restore(in_fd, c, ops->data))
+        res.error = errno ? errno : EIO;
+    res.store_mfn = c->store_mfn;
+    res.console_mfn = c->console_mfn;
+    res.genid_addr = c->genid_addr;
+    while ((n = read(in_fd, buf, sizeof(buf))) > 0 ||
+           (n < 0 && errno == EINTR))
+        if (n > 0)
+            res.left += n;
+    /* Smaller than PIPE_BUF, so the reports do not interleave */
+    write_exact(result_fd, &res, sizeof(res));
+    fflush(stdout);
+    _exit(0);
+}
+
+int fanout_restore(int fd, struct fanout_clone *clones, unsigned int nr,
+                   const struct fanout_ops *ops)
+{
+    int out_fd[FANOUT_MAX_CLONES];
+    pid_t pid[FANOUT_MAX_CLONES];
+    struct fanout_result res;
+    struct sigaction ign, old_pipe;
+    struct stat st;
+    int result[2], p[2], r = -1, restored = 0, saved_errno = 0, live;
+    unsigned int i, j;
+    off_t start;
+    uint64_t total = 0, t0 = now_us(), trace = trace_begin(), left = 0;
+    char *buf = NULL;
+    ssize_t n;
+
+    if (nr == 0 || nr > FANOUT_MAX_CLONES) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    start = lseek(fd, 0, SEEK_CUR);
+    buf = malloc(FANOUT_BUFFER_SIZE);
+    if (start < 0 || buf == NULL || pipe(result)) {
+        free(buf);
+        return -1;
+    }
+
+    /* A clone which fails stops reading: see EPIPE rather than die */
+    memset(&ign, 0, sizeof(ign));
+    ign.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ign, &old_pipe);
+    fflush(stdout);
+
+    for (i = 0; i < nr; i++) {
+        clones[i].error = ECHILD;
+        out_fd[i] = -1;
+        pid[i] = -1;
+        if (pipe(p)) {
+            clones[i].error = errno;
+            continue;
+        }
+#ifdef F_SETPIPE_SZ
+        /* Room for a whole batch of pages, so that one clone being slow
+           for a moment does not hold the others up */
+        fcntl(p[1], F_SETPIPE_SZ, FANOUT_BUFFER_SIZE);
+#endif
+        pid[i] = fork();
+        if (pid[i] == 0) {
+            close(p[1]);
+            close(result[0]);
+            for (j = 0; j < i; j++)
+                if (out_fd[j] != -1)
+                    close(out_fd[j]);
+            clone_main(p[0], result[1], i, &clones[i], ops);
+        }
+        close(p[0]);
+        if (pid[i] < 0) {
+            clones[i].error = errno;
+            close(p[1]);
+        } else
+            out_fd[i] = p[1];
+    }
+    close(result[1]);
+
+    posix_fadvise(fd, start, 0, POSIX_FADV_SEQUENTIAL);
+    for (;;) {
+        n = read(fd, buf, FANOUT_BUFFER_SIZE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n < 0)
+                saved_errno = errno;
+            break;
+        }
+        total += n;
+        for (i = 0, live = 0; i < nr; i++) {
+            if (out_fd[i] == -1)
+                continue;
+            if (write_exact(out_fd[i], buf, n)) {
+                /* That clone has given up */
+                close(out_fd[i]);
+                out_fd[i] = -1;
+            } else
+                live++;
+        }
+        if (live == 0)
+            break;
+    }
+    for (i = 0; i < nr; i++)
+        if (out_fd[i] != -1)
+            close(out_fd[i]);
+
+    while ((n = read(result[0], &res, sizeof(res))) == sizeof(res) ||
+           (n < 0 && errno == EINTR)) {
+        if (n < 0 || res.index >= nr)
+            continue;
+        clones[res.index].error = res.error;
+        clones[res.index].store_mfn = res.store_mfn;
+        clones[res.index].console_mfn = res.console_mfn;
+        clones[res.index].genid_addr = res.genid_addr;
+        if (res.error == 0 && restored++ == 0)
+            left = res.left;
+    }
+    close(result[0]);
+    for (i = 0; i < nr; i++)
+        if (pid[i] > 0)
+            while (waitpid(pid[i], NULL, 0) < 0 && errno == EINTR)
+                ;
+    sigaction(SIGPIPE, &old_pipe, NULL);
+
+    if (saved_errno) {
+        errno = saved_errno;
+        goto out;
+    }
+    if (restored) {
+        lseek(fd, start + (off_t)(total - left), SEEK_SET);
+        posix_fadvise(fd, start, total - left, POSIX_FADV_DONTNEED);
+    }
+    printf("fanout: %u of %u clones restored from %llu bytes in %llums",
+           restored, nr, (unsigned long long)(total - left),
+           (unsigned long long)(now_us() - t0) / 1000);
+    trace_end("restore", "fanout_restore", trace);
+    r = restored;
+out:
+    free(buf);
+    return r;
+}
+
+/* Whether gfn holds the generation ID of c */
+static int is_genid_gfn(const struct fanout_clone *c, unsigned long gfn)
+{
+    return c->genid_addr && (c->genid_addr >> XC_PAGE_SHIFT) == gfn;
+}
+
+long fanout_share(xc_interface *xch, struct fanout_clone *c, unsigned int nr)
+{
+    uint64_t start = trace_begin();
+    xen_pfn_t gfns[FANOUT_SHARE_BATCH];
+    int src_err[FANOUT_SHARE_BATCH], err[FANOUT_SHARE_BATCH];
+    int nominated[FANOUT_SHARE_BATCH];    /* 0 not yet, 1 done, -1 failed */
+    uint64_t src_handle[FANOUT_SHARE_BATCH], handle;
+    unsigned long base, gfn, n, k;
+    uint8_t *src_pages, *pages;
+    unsigned int i, src;
+    long shared = 0;
+    int max_gpfn;
+
+    for (src = 0; src < nr && c[src].error; src++)
+        ;
+    if (src == nr)
+        return 0;
+    max_gpfn = xc_domain_maximum_gpfn(xch, c[src].domid);
+    if (max_gpfn < 0)
+        return -1;
+    for (i = src; i < nr; i++)
+        if (!c[i].error && xc_memshr_control(xch, c[i].domid, 1))
+            return -1;
+
+    for (base = 0; base <= (unsigned long)max_gpfn; base += n) {
+        n = (unsigned long)max_gpfn + 1 - base;
+        if (n > FANOUT_SHARE_BATCH)
+            n = FANOUT_SHARE_BATCH;
+        for (k = 0; k < n; k++) {
+            gfns[k] = base + k;
+            nominated[k] = 0;
+        }
+        src_pages = xc_map_foreign_bulk(xch, c[src].domid, PROT_READ,
+                                        gfns, src_err, n);
+        if (src_pages == NULL)
+            continue;
+        for (i = src + 1; i < nr; i++) {
+            if (c[i].error)
+                continue;
+            pages = xc_map_foreign_bulk(xch, c[i].domid, PROT_READ,
+                                        gfns, err, n);
+            if (pages == NULL)
+                continue;
+            for (k = 0; k < n; k++) {
+                gfn = base + k;
+                if (src_err[k] || err[k] || nominated[k] < 0 ||
+                    is_genid_gfn(&c[src], gfn) || is_genid_gfn(&c[i], gfn) ||
+                    memcmp(src_pages + k * XC_PAGE_SIZE,
+                           pages + k * XC_PAGE_SIZE, XC_PAGE_SIZE))
+                    continue;
+                /* Pages which cannot be nominated (e.g. unpopulated) are
+                   left alone */
+                if (nominated[k] == 0)
+                    nominated[k] = xc_memshr_nominate_gfn(
+                        xch, c[src].domid, gfn, &src_handle[k]) ? -1 : 1;
+                if (nominated[k] < 0 ||
+                    xc_memshr_nominate_gfn(xch, c[i].domid, gfn, &handle))
+                    continue;
+                if (xc_memshr_share_gfns(xch, c[src].domid, gfn,
+                                         src_handle[k], c[i].domid, gfn,
+                                         handle) == 0)
+                    shared++;
+            }
+            munmap(pages, n * XC_PAGE_SIZE);
+        }
+        munmap(src_pages, n * XC_PAGE_SIZE);
+    }
+    trace_end("restore", "fanout_share", start);
+    printf("fanout: %ld pages shared", shared);
+    return shared;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
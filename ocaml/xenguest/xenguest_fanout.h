@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+#ifndef _XENGUEST_FANOUT_H_
+#define _XENGUEST_FANOUT_H_
+
+#include <stdint.h>
+#include <xenctrl.h>
+
+/* Restoring several clones of a domain from one suspend image, which is
+   read once. Each clone is restored by a process of its own, which reads
+   the image from a pipe; the parent reads the image file and copies it
+   into every pipe, so that the restores run side by side at the pace of
+   the slowest. libxc reads exactly the restore stream from its pipe; a
+   clone drains the rest after its restore and reports how much there
+   was, so that the image file is left at the end of the stream, as a
+   single restore would leave it. */
+#define FANOUT_MAX_CLONES 64
+#define FANOUT_BUFFER_SIZE (1024 * 1024)
+#define FANOUT_SHARE_BATCH 1024     /* pages compared at a time */
+
+struct fanout_clone {
+    uint32_t domid;
+    unsigned int store_evtchn, console_evtchn;
+    uint32_t store_domid, console_domid;
+    /* Results */
+    unsigned long store_mfn, console_mfn;
+    unsigned long genid_addr;   /* of the clone's own generation ID, or 0 */
+    int error;                  /* errno, 0 if restored */
+};
+
+struct fanout_ops {
+    /* Restore c from fd, in a child process: fill in store_mfn,
+       console_mfn and genid_addr. Returns 0, or -1 with errno set. */
+    int (*restore)(int fd, struct fanout_clone *c, void *data);
+    void *data;
+};
+
+/* Restore every clone from the image at fd's offset (fd must be a
+   regular file). Returns the number of clones restored, each failure
+   being in the clone's error, and leaves fd at the end of the stream if
+   any was; or -1 with errno set if the image could not be read. */
+extern int fanout_restore(int fd, struct fanout_clone *clones, unsigned int nr,
+                          const struct fanout_ops *ops);
+
+/* Share the pages which the restored clones (those without an error)
+   still have in common with the first of them. Xen shares whatever it is
+   asked to, so each page is compared first; the pages holding a clone's
+   own generation ID are never shared. Returns the number of pages
+   shared, or -1 with errno set if sharing could not be enabled. */
+extern long fanout_share(xc_interface *xch, struct fanout_clone *clones,
+                         unsigned int nr);
+
+#endif /* _XENGUEST_FANOUT_H_ */
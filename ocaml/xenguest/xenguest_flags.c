@@ -0,0 +1,430 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+/* Domain build parameters from xenstore, kept apart from the OCaml stubs
+   so that they can be benchmarked on their own (stubs_bench.c) */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+
+#include <xenctrl.h>
+#include <xenstore.h>
+
+#include "xenguest_flags.h"
+#include "trace_stub.h"
+
+static int
+xenstore_putsv(int domid, const char *val, const char *fmt, va_list ap)
+{
+    char *path = NULL;
+    struct xs_handle *xsh = NULL;
+    int n, m, rc;
+    char key[1024];
+    bool success;
+    uint64_t start = trace_begin();
+
+    rc = 1;
+    bzero(key, sizeof(key));
+    xsh = xs_daemon_open();
+    if (xsh == NULL)
+        goto out;
+
+    path = xs_get_domain_path(xsh, domid);
+    if (path == NULL)
+        goto out;
+
+    n = snprintf(key, sizeof(key), "%s/", path);
+    if (n < 0)
+        goto out;
+    m = vsnprintf(key + n, sizeof(key) - n, fmt, ap);
+    if (m < 0)
+        goto out;
+
+    success = xs_write(xsh, XBT_NULL, key, val, strlen(val));
+    rc = success? 0 : 1;
+out:
+    xs_daemon_close(xsh);
+    free(path);
+    trace_end("xenstore", "write", start);
+    return rc;
+}
+
+static char *
+xenstore_getsv(int domid, const char *fmt, va_list ap)
+{
+    char *path = NULL, *s = NULL;
+    struct xs_handle *xsh = NULL;
+    int n, m;
+    char key[1024];
+    uint64_t start = trace_begin();
+
+    bzero(key, sizeof(key));
+
+    xsh = xs_daemon_open();
+    if (xsh == NULL)
+        return 0;
+
+    path = xs_get_domain_path(xsh, domid);
+    if (path == NULL)
+        goto out;
+
+    n = snprintf(key, sizeof(key), "%s/", path);
+    if (n < 0)
+        goto out;
+    m = vsnprintf(key + n, sizeof(key) - n, fmt, ap);
+    if (m < 0)
+        goto out;
+
+    s = xs_read(xsh, XBT_NULL, key, NULL);
+out:
+    xs_daemon_close(xsh);
+    free(path);
+    trace_end("xenstore", "read", start);
+    return s;
+}
+
+int
+xenstore_puts(int domid, const char *val, const char *fmt, ...)
+{
+    int rc;
+    va_list ap;
+
+    va_start(ap, fmt);
+    rc = xenstore_putsv(domid, val, fmt, ap);
+    va_end(ap);
+    return rc;
+}
+
+static void
+xenstore_get_host_limits(size_t *kernel_max_size, size_t *ramdisk_max_size)
+{
+    static const char *kernel_max_path = "/mh/limits/pv-kernel-max-size";
+    static const char *ramdisk_max_path = "/mh/limits/pv-ramdisk-max-size";
+    struct xs_handle *xsh = NULL;
+    size_t value;
+    char *s;
+
+    /* Safe defaults */
+    *kernel_max_size  =  (32 * 1024 * 1024);
+    *ramdisk_max_size = (128 * 1024 * 1024);
+
+    xsh = xs_daemon_open();
+    if (xsh == NULL)
+        return;
+
+    s = xs_read(xsh, XBT_NULL, kernel_max_path, NULL);
+    if (s) {
+        errno = 0;
+        value = strtoul(s, NULL, 10);
+        if ( errno == 0 )
+            *kernel_max_size = value;
+        free(s);
+    }
+
+    s = xs_read(xsh, XBT_NULL, ramdisk_max_path, NULL);
+    if (s) {
+        errno = 0;
+        value = strtoul(s, NULL, 10);
+        if ( errno == 0 )
+            *ramdisk_max_size = value;
+        free(s);
+    }
+
+    xs_daemon_close(xsh);
+    return;
+}
+
+char *
+xenstore_gets(int domid, const char *fmt, ...)
+{
+    char *s;
+    va_list ap;
+
+    va_start(ap, fmt);
+    s = xenstore_getsv(domid, fmt, ap);
+    va_end(ap);
+    return s;
+}
+
+uint64_t
+xenstore_get(int domid, const char *fmt, ...)
+{
+    char *s;
+    uint64_t value = 0;
+    va_list ap;
+
+    va_start(ap, fmt);
+    s = xenstore_getsv(domid, fmt, ap);
+    if (s) {
+        if (!strcasecmp(s, "true"))
+            value = 1;
+        else if (sscanf(s, "%Ld", &value) != 1)
+            value = 0;
+        free(s);
+    }
+    va_end(ap);
+    return value;
+}
+
+struct xenstore_batch_entry {
+    char *path;
+    char *val;
+};
+
+struct xenstore_batch {
+    struct xs_handle *xsh;
+    char *dom_path;
+    struct xenstore_batch_entry *entries;
+    unsigned int nr, size;
+};
+
+struct xenstore_batch *
+xenstore_batch_create(int domid)
+{
+    struct xenstore_batch *b = calloc(1, sizeof(*b));
+
+    if (b == NULL)
+        return NULL;
+    errno = 0;
+    b->xsh = xs_daemon_open();
+    if (b->xsh == NULL)
+        goto fail;
+    b->dom_path = xs_get_domain_path(b->xsh, domid);
+    if (b->dom_path == NULL)
+        goto fail;
+    return b;
+fail:
+    xenstore_batch_free(b);
+    if (errno == 0)
+        errno = ENOENT;
+    return NULL;
+}
+
+static void
+xenstore_batch_clear(struct xenstore_batch *b)
+{
+    unsigned int i;
+
+    for (i = 0; i < b->nr; i++) {
+        free(b->entries[i].path);
+        free(b->entries[i].val);
+    }
+    b->nr = 0;
+}
+
+void
+xenstore_batch_free(struct xenstore_batch *b)
+{
+    if (b == NULL)
+        return;
+    xenstore_batch_clear(b);
+    free(b->entries);
+    free(b->dom_path);
+    if (b->xsh)
+        xs_daemon_close(b->xsh);
+    free(b);
+}
+
+int
+xenstore_batch_puts(struct xenstore_batch *b, const char *val,
+                    const char *fmt, ...)
+{
+    struct xenstore_batch_entry *e;
+    char *rel = NULL, *path = NULL;
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vasprintf(&rel, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return -1;
+    if (rel[0] == '/')
+        path = rel;
+    else {
+        n = asprintf(&path, "%s/%s", b->dom_path, rel);
+        free(rel);
+        if (n < 0)
+            return -1;
+    }
+
+    if (b->nr == b->size) {
+        unsigned int size = b->size ? b->size * 2 : 8;
+
+        e = realloc(b->entries, size * sizeof(*e));
+        if (e == NULL)
+            goto fail;
+        b->entries = e;
+        b->size = size;
+    }
+    e = &b->entries[b->nr];
+    e->val = strdup(val);
+    if (e->val == NULL)
+        goto fail;
+    e->path = path;
+    b->nr++;
+    return 0;
+fail:
+    free(path);
+    return -1;
+}
+
+int
+xenstore_batch_commit(struct xenstore_batch *b)
+{
+    xs_transaction_t t;
+    unsigned int i, attempt;
+    int rc = -1;
+    uint64_t start = trace_begin();
+
+    for (attempt = 0; b->nr > 0; attempt++) {
+        t = xs_transaction_start(b->xsh);
+        if (t == XBT_NULL)
+            goto out;
+        for (i = 0; i < b->nr; i++)
+            if (!xs_write(b->xsh, t, b->entries[i].path, b->entries[i].val,
+                          strlen(b->entries[i].val))) {
+                int err = errno;
+
+                xs_transaction_end(b->xsh, t, true);
+                errno = err;
+                goto out;
+            }
+        if (xs_transaction_end(b->xsh, t, false))
+            break;
+        if (errno != EAGAIN || attempt == XENSTORE_BATCH_RETRIES)
+            goto out;
+    }
+    rc = 0;
+out:
+    xenstore_batch_clear(b);
+    trace_end("xenstore", "batch_commit", start);
+    return rc;
+}
+
+void
+get_flags(struct flags *f, int domid)
+{
+    int n;
+    size_t host_pv_kernel_max_size;
+    size_t host_pv_ramdisk_max_size;
+    size_t vm_pv_kernel_max_size;
+    size_t vm_pv_ramdisk_max_size;
+    uint64_t start = trace_begin();
+    char *s;
+
+    f->vcpus    = xenstore_get(domid, "platform/vcpu/number");
+    f->vcpu_affinity = (const char**)(malloc(sizeof(char*) * f->vcpus));
+    f->vcpu_soft_affinity = (const char**)(malloc(sizeof(char*) * f->vcpus));
+
+    for (n = 0; n < f->vcpus; n++) {
+        f->vcpu_affinity[n] = xenstore_gets(domid, "platform/vcpu/%d/affinity", n);
+        f->vcpu_soft_affinity[n] = xenstore_gets(domid, "platform/vcpu/%d/soft-affinity", n);
+    }
+    f->vcpus_current = xenstore_get(domid, "platform/vcpu/current");
+    f->vcpu_weight = xenstore_get(domid, "platform/vcpu/weight");
+    f->vcpu_cap = xenstore_get(domid, "platform/vcpu/cap");
+    f->vcpu_period_us = xenstore_get(domid, "platform/vcpu/period");
+    f->vcpu_slice_us = xenstore_get(domid, "platform/vcpu/slice");
+    f->vcpu_latency_us = xenstore_get(domid, "platform/vcpu/latency");
+    f->vcpu_budget_us = xenstore_get(domid, "platform/vcpu/budget");
+    s = xenstore_gets(domid, "platform/vcpu/extratime");
+    f->vcpu_extratime = s ? (!strcasecmp(s, "true") || atoi(s) != 0) : -1;
+    free(s);
+    f->nx       = xenstore_get(domid, "platform/nx");
+    f->viridian = xenstore_get(domid, "platform/viridian");
+    f->apic     = xenstore_get(domid, "platform/apic");
+    f->acpi     = xenstore_get(domid, "platform/acpi");
+    f->pae      = xenstore_get(domid, "platform/pae");
+    f->acpi_s4  = xenstore_get(domid, "platform/acpi_s4");
+    f->acpi_s3  = xenstore_get(domid, "platform/acpi_s3");
+    f->mmio_size_mib = xenstore_get(domid, "platform/mmio_size_mib");
+    f->tsc_mode = xenstore_get(domid, "platform/tsc_mode");
+    f->nestedhvm = xenstore_get(domid, "platform/nestedhvm");
+    f->populate_threads = xenstore_get(domid, "platform/populate_threads");
+    f->vnuma_invalid = vnuma_load(&f->vnuma, domid, f->vcpus);
+
+    xenstore_get_host_limits(&host_pv_kernel_max_size, &host_pv_ramdisk_max_size);
+    vm_pv_kernel_max_size = xenstore_get(domid, "pv-kernel-max-size");
+    vm_pv_ramdisk_max_size = xenstore_get(domid, "pv-ramdisk-max-size");
+
+    f->kernel_max_size = vm_pv_kernel_max_size ? vm_pv_kernel_max_size : host_pv_kernel_max_size;
+    f->ramdisk_max_size = vm_pv_ramdisk_max_size ? vm_pv_ramdisk_max_size : host_pv_ramdisk_max_size;
+
+    printf("Determined the following parameters from xenstore:");
+    printf("vcpu/number:%d vcpu/weight:%d vcpu/cap:%d nx: %d viridian: %d apic: %d acpi: %d pae: %d acpi_s4: %d acpi_s3: %d mmio_size_mib: %lld tsc_mode: %d nestedhvm: %d",
+           f->vcpus,f->vcpu_weight,f->vcpu_cap,f->nx,f->viridian,f->apic,f->acpi,f->pae,f->acpi_s4,f->acpi_s3,f->mmio_size_mib,f->tsc_mode,f->nestedhvm);
+    printf("vcpu/period:%u vcpu/slice:%u vcpu/latency:%u vcpu/budget:%u vcpu/extratime:%d populate_threads:%u",
+           f->vcpu_period_us,f->vcpu_slice_us,f->vcpu_latency_us,f->vcpu_budget_us,f->vcpu_extratime,f->populate_threads);
+    for (n = 0; n < f->vcpus; n++){
+        printf("vcpu/%d/affinity:%s", n, (f->vcpu_affinity[n])?f->vcpu_affinity[n]:"unset");
+        printf("vcpu/%d/soft-affinity:%s", n, (f->vcpu_soft_affinity[n])?f->vcpu_soft_affinity[n]:"unset");
+    }
+    if (f->vnuma_invalid)
+        printf("vnuma: invalid: %s", f->vnuma.error);
+    else
+        printf("vnuma/nodes:%u", f->vnuma.nr_nodes);
+    printf("kernel/ramdisk host limits: (%zu,%zu), VM overrides: (%zu,%zu)",
+           host_pv_kernel_max_size, host_pv_ramdisk_max_size,
+           vm_pv_kernel_max_size, vm_pv_ramdisk_max_size);
+    trace_end("build", "get_flags", start);
+}
+
+void free_flags(struct flags *f)
+{
+    int n;
+
+    for (n = 0; n < f->vcpus; n++) {
+        free((char *)f->vcpu_affinity[n]);
+        free((char *)f->vcpu_soft_affinity[n]);
+    }
+    free(f->vcpu_affinity);
+    free(f->vcpu_soft_affinity);
+    vnuma_free(&f->vnuma);
+}
+
+xc_cpumap_t cpumap_of_string(xc_interface *xch, const char *mask)
+{
+    int j, size, pcpus_supplied, min;
+    xc_cpumap_t cpumap;
+
+    size = xc_get_cpumap_size(xch) * 8; /* array is of uint8_t */
+    pcpus_supplied = strlen(mask);
+    min = (pcpus_supplied < size)?pcpus_supplied:size;
+    cpumap = xc_cpumap_alloc(xch);
+    if (cpumap == NULL)
+        return NULL;
+
+    for (j=0; j<min; j++) {
+        if (mask[j] == '1')
+            cpumap[j/8] |= 1 << (j&7);
+    }
+    return cpumap;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+#ifndef _XENGUEST_FLAGS_H_
+#define _XENGUEST_FLAGS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <xenctrl.h>
+
+#include "xenguest_vnuma.h"
+
+/* The following boolean flags are all set by their value
+   in the platform area of xenstore. The only value that
+   is considered true is the string 'true' */
+struct flags {
+    int vcpus;
+    int vcpus_current;
+    const char** vcpu_affinity; /* 0 means unset */
+    const char** vcpu_soft_affinity; /* 0 means unset */
+    uint16_t vcpu_weight;   /* 0 means unset (0 is an illegal weight) */
+    uint16_t vcpu_cap;      /* 0 is default (no cap) */
+    uint32_t vcpu_period_us;  /* sedf/rtds: 0 means unset */
+    uint32_t vcpu_slice_us;   /* sedf: 0 means unset */
+    uint32_t vcpu_latency_us; /* sedf: 0 means unset */
+    uint32_t vcpu_budget_us;  /* rtds: 0 means unset */
+    int vcpu_extratime;       /* sedf: -1 means unset */
+    int nx;
+    int viridian;
+    int pae;
+    int acpi;
+    int apic;
+    int acpi_s3;
+    int acpi_s4;
+    uint64_t mmio_size_mib;
+    int tsc_mode;
+    size_t kernel_max_size;
+    size_t ramdisk_max_size;
+    int nestedhvm;
+    unsigned int populate_threads; /* HVM: 0 to let libxc populate memory */
+    struct vnuma vnuma;            /* HVM: see xenguest_vnuma.h */
+    int vnuma_invalid;             /* the reason is in vnuma.error */
+};
+
+/* Read the domain's platform/ keys (and the host's kernel and ramdisk
+   size limits) into f, logging every value on stdout */
+extern void get_flags(struct flags *f, int domid);
+
+/* Free what get_flags allocated */
+extern void free_flags(struct flags *f);
+
+/* Convert a string of '0'/'1' characters (one per pCPU) into a cpumap,
+   to be freed by the caller. Characters beyond the number of host pCPUs
+   are ignored. Returns NULL if it could not be allocated. */
+extern xc_cpumap_t cpumap_of_string(xc_interface *xch, const char *mask);
+
+/* Helpers for the domain's xenstore directory (fmt is relative to it),
+   each on a connection of its own */
+extern int xenstore_puts(int domid, const char *val, const char *fmt, ...);
+
+/* The value, to be freed by the caller, or NULL */
+extern char *xenstore_gets(int domid, const char *fmt, ...);
+
+/* The value as an integer: "true" is 1, anything unparseable 0 */
+extern uint64_t xenstore_get(int domid, const char *fmt, ...);
+
+/* Writes which are buffered, then committed together in one transaction
+   on one connection, which is retried (up to XENSTORE_BATCH_RETRIES
+   times) if it conflicts with another. Paths are relative to the
+   domain's directory, unless they start with '/'. */
+#define XENSTORE_BATCH_RETRIES 16
+
+struct xenstore_batch;
+
+/* NULL (with errno set) if xenstore cannot be reached */
+extern struct xenstore_batch *xenstore_batch_create(int domid);
+
+/* Returns 0, or -1 if out of memory */
+extern int xenstore_batch_puts(struct xenstore_batch *b, const char *val,
+                               const char *fmt, ...);
+
+/* Returns 0, or -1 with errno set; either way the batch is empty again */
+extern int xenstore_batch_commit(struct xenstore_batch *b);
+
+extern void xenstore_batch_free(struct xenstore_batch *b);
+
+#endif /* _XENGUEST_FLAGS_H_ */
@@ -0,0 +1,463 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "xenguest_integrity.h"
+#include "trace_stub.h"
+
+#define POLY 0x82f63b78         /* CRC-32C (Castagnoli), reflected */
+
+/* The crc32 instruction has a latency of 3 cycles and a throughput of 1:
+   three streams of LONG (then SHORT) bytes are run side by side, and
+   combined by shifting the CRCs of the first two over the bytes of the
+   others, which takes one lookup per byte of CRC. */
+#define LONG 8192
+#define SHORT 256
+
+static uint32_t crc32c_table[256];
+static uint32_t crc32c_long[4][256];
+static uint32_t crc32c_short[4][256];
+static int have_hw;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/* Operators on CRCs are 32x32 matrices over GF(2) */
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+
+    while (vec) {
+        if (vec & 1)
+            sum ^= *mat;
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+    int n;
+
+    for (n = 0; n < 32; n++)
+        square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+/* The operator which appends len (a power of two) zero bytes to a CRC,
+   by repeated squaring of the one for a single zero bit */
+static void crc32c_zeros_op(uint32_t *even, size_t len)
+{
+    uint32_t odd[32], row = 1;
+    int n;
+
+    odd[0] = POLY;
+    for (n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+    gf2_matrix_square(even, odd);       /* 2 bits */
+    gf2_matrix_square(odd, even);       /* 4 bits */
+    do {
+        gf2_matrix_square(even, odd);   /* 1, 4, 16 ... bytes */
+        len >>= 1;
+        if (len == 0)
+            return;
+        gf2_matrix_square(odd, even);   /* 2, 8, 32 ... bytes */
+        len >>= 1;
+    } while (len);
+    memcpy(even, odd, sizeof(odd));
+}
+
+static void crc32c_zeros(uint32_t zeros[][256], size_t len)
+{
+    uint32_t op[32];
+    uint32_t n;
+
+    crc32c_zeros_op(op, len);
+    for (n = 0; n < 256; n++) {
+        zeros[0][n] = gf2_matrix_times(op, n);
+        zeros[1][n] = gf2_matrix_times(op, n << 8);
+        zeros[2][n] = gf2_matrix_times(op, n << 16);
+        zeros[3][n] = gf2_matrix_times(op, n << 24);
+    }
+}
+
+static uint32_t crc32c_shift(uint32_t zeros[][256], uint32_t crc)
+{
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+        zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static void crc32c_init(void)
+{
+    uint32_t n, crc;
+    int k;
+
+    for (n = 0; n < 256; n++) {
+        crc = n;
+        for (k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+        crc32c_table[n] = crc;
+    }
+    crc32c_zeros(crc32c_long, LONG);
+    crc32c_zeros(crc32c_short, SHORT);
+#if defined(__x86_64__)
+    have_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    crc = ~crc;
+    while (len--)
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t crc0 = ~crc, crc1, crc2;
+    const uint8_t *end;
+
+    while (len && ((uintptr_t)p & 7)) {
+        crc0 = _mm_crc32_u8(crc0, *p++);
+        len--;
+    }
+    while (len >= 3 * LONG) {
+        crc1 = crc2 = 0;
+        end = p + LONG;
+        do {
+            crc0 = _mm_crc32_u64(crc0, *(const uint64_t *)p);
+            crc1 = _mm_crc32_u64(crc1, *(const uint64_t *)(p + LONG));
+            crc2 = _mm_crc32_u64(crc2, *(const uint64_t *)(p + 2 * LONG));
+            p += 8;
+        } while (p < end);
+        crc0 = crc32c_shift(crc32c_long, crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_long, crc0) ^ crc2;
+        p += 2 * LONG;
+        len -= 3 * LONG;
+    }
+    while (len >= 3 * SHORT) {
+        crc1 = crc2 = 0;
+        end = p + SHORT;
+        do {
+            crc0 = _mm_crc32_u64(crc0, *(const uint64_t *)p);
+            crc1 = _mm_crc32_u64(crc1, *(const uint64_t *)(p + SHORT));
+            crc2 = _mm_crc32_u64(crc2, *(const uint64_t *)(p + 2 * SHORT));
+            p += 8;
+        } while (p < end);
+        crc0 = crc32c_shift(crc32c_short, crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_short, crc0) ^ crc2;
+        p += 2 * SHORT;
+        len -= 3 * SHORT;
+    }
+    while (len >= 8) {
+        crc0 = _mm_crc32_u64(crc0, *(const uint64_t *)p);
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc0 = _mm_crc32_u8(crc0, *p++);
+    return ~(uint32_t)crc0;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+#if defined(__x86_64__)
+    if (have_hw)
+        return crc32c_sse42(crc, buf, len);
+#endif
+    return crc32c_sw(crc, buf, len);
+}
+
+int crc32c_hw(void)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return have_hw;
+}
+
+static void put_le32(unsigned char *p, uint32_t x)
+{
+    p[0] = x;
+    p[1] = x >> 8;
+    p[2] = x >> 16;
+    p[3] = x >> 24;
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+        (uint32_t)p[3] << 24;
+}
+
+void integrity_header_put(unsigned char *buf, const struct integrity_header *h)
+{
+    put_le32(buf, h->len);
+    put_le32(buf + 4, h->crc);
+}
+
+void integrity_header_get(const unsigned char *buf, struct integrity_header *h)
+{
+    h->len = get_le32(buf);
+    h->crc = get_le32(buf + 4);
+}
+
+int integrity_is_stream(int fd)
+{
+    char magic[sizeof(INTEGRITY_MAGIC) - 1];
+    struct stat st;
+    off_t off;
+    ssize_t n;
+
+    if (fstat(fd, &st))
+        return 0;
+    if (S_ISREG(st.st_mode)) {
+        off = lseek(fd, 0, SEEK_CUR);
+        if (off == -1)
+            return 0;
+        n = pread(fd, magic, sizeof(magic), off);
+    } else if (S_ISSOCK(st.st_mode)) {
+        do {
+            n = recv(fd, magic, sizeof(magic), MSG_PEEK | MSG_WAITALL);
+        } while (n == -1 && errno == EINTR);
+    } else
+        return 0;
+    return n == sizeof(magic) &&
+        !memcmp(magic, INTEGRITY_MAGIC, sizeof(magic));
+}
+
+/* Receiver ****************************************************************/
+
+struct integrity_reader {
+    int fd;                     /* the stream */
+    int out_fd;                 /* write end of libxc's pipe */
+    int libxc_fd;               /* ... and its read end */
+    char *buf;                  /* INTEGRITY_MAX_CHUNK */
+    uint64_t chunks, bytes;
+    int error;
+    char msg[160];
+    pthread_t thread;
+};
+
+/* Returns the bytes read: fewer than len at the end of the stream */
+static ssize_t read_full(int fd, void *buf, size_t len)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        n = read(fd, (char *)buf + done, len - done);
+        if (n == 0)
+            break;
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += n;
+    }
+    return done;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf = (const char *)buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void reader_fail(struct integrity_reader *r, int error,
+                        const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+static void reader_fail(struct integrity_reader *r, int error,
+                        const char *fmt, ...)
+{
+    va_list ap;
+
+    r->error = error;
+    va_start(ap, fmt);
+    vsnprintf(r->msg, sizeof(r->msg), fmt, ap);
+    va_end(ap);
+}
+
+static void *reader_thread(void *arg)
+{
+    struct integrity_reader *r = arg;
+    unsigned char hbuf[INTEGRITY_HEADER_SIZE];
+    struct integrity_header h;
+    uint64_t start = trace_begin();
+    sigset_t pipe_set;
+    char *buf = r->buf;
+    uint32_t crc;
+    ssize_t n;
+
+    /* If libxc gives up, writes fail with EPIPE rather than kill us */
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, NULL);
+
+    for (;;) {
+        n = read_full(r->fd, hbuf, sizeof(hbuf));
+        if (n != sizeof(hbuf)) {
+            reader_fail(r, n == -1 ? errno : EIO, "stream %s after chunk "
+                        "%"PRIu64" (%"PRIu64" bytes)", n == -1 ?
+                        strerror(errno) : "truncated", r->chunks, r->bytes);
+            break;
+        }
+        integrity_header_get(hbuf, &h);
+        if (h.len == 0)
+            break;
+        if (h.len > INTEGRITY_MAX_CHUNK) {
+            reader_fail(r, EBADMSG, "chunk %"PRIu64" at byte %"PRIu64
+                        ": bad length %u", r->chunks, r->bytes, h.len);
+            break;
+        }
+        n = read_full(r->fd, buf, h.len);
+        if (n != h.len) {
+            reader_fail(r, n == -1 ? errno : EIO, "chunk %"PRIu64" at "
+                        "byte %"PRIu64": %s", r->chunks, r->bytes,
+                        n == -1 ? strerror(errno) : "truncated");
+            break;
+        }
+        crc = crc32c(0, buf, h.len);
+        if (crc != h.crc) {
+            reader_fail(r, EBADMSG, "chunk %"PRIu64" at byte %"PRIu64
+                        " (%u bytes) is corrupt: CRC32C %08x, expected %08x",
+                        r->chunks, r->bytes, h.len, crc, h.crc);
+            break;
+        }
+        if (write_full(r->out_fd, buf, h.len)) {
+            reader_fail(r, errno, "chunk %"PRIu64": libxc stopped reading: "
+                        "%s", r->chunks, strerror(errno));
+            break;
+        }
+        r->chunks++;
+        r->bytes += h.len;
+    }
+    /* libxc sees the end of its stream */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    close(r->out_fd);
+    r->out_fd = -1;
+    trace_end("restore", "integrity_reader", start);
+    return NULL;
+}
+
+struct integrity_reader *integrity_reader_start(int fd, int *out_fd)
+{
+    char magic[sizeof(INTEGRITY_MAGIC) - 1];
+    struct integrity_reader *r;
+    int fds[2], saved_errno;
+
+    if (read_full(fd, magic, sizeof(magic)) != sizeof(magic) ||
+        memcmp(magic, INTEGRITY_MAGIC, sizeof(magic))) {
+        errno = EBADMSG;
+        return NULL;
+    }
+    r = calloc(1, sizeof(*r));
+    if (r == NULL)
+        return NULL;
+    r->fd = fd;
+    r->buf = malloc(INTEGRITY_MAX_CHUNK);
+    if (r->buf == NULL || pipe2(fds, O_CLOEXEC) == -1)
+        goto err;
+#ifdef F_SETPIPE_SZ
+    fcntl(fds[1], F_SETPIPE_SZ, INTEGRITY_MAX_CHUNK);
+#endif
+    r->libxc_fd = fds[0];
+    r->out_fd = fds[1];
+    errno = pthread_create(&r->thread, NULL, reader_thread, r);
+    if (errno) {
+        saved_errno = errno;
+        close(fds[0]);
+        close(fds[1]);
+        errno = saved_errno;
+        goto err;
+    }
+    *out_fd = r->libxc_fd;
+    return r;
+
+err:
+    saved_errno = errno;
+    free(r->buf);
+    free(r);
+    errno = saved_errno;
+    return NULL;
+}
+
+int integrity_reader_finish(struct integrity_reader *r, int failed,
+                            char *msg, size_t len)
+{
+    int error;
+
+    /* A failed restore may leave the thread waiting for data which the
+       sender will never send */
+    if (failed)
+        pthread_cancel(r->thread);
+    pthread_join(r->thread, NULL);
+    if (r->out_fd != -1)
+        close(r->out_fd);
+    close(r->libxc_fd);
+    printf("integrity: %"PRIu64" chunks, %"PRIu64" bytes checked (%s)",
+           r->chunks, r->bytes, crc32c_hw() ? "sse4.2" : "table");
+    error = r->error;
+    snprintf(msg, len, "%s", r->msg);
+    free(r->buf);
+    free(r);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+#ifndef _XENGUEST_INTEGRITY_H_
+#define _XENGUEST_INTEGRITY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* End-to-end integrity of save and migration streams. The sender (the
+   stream pump, see xenguest_pump.h) writes INTEGRITY_MAGIC and then cuts
+   what libxc writes into chunks, each preceded by its length and CRC32C
+   (INTEGRITY_HEADER_SIZE bytes, both little-endian whatever the host);
+   a chunk of length 0 ends the stream. The receiver checks every chunk
+   before handing it to libxc, and on a mismatch cuts libxc's stream
+   short, so that the restore fails before the guest can run.
+
+   The CRC uses the SSE4.2 crc32 instruction where the CPU has it, on
+   three interleaved streams to hide its latency, which keeps it well
+   above line rate; otherwise a table. */
+#define INTEGRITY_MAGIC "XGCRC32C"
+#define INTEGRITY_MAX_CHUNK (1024 * 1024)
+#define INTEGRITY_HEADER_SIZE 8
+
+struct integrity_header {
+    uint32_t len;               /* of the data which follows */
+    uint32_t crc;               /* CRC32C of the data */
+};
+
+/* Convert between a header and its INTEGRITY_HEADER_SIZE bytes in the
+   stream */
+extern void integrity_header_put(unsigned char *buf,
+                                 const struct integrity_header *h);
+extern void integrity_header_get(const unsigned char *buf,
+                                 struct integrity_header *h);
+
+/* The CRC32C of buf, continuing from crc (0 to start) */
+extern uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* Non-zero if crc32c uses the crc32 instruction */
+extern int crc32c_hw(void);
+
+/* Non-zero if fd (a socket or a regular file) carries a checked stream
+   from its current position. Nothing is consumed. */
+extern int integrity_is_stream(int fd);
+
+struct integrity_reader;
+
+/* Consume the magic from fd and start a thread checking the chunks which
+   follow. libxc is to read the data from *out_fd; the thread stops at
+   the end of the stream, leaving fd just after it. Returns NULL with
+   errno set on failure. */
+extern struct integrity_reader *integrity_reader_start(int fd, int *out_fd);
+
+/* Wait for the thread, or stop it if the restore has failed, and free
+   the reader. Returns 0 if every chunk up to the end of the stream was
+   intact, or -1 with errno set and a description of the first problem
+   (e.g. which chunk was corrupt) in msg. */
+extern int integrity_reader_finish(struct integrity_reader *r, int failed,
+                                   char *msg, size_t len);
+
+#endif /* _XENGUEST_INTEGRITY_H_ */
@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include <xenstore.h>
+
+#include "xenguest_logdirty.h"
+
+#define LOGDIRTY_TOKEN "xenguest-logdirty"
+
+/* The device model (qemu) watches logdirty/cmd and writes the command it
+   has just carried out to logdirty/ret. */
+struct logdirty_ctl {
+    struct xs_handle *xsh;
+    int domid;
+    int timeout_ms;
+    char *cmd_path;
+    char *ret_path;
+};
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct logdirty_ctl *logdirty_open(int domid, int timeout_ms)
+{
+    struct logdirty_ctl *ctl;
+    int saved_errno;
+
+    ctl = calloc(1, sizeof(*ctl));
+    if (ctl == NULL)
+        return NULL;
+    ctl->domid = domid;
+    ctl->timeout_ms = timeout_ms;
+
+    if (asprintf(&ctl->cmd_path,
+                 "/local/domain/0/device-model/%u/logdirty/cmd", domid) == -1) {
+        ctl->cmd_path = NULL;
+        goto err;
+    }
+    if (asprintf(&ctl->ret_path,
+                 "/local/domain/0/device-model/%u/logdirty/ret", domid) == -1) {
+        ctl->ret_path = NULL;
+        goto err;
+    }
+
+    ctl->xsh = xs_daemon_open();
+    if (ctl->xsh == NULL) {
+        fprintf(stderr, "logdirty: couldn't contact xenstore: %s",
+                strerror(errno));
+        goto err;
+    }
+    if (!xs_watch(ctl->xsh, ctl->ret_path, LOGDIRTY_TOKEN)) {
+        fprintf(stderr, "logdirty: failed to watch %s: %s",
+                ctl->ret_path, strerror(errno));
+        goto err;
+    }
+    return ctl;
+
+err:
+    saved_errno = errno;
+    logdirty_close(ctl);
+    errno = saved_errno;
+    return NULL;
+}
+
+/* Returns 1 if logdirty/ret holds cmd, 0 otherwise */
+static int logdirty_acked(struct logdirty_ctl *ctl, const char *cmd)
+{
+    unsigned int len;
+    char *ret;
+    int acked;
+
+    ret = xs_read(ctl->xsh, XBT_NULL, ctl->ret_path, &len);
+    if (ret == NULL)
+        return 0;
+    acked = (len == strlen(cmd)) && !memcmp(ret, cmd, len);
+    free(ret);
+    return acked;
+}
+
+int logdirty_switch(struct logdirty_ctl *ctl, unsigned enable,
+                    uint64_t *elapsed_us)
+{
+    const char *cmd = enable ? "enable" : "disable";
+    struct pollfd pfd;
+    uint64_t start, deadline, now;
+    char **vec;
+    int r;
+
+    start = now_us();
+    deadline = start + (uint64_t)ctl->timeout_ms * 1000;
+
+    /* Clear any acknowledgement of a previous command so that a stale
+       "enable" cannot be mistaken for the answer to this one. */
+    xs_rm(ctl->xsh, XBT_NULL, ctl->ret_path);
+    if (!xs_write(ctl->xsh, XBT_NULL, ctl->cmd_path, cmd, strlen(cmd))) {
+        fprintf(stderr, "logdirty: failed to write %s to %s: %s",
+                cmd, ctl->cmd_path, strerror(errno));
+        return -1;
+    }
+
+    pfd.fd = xs_fileno(ctl->xsh);
+    pfd.events = POLLIN;
+    for (;;) {
+        if (logdirty_acked(ctl, cmd))
+            break;
+
+        now = now_us();
+        if (now >= deadline) {
+            fprintf(stderr, "logdirty: warning: qemu did not acknowledge "
+                    "%s for domain %d within %dms",
+                    cmd, ctl->domid, ctl->timeout_ms);
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        r = poll(&pfd, 1, (deadline - now + 999) / 1000);
+        if (r < 0 && errno != EINTR) {
+            fprintf(stderr, "logdirty: poll failed: %s", strerror(errno));
+            return -1;
+        }
+        if (r > 0) {
+            /* Drain the event; the node is re-read at the top of the loop */
+            vec = xs_read_watch(ctl->xsh, NULL);
+            free(vec);
+        }
+    }
+
+    if (elapsed_us)
+        *elapsed_us = now_us() - start;
+    return 0;
+}
+
+void logdirty_close(struct logdirty_ctl *ctl)
+{
+    if (ctl == NULL)
+        return;
+    if (ctl->xsh) {
+        if (ctl->ret_path)
+            xs_unwatch(ctl->xsh, ctl->ret_path, LOGDIRTY_TOKEN);
+        xs_daemon_close(ctl->xsh);
+    }
+    free(ctl->cmd_path);
+    free(ctl->ret_path);
+    free(ctl);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
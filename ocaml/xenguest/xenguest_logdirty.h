@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+#ifndef _XENGUEST_LOGDIRTY_H_
+#define _XENGUEST_LOGDIRTY_H_
+
+#include <stdint.h>
+
+/* Default time to wait for qemu to acknowledge a log-dirty switch */
+#define LOGDIRTY_TIMEOUT_MS 10000
+
+struct logdirty_ctl;
+
+/* Open a xenstore connection for switching qemu log-dirty mode of domid
+   and register a watch on its logdirty/ret node. Returns NULL with errno
+   set on failure. */
+extern struct logdirty_ctl *logdirty_open(int domid, int timeout_ms);
+
+/* Ask qemu to enable or disable log-dirty mode and wait until it has
+   acknowledged by writing the same command to logdirty/ret. On success
+   returns 0 and stores the round-trip time in *elapsed_us (if non-NULL).
+   On failure returns -1 with errno set (ETIMEDOUT if qemu did not
+   answer in time; callers may treat that as a warning since qemu may
+   have switched without echoing the command). */
+extern int logdirty_switch(struct logdirty_ctl *ctl, unsigned enable,
+                           uint64_t *elapsed_us);
+
+extern void logdirty_close(struct logdirty_ctl *ctl);
+
+#endif /* _XENGUEST_LOGDIRTY_H_ */
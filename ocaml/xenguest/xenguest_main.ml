@@ -62,21 +62,7 @@ let closelog () = match !debug_fd with
   | None -> ()
 
 (* Types of messages we can transmit *****************************************)
-type message =
-    | Stdout of string (* captured stdout from libxenguest *)
-    | Stderr of string (* captured stderr from libxenguest *)
-    | Error of string  (* an actual error that we detected *)
-    | Suspend          (* request the caller suspends the domain *)
-    | Info of string   (* some info that we want to send back *)
-    | Result of string (* the result of the operation *)
-
-let string_of_message = function
-  | Stdout x -> "stdout:" ^ (String.escaped x)
-  | Stderr x -> "stderr:" ^ (String.escaped x)
-  | Error x  -> "error:" ^ (String.escaped x)
-  | Suspend  -> "suspend:"
-  | Info x   -> "info:" ^ (String.escaped x)
-  | Result x -> "result:" ^ (String.escaped x)
+open Xenguest_protocol
 
 (* Parameter parsing code ****************************************************)
 
@@ -119,13 +105,58 @@ let has_param param = Hashtbl.find params param <> None
 let controlinfd = ref (-1)
 let controloutfd = ref (-1)
 
-let control_write (x: message) =
-  let x = string_of_message x in
-  debug "control_write: %s" x;
+(** Text unless the parent asked for (and we acknowledged) framing *)
+let control_protocol = ref Text
+
+(* With -fork two processes write to the control fd: the child, from the
+   C callbacks (Suspend, and the post-copy Result), and the parent, which
+   relays the child's output. A write(2) of up to PIPE_BUF (4096) bytes to
+   a pipe is not interleaved with others, so each message is sent with a
+   single write and output is relayed in pieces which stay below PIPE_BUF
+   even once escaped (at most 4 bytes per byte) for the text protocol.
+   The parent's Result or Error, which can be longer, is only sent after
+   the child has exited. *)
+let max_relay = 1000
+
+let rec control_write (x: message) =
   let outfd = file_descr_of_int !controloutfd in
-  let oc = Unix.out_channel_of_descr outfd in
-  output_string oc (x ^ "\n");
-  flush oc
+  let send s = ignore (Unix.write outfd s 0 (String.length s)) in
+  let split s = String.sub s 0 max_relay, String.sub s max_relay (String.length s - max_relay) in
+  match !control_protocol, x with
+  | _, Stdout s when String.length s > max_relay ->
+    let a, b = split s in control_write (Stdout a); control_write (Stdout b)
+  | _, Stderr s when String.length s > max_relay ->
+    let a, b = split s in control_write (Stderr a); control_write (Stderr b)
+  | Text, _ ->
+    let x = string_of_message x in
+    debug "control_write: %s" x;
+    send (x ^ "\n")
+  | Framed, _ ->
+    (* The parent need not pick libxc's progress, or our measurements of
+       a live save, out of its output *)
+    let x = match x with
+      | Stdout s | Stderr s ->
+        begin match progress_of_output s, convergence_of_output s with
+        | Some p, _ -> Progress p
+        | None, Some c -> Convergence c
+        | None, None -> x
+        end
+      | x -> x in
+    debug "control_write: %c (%d bytes)" (tag_of_message x) (String.length (payload_of_message x));
+    send (frame_of_message x)
+
+(** Agree to the protocol offered by the parent (in our environment, see
+    Xenguest_protocol.offer_env), before sending anything else *)
+let control_negotiate () =
+  match (try Some (Sys.getenv offer_env) with Not_found -> None) with
+  | None -> ()
+  | Some "framed" ->
+    let oc = Unix.out_channel_of_descr (file_descr_of_int !controloutfd) in
+    output_string oc (ack ^ "\n");
+    flush oc;
+    control_protocol := Framed;
+    debug "control protocol: framed"
+  | Some x -> debug "control protocol %s not supported; using text" x
 
 let control_read () : string =
   let infd = file_descr_of_int !controlinfd in
@@ -134,7 +165,18 @@ let control_read () : string =
   debug "control_read: %s" result;
   result
 
-let fork_capture_stdout_stderr callback f x =
+(** Split the complete lines off the front of buf, returning them and the
+    remaining partial line *)
+let rec split_lines acc buf =
+	if String.contains buf '\n' then begin
+		let i = String.index buf '\n' in
+		split_lines (String.sub buf 0 i :: acc)
+			(String.sub buf (i + 1) (String.length buf - i - 1))
+	end else List.rev acc, buf
+
+(* If [control] is given, lines arriving on the control channel while the
+   child runs are passed to it. *)
+let fork_capture_stdout_stderr ?control callback f x =
 	let stdout_r, stdout_w = Unix.pipe ()
 	and stderr_r, stderr_w = Unix.pipe ()
 	and output_r, output_w = Unix.pipe () in
@@ -164,12 +206,29 @@ let fork_capture_stdout_stderr callback f x =
 	(* We want to make sure we drain stdout and stderr before quitting *)
 	let active_fds = ref [ stdout_r; stderr_r; output_r ] in
 
+	let control_in = file_descr_of_int !controlinfd in
+	let control_fds = ref (match control with Some _ -> [ control_in ] | None -> []) in
+	let control_buf = ref "" in
+
 	let result = ref "" in
 	while not(!finished) do
 		let r, _, _ =
-			try Unix.select !active_fds [] [] (-1.)
+			try Unix.select (!active_fds @ !control_fds) [] [] (-1.)
 			with Unix.Unix_error (Unix.EINTR, _, _) -> [], [], [] in
-	
+
+		if List.mem control_in r then begin
+			let n = Unix.read control_in buf 0 (String.length buf) in
+			if n = 0 then begin
+			    debug "Zero-length read on control channel; ignoring it";
+			    control_fds := []
+			end else begin
+			    let lines, rest = split_lines [] (!control_buf ^ String.sub buf 0 n) in
+			    control_buf := rest;
+			    match control with
+			    | Some f -> List.iter f lines
+			    | None -> ()
+			end
+		end;
 		if List.mem stdout_r r then begin
 			let n = Unix.read stdout_r buf 0 (String.length buf) in
 			if n = 0 then begin
@@ -192,7 +251,7 @@ let fork_capture_stdout_stderr callback f x =
 			    debug "Zero-length read on output; closing";
 			    Unix.close output_r;
 			    active_fds := List.filter (fun x -> x <> output_r) !active_fds
-			end else result := String.sub buf 0 n
+			end else result := !result ^ String.sub buf 0 n
 		end;
 		finished := !active_fds = []
 	done;
@@ -217,13 +276,43 @@ let fork_capture_stdout_stderr callback f x =
 let suspend_callback id : bool =
 	if id = int_of_string (get_param "domid") then begin
 		control_write Suspend;
-		let line = control_read () in
-		print_endline line;
+		(* A rate change here is not the answer we are waiting for *)
+		let rec answer () =
+			let line = control_read () in
+			if Stringext.String.startswith "ratelimit:" line then begin
+				error "ignoring %s: rate changes need -fork and the suspend fast path" line;
+				answer ()
+			end else line in
+		print_endline (answer ());
 		true
 	end else false
 
 let _ = Callback.register "suspend_callback" suspend_callback
 
+(** Called from C when a post-copy restore can start the guest: the caller
+    reads qemu's state off the stream and answers once it has *)
+let postcopy_callback store_mfn console_mfn : bool =
+	control_write (Result (Postcopy_ready { store_mfn = store_mfn; console_mfn = console_mfn; protocol = None }));
+	let line = control_read () in
+	debug "postcopy: %s" line;
+	line = "postcopy:continue"
+
+let _ = Callback.register "postcopy_callback" postcopy_callback
+
+(** Pipes used instead of the control channel to request a suspend *)
+let suspend_fds = ref None
+
+(** OCaml equivalent of the C suspend fast path, for the fake operations *)
+let fast_suspend req ack domid =
+	let buf = String.make 4 '\000' in
+	buf.[0] <- char_of_int ((domid lsr 24) land 0xff);
+	buf.[1] <- char_of_int ((domid lsr 16) land 0xff);
+	buf.[2] <- char_of_int ((domid lsr 8) land 0xff);
+	buf.[3] <- char_of_int (domid land 0xff);
+	ignore (Unix.write req buf 0 4);
+	let ack_buf = String.make 1 '\000' in
+	Unix.read ack ack_buf 0 1 = 1 && ack_buf.[0] = '\001'
+
 (** real operations *)
 let with_xenguest f =
 	let xc = Xenguest.init () in
@@ -234,8 +323,7 @@ let linux_build_real domid mem_max_mib mem_start_mib image ramdisk cmdline featu
 		let store_mfn, console_mfn, proto =
 			Xenguest.linux_build xc domid mem_max_mib mem_start_mib image
 			                     ramdisk cmdline features flags store_port store_domid console_port console_domid in
-		String.concat " " [ Nativeint.to_string store_mfn;
-		                    Nativeint.to_string console_mfn; proto ]
+		Domain { store_mfn = store_mfn; console_mfn = console_mfn; protocol = Some proto }
 	)
 
 let hvm_build_real domid mem_max_mib mem_start_mib image store_port store_domid console_port console_domid =
@@ -243,37 +331,69 @@ let hvm_build_real domid mem_max_mib mem_start_mib image store_port store_domid
 		let store_mfn, console_mfn =
 			Xenguest.hvm_build xc domid mem_max_mib mem_start_mib image
 			                   store_port store_domid console_port console_domid in
-		String.concat " " [Nativeint.to_string store_mfn;
-		                   Nativeint.to_string console_mfn]
+		Domain { store_mfn = store_mfn; console_mfn = console_mfn; protocol = None }
 	)
 
 let domain_save_real fd domid x y flags hvm =
 	with_xenguest (fun xc ->
 		Xenguest.domain_save xc fd domid x y flags hvm;
-		""
+		Done
 	)
 
-let domain_restore_real fd domid store_port store_domid console_port console_domid hvm no_incr_generationid =
+let domain_restore_real fd domid store_port store_domid console_port console_domid hvm no_incr_generationid mem_target_mib =
 	with_xenguest (fun xc ->
 		let store_mfn, console_mfn =
 		Xenguest.domain_restore xc fd domid store_port store_domid
-					console_port console_domid hvm no_incr_generationid in
-		String.concat " "  [ Nativeint.to_string store_mfn;
-				     Nativeint.to_string console_mfn ]
+					console_port console_domid hvm no_incr_generationid mem_target_mib in
+		Domain { store_mfn = store_mfn; console_mfn = console_mfn; protocol = None }
+	)
+
+(* clones are "domid:store_port:store_domid:console_port:console_domid",
+   comma-separated *)
+let clones_of_string s =
+	Array.of_list (List.map (fun c ->
+		match List.map int_of_string (Stringext.String.split ':' c) with
+		| [ domid; store_port; store_domid; console_port; console_domid ] ->
+			domid, store_port, store_domid, console_port, console_domid
+		| _ -> failwith (sprintf "clone '%s' is not domid:store_port:store_domid:console_port:console_domid" c)
+	) (Stringext.String.split ',' s))
+
+let domain_restore_fanout_real fd clones hvm no_incr_generationid share =
+	with_xenguest (fun xc ->
+		let results = Xenguest.domain_restore_fanout xc fd clones hvm no_incr_generationid share in
+		Clones (Array.to_list (Array.mapi (fun i (err, store_mfn, console_mfn) ->
+			let (domid, _, _, _, _) = clones.(i) in
+			if err = "" then domid, Some { store_mfn = store_mfn; console_mfn = console_mfn; protocol = None }
+			else begin
+				error "domid = %d; restore failed: %s" domid err;
+				domid, None
+			end
+		) results))
 	)
 
 (** fake operations *)
-let linux_build_fake domid mem_max_mib mem_start_mib image ramdisk cmdline features flags store_port store_domid console_port console_domid = "10 10 x86-32"
-let hvm_build_fake domid mem_max_mib mem_start_mib image store_port store_domid console_port console_domid = "2901 2901"
-let domain_save_fake fd domid x y flags hvm = Unix.sleep 1; ignore (suspend_callback domid); ""
-let domain_restore_fake fd domid store_port store_domid console_port console_domid hvm no_incr_generationid = "10 10"
+let fake_pages mfn = { store_mfn = mfn; console_mfn = mfn; protocol = None }
+let linux_build_fake domid mem_max_mib mem_start_mib image ramdisk cmdline features flags store_port store_domid console_port console_domid =
+	Domain { (fake_pages 10n) with protocol = Some "x86-32" }
+let hvm_build_fake domid mem_max_mib mem_start_mib image store_port store_domid console_port console_domid = Domain (fake_pages 2901n)
+let domain_save_fake fd domid x y flags hvm =
+	Unix.sleep 1;
+	begin match !suspend_fds with
+	| Some (req, ack) -> ignore (fast_suspend req ack domid)
+	| None -> ignore (suspend_callback domid)
+	end;
+	Done
+let domain_restore_fake fd domid store_port store_domid console_port console_domid hvm no_incr_generationid mem_target_mib = Domain (fake_pages 10n)
+let domain_restore_fanout_fake fd clones hvm no_incr_generationid share =
+	Clones (Array.to_list (Array.map (fun (domid, _, _, _, _) -> domid, Some (fake_pages 10n)) clones))
 
 (** operation vector *)
 type ops = {
-	linux_build: int -> int -> int -> string -> string option -> string -> string -> int -> int -> int -> int -> int -> string;
-	hvm_build: int -> int -> int -> string -> int -> int -> int -> int -> string;
-	domain_save: Unix.file_descr -> int -> int -> int -> Xenguest.suspend_flags list -> bool -> string;
-	domain_restore: Unix.file_descr -> int -> int -> int -> int -> int -> bool -> bool -> string;
+	linux_build: int -> int -> int -> string -> string option -> string -> string -> int -> int -> int -> int -> int -> result;
+	hvm_build: int -> int -> int -> string -> int -> int -> int -> int -> result;
+	domain_save: Unix.file_descr -> int -> int -> int -> Xenguest.suspend_flags list -> bool -> result;
+	domain_restore: Unix.file_descr -> int -> int -> int -> int -> int -> bool -> bool -> int -> result;
+	domain_restore_fanout: Unix.file_descr -> (int * int * int * int * int) array -> bool -> bool -> bool -> result;
 }
 
 let tcp_keepcnt = 5
@@ -318,12 +438,27 @@ let _ =
 	add_param "flags" "";
 	add_param "mem_max_mib" "maximum memory allocation / MiB";
 	add_param "mem_start_mib" "initial memory allocation / MiB";
+	add_param "mem_target_mib" "hvm restore: populate-on-demand target / MiB, for a guest built with less than its maximum";
 	add_param "fork" "true to fork a background thread to capture stdout and stderr";
+	add_param "suspend_req_fd" "the file-descriptor on which to request a suspend (fast path)";
+	add_param "suspend_ack_fd" "the file-descriptor on which the suspend is acknowledged (fast path)";
+	add_param "downtime_ms" "live save: report the predicted downtime against this budget in ms";
+	add_param "auto_converge" "live save: throttle the guest vCPUs if it dirties memory faster than it is sent";
+	add_param "rate_limit" "save: maximum bytes/s for this stream (may be changed by a ratelimit: control message)";
+	add_param "host_rate_limit" "save: maximum bytes/s shared between all rate-limited streams on the host";
+	add_param "checkpoint_interval_ms" "save: keep replicating the domain, one checkpoint per this many ms";
+	add_param "checkpoint_epochs" "save: stop after this many checkpoints (default: when the stream breaks)";
+	add_param "delta" "save: with checkpoint_interval_ms, send each checkpoint's pages as deltas";
+	add_param "integrity" "save: send a checksum with every chunk of the stream (checked by any restore)";
+	add_param "postcopy_sample_ms" "hvm save: post-copy, sampling the working set for this many ms first";
+	add_param "clones" "restore_fanout: the domains to restore the image into, as domid:store_port:store_domid:console_port:console_domid,...";
+	add_param "share" "hvm_restore_fanout: share the memory which the clones have in common";
+	add_param "trace" "append a Chrome trace of the time spent in libxc, xenstore and the fast path to this file";
 
 	let fake = ref false in
 
 	Arg.parse ([
-	  "-mode", Arg.Symbol ([ "save"; "hvm_save"; "restore"; "hvm_restore"; "resume_slow"; "linux_build"; "hvm_build"; "test" ],
+	  "-mode", Arg.Symbol ([ "save"; "hvm_save"; "restore"; "hvm_restore"; "restore_fanout"; "hvm_restore_fanout"; "resume_slow"; "linux_build"; "hvm_build"; "test" ],
 			       fun x -> mode := Some x),
 	  "set the mode of operation";
 	] @ (get_args ()) @ [
@@ -350,6 +485,8 @@ let _ =
 	  List.map file_descr_of_int [  !controlinfd; !controloutfd ] @
 	    [ Unix.stdout; Unix.stderr ] @
 	    (if has_param "fd" then [ file_descr_of_int (int_of_string (get_param "fd")) ] else []) @
+	    (List.map (fun p -> file_descr_of_int (int_of_string (get_param p)))
+	       (List.filter has_param [ "suspend_req_fd"; "suspend_ack_fd" ])) @
 	    (match !debug_fd with Some x -> [ x ] | None -> []) in
 
 	(* Prevent accidentally inheriting someone elses fd *)
@@ -357,26 +494,40 @@ let _ =
 
 	debug "Arguments parsed successfully [ %s ]." (String.concat "; " (Array.to_list Sys.argv));
 
+	control_negotiate ();
+
 	let capture_stdout_stderr = has_param "fork" && (get_param "fork" = "true") in
 	if capture_stdout_stderr
 	then debug "Will fork to capture stdout and stderr from libxenguest"
 	else debug "Will not fork; stdout and stderr will not be redirected";
 
-	let with_logging f = if capture_stdout_stderr
-	  then fork_capture_stdout_stderr control_write f ()
-	  else f () in
+	let with_logging ?control f = if capture_stdout_stderr
+	  then result_of_payload (fork_capture_stdout_stderr ?control control_write (fun () -> payload_of_result (f ())) ())
+	  else match control with
+	  | Some _ -> failwith "control messages can only be served with -fork"
+	  | None -> f () in
+
+	(* Each process (with -fork, the child doing the work) appends its
+	   own spans when it exits *)
+	if has_param "trace" then begin
+	  debug "tracing to %s" (get_param "trace");
+	  Trace.start ();
+	  Trace.dump_at_exit ~on_error:(fun msg -> error "%s" msg) (get_param "trace")
+	end;
 
 	let real_ops = {
 		linux_build = linux_build_real;
 		hvm_build = hvm_build_real;
 		domain_save = domain_save_real;
 		domain_restore = domain_restore_real;
+		domain_restore_fanout = domain_restore_fanout_real;
 	} in
 	let fake_ops = {
 		linux_build = linux_build_fake;
 		hvm_build = hvm_build_fake;
 		domain_save = domain_save_fake;
 		domain_restore = domain_restore_fake;
+		domain_restore_fanout = domain_restore_fanout_fake;
 	} in
 
 	let ops = if !fake then fake_ops else real_ops in
@@ -395,9 +546,61 @@ let _ =
 		  let fd = file_descr_of_int (int_of_string (get_param "fd"))
 		  and domid = int_of_string (get_param "domid")
 		  and flags = List.concat [ if has_param "live" then [ Xenguest.Live ] else [];
-					    if has_param "debug" then [ Xenguest.Debug ] else [] ] in
+					    if has_param "debug" then [ Xenguest.Debug ] else [];
+					    if has_param "delta" then [ Xenguest.Delta ] else [] ] in
 		  fix_fd fd;
-		  with_logging (fun () -> ops.domain_save fd domid 0 0 flags hvm)
+		  if has_param "suspend_req_fd" && has_param "suspend_ack_fd" then begin
+		    let req = file_descr_of_int (int_of_string (get_param "suspend_req_fd"))
+		    and ack = file_descr_of_int (int_of_string (get_param "suspend_ack_fd")) in
+		    debug "using the suspend fast path";
+		    suspend_fds := Some (req, ack);
+		    if not !fake then Xenguest.set_suspend_fds req ack
+		  end;
+		  if has_param "downtime_ms" then begin
+		    let downtime_ms = int_of_string (get_param "downtime_ms")
+		    and auto_converge = has_param "auto_converge" && bool_of_string (get_param "auto_converge") in
+		    debug "convergence: downtime budget %dms auto_converge %b" downtime_ms auto_converge;
+		    if not !fake then Xenguest.set_convergence_policy downtime_ms auto_converge
+		  end;
+		  if has_param "checkpoint_interval_ms" then begin
+		    let interval_ms = int_of_string (get_param "checkpoint_interval_ms")
+		    and epochs = if has_param "checkpoint_epochs" then int_of_string (get_param "checkpoint_epochs") else 0 in
+		    debug "checkpoint mode: every %dms, %d epochs" interval_ms epochs;
+		    if not !fake then Xenguest.set_checkpoint interval_ms epochs
+		  end;
+		  if has_param "delta" && not (has_param "checkpoint_interval_ms") then
+		    failwith "-delta needs -checkpoint_interval_ms: libxc only sends checkpoints as deltas";
+		  if has_param "integrity" && bool_of_string (get_param "integrity") then begin
+		    debug "integrity: checksumming the stream";
+		    if not !fake then Xenguest.set_integrity true
+		  end;
+		  if has_param "postcopy_sample_ms" then begin
+		    let sample_ms = int_of_string (get_param "postcopy_sample_ms") in
+		    debug "post-copy: sampling the working set for %dms" sample_ms;
+		    if not !fake then Xenguest.set_postcopy sample_ms
+		  end;
+		  let control =
+		    if has_param "rate_limit" || has_param "host_rate_limit" then begin
+		      let get name = if has_param name then int_of_string (get_param name) else 0 in
+		      let stream_bps = get "rate_limit" and host_bps = get "host_rate_limit" in
+		      let ctl_r, ctl_w = Unix.pipe () in
+		      debug "rate limit: %d bytes/s for this stream, %d bytes/s for the host" stream_bps host_bps;
+		      if not !fake then Xenguest.set_rate_limit stream_bps host_bps ctl_r;
+		      (* Without the suspend fast path the control channel is read by
+		         the suspend callback, so it can't carry rate changes too;
+		         without -fork nothing reads it while libxc runs *)
+		      if !suspend_fds = None || not capture_stdout_stderr then begin
+		        error "rate limit changes need -fork and the suspend fast path; they will be ignored";
+		        None
+		      end else Some (fun line ->
+		        match Stringext.String.split ~limit:2 ':' line with
+		        | [ "ratelimit"; bps ] ->
+		            debug "changing the stream rate limit to %s bytes/s" bps;
+		            let bps = string_of_int (int_of_string bps) ^ "\n" in
+		            ignore (Unix.write ctl_w bps 0 (String.length bps))
+		        | _ -> error "unexpected control message: %s" line)
+		    end else None in
+		  with_logging ?control (fun () -> ops.domain_save fd domid 0 0 flags hvm)
 	      | Some "hvm_restore"
 	      | Some "restore" ->
 		  debug "restore mode selected";
@@ -409,9 +612,21 @@ let _ =
 		  and store_domid = int_of_string (get_param "store_domid")
 		  and console_port = int_of_string (get_param "console_port")
 		  and console_domid = int_of_string (get_param "console_domid")
-		  and no_incr_generationid = bool_of_string (get_param "no_incr_generationid") in
+		  and no_incr_generationid = bool_of_string (get_param "no_incr_generationid")
+		  and mem_target_mib = if has_param "mem_target_mib" then int_of_string (get_param "mem_target_mib") else 0 in
+		  fix_fd fd;
+		  with_logging (fun () -> ops.domain_restore fd domid store_port store_domid console_port console_domid hvm no_incr_generationid mem_target_mib)
+	      | Some "hvm_restore_fanout"
+	      | Some "restore_fanout" ->
+		  debug "restore_fanout mode selected";
+		  let hvm = !mode = Some "hvm_restore_fanout" in
+		  require [ "fd"; "clones" ];
+		  let fd = file_descr_of_int (int_of_string (get_param "fd"))
+		  and clones = clones_of_string (get_param "clones")
+		  and no_incr_generationid = has_param "no_incr_generationid" && bool_of_string (get_param "no_incr_generationid")
+		  and share = has_param "share" && bool_of_string (get_param "share") in
 		  fix_fd fd;
-		  with_logging (fun () -> ops.domain_restore fd domid store_port store_domid console_port console_domid hvm no_incr_generationid)
+		  with_logging (fun () -> ops.domain_restore_fanout fd clones hvm no_incr_generationid share)
 	      | Some "linux_build" ->
 		  debug "linux_build mode selected";
 		  require [ "domid"; "mem_max_mib"; "mem_start_mib"; "image"; "ramdisk"; "cmdline"; "features"; "flags";
@@ -449,7 +664,7 @@ let _ =
 			  store_port store_domid console_port console_domid)
 	      | Some "test" ->
 		  debug "test mode selected";
-		  with_logging (fun () -> ignore(Unix.system "/tmp/test"); "result")
+		  with_logging (fun () -> ignore(Unix.system "/tmp/test"); Done)
 
 	      | Some "resume_slow" ->
 		  debug "resume slow selected";
@@ -457,7 +672,7 @@ let _ =
 		  let domid = int_of_string (get_param "domid") in
 		  with_logging (fun () -> with_xenguest (fun xc ->
 		    Xenguest.domain_resume_slow xc domid;
-		    ""))
+		    Done))
 	      | Some x ->
 		  let msg = sprintf "Unrecognised mode: %s" x in
 		  error "%s" msg;
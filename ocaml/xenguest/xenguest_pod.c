@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include <xenctrl.h>
+#include <xen/hvm/params.h>
+
+#include "xenguest_pod.h"
+#include "trace_stub.h"
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int page_is_zero(const uint8_t *p)
+{
+    const uint64_t *w = (const uint64_t *)p;
+    unsigned int i;
+
+    for (i = 0; i < XC_PAGE_SIZE / sizeof(*w); i++)
+        if (w[i])
+            return 0;
+    return 1;
+}
+
+/* The gfns of the pages which Xen or the device model map, which must
+   stay populated */
+static const int special_params[] = {
+    HVM_PARAM_IOREQ_PFN,
+    HVM_PARAM_BUFIOREQ_PFN,
+    HVM_PARAM_STORE_PFN,
+#ifdef HVM_PARAM_CONSOLE_PFN
+    HVM_PARAM_CONSOLE_PFN,
+#endif
+    HVM_PARAM_IDENT_PT,
+#ifdef HVM_PARAM_PAGING_RING_PFN
+    HVM_PARAM_PAGING_RING_PFN,
+#endif
+#ifdef HVM_PARAM_ACCESS_RING_PFN
+    HVM_PARAM_ACCESS_RING_PFN,
+#endif
+#ifdef HVM_PARAM_SHARING_RING_PFN
+    HVM_PARAM_SHARING_RING_PFN,
+#endif
+};
+#define NR_SPECIAL (sizeof(special_params) / sizeof(special_params[0]))
+
+static int is_special(const unsigned long *special, xen_pfn_t gfn)
+{
+    unsigned int i;
+
+    for (i = 0; i < NR_SPECIAL; i++)
+        if (special[i] && special[i] == gfn)
+            return 1;
+    return 0;
+}
+
+int pod_save_stats(xc_interface *xch, uint32_t domid, struct pod_stats *st)
+{
+    int max_gpfn;
+
+    memset(st, 0, sizeof(*st));
+    max_gpfn = xc_domain_maximum_gpfn(xch, domid);
+    if (max_gpfn < 0 ||
+        xc_domain_get_pod_target(xch, domid, &st->tot_pages, &st->pod_cache,
+                                 &st->pod_entries))
+        return -1;
+    /* The PoD cache is memory the guest has not been given yet */
+    st->gfns = (uint64_t)max_gpfn + 1;
+    st->populated = st->tot_pages - st->pod_cache;
+    if (st->populated + st->pod_entries < st->gfns)
+        st->unpopulated = st->gfns - st->populated - st->pod_entries;
+    printf("pod: %"PRIu64" of %"PRIu64" gfns unpopulated (%"PRIu64" MiB "
+           "not sent), %"PRIu64" PoD entries", st->unpopulated, st->gfns,
+           (st->unpopulated * XC_PAGE_SIZE) >> 20, st->pod_entries);
+    return 0;
+}
+
+/* Replace the zero pages among count gfns with PoD entries */
+static int reclaim(xc_interface *xch, uint32_t domid, xen_pfn_t *gfns,
+                   unsigned long count)
+{
+    if (count == 0)
+        return 0;
+    if (xc_domain_decrease_reservation_exact(xch, domid, count, 0, gfns))
+        return -1;
+    return xc_domain_populate_physmap_exact(xch, domid, count, 0,
+                                            XENMEMF_populate_on_demand, gfns);
+}
+
+int pod_restore_sparse(xc_interface *xch, uint32_t domid,
+                       uint64_t target_pages, struct pod_stats *st)
+{
+    uint64_t start = trace_begin(), t0 = now_us();
+    unsigned long special[NR_SPECIAL];
+    xen_pfn_t types[POD_BATCH], gfns[POD_BATCH], zero[POD_BATCH];
+    int err[POD_BATCH];
+    unsigned long base, i, n, mapped, nr_zero;
+    uint8_t *pages;
+    int max_gpfn, rc = -1;
+
+    memset(st, 0, sizeof(*st));
+    for (i = 0; i < NR_SPECIAL; i++)
+        if (xc_get_hvm_param(xch, domid, special_params[i], &special[i]))
+            special[i] = 0;
+    max_gpfn = xc_domain_maximum_gpfn(xch, domid);
+    if (max_gpfn < 0)
+        return -1;
+    st->gfns = (uint64_t)max_gpfn + 1;
+
+    for (base = 0; base < st->gfns; base += n) {
+        n = st->gfns - base < POD_BATCH ? st->gfns - base : POD_BATCH;
+        for (i = 0; i < n; i++)
+            types[i] = base + i;
+        if (xc_get_pfn_type_batch(xch, domid, n, types))
+            goto out;
+
+        mapped = 0;
+        for (i = 0; i < n; i++) {
+            if ((types[i] & XEN_DOMCTL_PFINFO_LTAB_MASK) ==
+                XEN_DOMCTL_PFINFO_XTAB)
+                st->unpopulated++;
+            else if (!is_special(special, base + i))
+                gfns[mapped++] = base + i;
+        }
+        if (mapped == 0)
+            continue;
+
+        pages = xc_map_foreign_bulk(xch, domid, PROT_READ, gfns, err, mapped);
+        if (pages == NULL)
+            goto out;
+        nr_zero = 0;
+        for (i = 0; i < mapped; i++) {
+            if (err[i])
+                continue;
+            if (page_is_zero(pages + i * XC_PAGE_SIZE))
+                zero[nr_zero++] = gfns[i];
+        }
+        munmap(pages, mapped * XC_PAGE_SIZE);
+
+        if (reclaim(xch, domid, zero, nr_zero))
+            goto out;
+        st->reclaimed += nr_zero;
+    }
+    st->populated = st->gfns - st->unpopulated - st->reclaimed;
+
+    /* Xen ignores a target for a domain without PoD entries */
+    if (xc_domain_set_pod_target(xch, domid, target_pages, &st->tot_pages,
+                                 &st->pod_cache, &st->pod_entries))
+        goto out;
+    rc = 0;
+
+out:
+    st->elapsed_us = now_us() - t0;
+    trace_end("restore", "pod_restore_sparse", start);
+    if (rc == 0)
+        printf("pod: %"PRIu64" zero pages of %"PRIu64" returned to PoD "
+               "(%"PRIu64" MiB), %"PRIu64" PoD entries, target %"PRIu64
+               " pages, in %"PRIu64"ms", st->reclaimed,
+               st->populated + st->reclaimed,
+               (st->reclaimed * XC_PAGE_SIZE) >> 20, st->pod_entries,
+               target_pages, st->elapsed_us / 1000);
+    return rc;
+}
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
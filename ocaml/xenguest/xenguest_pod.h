@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+#ifndef _XENGUEST_POD_H_
+#define _XENGUEST_POD_H_
+
+#include <stdint.h>
+#include <xenctrl.h>
+
+/* Populate-on-demand (PoD) guests across save and restore. A guest built
+   with a target below its size has PoD entries in place of the memory
+   it has not touched. libxc omits unpopulated gfns (holes, pages the
+   balloon driver gave back) from the stream, but it reads every PoD
+   entry, which populates it with a zero page, and the receiver installs
+   all of those: the guest comes back fully populated, if it fits at all.
+
+   So after a restore, while the guest is still paused, its zero pages
+   are given back to Xen and replaced with PoD entries, and the PoD
+   target is set again. The guest reads the same (zero) contents, and
+   has the same sparse layout as on the sender.
+
+   This happens only once the restore is complete: libxc populates every
+   page it receives and has no hook to hand a zero page back as it goes.
+   So the receiving host must have the guest's full size free for the
+   duration of the restore, even though the guest keeps only its target
+   afterwards. */
+#define POD_BATCH 1024
+
+struct pod_stats {
+    uint64_t gfns;              /* 0 .. maximum gpfn */
+    uint64_t unpopulated;       /* gfns with no page */
+    uint64_t populated;         /* pages with contents */
+    uint64_t reclaimed;         /* zero pages turned into PoD entries */
+    uint64_t tot_pages, pod_cache, pod_entries;
+    uint64_t elapsed_us;
+};
+
+/* Account for domid's memory before a save: libxc sends nothing for the
+   unpopulated gfns. Returns 0, or -1 with the error on xch. */
+extern int pod_save_stats(xc_interface *xch, uint32_t domid,
+                          struct pod_stats *st);
+
+/* Turn the zero pages of domid, a paused HVM guest which has just been
+   restored, into PoD entries and set its PoD target to target_pages.
+   Pages Xen or the device model use (ioreq, xenstore, console, ring
+   pages) are left alone. Returns 0, or -1 with the error on xch. */
+extern int pod_restore_sparse(xc_interface *xch, uint32_t domid,
+                              uint64_t target_pages, struct pod_stats *st);
+
+#endif /* _XENGUEST_POD_H_ */
@@ -0,0 +1,242 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <xenctrl.h>
+
+#include "xenguest_populate.h"
+#include "trace_stub.h"
+
+#define ORDER_1G 18
+#define ORDER_2M 9
+
+/* Extents per hypercall: 2MiB extents for up to 1GiB, or 4KiB pages for
+   up to 2MiB */
+#define BATCH (1UL << (ORDER_1G - ORDER_2M))
+
+struct populate_job {
+    xc_interface *xch;
+    uint32_t domid;
+    xen_pfn_t base_pfn;
+    unsigned long nr_pfns;
+    unsigned int nr_chunks;
+    unsigned int next;          /* the next chunk to take (atomic) */
+    pthread_mutex_t lock;       /* protects the rest */
+    int failed;
+    struct populate_stats *st;
+};
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Allocate chunk i from its node: the guest is cut into as many
+   contiguous ranges as there are nodes. This is a preference, Xen falls
+   back to other nodes rather than fail. */
+static unsigned int chunk_mem_flags(struct populate_job *job, unsigned int i)
+{
+#ifdef XENMEMF_node
+    if (job->st->nodes > 1)
+        return XENMEMF_node((uint64_t)i * job->st->nodes / job->nr_chunks);
+#endif
+    return 0;
+}
+
+/* Populate count pages from pfn with the largest extents Xen will give
+   us. Once an extent size has failed it is not tried again in this
+   chunk: the node has run out of them. */
+static int populate_chunk(struct populate_job *job, xen_pfn_t pfn,
+                          unsigned long count, unsigned int mem_flags,
+                          struct populate_stats *cs)
+{
+    xen_pfn_t pfns[BATCH], end = pfn + count, limit;
+    int try_1g = 1, try_2m = 1;
+    unsigned long n;
+    int rc;
+
+    while (pfn < end) {
+        if (try_1g && (pfn & ((1UL << ORDER_1G) - 1)) == 0 &&
+            end - pfn >= (1UL << ORDER_1G)) {
+            pfns[0] = pfn;
+            rc = xc_domain_populate_physmap(job->xch, job->domid, 1, ORDER_1G,
+                                            mem_flags, pfns);
+            if (rc == 1) {
+                cs->extents_1g++;
+                pfn += 1UL << ORDER_1G;
+                continue;
+            }
+            try_1g = 0;
+        }
+
+        /* 2MiB extents up to the next 1GiB boundary */
+        limit = (pfn | ((1UL << ORDER_1G) - 1)) + 1;
+        if (limit > end)
+            limit = end;
+        if (try_2m && (pfn & ((1UL << ORDER_2M) - 1)) == 0) {
+            for (n = 0; pfn + ((n + 1) << ORDER_2M) <= limit; n++)
+                pfns[n] = pfn + (n << ORDER_2M);
+            if (n) {
+                rc = xc_domain_populate_physmap(job->xch, job->domid, n,
+                                                ORDER_2M, mem_flags, pfns);
+                if (rc > 0) {
+                    cs->extents_2m += rc;
+                    pfn += (xen_pfn_t)rc << ORDER_2M;
+                }
+                if (rc == (int)n)
+                    continue;
+                try_2m = 0;
+            }
+        }
+
+        /* 4KiB pages up to the next 2MiB boundary */
+        limit = (pfn | ((1UL << ORDER_2M) - 1)) + 1;
+        if (limit > end)
+            limit = end;
+        for (n = 0; pfn + n < limit; n++)
+            pfns[n] = pfn + n;
+        rc = xc_domain_populate_physmap(job->xch, job->domid, n, 0,
+                                        mem_flags, pfns);
+        if (rc > 0) {
+            cs->pages_4k += rc;
+            pfn += rc;
+        }
+        if (rc != (int)n) {
+            if (rc >= 0)
+                errno = ENOMEM;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void *populate_worker(void *arg)
+{
+    struct populate_job *job = arg;
+    struct populate_stats cs;
+    unsigned long count;
+    unsigned int i;
+    uint64_t t0, us, span;
+    xen_pfn_t pfn;
+    int rc;
+
+    for (;;) {
+        i = __sync_fetch_and_add(&job->next, 1);
+        if (i >= job->nr_chunks)
+            break;
+        pfn = job->base_pfn + (xen_pfn_t)i * POPULATE_CHUNK_PAGES;
+        count = job->nr_pfns - (unsigned long)i * POPULATE_CHUNK_PAGES;
+        if (count > POPULATE_CHUNK_PAGES)
+            count = POPULATE_CHUNK_PAGES;
+
+        memset(&cs, 0, sizeof(cs));
+        span = trace_begin();
+        t0 = now_us();
+        rc = populate_chunk(job, pfn, count, chunk_mem_flags(job, i), &cs);
+        us = now_us() - t0;
+        trace_end("build", "populate_chunk", span);
+
+        pthread_mutex_lock(&job->lock);
+        job->st->extents_1g += cs.extents_1g;
+        job->st->extents_2m += cs.extents_2m;
+        job->st->pages_4k += cs.pages_4k;
+        job->st->chunks++;
+        job->st->chunk_us_total += us;
+        if (us > job->st->chunk_us_max)
+            job->st->chunk_us_max = us;
+        if (rc)
+            job->failed = 1;
+        pthread_mutex_unlock(&job->lock);
+        if (rc) {
+            /* Stop everybody: the build has failed anyway */
+            __sync_fetch_and_add(&job->next, job->nr_chunks);
+            break;
+        }
+    }
+    return NULL;
+}
+
+int populate_parallel(xc_interface *xch, uint32_t domid, xen_pfn_t base_pfn,
+                      unsigned long nr_pfns, unsigned int nr_threads,
+                      struct populate_stats *st)
+{
+    struct populate_job job;
+    pthread_t *threads;
+    xc_physinfo_t info;
+    unsigned int i, started = 0;
+    uint64_t t0 = now_us();
+
+    memset(st, 0, sizeof(*st));
+    memset(&job, 0, sizeof(job));
+    job.xch = xch;
+    job.domid = domid;
+    job.base_pfn = base_pfn;
+    job.nr_pfns = nr_pfns;
+    job.nr_chunks = (nr_pfns + POPULATE_CHUNK_PAGES - 1) / POPULATE_CHUNK_PAGES;
+    job.st = st;
+    pthread_mutex_init(&job.lock, NULL);
+
+    memset(&info, 0, sizeof(info));
+    st->nodes = xc_physinfo(xch, &info) == 0 && info.nr_nodes ? info.nr_nodes : 1;
+    if (nr_threads > job.nr_chunks)
+        nr_threads = job.nr_chunks;
+    if (nr_threads == 0)
+        nr_threads = 1;
+
+    /* This thread is one of the workers */
+    threads = calloc(nr_threads, sizeof(*threads));
+    for (i = 1; threads && i < nr_threads; i++) {
+        if (pthread_create(&threads[i], NULL, populate_worker, &job))
+            break;
+        started++;
+    }
+    populate_worker(&job);
+    for (i = 1; i <= started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&job.lock);
+
+    st->threads = started + 1;
+    st->elapsed_us = now_us() - t0;
+    printf("populate: %lu MiB from pfn %#"PRIx64" in %.2fs with %u threads "
+           "over %u nodes: %u chunks, %.1fms mean, %.1fms max; "
+           "1GiB extents: %"PRIu64", 2MiB extents: %"PRIu64", 4KiB pages: %"PRIu64,
+           nr_pfns >> (20 - XC_PAGE_SHIFT), (uint64_t)base_pfn,
+           st->elapsed_us / 1e6, st->threads, st->nodes, st->chunks,
+           st->chunks ? st->chunk_us_total / 1e3 / st->chunks : 0.0,
+           st->chunk_us_max / 1e3, st->extents_1g, st->extents_2m,
+           st->pages_4k);
+    return job.failed ? -1 : 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+#ifndef _XENGUEST_POPULATE_H_
+#define _XENGUEST_POPULATE_H_
+
+#include <stdint.h>
+#include <xenctrl.h>
+
+/* Parallel population of HVM guest memory. libxc populates a guest from
+   one thread, which dominates the build time of a large guest. Instead
+   the builder is given the memory below the MMIO hole only, and the
+   memory above 4GiB is populated here by a pool of workers, in chunks
+   of POPULATE_CHUNK_PAGES which are spread over the host's NUMA nodes
+   (each node takes a contiguous range of the guest). Each chunk is
+   populated with 1GiB extents where Xen can find them, then 2MiB, then
+   4KiB pages. */
+#define POPULATE_CHUNK_PAGES (1UL << 18)    /* 1GiB */
+
+/* Where the memory above the MMIO hole starts */
+#define POPULATE_HIGH_PFN (1UL << (32 - XC_PAGE_SHIFT))
+
+struct populate_stats {
+    uint64_t extents_1g, extents_2m, pages_4k;
+    unsigned int chunks, threads, nodes;
+    uint64_t elapsed_us;
+    uint64_t chunk_us_max, chunk_us_total;
+};
+
+/* Populate nr_pfns pages of domid from base_pfn (which must be 1GiB
+   aligned) with nr_threads workers, reporting on stdout. Returns 0, or
+   -1 with the error on xch if any chunk could not be populated. */
+extern int populate_parallel(xc_interface *xch, uint32_t domid,
+                             xen_pfn_t base_pfn, unsigned long nr_pfns,
+                             unsigned int nr_threads,
+                             struct populate_stats *st);
+
+#endif /* _XENGUEST_POPULATE_H_ */
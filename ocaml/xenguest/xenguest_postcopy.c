@@ -0,0 +1,826 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <xenctrl.h>
+#include <xen/hvm/params.h>
+#include <xen/mem_event.h>
+
+#include "xenguest_postcopy.h"
+
+/* The stream, in host byte order like libxc's:
+
+     struct pc_header
+     struct pc_range      x nr_ranges      populated pfns
+     HVM context          ctx_len bytes
+     struct pc_param      x nr_params
+     page records         x nr_working_set
+     ...                  whatever the caller appends at the transition
+     page records         every other populated page, in any order
+     PC_END
+
+   A page record is its pfn followed by the page, or just the pfn with
+   PC_ZERO set for a page of zeroes. In the other direction the receiver
+   sends the pfns it faults on and PC_END once it has every page. */
+#define PC_END  (~0ULL)
+#define PC_ZERO (1ULL << 63)
+
+struct pc_header {
+    char magic[8];
+    uint64_t nr_pfns;
+    uint32_t nr_ranges;
+    uint32_t ctx_len;
+    uint32_t nr_params;
+    uint32_t nr_working_set;
+};
+
+struct pc_range {
+    uint64_t start, count;
+};
+
+struct pc_param {
+    uint64_t index, value;
+};
+
+/* HVM parameters which describe the guest rather than the host, as sent
+   by libxc. The special pages they point at are always part of the
+   working set, so that xenstored and qemu never map a paged-out page. */
+static const int pc_params[] = {
+    HVM_PARAM_IDENT_PT, HVM_PARAM_VM86_TSS, HVM_PARAM_ACPI_IOPORTS_LOCATION,
+#ifdef HVM_PARAM_VIRIDIAN
+    HVM_PARAM_VIRIDIAN,
+#endif
+    HVM_PARAM_STORE_PFN, HVM_PARAM_CONSOLE_PFN, HVM_PARAM_IOREQ_PFN,
+    HVM_PARAM_BUFIOREQ_PFN, HVM_PARAM_PAGING_RING_PFN,
+    HVM_PARAM_ACCESS_RING_PFN, HVM_PARAM_SHARING_RING_PFN,
+};
+#define PC_NR_PARAMS (sizeof(pc_params) / sizeof(pc_params[0]))
+
+static const int pc_special_params[] = {
+    HVM_PARAM_STORE_PFN, HVM_PARAM_CONSOLE_PFN, HVM_PARAM_IOREQ_PFN,
+    HVM_PARAM_BUFIOREQ_PFN,
+};
+#define PC_NR_SPECIAL (sizeof(pc_special_params) / sizeof(pc_special_params[0]))
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int write_exact(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (len) {
+        n = write(fd, p, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_exact(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    ssize_t n;
+
+    while (len) {
+        n = read(fd, p, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n == 0)
+                errno = EPIPE;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int is_zero_page(const void *page)
+{
+    const uint64_t *p = page;
+    size_t i;
+
+    for (i = 0; i < XC_PAGE_SIZE / sizeof(*p); i++)
+        if (p[i])
+            return 0;
+    return 1;
+}
+
+int postcopy_is_stream(int fd)
+{
+    char magic[sizeof(POSTCOPY_MAGIC) - 1];
+    struct stat st;
+    ssize_t n;
+
+    if (fstat(fd, &st) || !S_ISSOCK(st.st_mode))
+        return 0;
+    do {
+        n = recv(fd, magic, sizeof(magic), MSG_PEEK | MSG_WAITALL);
+    } while (n == -1 && errno == EINTR);
+    return n == sizeof(magic) && !memcmp(magic, POSTCOPY_MAGIC, sizeof(magic));
+}
+
+/* Sender ******************************************************************/
+
+struct pc_sender {
+    xc_interface *xch;
+    int fd;
+    uint32_t domid;
+    uint64_t nr_pfns;
+    uint8_t *sent;              /* per pfn: sent, or nothing to send */
+    char *buf;                  /* page records of one batch */
+    unsigned long working_set, demand, background, zero;
+};
+
+/* Send the given pages, which must not have been sent yet */
+static int send_pages(struct pc_sender *s, const xen_pfn_t *pfns, int n)
+{
+    int err[POSTCOPY_BATCH];
+    char *mem, *out = s->buf;
+    uint64_t rec;
+    int i;
+
+    mem = xc_map_foreign_bulk(s->xch, s->domid, PROT_READ, pfns, err, n);
+    if (mem == NULL)
+        return -1;
+    for (i = 0; i < n; i++) {
+        rec = pfns[i];
+        /* A page which has gone (ballooned out) since the scan reads as
+           zeroes */
+        if (err[i] || is_zero_page(mem + i * XC_PAGE_SIZE)) {
+            rec |= PC_ZERO;
+            s->zero++;
+        }
+        memcpy(out, &rec, sizeof(rec));
+        out += sizeof(rec);
+        if (!(rec & PC_ZERO)) {
+            memcpy(out, mem + i * XC_PAGE_SIZE, XC_PAGE_SIZE);
+            out += XC_PAGE_SIZE;
+        }
+        s->sent[pfns[i]] = 1;
+    }
+    munmap(mem, n * XC_PAGE_SIZE);
+    return write_exact(s->fd, s->buf, out - s->buf);
+}
+
+/* Find the populated pfns. Done while the guest still runs: it is not
+   expected to balloon during a migration (a page which goes away in the
+   meantime is sent as zeroes). */
+static struct pc_range *scan_ranges(struct pc_sender *s, uint32_t *nr_ranges)
+{
+    xen_pfn_t types[1024];
+    struct pc_range *ranges = NULL, *r;
+    uint64_t pfn;
+    unsigned int i, n, size = 0;
+
+    *nr_ranges = 0;
+    for (pfn = 0; pfn < s->nr_pfns; pfn += n) {
+        n = s->nr_pfns - pfn < 1024 ? s->nr_pfns - pfn : 1024;
+        for (i = 0; i < n; i++)
+            types[i] = pfn + i;
+        if (xc_get_pfn_type_batch(s->xch, s->domid, n, types))
+            goto err;
+        for (i = 0; i < n; i++) {
+            if ((types[i] & XEN_DOMCTL_PFINFO_LTAB_MASK)
+                == XEN_DOMCTL_PFINFO_XTAB) {
+                s->sent[pfn + i] = 1;
+                continue;
+            }
+            if (*nr_ranges) {
+                r = &ranges[*nr_ranges - 1];
+                if (r->start + r->count == pfn + i) {
+                    r->count++;
+                    continue;
+                }
+            }
+            if (*nr_ranges == size) {
+                size = size ? size * 2 : 16;
+                r = realloc(ranges, size * sizeof(*r));
+                if (r == NULL)
+                    goto err;
+                ranges = r;
+            }
+            ranges[*nr_ranges].start = pfn + i;
+            ranges[*nr_ranges].count = 1;
+            (*nr_ranges)++;
+        }
+    }
+    return ranges;
+
+err:
+    free(ranges);
+    return NULL;
+}
+
+/* Serve requests until the receiver has every page */
+static int serve_pages(struct pc_sender *s)
+{
+    struct pollfd pfd = { .fd = s->fd, .events = POLLIN };
+    xen_pfn_t pfns[POSTCOPY_BATCH];
+    uint64_t req[64], cursor = 0, end = PC_END;
+    size_t have = 0, i;
+    int n, done = 0;
+    ssize_t r;
+
+    for (;;) {
+        /* Requested pages first, then a batch in address order */
+        while (poll(&pfd, 1, 0) == 1) {
+            r = read(s->fd, (char *)req + have, sizeof(req) - have);
+            if (r == -1 && errno == EINTR)
+                continue;
+            if (r <= 0) {
+                if (r == 0)
+                    errno = EPIPE;
+                return -1;
+            }
+            have += r;
+            for (i = 0; i < have / sizeof(req[0]); i++) {
+                if (req[i] == PC_END) {
+                    done = 1;
+                } else if (req[i] < s->nr_pfns && !s->sent[req[i]]) {
+                    pfns[0] = req[i];
+                    if (send_pages(s, pfns, 1))
+                        return -1;
+                    s->demand++;
+                }
+            }
+            memmove(req, (char *)req + i * sizeof(req[0]), have % sizeof(req[0]));
+            have %= sizeof(req[0]);
+            if (done)
+                return 0;
+        }
+        if (cursor == PC_END) {
+            /* Everything is on its way: wait for the receiver */
+            if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+                return -1;
+            continue;
+        }
+        for (n = 0; cursor < s->nr_pfns && n < POSTCOPY_BATCH; cursor++)
+            if (!s->sent[cursor])
+                pfns[n++] = cursor;
+        if (n) {
+            if (send_pages(s, pfns, n))
+                return -1;
+            s->background += n;
+        }
+        if (cursor == s->nr_pfns) {
+            cursor = PC_END;
+            if (write_exact(s->fd, &end, sizeof(end)))
+                return -1;
+        }
+    }
+}
+
+int postcopy_save(xc_interface *xch, int fd, uint32_t domid,
+                  unsigned int sample_ms, const struct postcopy_save_ops *ops)
+{
+    struct pc_sender s;
+    struct pc_header h;
+    struct pc_range *ranges = NULL;
+    struct pc_param params[PC_NR_PARAMS];
+    xen_pfn_t pfns[POSTCOPY_BATCH];
+    uint8_t *ctx = NULL;
+    unsigned long value, bitmap_pages, pfn;
+    uint64_t t_suspend, t_transition, t_done;
+    int ctx_len, logdirty = 0, r = -1, n, saved_errno;
+    unsigned int i;
+    DECLARE_HYPERCALL_BUFFER(unsigned long, bitmap);
+
+    memset(&s, 0, sizeof(s));
+    s.xch = xch;
+    s.fd = fd;
+    s.domid = domid;
+    n = xc_domain_maximum_gpfn(xch, domid);
+    if (n < 0)
+        return -1;
+    s.nr_pfns = (uint64_t)n + 1;
+    s.sent = calloc(s.nr_pfns, 1);
+    s.buf = malloc(POSTCOPY_BATCH * (sizeof(uint64_t) + XC_PAGE_SIZE));
+    bitmap_pages = (s.nr_pfns / 8 + XC_PAGE_SIZE) / XC_PAGE_SIZE;
+    bitmap = xc_hypercall_buffer_alloc_pages(xch, bitmap, bitmap_pages);
+    if (s.sent == NULL || s.buf == NULL || bitmap == NULL) {
+        errno = ENOMEM;
+        goto out;
+    }
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, POSTCOPY_MAGIC, sizeof(h.magic));
+    h.nr_pfns = s.nr_pfns;
+    ranges = scan_ranges(&s, &h.nr_ranges);
+    if (ranges == NULL)
+        goto out;
+
+    /* Whatever the guest writes to while we watch is its working set */
+    if (sample_ms) {
+        if (xc_shadow_control(xch, domid, XEN_DOMCTL_SHADOW_OP_ENABLE_LOGDIRTY,
+                              NULL, 0, NULL, 0, NULL) ||
+            xc_shadow_control(xch, domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
+                              HYPERCALL_BUFFER(bitmap), s.nr_pfns,
+                              NULL, 0, NULL) < 0)
+            goto out;
+        logdirty = 1;
+        usleep(sample_ms * 1000);
+    }
+
+    if (!ops->suspend(ops->data)) {
+        errno = EAGAIN;
+        goto out;
+    }
+    t_suspend = now_us();
+
+    memset(bitmap, 0, bitmap_pages * XC_PAGE_SIZE);
+    if (logdirty &&
+        xc_shadow_control(xch, domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
+                          HYPERCALL_BUFFER(bitmap), s.nr_pfns,
+                          NULL, 0, NULL) < 0)
+        goto out;
+
+    ctx_len = xc_domain_hvm_getcontext(xch, domid, NULL, 0);
+    if (ctx_len <= 0 || (ctx = malloc(ctx_len)) == NULL)
+        goto out;
+    ctx_len = xc_domain_hvm_getcontext(xch, domid, ctx, ctx_len);
+    if (ctx_len <= 0)
+        goto out;
+    h.ctx_len = ctx_len;
+
+    for (i = 0; i < PC_NR_PARAMS; i++) {
+        if (xc_get_hvm_param(xch, domid, pc_params[i], &value) || !value)
+            continue;
+        params[h.nr_params].index = pc_params[i];
+        params[h.nr_params].value = value;
+        h.nr_params++;
+    }
+    for (i = 0; i < PC_NR_SPECIAL; i++)
+        if (!xc_get_hvm_param(xch, domid, pc_special_params[i], &value) &&
+            value && value < s.nr_pfns)
+            bitmap[value / (8 * sizeof(*bitmap))] |=
+                1UL << (value % (8 * sizeof(*bitmap)));
+    for (pfn = 0; pfn < s.nr_pfns; pfn++)
+        if (!s.sent[pfn] &&
+            bitmap[pfn / (8 * sizeof(*bitmap))] &
+            (1UL << (pfn % (8 * sizeof(*bitmap)))))
+            h.nr_working_set++;
+
+    if (write_exact(fd, &h, sizeof(h)) ||
+        write_exact(fd, ranges, h.nr_ranges * sizeof(*ranges)) ||
+        write_exact(fd, ctx, h.ctx_len) ||
+        write_exact(fd, params, h.nr_params * sizeof(*params)))
+        goto out;
+    for (pfn = 0, n = 0; pfn < s.nr_pfns; pfn++) {
+        if (s.sent[pfn] ||
+            !(bitmap[pfn / (8 * sizeof(*bitmap))] &
+              (1UL << (pfn % (8 * sizeof(*bitmap))))))
+            continue;
+        pfns[n++] = pfn;
+        if (n == POSTCOPY_BATCH) {
+            if (send_pages(&s, pfns, n))
+                goto out;
+            n = 0;
+        }
+    }
+    if (n && send_pages(&s, pfns, n))
+        goto out;
+    s.working_set = h.nr_working_set;
+
+    if (ops->transition(ops->data)) {
+        errno = EPIPE;
+        goto out;
+    }
+    t_transition = now_us();
+
+    if (serve_pages(&s))
+        goto out;
+    t_done = now_us();
+
+    printf("postcopy: domain %u handed over after %.3fms with %lu of %"
+           PRIu64" pages; %lu pages sent on demand and %lu in the "
+           "background in %.3fs, %lu of them zero",
+           domid, (t_transition - t_suspend) / 1000.0, s.working_set,
+           s.nr_pfns, s.demand, s.background,
+           (t_done - t_transition) / 1e6, s.zero);
+    r = 0;
+
+out:
+    saved_errno = errno;
+    if (logdirty)
+        xc_shadow_control(xch, domid, XEN_DOMCTL_SHADOW_OP_OFF,
+                          NULL, 0, NULL, 0, NULL);
+    if (bitmap)
+        xc_hypercall_buffer_free_pages(xch, bitmap, bitmap_pages);
+    free(ctx);
+    free(ranges);
+    free(s.sent);
+    free(s.buf);
+    errno = saved_errno;
+    return r;
+}
+
+/* Receiver ****************************************************************/
+
+enum { PC_HOLE, PC_PAGED, PC_REQUESTED, PC_PRESENT };
+
+/* A vCPU waiting for a page */
+struct pc_fault {
+    mem_event_request_t req;
+    uint64_t t0;
+};
+
+struct pc_receiver {
+    xc_interface *xch;
+    int fd;
+    uint32_t domid;
+    uint64_t nr_pfns, missing;
+    uint8_t *state;
+    char *page;
+
+    xc_evtchn *xce;
+    evtchn_port_t port;
+    void *ring_page;
+    mem_event_back_ring_t ring;
+
+    struct pc_fault *faults;
+    unsigned int nr_faults, size_faults;
+
+    unsigned long nr_faulted, prefetched, requested;
+    uint64_t fault_us, max_fault_us;
+};
+
+static void resume_vcpu(struct pc_receiver *pc, const mem_event_request_t *req)
+{
+    mem_event_response_t rsp;
+    RING_IDX prod = pc->ring.rsp_prod_pvt;
+
+    memset(&rsp, 0, sizeof(rsp));
+    rsp.gfn = req->gfn;
+    rsp.vcpu_id = req->vcpu_id;
+    rsp.flags = req->flags;
+    memcpy(RING_GET_RESPONSE(&pc->ring, prod), &rsp, sizeof(rsp));
+    pc->ring.rsp_prod_pvt = prod + 1;
+    RING_PUSH_RESPONSES(&pc->ring);
+}
+
+/* Resume the vCPUs which were waiting for pfn */
+static void page_arrived(struct pc_receiver *pc, uint64_t pfn)
+{
+    uint64_t now = now_us(), us;
+    unsigned int i = 0;
+    int notify = 0;
+
+    while (i < pc->nr_faults) {
+        if (pc->faults[i].req.gfn != pfn) {
+            i++;
+            continue;
+        }
+        resume_vcpu(pc, &pc->faults[i].req);
+        us = now - pc->faults[i].t0;
+        pc->fault_us += us;
+        if (us > pc->max_fault_us)
+            pc->max_fault_us = us;
+        pc->faults[i] = pc->faults[--pc->nr_faults];
+        notify = 1;
+    }
+    if (notify)
+        xc_evtchn_notify(pc->xce, pc->port);
+}
+
+static int receive_page(struct pc_receiver *pc, uint64_t rec)
+{
+    uint64_t pfn = rec & ~PC_ZERO;
+
+    if (pfn >= pc->nr_pfns) {
+        errno = ERANGE;
+        return -1;
+    }
+    if (rec & PC_ZERO)
+        memset(pc->page, 0, XC_PAGE_SIZE);
+    else if (read_exact(pc->fd, pc->page, XC_PAGE_SIZE))
+        return -1;
+
+    /* Holes, dropped pages and (ring) pages we did not page out */
+    if (pc->state[pfn] != PC_PAGED && pc->state[pfn] != PC_REQUESTED)
+        return 0;
+    if (xc_mem_paging_load(pc->xch, pc->domid, pfn, pc->page))
+        return -1;
+    if (pc->state[pfn] == PC_PAGED)
+        pc->prefetched++;
+    pc->state[pfn] = PC_PRESENT;
+    pc->missing--;
+    page_arrived(pc, pfn);
+    return 0;
+}
+
+/* Take the vCPUs' page faults off the ring */
+static int handle_faults(struct pc_receiver *pc)
+{
+    mem_event_request_t req;
+    struct pc_fault *f;
+    RING_IDX cons;
+    evtchn_port_or_error_t port;
+    int notify = 0;
+
+    port = xc_evtchn_pending(pc->xce);
+    if (port == -1 || xc_evtchn_unmask(pc->xce, port))
+        return -1;
+
+    while (RING_HAS_UNCONSUMED_REQUESTS(&pc->ring)) {
+        cons = pc->ring.req_cons;
+        memcpy(&req, RING_GET_REQUEST(&pc->ring, cons), sizeof(req));
+        pc->ring.req_cons = cons + 1;
+        pc->ring.sring->req_event = cons + 2;
+
+        if (req.gfn >= pc->nr_pfns)
+            continue;
+        if (req.flags & MEM_EVENT_FLAG_DROP_PAGE) {
+            /* Ballooned out while paged out: no longer wanted */
+            if (pc->state[req.gfn] == PC_PAGED ||
+                pc->state[req.gfn] == PC_REQUESTED) {
+                pc->state[req.gfn] = PC_PRESENT;
+                pc->missing--;
+            }
+            continue;
+        }
+        if (pc->state[req.gfn] == PC_PRESENT ||
+            pc->state[req.gfn] == PC_HOLE) {
+            /* Raced with its arrival */
+            resume_vcpu(pc, &req);
+            notify = 1;
+            continue;
+        }
+        if (pc->nr_faults == pc->size_faults) {
+            pc->size_faults = pc->size_faults ? pc->size_faults * 2 : 16;
+            f = realloc(pc->faults, pc->size_faults * sizeof(*f));
+            if (f == NULL)
+                return -1;
+            pc->faults = f;
+        }
+        pc->faults[pc->nr_faults].req = req;
+        pc->faults[pc->nr_faults].t0 = now_us();
+        pc->nr_faults++;
+        pc->nr_faulted++;
+        if (pc->state[req.gfn] == PC_PAGED) {
+            pc->state[req.gfn] = PC_REQUESTED;
+            pc->requested++;
+            if (write_exact(pc->fd, &req.gfn, sizeof(req.gfn)))
+                return -1;
+        }
+    }
+    if (notify)
+        xc_evtchn_notify(pc->xce, pc->port);
+    return 0;
+}
+
+static int enable_paging(struct pc_receiver *pc, xen_pfn_t ring_pfn)
+{
+    uint32_t port;
+    int r;
+
+    pc->ring_page = xc_map_foreign_range(pc->xch, pc->domid, XC_PAGE_SIZE,
+                                         PROT_READ | PROT_WRITE, ring_pfn);
+    if (pc->ring_page == NULL)
+        return -1;
+    if (xc_mem_paging_enable(pc->xch, pc->domid, &port))
+        return -1;
+    pc->xce = xc_evtchn_open(NULL, 0);
+    if (pc->xce == NULL)
+        return -1;
+    r = xc_evtchn_bind_interdomain(pc->xce, pc->domid, port);
+    if (r < 0)
+        return -1;
+    pc->port = r;
+    SHARED_RING_INIT((mem_event_sring_t *)pc->ring_page);
+    BACK_RING_INIT(&pc->ring, (mem_event_sring_t *)pc->ring_page,
+                   XC_PAGE_SIZE);
+    /* As xenpaging does: the guest has no business with the ring */
+    return xc_domain_decrease_reservation_exact(pc->xch, pc->domid, 1, 0,
+                                                &ring_pfn);
+}
+
+static void disable_paging(struct pc_receiver *pc)
+{
+    if (pc->xce) {
+        xc_mem_paging_disable(pc->xch, pc->domid);
+        xc_evtchn_unbind(pc->xce, pc->port);
+        xc_evtchn_close(pc->xce);
+    }
+    if (pc->ring_page)
+        munmap(pc->ring_page, XC_PAGE_SIZE);
+}
+
+int postcopy_restore(xc_interface *xch, int fd, uint32_t domid,
+                     unsigned int store_evtchn, unsigned long *store_mfn,
+                     unsigned long *console_mfn,
+                     const struct postcopy_restore_ops *ops)
+{
+    struct pc_receiver pc;
+    struct pc_header h;
+    struct pc_range *ranges = NULL;
+    struct pc_param *params = NULL;
+    struct pollfd pfd[2];
+    xen_pfn_t pfns[1024];
+    uint8_t *ctx = NULL;
+    unsigned long ring_pfn = 0;
+    uint64_t rec, pfn, t0, t_start, t_done;
+    unsigned int i, n;
+    int r = -1, saved_errno, done = 0;
+
+    memset(&pc, 0, sizeof(pc));
+    pc.xch = xch;
+    pc.fd = fd;
+    pc.domid = domid;
+    *store_mfn = *console_mfn = 0;
+    t0 = now_us();
+
+    if (read_exact(fd, &h, sizeof(h)))
+        return -1;
+    if (memcmp(h.magic, POSTCOPY_MAGIC, sizeof(h.magic)) ||
+        h.nr_params > PC_NR_PARAMS) {
+        errno = EINVAL;
+        return -1;
+    }
+    pc.nr_pfns = h.nr_pfns;
+    pc.state = calloc(h.nr_pfns, 1);
+    pc.page = malloc(XC_PAGE_SIZE);
+    ranges = malloc(h.nr_ranges * sizeof(*ranges) + 1);
+    ctx = malloc(h.ctx_len + 1);
+    params = malloc(h.nr_params * sizeof(*params) + 1);
+    if (pc.state == NULL || pc.page == NULL || ranges == NULL ||
+        ctx == NULL || params == NULL) {
+        errno = ENOMEM;
+        goto out;
+    }
+    if (read_exact(fd, ranges, h.nr_ranges * sizeof(*ranges)) ||
+        read_exact(fd, ctx, h.ctx_len) ||
+        read_exact(fd, params, h.nr_params * sizeof(*params)))
+        goto out;
+
+    for (i = 0; i < h.nr_ranges; i++) {
+        if (ranges[i].start + ranges[i].count > h.nr_pfns) {
+            errno = ERANGE;
+            goto out;
+        }
+        for (pfn = ranges[i].start; pfn < ranges[i].start + ranges[i].count;
+             pfn += n) {
+            n = ranges[i].start + ranges[i].count - pfn;
+            if (n > 1024)
+                n = 1024;
+            for (rec = 0; rec < n; rec++) {
+                pfns[rec] = pfn + rec;
+                pc.state[pfn + rec] = PC_PAGED;
+            }
+            if (xc_domain_populate_physmap_exact(xch, domid, n, 0, 0, pfns))
+                goto out;
+            pc.missing += n;
+        }
+    }
+    for (i = 0; i < h.nr_params; i++) {
+        if (xc_set_hvm_param(xch, domid, params[i].index, params[i].value))
+            goto out;
+        if (params[i].index == HVM_PARAM_STORE_PFN)
+            *store_mfn = params[i].value;
+        else if (params[i].index == HVM_PARAM_CONSOLE_PFN)
+            *console_mfn = params[i].value;
+        else if (params[i].index == HVM_PARAM_PAGING_RING_PFN)
+            ring_pfn = params[i].value;
+    }
+    if (xc_set_hvm_param(xch, domid, HVM_PARAM_STORE_EVTCHN, store_evtchn))
+        goto out;
+
+    if (ring_pfn == 0 || ring_pfn >= h.nr_pfns) {
+        fprintf(stderr, "postcopy: the guest has no paging ring page");
+        errno = ENOSYS;
+        goto out;
+    }
+    if (pc.state[ring_pfn] == PC_HOLE) {
+        pfns[0] = ring_pfn;
+        if (xc_domain_populate_physmap_exact(xch, domid, 1, 0, 0, pfns))
+            goto out;
+    } else {
+        pc.missing--;
+    }
+    pc.state[ring_pfn] = PC_HOLE;
+    if (enable_paging(&pc, ring_pfn))
+        goto out;
+
+    /* Page everything out; the working set comes straight back in */
+    for (pfn = 0; pfn < h.nr_pfns; pfn++)
+        if (pc.state[pfn] == PC_PAGED &&
+            (xc_mem_paging_nominate(xch, domid, pfn) ||
+             xc_mem_paging_evict(xch, domid, pfn)))
+            goto out;
+    for (i = 0; i < h.nr_working_set; i++)
+        if (read_exact(fd, &rec, sizeof(rec)) || receive_page(&pc, rec))
+            goto out;
+    pc.prefetched = 0;
+
+    if (xc_domain_hvm_setcontext(xch, domid, ctx, h.ctx_len))
+        goto out;
+
+    t_start = now_us();
+    printf("postcopy: domain %u can start after %.3fms with %u of %"PRIu64
+           " pages present", domid, (t_start - t0) / 1000.0,
+           h.nr_working_set, h.nr_pfns);
+    fflush(stdout);
+    if (ops->transition(*store_mfn, *console_mfn, ops->data)) {
+        errno = ECANCELED;
+        goto out;
+    }
+
+    pfd[0].fd = xc_evtchn_fd(pc.xce);
+    pfd[0].events = POLLIN;
+    pfd[1].fd = fd;
+    pfd[1].events = POLLIN;
+    while (!done) {
+        if (poll(pfd, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            goto out;
+        }
+        if ((pfd[0].revents & POLLIN) && handle_faults(&pc))
+            goto out;
+        if (pfd[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            if (read_exact(fd, &rec, sizeof(rec)))
+                goto out;
+            if (rec == PC_END)
+                done = 1;
+            else if (receive_page(&pc, rec))
+                goto out;
+        }
+    }
+    if (pc.missing) {
+        fprintf(stderr, "postcopy: stream ended with %"PRIu64" pages "
+                "missing", pc.missing);
+        errno = EPIPE;
+        goto out;
+    }
+    rec = PC_END;
+    if (write_exact(fd, &rec, sizeof(rec)))
+        goto out;
+    t_done = now_us();
+
+    printf("postcopy: domain %u complete %.3fs after it could start: %lu "
+           "faults (%lu pages requested), mean %.0fus, max %"PRIu64"us; "
+           "%lu pages prefetched", domid, (t_done - t_start) / 1e6,
+           pc.nr_faulted, pc.requested,
+           pc.nr_faulted ? (double)pc.fault_us / pc.nr_faulted : 0.0,
+           pc.max_fault_us, pc.prefetched);
+    r = 0;
+
+out:
+    saved_errno = errno;
+    disable_paging(&pc);
+    free(pc.faults);
+    free(pc.state);
+    free(pc.page);
+    free(ranges);
+    free(ctx);
+    free(params);
+    errno = saved_errno;
+    return r;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+#ifndef _XENGUEST_POSTCOPY_H_
+#define _XENGUEST_POSTCOPY_H_
+
+#include <stdint.h>
+#include <xenctrl.h>
+
+/* Post-copy migration of HVM guests. The sender suspends the guest and
+   sends its context and its working set (the pages it dirtied during a
+   short sampling window before the suspend), and the receiver starts it
+   with every other page paged out through the Xen paging interface. A
+   page the guest faults on is requested from the sender over the same
+   connection, which must therefore be a socket; meanwhile the sender
+   pushes all remaining pages in address order. libxc is not involved:
+   the stream starts with POSTCOPY_MAGIC instead of libxc's header. */
+#define POSTCOPY_MAGIC "XGPOSTC1"
+
+/* Pages per background batch: small, so that a page the receiver asks
+   for does not queue behind much else */
+#define POSTCOPY_BATCH 64
+
+struct postcopy_save_ops {
+    /* Returns 1 once the guest is suspended */
+    int (*suspend)(void *data);
+    /* Called once the receiver has everything it needs to start the
+       guest. The caller may append its own data (e.g. qemu's state) to
+       the stream before returning 0; pages are served after that. */
+    int (*transition)(void *data);
+    void *data;
+};
+
+struct postcopy_restore_ops {
+    /* The guest is ready to be unpaused. Whatever the sender's caller
+       appended at its transition must be read off the stream before
+       this returns 0; the missing pages are fetched after that. */
+    int (*transition)(unsigned long store_mfn, unsigned long console_mfn,
+                      void *data);
+    void *data;
+};
+
+/* Non-zero if fd is a socket carrying a post-copy stream. Nothing is
+   consumed. */
+extern int postcopy_is_stream(int fd);
+
+/* Send domid, sampling its working set for sample_ms first. Returns
+   once the receiver has every page, 0 on success or -1 with errno set. */
+extern int postcopy_save(xc_interface *xch, int fd, uint32_t domid,
+                         unsigned int sample_ms,
+                         const struct postcopy_save_ops *ops);
+
+/* Receive into domid, which must be empty. Returns once every page has
+   arrived, 0 on success or -1 with errno set (after the transition the
+   guest cannot continue without the missing pages). */
+extern int postcopy_restore(xc_interface *xch, int fd, uint32_t domid,
+                            unsigned int store_evtchn,
+                            unsigned long *store_mfn,
+                            unsigned long *console_mfn,
+                            const struct postcopy_restore_ops *ops);
+
+#endif /* _XENGUEST_POSTCOPY_H_ */
@@ -0,0 +1,455 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "xenguest_pump.h"
+#include "xenguest_direct.h"
+#include "xenguest_integrity.h"
+
+#define PUMP_BUFFER_SIZE (64 * 1024)
+#define PUMP_PIPE_SIZE (1024 * 1024)
+#define PUMP_MIN_BURST 4096
+
+struct pump {
+    int in_fd;                  /* read end of the pipe libxc writes to,
+                                   -1 once closed after an error */
+    int in_wfd;                 /* ... and its write end */
+    int out_fd;
+    struct direct_writer *direct;  /* if out_fd is a regular file */
+    int ctl_fd;
+    int lock_fd;                /* our entry in PUMP_STREAMS_DIR, or -1 */
+    char lock_path[PATH_MAX];
+    struct pump_limits limits;
+    uint64_t rate;              /* current limit in bytes/s, 0 if none */
+    unsigned int streams;       /* sharing the host limit, including us */
+    double tokens;
+    uint64_t refill_us, share_us, report_us, start_us;
+    uint64_t total, reported;   /* bytes written to out_fd */
+    uint64_t received;          /* bytes read from in_fd */
+    char ctl_buf[64];
+    size_t ctl_len;
+    int error;                  /* errno of the first failed write */
+    int integrity;              /* frame the stream, see xenguest_integrity.h */
+    struct sigaction old_pipe;  /* the SIGPIPE action before pump_start */
+    pthread_t thread;
+};
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Register in PUMP_STREAMS_DIR. The file is locked before it becomes
+   visible under its final name, so that any unlocked file found there
+   belongs to a stream which has gone away. */
+static int register_stream(struct pump *p)
+{
+    char tmp[PATH_MAX];
+
+    if ((mkdir(PUMP_RUN_DIR, 0755) == -1 && errno != EEXIST) ||
+        (mkdir(PUMP_STREAMS_DIR, 0755) == -1 && errno != EEXIST))
+        return -1;
+    snprintf(tmp, sizeof(tmp), "%s/.%d", PUMP_STREAMS_DIR, getpid());
+    snprintf(p->lock_path, sizeof(p->lock_path), "%s/%d",
+             PUMP_STREAMS_DIR, getpid());
+    p->lock_fd = open(tmp, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (p->lock_fd == -1)
+        return -1;
+    if (flock(p->lock_fd, LOCK_EX) == -1 || rename(tmp, p->lock_path) == -1) {
+        close(p->lock_fd);
+        p->lock_fd = -1;
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static void unregister_stream(struct pump *p)
+{
+    if (p->lock_fd == -1)
+        return;
+    unlink(p->lock_path);
+    close(p->lock_fd);
+    p->lock_fd = -1;
+}
+
+static unsigned int count_streams(void)
+{
+    char path[PATH_MAX];
+    struct dirent *de;
+    unsigned int n = 0;
+    DIR *dir;
+    int fd;
+
+    dir = opendir(PUMP_STREAMS_DIR);
+    if (dir == NULL)
+        return 1;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", PUMP_STREAMS_DIR, de->d_name);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+            continue;
+        if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+            if (errno == EWOULDBLOCK)
+                n++;
+        } else
+            unlink(path);
+        close(fd);
+    }
+    closedir(dir);
+    return n ? n : 1;
+}
+
+static void update_rate(struct pump *p)
+{
+    uint64_t rate = p->limits.stream_bps;
+
+    if (p->limits.host_bps) {
+        uint64_t share;
+
+        p->streams = count_streams();
+        share = p->limits.host_bps / p->streams;
+        if (rate == 0 || share < rate)
+            rate = share;
+    }
+    if (rate != p->rate) {
+        printf("stream rate limit: %.1f MiB/s (%u streams)",
+               rate / 1048576.0, p->streams);
+        p->rate = rate;
+        /* Don't let the bucket carry more than a burst at the new rate */
+        if (p->tokens > (double)rate * PUMP_BURST_MS / 1000)
+            p->tokens = (double)rate * PUMP_BURST_MS / 1000;
+    }
+}
+
+static void report(struct pump *p, uint64_t now, const char *what)
+{
+    double elapsed = (now - p->report_us) / 1000000.0;
+    double total = (now - p->start_us) / 1000000.0;
+
+    printf("stream %s: %.1f MiB/s now, %.1f MiB/s average, "
+           "%"PRIu64" bytes, limit %.1f MiB/s", what,
+           elapsed > 0 ? (p->total - p->reported) / elapsed / 1048576.0 : 0,
+           total > 0 ? p->total / total / 1048576.0 : 0,
+           p->total, p->rate / 1048576.0);
+    p->report_us = now;
+    p->reported = p->total;
+}
+
+static void read_ctl(struct pump *p)
+{
+    ssize_t n;
+    char *nl;
+
+    n = read(p->ctl_fd, p->ctl_buf + p->ctl_len,
+             sizeof(p->ctl_buf) - p->ctl_len - 1);
+    if (n <= 0) {
+        if (n == 0 || (errno != EINTR && errno != EAGAIN))
+            p->ctl_fd = -1;
+        return;
+    }
+    p->ctl_len += n;
+    p->ctl_buf[p->ctl_len] = '\0';
+    while ((nl = strchr(p->ctl_buf, '\n')) != NULL) {
+        *nl = '\0';
+        p->limits.stream_bps = strtoull(p->ctl_buf, NULL, 10);
+        memmove(p->ctl_buf, nl + 1, p->ctl_len - (nl + 1 - p->ctl_buf) + 1);
+        p->ctl_len -= nl + 1 - p->ctl_buf;
+        update_rate(p);
+    }
+    /* A line that doesn't fit is garbage */
+    if (p->ctl_len == sizeof(p->ctl_buf) - 1)
+        p->ctl_len = 0;
+}
+
+/* Sleep until len bytes worth of tokens are available and take them */
+static void take_tokens(struct pump *p, size_t len)
+{
+    double burst;
+    uint64_t now;
+
+    if (p->rate == 0)
+        return;
+    burst = (double)p->rate * PUMP_BURST_MS / 1000;
+    if (burst < PUMP_MIN_BURST)
+        burst = PUMP_MIN_BURST;
+    for (;;) {
+        now = now_us();
+        p->tokens += (double)p->rate * (now - p->refill_us) / 1000000;
+        if (p->tokens > burst)
+            p->tokens = burst;
+        p->refill_us = now;
+        if (p->tokens >= len)
+            break;
+        usleep((len - p->tokens) * 1000000 / p->rate + 1);
+    }
+    p->tokens -= len;
+}
+
+static int write_exact(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Write len bytes to out_fd, no faster than the limits allow */
+static int pump_write(struct pump *p, const char *buf, size_t len)
+{
+    size_t chunk, off;
+
+    for (off = 0; off < len; off += chunk) {
+        chunk = len - off;
+        if (p->rate) {
+            size_t burst = p->rate * PUMP_BURST_MS / 1000;
+
+            if (burst < PUMP_MIN_BURST)
+                burst = PUMP_MIN_BURST;
+            if (chunk > burst)
+                chunk = burst;
+        }
+        take_tokens(p, chunk);
+        if (p->direct ? direct_write(p->direct, buf + off, chunk)
+            : write_exact(p->out_fd, buf + off, chunk)) {
+            p->error = errno;
+            fprintf(stderr, "stream pump: write failed: %s",
+                    strerror(errno));
+            return -1;
+        }
+        p->total += chunk;
+    }
+    return 0;
+}
+
+static void *pump_thread(void *arg)
+{
+    struct pump *p = arg;
+    struct integrity_header h;
+    struct pollfd fds[2];
+    size_t hlen = 0;
+    uint64_t now;
+    ssize_t n;
+    char *buf;
+
+    buf = malloc(PUMP_BUFFER_SIZE + INTEGRITY_HEADER_SIZE);
+    if (buf == NULL) {
+        p->error = ENOMEM;
+        goto out;
+    }
+    /* Each read is sent as one chunk, after its header */
+    if (p->integrity) {
+        hlen = INTEGRITY_HEADER_SIZE;
+        if (pump_write(p, INTEGRITY_MAGIC, sizeof(INTEGRITY_MAGIC) - 1))
+            goto out;
+    }
+    for (;;) {
+        now = now_us();
+        if (p->limits.host_bps &&
+            now - p->share_us >= PUMP_SHARE_INTERVAL_MS * 1000) {
+            update_rate(p);
+            p->share_us = now;
+        }
+        if (now - p->report_us >= PUMP_REPORT_INTERVAL_MS * 1000)
+            report(p, now, "progress");
+
+        fds[0].fd = p->in_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = p->ctl_fd;
+        fds[1].events = POLLIN;
+        fds[0].revents = fds[1].revents = 0;
+        if (poll(fds, p->ctl_fd == -1 ? 1 : 2, PUMP_SHARE_INTERVAL_MS) == -1) {
+            if (errno == EINTR)
+                continue;
+            p->error = errno;
+            break;
+        }
+        if (fds[1].revents)
+            read_ctl(p);
+        if (!fds[0].revents)
+            continue;
+
+        n = read(p->in_fd, buf + hlen, PUMP_BUFFER_SIZE);
+        if (n == 0)
+            break;
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            p->error = errno;
+            break;
+        }
+        __atomic_add_fetch(&p->received, n, __ATOMIC_RELAXED);
+        if (hlen) {
+            h.len = n;
+            h.crc = crc32c(0, buf + hlen, n);
+            integrity_header_put((unsigned char *)buf, &h);
+        }
+        if (pump_write(p, buf, hlen + n))
+            break;
+    }
+    /* The end of a complete stream */
+    if (hlen && !p->error) {
+        h.len = h.crc = 0;
+        integrity_header_put((unsigned char *)buf, &h);
+        pump_write(p, buf, hlen);
+    }
+out:
+    /* Stop at the first error: with the read end closed, libxc's next
+       write fails with EPIPE and the save is abandoned there and then,
+       instead of going through every round and suspending the guest */
+    if (p->error) {
+        int fd = __atomic_exchange_n(&p->in_fd, -1, __ATOMIC_SEQ_CST);
+
+        if (fd >= 0)
+            close(fd);
+    }
+    free(buf);
+    return NULL;
+}
+
+struct pump *pump_start(int out_fd, const struct pump_limits *limits,
+                        int ctl_fd, int integrity, int *in_fd)
+{
+    struct sigaction ign;
+    struct pump *p;
+    int fds[2], saved_errno;
+
+    p = calloc(1, sizeof(*p));
+    if (p == NULL)
+        return NULL;
+    p->out_fd = out_fd;
+    p->ctl_fd = ctl_fd;
+    p->lock_fd = -1;
+    p->limits = *limits;
+    p->integrity = integrity;
+    p->streams = 1;
+    p->start_us = p->refill_us = p->share_us = p->report_us = now_us();
+
+    if (pipe2(fds, O_CLOEXEC) == -1)
+        goto err;
+    /* A dead destination, or the pump giving up, must show up as EPIPE
+       from write(), not kill the helper */
+    memset(&ign, 0, sizeof(ign));
+    ign.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ign, &p->old_pipe);
+    p->in_fd = fds[0];
+    p->in_wfd = fds[1];
+#ifdef F_SETPIPE_SZ
+    fcntl(p->in_wfd, F_SETPIPE_SZ, PUMP_PIPE_SIZE);
+#endif
+    /* Suspend images go straight to disk, see xenguest_direct.c */
+    p->direct = direct_open(out_fd);
+    if (p->direct == NULL && errno != ENOTSUP)
+        fprintf(stderr, "stream pump: cannot write %d directly, using "
+                "buffered writes: %s", out_fd, strerror(errno));
+    if (p->limits.host_bps && register_stream(p))
+        fprintf(stderr, "stream pump: cannot register in %s, "
+                "ignoring other streams: %s", PUMP_STREAMS_DIR,
+                strerror(errno));
+    update_rate(p);
+
+    errno = pthread_create(&p->thread, NULL, pump_thread, p);
+    if (errno)
+        goto err_pipe;
+    *in_fd = p->in_wfd;
+    return p;
+
+err_pipe:
+    saved_errno = errno;
+    sigaction(SIGPIPE, &p->old_pipe, NULL);
+    if (p->direct)
+        direct_close(p->direct);
+    unregister_stream(p);
+    close(p->in_fd);
+    close(p->in_wfd);
+    errno = saved_errno;
+err:
+    saved_errno = errno;
+    free(p);
+    errno = saved_errno;
+    return NULL;
+}
+
+uint64_t pump_bytes(struct pump *p)
+{
+    int pending = 0, fd = __atomic_load_n(&p->in_fd, __ATOMIC_ACQUIRE);
+
+    if (fd == -1 || ioctl(fd, FIONREAD, &pending) == -1)
+        pending = 0;
+    return __atomic_load_n(&p->received, __ATOMIC_RELAXED) + pending;
+}
+
+int pump_finish(struct pump *p)
+{
+    int error;
+
+    close(p->in_wfd);
+    pthread_join(p->thread, NULL);
+    if (p->direct && direct_close(p->direct) && !p->error)
+        p->error = errno;
+    report(p, now_us(), "done");
+    if (p->in_fd != -1)
+        close(p->in_fd);
+    sigaction(SIGPIPE, &p->old_pipe, NULL);
+    unregister_stream(p);
+    error = p->error;
+    free(p);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
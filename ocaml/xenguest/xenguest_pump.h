@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+#ifndef _XENGUEST_PUMP_H_
+#define _XENGUEST_PUMP_H_
+
+#include <stdint.h>
+
+/* Every stream pumping with a host-wide limit holds a lock on a file in
+   here; the host limit is shared equally between the holders, whether
+   or not each uses its share. */
+#define PUMP_RUN_DIR "/var/run/xenguest"
+#define PUMP_STREAMS_DIR PUMP_RUN_DIR "/streams"
+
+/* Bucket depth, as milliseconds worth of the current rate */
+#define PUMP_BURST_MS 100
+
+/* How often to recompute our share of the host limit and report */
+#define PUMP_SHARE_INTERVAL_MS 1000
+#define PUMP_REPORT_INTERVAL_MS 5000
+
+struct pump_limits {
+    uint64_t stream_bps;   /* bytes/s for this stream, 0 for no limit */
+    uint64_t host_bps;     /* bytes/s for all streams, 0 for no limit */
+};
+
+struct pump;
+
+/* Start a thread copying everything written to *in_fd to out_fd, no
+   faster than the limits allow. A regular file is written with direct
+   I/O (see xenguest_direct.h). If ctl_fd is not -1, the thread also
+   reads new per-stream limits (decimal bytes/s, one per line) from it.
+   If integrity is set, the stream is cut into checked chunks (see
+   xenguest_integrity.h). If writing to out_fd fails the thread stops
+   and closes the pipe, so that writes to *in_fd fail with EPIPE
+   (SIGPIPE is ignored until pump_finish). Returns NULL with errno set
+   on failure. */
+extern struct pump *pump_start(int out_fd, const struct pump_limits *limits,
+                               int ctl_fd, int integrity, int *in_fd);
+
+/* Bytes written to *in_fd so far */
+extern uint64_t pump_bytes(struct pump *p);
+
+/* Close the write end, wait for the data to drain and free the pump.
+   Returns 0, or -1 with errno set if writing to out_fd failed. */
+extern int pump_finish(struct pump *p);
+
+#endif /* _XENGUEST_PUMP_H_ */
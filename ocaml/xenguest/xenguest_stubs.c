@@ -21,6 +21,11 @@
 #include <errno.h>
 #include <string.h>
 #include <stdarg.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
 
 #include <xenctrl.h>
 #include <xenguest.h>
@@ -37,6 +42,19 @@
 #include <caml/signals.h>
 #include <caml/fail.h>
 
+#include "xenguest_logdirty.h"
+#include "xenguest_pump.h"
+#include "xenguest_checkpoint.h"
+#include "xenguest_postcopy.h"
+#include "xenguest_flags.h"
+#include "xenguest_populate.h"
+#include "xenguest_fanout.h"
+#include "xenguest_pod.h"
+#include "xenguest_integrity.h"
+#include "xenguest_converge.h"
+#include "trace_stub.h"
+#include "domain_lock.h"
+
 #define _H(__h) ((xc_interface *)(__h))
 #define _D(__d) ((uint32_t)Int_val(__d))
 
@@ -54,29 +72,6 @@
 
 #include <stdio.h>
 
-/* The following boolean flags are all set by their value
-   in the platform area of xenstore. The only value that
-   is considered true is the string 'true' */
-struct flags {
-    int vcpus;
-    int vcpus_current;
-    const char** vcpu_affinity; /* 0 means unset */
-    uint16_t vcpu_weight;   /* 0 means unset (0 is an illegal weight) */
-    uint16_t vcpu_cap;      /* 0 is default (no cap) */
-    int nx;
-    int viridian;
-    int pae;
-    int acpi;
-    int apic;
-    int acpi_s3;
-    int acpi_s4;
-    uint64_t mmio_size_mib;
-    int tsc_mode;
-    size_t kernel_max_size;
-    size_t ramdisk_max_size;
-    int nestedhvm;
-};
-
 static int pasprintf(char **buf, const char *fmt, ...)
 {
     va_list ap;
@@ -93,234 +88,318 @@ static int pasprintf(char **buf, const char *fmt, ...)
     return ret;
 }
 
-static int
-xenstore_putsv(int domid, const char *val, const char *fmt, va_list ap)
+static void failwith_oss_xc(xc_interface *xch, char *fct)
 {
-    char *path = NULL;
-    struct xs_handle *xsh = NULL;
-    int n, m, rc;
-    char key[1024];
-    bool success;
+    char buf[80];
+    const xc_error *error;
 
-    rc = 1;
-    bzero(key, sizeof(key));
-    xsh = xs_daemon_open();
-    if (xsh == NULL)
-        goto out;
+    error = xc_get_last_error(xch);
+    if (error->code == XC_ERROR_NONE)
+        snprintf(buf, 80, "%s: [%d] %s", fct, errno, strerror(errno));
+    else
+        snprintf(buf, 80, "%s: [%d] %s", fct, error->code, error->message);
+    xc_clear_last_error(xch);
+    caml_failwith(buf);
+}
 
-    path = xs_get_domain_path(xsh, domid);
-    if (path == NULL)
-        goto out;
+/* State shared by the save callbacks for the duration of one save */
+struct save_cb_data {
+    xc_interface *xch;
+    uint32_t domid;
+    struct logdirty_ctl *logdirty; /* opened on first use */
+    struct converge *converge;     /* NULL without a downtime budget */
+    struct pump *pump;             /* NULL if libxc writes to the fd */
+    struct checkpoint checkpoint;  /* used if checkpointing */
+};
 
-    n = snprintf(key, sizeof(key), "%s/", path);
-    if (n < 0)
-        goto out;
-    m = vsnprintf(key + n, sizeof(key) - n, fmt, ap);
-    if (m < 0)
-        goto out;
+static int is_regular_file(int fd)
+{
+    struct stat st;
 
-    success = xs_write(xsh, XBT_NULL, key, val, strlen(val));
-    rc = success? 0 : 1;
-out:
-    xs_daemon_close(xsh);
-    free(path);
-    return rc;
+    return fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
 }
 
-static char *
-xenstore_getsv(int domid, const char *fmt, va_list ap)
+static uint64_t monotonic_us(void)
 {
-    char *path = NULL, *s = NULL;
-    struct xs_handle *xsh = NULL;
-    int n, m;
-    char key[1024];
+    struct timespec ts;
 
-    bzero(key, sizeof(key));
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Suspend fast path: if the caller handed us a pair of pipes at startup
+   (see stub_xenguest_set_suspend_fds) the suspend request is a 4-byte
+   domid written to suspend_req_fd and the answer a single byte read from
+   suspend_ack_fd (1 if the domain is now suspended). This avoids taking
+   the OCaml runtime lock and the text control channel while the guest
+   is being stopped. In checkpoint mode the same pipes carry requests to
+   resume the guest, which have SUSPEND_REQ_RESUME set (domids are below
+   DOMID_FIRST_RESERVED, so the top bit is free). In post-copy mode a
+   request with SUSPEND_REQ_POSTCOPY set asks the caller to append its own
+   state to the stream before the pages are served. */
+#define SUSPEND_REQ_RESUME 0x80000000u
+#define SUSPEND_REQ_POSTCOPY 0x40000000u
+
+static int suspend_req_fd = -1;
+static int suspend_ack_fd = -1;
+
+CAMLprim value stub_xenguest_set_suspend_fds(value req_fd, value ack_fd)
+{
+    CAMLparam2(req_fd, ack_fd);
+    suspend_req_fd = Int_val(req_fd);
+    suspend_ack_fd = Int_val(ack_fd);
+    CAMLreturn(Val_unit);
+}
 
-    xsh = xs_daemon_open();
-    if (xsh == NULL)
+static int fast_request(uint32_t request, const char *what)
+{
+    uint32_t req = htonl(request);
+    uint8_t ack = 0;
+    uint64_t t0, t1, t2, start = trace_begin();
+    ssize_t n;
+
+    t0 = monotonic_us();
+    do {
+        n = write(suspend_req_fd, &req, sizeof(req));
+    } while (n == -1 && errno == EINTR);
+    if (n != sizeof(req)) {
+        fprintf(stderr, "%s fast path: failed to send request: %s",
+                what, strerror(errno));
+        return 0;
+    }
+    t1 = monotonic_us();
+    do {
+        n = read(suspend_ack_fd, &ack, sizeof(ack));
+    } while (n == -1 && errno == EINTR);
+    t2 = monotonic_us();
+    if (n != sizeof(ack)) {
+        fprintf(stderr, "%s fast path: no acknowledgement: %s",
+                what, n == 0 ? "end of file" : strerror(errno));
         return 0;
+    }
+    printf("%s fast path: request %"PRIu64"us, %s %"PRIu64"us, "
+           "result %d", what, t1 - t0, what, t2 - t1, ack);
+    trace_end("fast-path", what, start);
+    return ack == 1;
+}
 
-    path = xs_get_domain_path(xsh, domid);
-    if (path == NULL)
-        goto out;
+static int dispatch_suspend(void *arg)
+{
+    value * __suspend_closure;
+    struct save_cb_data *data = arg;
+    int ret;
 
-    n = snprintf(key, sizeof(key), "%s/", path);
-    if (n < 0)
-        goto out;
-    m = vsnprintf(key + n, sizeof(key) - n, fmt, ap);
-    if (m < 0)
-        goto out;
+    converge_stop(data->converge);
+    checkpoint_suspend(&data->checkpoint);
+    if (suspend_req_fd >= 0 && suspend_ack_fd >= 0)
+        return fast_request(data->domid, "suspend");
 
-    s = xs_read(xsh, XBT_NULL, key, NULL);
-out:
-    xs_daemon_close(xsh);
-    free(path);
-    return s;
+    __suspend_closure = caml_named_value("suspend_callback");
+    if (!__suspend_closure)
+        return 0;
+    caml_leave_blocking_section();
+    ret = Int_val(caml_callback(*__suspend_closure, Val_int(data->domid)));
+    caml_enter_blocking_section();
+    return ret;
 }
 
-static int
-xenstore_puts(int domid, const char *val, const char *fmt, ...)
+/* Checkpoint mode (see stub_xenguest_set_checkpoint): after each epoch
+   has been sent the guest is resumed (postcopy) and the next epoch taken
+   once the interval has passed (checkpoint). The receiving restore keeps
+   applying complete epochs and only finishes, with the last complete
+   one, when the stream ends. */
+static unsigned int checkpoint_interval_ms;   /* 0: normal save */
+static unsigned int checkpoint_max_epochs;
+
+CAMLprim value stub_xenguest_set_checkpoint(value interval_ms,
+                                            value max_epochs)
 {
-    int rc;
-    va_list ap;
+    CAMLparam2(interval_ms, max_epochs);
+    checkpoint_interval_ms = Int_val(interval_ms);
+    checkpoint_max_epochs = Int_val(max_epochs);
+    CAMLreturn(Val_unit);
+}
 
-    va_start(ap, fmt);
-    rc = xenstore_putsv(domid, val, fmt, ap);
-    va_end(ap);
-    return rc;
+static int dispatch_postcopy(void *arg)
+{
+    struct save_cb_data *data = arg;
+    int r = 0;
+
+    /* Without the fast path there is nobody to ask, so resume it here
+       the way the suspend left it: cooperatively */
+    if (suspend_req_fd >= 0 && suspend_ack_fd >= 0) {
+        if (!fast_request(data->domid | SUSPEND_REQ_RESUME, "resume"))
+            r = -1;
+    } else if (xc_domain_resume(data->xch, data->domid, 1)) {
+        fprintf(stderr, "checkpoint: failed to resume domain %u: %s",
+                data->domid, strerror(errno));
+        r = -1;
+    }
+    checkpoint_resumed(&data->checkpoint,
+                       data->pump ? pump_bytes(data->pump) : 0);
+    return r;
 }
 
-static void
-xenstore_get_host_limits(size_t *kernel_max_size, size_t *ramdisk_max_size)
+static int dispatch_checkpoint(void *arg)
 {
-    static const char *kernel_max_path = "/mh/limits/pv-kernel-max-size";
-    static const char *ramdisk_max_path = "/mh/limits/pv-ramdisk-max-size";
-    struct xs_handle *xsh = NULL;
-    size_t value;
-    char *s;
+    struct save_cb_data *data = arg;
 
-    /* Safe defaults */
-    *kernel_max_size  =  (32 * 1024 * 1024);
-    *ramdisk_max_size = (128 * 1024 * 1024);
+    return checkpoint_next(&data->checkpoint);
+}
 
-    xsh = xs_daemon_open();
-    if (xsh == NULL)
-        return;
+/* Adaptive convergence (see stub_xenguest_set_convergence_policy): a
+   thread measures how fast the save is sending and the guest dirtying
+   pages against the downtime budget, and with auto-converge throttles a
+   guest which is not converging (see xenguest_converge.h). libxc 4.2
+   still chooses when to stop the guest, within max_iters/max_factors. */
+static unsigned int converge_downtime_ms;  /* 0: not watched */
+static int converge_auto_throttle;
 
-    s = xs_read(xsh, XBT_NULL, kernel_max_path, NULL);
-    if (s) {
-        errno = 0;
-        value = strtoul(s, NULL, 10);
-        if ( errno == 0 )
-            *kernel_max_size = value;
-        free(s);
-    }
+CAMLprim value stub_xenguest_set_convergence_policy(value downtime_ms,
+                                                    value auto_converge)
+{
+    CAMLparam2(downtime_ms, auto_converge);
+    converge_downtime_ms = Int_val(downtime_ms);
+    converge_auto_throttle = Bool_val(auto_converge);
+    CAMLreturn(Val_unit);
+}
 
-    s = xs_read(xsh, XBT_NULL, ramdisk_max_path, NULL);
-    if (s) {
-        errno = 0;
-        value = strtoul(s, NULL, 10);
-        if ( errno == 0 )
-            *ramdisk_max_size = value;
-        free(s);
-    }
+static uint64_t converge_bytes_sent(void *arg)
+{
+    return pump_bytes(arg);
+}
 
-    xs_daemon_close(xsh);
-    return;
+/* Rate limiting (see stub_xenguest_set_rate_limit): when a limit is set
+   libxc writes the save stream into a pipe and a pump thread copies it
+   to the real fd (see xenguest_pump.c). */
+static struct pump_limits rate_limits;
+static int rate_limit_ctl_fd = -1;
+
+CAMLprim value stub_xenguest_set_rate_limit(value stream_bps, value host_bps,
+                                            value ctl_fd)
+{
+    CAMLparam3(stream_bps, host_bps, ctl_fd);
+    rate_limits.stream_bps = Long_val(stream_bps);
+    rate_limits.host_bps = Long_val(host_bps);
+    rate_limit_ctl_fd = Int_val(ctl_fd);
+    CAMLreturn(Val_unit);
 }
 
-static char *
-xenstore_gets(int domid, const char *fmt, ...)
+/* Integrity mode (see stub_xenguest_set_integrity): the pump cuts the
+   save stream into chunks, each with its CRC32C (see
+   xenguest_integrity.h). A restore recognises such a stream itself. */
+static int integrity;
+
+CAMLprim value stub_xenguest_set_integrity(value on)
 {
-    char *s;
-    va_list ap;
+    CAMLparam1(on);
+    integrity = Bool_val(on);
+    CAMLreturn(Val_unit);
+}
 
-    va_start(ap, fmt);
-    s = xenstore_getsv(domid, fmt, ap);
-    va_end(ap);
-    return s;
+/* Post-copy mode (see stub_xenguest_set_postcopy): xenguest sends the
+   guest itself, see xenguest_postcopy.c, and the caller appends qemu's
+   state when asked to over the suspend fast path. */
+static unsigned int postcopy_sample_ms;   /* 0: normal save */
+
+CAMLprim value stub_xenguest_set_postcopy(value sample_ms)
+{
+    CAMLparam1(sample_ms);
+    postcopy_sample_ms = Int_val(sample_ms);
+    CAMLreturn(Val_unit);
 }
 
-static uint64_t
-xenstore_get(int domid, const char *fmt, ...)
+static int postcopy_transition(void *arg)
 {
-    char *s;
-    uint64_t value = 0;
-    va_list ap;
+    struct save_cb_data *data = arg;
 
-    va_start(ap, fmt);
-    s = xenstore_getsv(domid, fmt, ap);
-    if (s) {
-        if (!strcasecmp(s, "true"))
-            value = 1;
-        else if (sscanf(s, "%Ld", &value) != 1)
-            value = 0;
-        free(s);
-    }
-    va_end(ap);
-    return value;
+    return fast_request(data->domid | SUSPEND_REQ_POSTCOPY, "postcopy")
+        ? 0 : -1;
 }
 
-static void
-get_flags(struct flags *f, int domid)
+/* Take the domain's log-dirty lock for a save (see domain_lock.h),
+   waiting for a dirty rate sample in progress to finish */
+static int save_lock(uint32_t domid)
 {
-    int n;
-    size_t host_pv_kernel_max_size;
-    size_t host_pv_ramdisk_max_size;
-    size_t vm_pv_kernel_max_size;
-    size_t vm_pv_ramdisk_max_size;
+    char msg[80];
+    int fd;
 
-    f->vcpus    = xenstore_get(domid, "platform/vcpu/number");
-    f->vcpu_affinity = (const char**)(malloc(sizeof(char*) * f->vcpus));
-
-    for (n = 0; n < f->vcpus; n++) {
-        f->vcpu_affinity[n] = xenstore_gets(domid, "platform/vcpu/%d/affinity", n);
+    caml_enter_blocking_section();
+    fd = domain_lock(domid, 1);
+    caml_leave_blocking_section();
+    if (fd < 0) {
+        snprintf(msg, sizeof(msg), "domain_lock: %s", strerror(errno));
+        caml_failwith(msg);
     }
-    f->vcpus_current = xenstore_get(domid, "platform/vcpu/current");
-    f->vcpu_weight = xenstore_get(domid, "platform/vcpu/weight");
-    f->vcpu_cap = xenstore_get(domid, "platform/vcpu/cap");
-    f->nx       = xenstore_get(domid, "platform/nx");
-    f->viridian = xenstore_get(domid, "platform/viridian");
-    f->apic     = xenstore_get(domid, "platform/apic");
-    f->acpi     = xenstore_get(domid, "platform/acpi");
-    f->pae      = xenstore_get(domid, "platform/pae");
-    f->acpi_s4  = xenstore_get(domid, "platform/acpi_s4");
-    f->acpi_s3  = xenstore_get(domid, "platform/acpi_s3");
-    f->mmio_size_mib = xenstore_get(domid, "platform/mmio_size_mib");
-    f->tsc_mode = xenstore_get(domid, "platform/tsc_mode");
-    f->nestedhvm = xenstore_get(domid, "platform/nestedhvm");
-
-    xenstore_get_host_limits(&host_pv_kernel_max_size, &host_pv_ramdisk_max_size);
-    vm_pv_kernel_max_size = xenstore_get(domid, "pv-kernel-max-size");
-    vm_pv_ramdisk_max_size = xenstore_get(domid, "pv-ramdisk-max-size");
+    return fd;
+}
 
-    f->kernel_max_size = vm_pv_kernel_max_size ? vm_pv_kernel_max_size : host_pv_kernel_max_size;
-    f->ramdisk_max_size = vm_pv_ramdisk_max_size ? vm_pv_ramdisk_max_size : host_pv_ramdisk_max_size;
+static int is_socket(int fd)
+{
+    struct stat st;
 
-    printf("Determined the following parameters from xenstore:");
-    printf("vcpu/number:%d vcpu/weight:%d vcpu/cap:%d nx: %d viridian: %d apic: %d acpi: %d pae: %d acpi_s4: %d acpi_s3: %d mmio_size_mib: %lld tsc_mode: %d nestedhvm: %d",
-           f->vcpus,f->vcpu_weight,f->vcpu_cap,f->nx,f->viridian,f->apic,f->acpi,f->pae,f->acpi_s4,f->acpi_s3,f->mmio_size_mib,f->tsc_mode,f->nestedhvm);
-    for (n = 0; n < f->vcpus; n++){
-        printf("vcpu/%d/affinity:%s", n, (f->vcpu_affinity[n])?f->vcpu_affinity[n]:"unset");
-    }
-    printf("kernel/ramdisk host limits: (%zu,%zu), VM overrides: (%zu,%zu)",
-           host_pv_kernel_max_size, host_pv_ramdisk_max_size,
-           vm_pv_kernel_max_size, vm_pv_ramdisk_max_size);
+    return fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode);
 }
 
-
-static void failwith_oss_xc(xc_interface *xch, char *fct)
+static void postcopy_domain_save(xc_interface *xch, int fd,
+                                 struct save_cb_data *cb_data, int hvm)
 {
-    char buf[80];
-    const xc_error *error;
-
-    error = xc_get_last_error(xch);
-    if (error->code == XC_ERROR_NONE)
-        snprintf(buf, 80, "%s: [%d] %s", fct, errno, strerror(errno));
-    else
-        snprintf(buf, 80, "%s: [%d] %s", fct, error->code, error->message);
-    xc_clear_last_error(xch);
-    caml_failwith(buf);
+    struct postcopy_save_ops ops = {
+        dispatch_suspend, postcopy_transition, cb_data
+    };
+    int r, lock_fd;
+
+    if (!hvm)
+        caml_failwith("post-copy is only supported for HVM guests");
+    if (suspend_req_fd < 0 || suspend_ack_fd < 0)
+        caml_failwith("post-copy needs the suspend fast path");
+    if (rate_limits.stream_bps || rate_limits.host_bps ||
+        checkpoint_interval_ms)
+        caml_failwith("post-copy cannot be rate-limited or checkpointed");
+    if (!is_socket(fd))
+        caml_failwith("post-copy needs a socket");
+
+    lock_fd = save_lock(cb_data->domid);
+    printf("postcopy: sampling the working set for %ums",
+           postcopy_sample_ms);
+    caml_enter_blocking_section();
+    TRACE("save", "postcopy_save",
+          r = postcopy_save(xch, fd, cb_data->domid, postcopy_sample_ms,
+                            &ops));
+    domain_unlock(lock_fd);
+    caml_leave_blocking_section();
+    if (r)
+        failwith_oss_xc(xch, "postcopy_save");
 }
 
-static int dispatch_suspend(void *arg)
+/* The guest can be unpaused: let the caller read qemu's state off the
+   stream and start the device model (see xenguest_main.ml) */
+static int postcopy_restore_transition(unsigned long store_mfn,
+                                       unsigned long console_mfn,
+                                       void *data)
 {
-    value * __suspend_closure;
-    int domid = (int) arg;
-    int ret;
+    value * __postcopy_closure;
+    value r;
 
-    __suspend_closure = caml_named_value("suspend_callback");
-    if (!__suspend_closure)
-        return 0;
+    __postcopy_closure = caml_named_value("postcopy_callback");
+    if (!__postcopy_closure)
+        return -1;
     caml_leave_blocking_section();
-    ret = Int_val(caml_callback(*__suspend_closure, Val_int(domid)));
+    r = caml_callback2(*__postcopy_closure,
+                       caml_copy_nativeint(store_mfn),
+                       caml_copy_nativeint(console_mfn));
     caml_enter_blocking_section();
-    return ret;
+    return Bool_val(r) ? 0 : -1;
 }
 
+/* Delta encoding of the pages of each checkpoint (libxc's checkpoint
+   compression, a no-op without a checkpoint callback), see Xenguest.Delta */
+#ifndef XCFLAGS_CHECKPOINT_COMPRESS
+#define XCFLAGS_CHECKPOINT_COMPRESS 0
+#endif
+
 static int suspend_flag_list[] = {
-    XCFLAGS_DEBUG, XCFLAGS_LIVE, XCFLAGS_HVM
+    XCFLAGS_DEBUG, XCFLAGS_LIVE, XCFLAGS_CHECKPOINT_COMPRESS, XCFLAGS_HVM
 };
 
 CAMLprim value stub_xenguest_init()
@@ -344,37 +423,48 @@ CAMLprim value stub_xenguest_close(value xenguest_handle)
 
 extern struct xc_dom_image *xc_dom_allocate(xc_interface *xch, const char *cmdline, const char *features);
 
-static void configure_vcpus(xc_interface *xch, int domid, struct flags f){
-    struct xen_domctl_sched_credit sdom;
-    int i, j, r, size, pcpus_supplied, min;
-    xc_cpumap_t cpumap;
-
-    size = xc_get_cpumap_size(xch) * 8; /* array is of uint8_t */
+/* Apply the hard and (where libxc supports it) soft affinity of every
+   vCPU. Both masks of a vCPU are set by the same hypercall. */
+static void configure_vcpu_affinity(xc_interface *xch, int domid, struct flags f)
+{
+    xc_cpumap_t hard, soft;
+    int i, r;
 
     for (i=0; i<f.vcpus; i++){
-        if (f.vcpu_affinity[i]){ /* NULL means unset */
-            pcpus_supplied = strlen(f.vcpu_affinity[i]);
-            min = (pcpus_supplied < size)?pcpus_supplied:size;
-            cpumap = xc_cpumap_alloc(xch);
-            if (cpumap == NULL)
-                failwith_oss_xc(xch, "xc_cpumap_alloc");
-
-            for (j=0; j<min; j++) {
-                if (f.vcpu_affinity[i][j] == '1')
-                    cpumap[j/8] |= 1 << (j&7);
-            }
-            r = xc_vcpu_setaffinity(xch, domid, i, cpumap);
-            free(cpumap);
-            if (r) {
-                failwith_oss_xc(xch, "xc_vcpu_setaffinity");
-            }
+        if (!f.vcpu_affinity[i] && !f.vcpu_soft_affinity[i]) /* NULL means unset */
+            continue;
+        hard = f.vcpu_affinity[i] ? cpumap_of_string(xch, f.vcpu_affinity[i]) : NULL;
+        soft = f.vcpu_soft_affinity[i] ? cpumap_of_string(xch, f.vcpu_soft_affinity[i]) : NULL;
+        if ((f.vcpu_affinity[i] && !hard) || (f.vcpu_soft_affinity[i] && !soft)) {
+            free(hard);
+            free(soft);
+            failwith_oss_xc(xch, "xc_cpumap_alloc");
+        }
+#ifdef XEN_VCPUAFFINITY_SOFT
+        r = xc_vcpu_setaffinity(xch, domid, i, hard, soft,
+                                (hard ? XEN_VCPUAFFINITY_HARD : 0) |
+                                (soft ? XEN_VCPUAFFINITY_SOFT : 0));
+#else
+        if (soft)
+            fprintf(stderr, "vcpu/%d/soft-affinity set, but no support compiled in", i);
+        r = hard ? xc_vcpu_setaffinity(xch, domid, i, hard) : 0;
+#endif
+        free(hard);
+        free(soft);
+        if (r) {
+            failwith_oss_xc(xch, "xc_vcpu_setaffinity");
         }
     }
+}
+
+static void configure_sched_credit(xc_interface *xch, int domid, struct flags f)
+{
+    struct xen_domctl_sched_credit sdom;
+    int r;
 
     r = xc_sched_credit_domain_get(xch, domid, &sdom);
-    /* This should only happen when a different scheduler is set */
     if (r) {
-        fprintf(stderr, "Failed to get credit scheduler parameters: scheduler not enabled?");
+        fprintf(stderr, "Failed to get credit scheduler parameters");
         return;
     }
     if (f.vcpu_weight != 0L) sdom.weight = f.vcpu_weight;
@@ -384,6 +474,119 @@ static void configure_vcpus(xc_interface *xch, int domid, struct flags f){
     r = xc_sched_credit_domain_set(xch, domid, &sdom);
     if (r)
         failwith_oss_xc(xch, "xc_sched_credit_domain_set");
+
+    if (xc_sched_credit_domain_get(xch, domid, &sdom) == 0)
+        printf("Applied scheduler parameters: scheduler:credit weight:%d cap:%d",
+               sdom.weight, sdom.cap);
+}
+
+static void configure_sched_credit2(xc_interface *xch, int domid, struct flags f)
+{
+    struct xen_domctl_sched_credit2 sdom;
+    int r;
+
+    r = xc_sched_credit2_domain_get(xch, domid, &sdom);
+    if (r) {
+        fprintf(stderr, "Failed to get credit2 scheduler parameters");
+        return;
+    }
+    if (f.vcpu_weight != 0L) sdom.weight = f.vcpu_weight;
+    if (f.vcpu_cap != 0L)
+        fprintf(stderr, "vcpu/cap:%d ignored: not supported by credit2", f.vcpu_cap);
+    r = xc_sched_credit2_domain_set(xch, domid, &sdom);
+    if (r)
+        failwith_oss_xc(xch, "xc_sched_credit2_domain_set");
+
+    if (xc_sched_credit2_domain_get(xch, domid, &sdom) == 0)
+        printf("Applied scheduler parameters: scheduler:credit2 weight:%d",
+               sdom.weight);
+}
+
+/* sedf was removed in Xen 4.6, and its definitions with it */
+#ifdef XEN_SCHEDULER_SEDF
+static void configure_sched_sedf(xc_interface *xch, int domid, struct flags f)
+{
+    uint64_t period, slice, latency; /* nanoseconds */
+    uint16_t extratime, weight;
+    int r;
+
+    r = xc_sedf_domain_get(xch, domid, &period, &slice, &latency,
+                           &extratime, &weight);
+    if (r) {
+        fprintf(stderr, "Failed to get sedf scheduler parameters");
+        return;
+    }
+    if (f.vcpu_period_us != 0) period = (uint64_t)f.vcpu_period_us * 1000;
+    if (f.vcpu_slice_us != 0) slice = (uint64_t)f.vcpu_slice_us * 1000;
+    if (f.vcpu_latency_us != 0) latency = (uint64_t)f.vcpu_latency_us * 1000;
+    if (f.vcpu_weight != 0L) weight = f.vcpu_weight;
+    if (f.vcpu_extratime >= 0) extratime = f.vcpu_extratime;
+    r = xc_sedf_domain_set(xch, domid, period, slice, latency,
+                           extratime, weight);
+    if (r)
+        failwith_oss_xc(xch, "xc_sedf_domain_set");
+
+    if (xc_sedf_domain_get(xch, domid, &period, &slice, &latency,
+                           &extratime, &weight) == 0)
+        printf("Applied scheduler parameters: scheduler:sedf period:%"PRIu64
+               " slice:%"PRIu64" latency:%"PRIu64" extratime:%d weight:%d",
+               period / 1000, slice / 1000, latency / 1000, extratime, weight);
+}
+#endif
+
+#ifdef XEN_SCHEDULER_RTDS
+static void configure_sched_rtds(xc_interface *xch, int domid, struct flags f)
+{
+    struct xen_domctl_sched_rtds sdom;
+    int r;
+
+    r = xc_sched_rtds_domain_get(xch, domid, &sdom);
+    if (r) {
+        fprintf(stderr, "Failed to get rtds scheduler parameters");
+        return;
+    }
+    if (f.vcpu_period_us != 0) sdom.period = f.vcpu_period_us;
+    if (f.vcpu_budget_us != 0) sdom.budget = f.vcpu_budget_us;
+    r = xc_sched_rtds_domain_set(xch, domid, &sdom);
+    if (r)
+        failwith_oss_xc(xch, "xc_sched_rtds_domain_set");
+
+    if (xc_sched_rtds_domain_get(xch, domid, &sdom) == 0)
+        printf("Applied scheduler parameters: scheduler:rtds period:%u budget:%u",
+               sdom.period, sdom.budget);
+}
+#endif
+
+static void configure_vcpus(xc_interface *xch, int domid, struct flags f){
+    int sched_id;
+
+    configure_vcpu_affinity(xch, domid, f);
+
+    if (xc_sched_id(xch, &sched_id)) {
+        fprintf(stderr, "Failed to get scheduler id: scheduler parameters not set");
+        return;
+    }
+    switch (sched_id) {
+    case XEN_SCHEDULER_CREDIT:
+        configure_sched_credit(xch, domid, f);
+        break;
+    case XEN_SCHEDULER_CREDIT2:
+        configure_sched_credit2(xch, domid, f);
+        break;
+#ifdef XEN_SCHEDULER_SEDF
+    case XEN_SCHEDULER_SEDF:
+        configure_sched_sedf(xch, domid, f);
+        break;
+#endif
+#ifdef XEN_SCHEDULER_RTDS
+    case XEN_SCHEDULER_RTDS:
+        configure_sched_rtds(xch, domid, f);
+        break;
+#endif
+    default:
+        printf("Scheduler %d has no per-domain parameters", sched_id);
+        break;
+    }
 }
 
 static void configure_tsc(xc_interface *xch, int domid, struct flags f) {
@@ -423,12 +626,13 @@ CAMLprim value stub_xc_linux_build_native(value xc_handle, value domid,
     get_flags(&f,c_domid);
 
     xc_dom_loginit(xch);
-    dom = xc_dom_allocate(xch, String_val(cmdline), String_val(features));
+    TRACE("build", "xc_dom_allocate",
+          dom = xc_dom_allocate(xch, String_val(cmdline), String_val(features)));
     if (!dom)
         failwith_oss_xc(xch, "xc_dom_allocate");
 
-    configure_vcpus(xch, c_domid, f);
-    configure_tsc(xch, c_domid, f);
+    TRACE("build", "configure_vcpus", configure_vcpus(xch, c_domid, f));
+    TRACE("build", "configure_tsc", configure_tsc(xch, c_domid, f));
 #ifdef XC_HAVE_DECOMPRESS_LIMITS
     if ( xc_dom_kernel_max_size(dom, f.kernel_max_size) )
         failwith_oss_xc(xch, "xc_dom_kernel_max_size");
@@ -441,16 +645,18 @@ CAMLprim value stub_xc_linux_build_native(value xc_handle, value domid,
 #endif
 
     caml_enter_blocking_section();
-    r = xc_dom_linux_build(xch, dom, c_domid, c_mem_start_mib,
-                           c_image_name, c_ramdisk_name, c_flags,
-                           c_store_evtchn, &store_mfn,
-                           c_console_evtchn, &console_mfn);
+    TRACE("build", "xc_dom_linux_build",
+          r = xc_dom_linux_build(xch, dom, c_domid, c_mem_start_mib,
+                                 c_image_name, c_ramdisk_name, c_flags,
+                                 c_store_evtchn, &store_mfn,
+                                 c_console_evtchn, &console_mfn));
     if (r == 0)
-        r = xc_dom_gnttab_seed(xch, c_domid,
-                               console_mfn,
-                               store_mfn,
-                               Int_val(console_domid),
-                               Int_val(store_domid));
+        TRACE("build", "xc_dom_gnttab_seed",
+              r = xc_dom_gnttab_seed(xch, c_domid,
+                                     console_mfn,
+                                     store_mfn,
+                                     Int_val(console_domid),
+                                     Int_val(store_domid)));
 
     caml_leave_blocking_section();
 
@@ -486,7 +692,7 @@ CAMLprim value stub_xc_linux_build_bytecode(value * argv, int argn)
 static int hvm_build_set_params(xc_interface *xch, int domid,
                                 int store_evtchn, unsigned long *store_mfn,
                                 int console_evtchn, unsigned long *console_mfn,
-                                struct flags f)
+                                unsigned long high_pfns, struct flags f)
 {
     struct hvm_info_table *va_hvm;
     uint8_t *va_map, sum;
@@ -510,6 +716,9 @@ static int hvm_build_set_params(xc_interface *xch, int domid,
 #if defined(HVM_INFO_TABLE_HAS_S3_ENABLED)
     va_hvm->s3_enabled = f.acpi_s3;
 #endif
+    /* Memory above 4GiB which was populated behind the builder's back */
+    if (high_pfns)
+        va_hvm->high_mem_pgend = POPULATE_HIGH_PFN + high_pfns;
     va_hvm->checksum = 0;
     for (i = 0, sum = 0; i < va_hvm->length; i++)
         sum += ((uint8_t *) va_hvm)[i];
@@ -531,6 +740,14 @@ static int hvm_build_set_params(xc_interface *xch, int domid,
     return 0;
 }
 
+static void failwith_vnuma(const char *why)
+{
+    char buf[160];
+
+    snprintf(buf, sizeof(buf), "hvm_build_vnuma: %s", why);
+    caml_failwith(buf);
+}
+
 CAMLprim value stub_xc_hvm_build_native(value xc_handle, value domid,
                                         value mem_max_mib, value mem_start_mib, value image_name,
                                         value store_evtchn, value store_domid,
@@ -545,33 +762,96 @@ CAMLprim value stub_xc_hvm_build_native(value xc_handle, value domid,
 
     unsigned long store_mfn=0;
     unsigned long console_mfn=0;
+    unsigned long high_pfns = 0;
     int r;
+    uint64_t start;
     struct flags f;
     /* The xenguest interface changed and was backported to XCP: */
 #if defined(XENGUEST_HAS_HVM_BUILD_ARGS) || (__XEN_LATEST_INTERFACE_VERSION__ >= 0x00040200)
     struct xc_hvm_build_args args;
+    struct populate_stats pst;
+    uint64_t mmio_start;
+#endif
+#ifdef XENMEM_get_vnumainfo
+    struct vnuma_range ranges[VNUMA_MAX_NODES + 1];
+    xen_vmemrange_t vmemranges[VNUMA_MAX_NODES + 1];
+    int nr_ranges = 0, i;
 #endif
     get_flags(&f, _D(domid));
+    if (f.vnuma_invalid)
+        failwith_vnuma(f.vnuma.error);
 
     xch = _H(xc_handle);
-    configure_vcpus(xch, _D(domid), f);
-    configure_tsc(xch, _D(domid), f);
+    TRACE("build", "configure_vcpus", configure_vcpus(xch, _D(domid), f));
+    TRACE("build", "configure_tsc", configure_tsc(xch, _D(domid), f));
 
 #if defined(XENGUEST_HAS_HVM_BUILD_ARGS) || (__XEN_LATEST_INTERFACE_VERSION__ >= 0x00040200)
+    memset(&args, 0, sizeof(args));
     args.mem_size = (uint64_t)Int_val(mem_max_mib) << 20;
     args.mem_target = (uint64_t)Int_val(mem_start_mib) << 20;
     args.mmio_size = f.mmio_size_mib << 20;
     args.image_file_name = image_name_c;
+
+    mmio_start = (1ULL << 32) -
+        (args.mmio_size ? args.mmio_size : HVM_BELOW_4G_MMIO_LENGTH);
+
+    /* libxc allocates each virtual node's memory from its host node, and
+       hvmloader builds the SRAT and SLIT from what xc_domain_setvnuma
+       registers */
+#ifdef XENMEM_get_vnumainfo
+    if (f.vnuma.nr_nodes) {
+        if (args.mem_target != args.mem_size)
+            failwith_vnuma("not with populate-on-demand (mem_start_mib < mem_max_mib)");
+        nr_ranges = vnuma_layout(&f.vnuma, args.mem_size, mmio_start, ranges);
+        if (nr_ranges < 0)
+            failwith_vnuma("the nodes' memory_mib do not add up to mem_max_mib");
+        for (i = 0; i < nr_ranges; i++) {
+            vmemranges[i].start = ranges[i].start;
+            vmemranges[i].end = ranges[i].end;
+            vmemranges[i].flags = 0;
+            vmemranges[i].nid = ranges[i].node;
+        }
+        args.vmemranges = vmemranges;
+        args.nr_vmemranges = nr_ranges;
+        args.vnode_to_pnode = f.vnuma.pnode;
+        args.nr_vnodes = f.vnuma.nr_nodes;
+    }
+#else
+    if (f.vnuma.nr_nodes)
+        fprintf(stderr, "platform/vnuma set, but no support compiled in: the guest sees one node");
+#endif
+
+    /* Leave the memory above the MMIO hole to populate_parallel. Not with
+       populate-on-demand (a target below the size), where there is
+       nothing to populate up front, nor with vNUMA. */
+    if (f.populate_threads && f.vnuma.nr_nodes == 0 &&
+        args.mem_target == args.mem_size && args.mem_size > mmio_start) {
+        high_pfns = (args.mem_size - mmio_start) >> XC_PAGE_SHIFT;
+        args.mem_size = args.mem_target = mmio_start;
+    }
 #endif
 
     caml_enter_blocking_section ();
+    start = trace_begin();
 #if defined(XENGUEST_HAS_HVM_BUILD_ARGS) || (__XEN_LATEST_INTERFACE_VERSION__ >= 0x00040200)
     r = xc_hvm_build(xch, _D(domid), &args);
+    trace_end("build", "xc_hvm_build", start);
+    if (r == 0 && high_pfns) {
+        TRACE("build", "populate_parallel",
+              r = populate_parallel(xch, _D(domid), POPULATE_HIGH_PFN,
+                                    high_pfns, f.populate_threads, &pst));
+        if (r) {
+            caml_leave_blocking_section ();
+            free(image_name_c);
+            failwith_oss_xc(xch, "hvm_build_mem");
+        }
+    }
 #else
     r = xc_hvm_build_target_mem(xch, _D(domid),
                                 Int_val(mem_max_mib),
                                 Int_val(mem_start_mib),
                                 image_name_c);
+    trace_end("build", "xc_hvm_build", start);
 #endif
     caml_leave_blocking_section ();
 
@@ -580,13 +860,27 @@ CAMLprim value stub_xc_hvm_build_native(value xc_handle, value domid,
     if (r)
         failwith_oss_xc(xch, "hvm_build");
 
+#ifdef XENMEM_get_vnumainfo
+    if (nr_ranges) {
+        TRACE("build", "xc_domain_setvnuma",
+              r = xc_domain_setvnuma(xch, _D(domid), f.vnuma.nr_nodes,
+                                     nr_ranges, f.vnuma.nr_vcpus, vmemranges,
+                                     f.vnuma.distance, f.vnuma.vcpu_to_vnode,
+                                     f.vnuma.pnode));
+        if (r)
+            failwith_oss_xc(xch, "xc_domain_setvnuma");
+    }
+#endif
 
-    r = hvm_build_set_params(xch, _D(domid), Int_val(store_evtchn), &store_mfn,
-                             Int_val(console_evtchn), &console_mfn, f);
+    TRACE("build", "hvm_build_set_params",
+          r = hvm_build_set_params(xch, _D(domid), Int_val(store_evtchn),
+                                   &store_mfn, Int_val(console_evtchn),
+                                   &console_mfn, high_pfns, f));
     if (r)
         failwith_oss_xc(xch, "hvm_build_params");
 
-    xc_dom_gnttab_hvm_seed(xch, _D(domid), console_mfn, store_mfn, Int_val(console_domid), Int_val(store_domid));
+    TRACE("build", "xc_dom_gnttab_hvm_seed",
+          xc_dom_gnttab_hvm_seed(xch, _D(domid), console_mfn, store_mfn, Int_val(console_domid), Int_val(store_domid)));
 
     result = caml_alloc_tuple(2);
     Store_field(result, 0, caml_copy_nativeint(store_mfn));
@@ -602,27 +896,27 @@ CAMLprim value stub_xc_hvm_build_bytecode(value * argv, int argn)
 }
 
 
-int switch_qemu_logdirty(int domid, unsigned enable, void *data)
+int switch_qemu_logdirty(int domid, unsigned enable, void *_data)
 {
-    char *path = NULL;
-    struct xs_handle *xsh = NULL;
-    bool rc;
-
-    pasprintf(&path, "/local/domain/0/device-model/%u/logdirty/cmd", domid);
-
-    xsh = xs_daemon_open();
-    if (xsh == NULL)
-        errx(1, "Couldn't contact xenstore");
-
-    if (enable)
-        rc = xs_write(xsh, XBT_NULL, path, "enable", strlen("enable"));
-    else
-        rc = xs_write(xsh, XBT_NULL, path, "disable", strlen("disable"));
+    struct save_cb_data *data = _data;
+    uint64_t elapsed_us;
 
-    xs_daemon_close(xsh);
-    free(path);
-    return rc ? 0 : 1;
+    if (data->logdirty == NULL) {
+        data->logdirty = logdirty_open(domid, LOGDIRTY_TIMEOUT_MS);
+        if (data->logdirty == NULL)
+            return 1;
+    }
+    if (logdirty_switch(data->logdirty, enable, &elapsed_us)) {
+        /* qemu versions that never echo logdirty/ret still switch mode;
+           a missing acknowledgement is only worth a warning */
+        if (errno == ETIMEDOUT)
+            return 0;
+        return 1;
+    }
 
+    printf("qemu log-dirty %s acknowledged in %"PRIu64"us",
+           enable ? "enable" : "disable", elapsed_us);
+    return 0;
 }
 
 /* static struct save_callbacks save_callbacks = { */
@@ -640,29 +934,105 @@ CAMLprim value stub_xc_domain_save(value handle, value fd, value domid,
     CAMLparam5(handle, fd, domid, max_iters, max_factors);
     CAMLxparam2(flags, hvm);
     struct save_callbacks callbacks;
+    struct save_cb_data cb_data;
+    struct pump *pump = NULL;
+    struct pod_stats pod;
 
     uint32_t c_flags;
     uint32_t c_domid;
-    int r;
-    uint64_t generation_id_addr;
+    struct converge_policy policy;
+    int r, io_fd, lock_fd, saved_errno, watch;
+    uint64_t generation_id_addr, start;
 
     c_flags = caml_convert_flag_list(flags, suspend_flag_list);
     c_domid = _D(domid);
 
+    memset(&cb_data, 0, sizeof(cb_data));
+    cb_data.xch = _H(handle);
+    cb_data.domid = c_domid;
+
     memset(&callbacks, 0, sizeof(callbacks));
-    callbacks.data = (void*) c_domid;
+    callbacks.data = &cb_data;
     callbacks.suspend = dispatch_suspend;
     callbacks.switch_qemu_logdirty = switch_qemu_logdirty;
 
+    if (checkpoint_interval_ms) {
+        /* Only the memory image is replicated, not qemu's state */
+        if (Bool_val(hvm))
+            caml_failwith("checkpoint mode is only supported for PV guests");
+        checkpoint_init(&cb_data.checkpoint, checkpoint_interval_ms,
+                        checkpoint_max_epochs);
+        callbacks.postcopy = dispatch_postcopy;
+        callbacks.checkpoint = dispatch_checkpoint;
+        printf("checkpoint mode: interval %ums, %u epochs",
+               checkpoint_interval_ms, checkpoint_max_epochs);
+    }
+
+    io_fd = Int_val(fd);
+    if (postcopy_sample_ms) {
+        postcopy_domain_save(_H(handle), io_fd, &cb_data, Bool_val(hvm));
+        CAMLreturn(Val_unit);
+    }
+
+    lock_fd = save_lock(c_domid);
+    /* The pump also counts the bytes of each checkpoint epoch and for
+       the convergence measurements, writes suspend images to files with
+       direct I/O and adds the checksums */
+    watch = converge_downtime_ms > 0 && (c_flags & XCFLAGS_LIVE);
+    if (rate_limits.stream_bps || rate_limits.host_bps ||
+        checkpoint_interval_ms || integrity || watch ||
+        is_regular_file(io_fd)) {
+        pump = pump_start(io_fd, &rate_limits, rate_limit_ctl_fd, integrity,
+                          &io_fd);
+        if (pump == NULL) {
+            domain_unlock(lock_fd);
+            failwith_oss_xc(_H(handle), "pump_start");
+        }
+    }
+    cb_data.pump = pump;
+
     caml_enter_blocking_section();
+    /* libxc sends nothing for unpopulated gfns: say how much that is */
+    if (Bool_val(hvm))
+        TRACE("save", "pod_save_stats",
+              pod_save_stats(_H(handle), c_domid, &pod));
     generation_id_addr = xenstore_get(c_domid, GENERATION_ID_ADDRESS);
-    r = xc_domain_save(_H(handle), Int_val(fd), c_domid,
+    if (watch) {
+        policy.downtime_ms = converge_downtime_ms;
+        policy.auto_throttle = converge_auto_throttle;
+        policy.interval_ms = CONVERGE_INTERVAL_MS;
+        cb_data.converge = converge_start(c_domid, &policy,
+                                          converge_bytes_sent, pump);
+        if (cb_data.converge == NULL)
+            fprintf(stderr, "converge: cannot watch the save: %s",
+                    strerror(errno));
+        else
+            printf("converge: downtime budget %ums, auto-converge %s, "
+                   "max_iters %d max_factors %d", converge_downtime_ms,
+                   converge_auto_throttle ? "on" : "off",
+                   Int_val(max_iters), Int_val(max_factors));
+    }
+    start = trace_begin();
+    r = xc_domain_save(_H(handle), io_fd, c_domid,
                        Int_val(max_iters), Int_val(max_factors),
                        c_flags, &callbacks, Bool_val(hvm)
 #if defined(XENGUEST_4_2) || defined(XC_HAS_4_1_NEW_GENERATION_ID_INTERFACE)
                        ,generation_id_addr
 #endif
         );
+    saved_errno = errno;
+    converge_finish(cb_data.converge);
+    logdirty_close(cb_data.logdirty);
+    /* The save is only complete once the pump has written everything.
+       If the pump failed, libxc only saw the EPIPE which followed. */
+    if (pump != NULL && pump_finish(pump)) {
+        r = -1;
+        saved_errno = errno;
+        xc_clear_last_error(_H(handle));
+    }
+    trace_end("save", "xc_domain_save", start);
+    domain_unlock(lock_fd);
+    errno = saved_errno;
     caml_leave_blocking_section();
     if (r)
         failwith_oss_xc(_H(handle), "xc_domain_save");
@@ -694,11 +1064,12 @@ CAMLprim value stub_xc_domain_resume_slow(value handle, value domid)
 typedef struct
 {
     const uint16_t domid;
+    struct xenstore_batch *xsb;
 } genid_cb_data_t;
 
 /* Callback from libxc when a generation ID marker is found in the migration
- * stream. The new generation ID must be written into XenStore before migration
- * starts. */
+ * stream. The new generation ID must be written into XenStore before the
+ * domain starts: it goes with the rest of the restore's writes. */
 static int genid_callback(uint64_t *vm_genid_addr, void *genid_page, void *_data)
 {
     genid_cb_data_t *data = _data;
@@ -743,8 +1114,8 @@ static int genid_callback(uint64_t *vm_genid_addr, void *genid_page, void *_data
         return -1;
     }
 
-    if ( xenstore_puts(data->domid, genid_addr_str,
-                       "hvmloader/generation-id-address") )
+    if ( xenstore_batch_puts(data->xsb, genid_addr_str,
+                             "hvmloader/generation-id-address") )
     {
         fprintf(stderr, "Failed to write generation id to xenstore");
         free(genid_addr_str);
@@ -759,27 +1130,86 @@ static int genid_callback(uint64_t *vm_genid_addr, void *genid_page, void *_data
 }
 #endif
 
+/* The libxc restore, and the xenstore writes which follow from it, into
+   xsb. Must be called outside the OCaml runtime lock (and without it at
+   all in a clone's process). Returns 0, or -1 if xc_domain_restore
+   failed; *xs_err is set to the errno of a failure to record a write.
+   *genid_addr is where the guest's generation ID is (0 if none, or if
+   libxc reported it through genid_callback). */
+static int restore_stream(xc_interface *xch, int fd, uint32_t domid,
+                          unsigned int store_evtchn, domid_t store_domid,
+                          unsigned long *store_mfn,
+                          unsigned int console_evtchn, domid_t console_domid,
+                          unsigned long *console_mfn, int hvm, int pae,
+                          int no_incr_generationid,
+                          struct xenstore_batch *xsb,
+                          unsigned long *genid_addr, int *xs_err)
+{
+#ifdef XENGUEST_4_2
+    unsigned long vm_generationid_addr = 0;
+    char buf[64];
+#endif
+#ifdef XC_HAS_4_1_NEW_GENERATION_ID_INTERFACE
+    genid_cb_data_t genid_cb_data = { domid, xsb };
+#endif
+    uint64_t start = trace_begin();
+    int r;
+
+    *xs_err = 0;
+    *genid_addr = 0;
+    r = xc_domain_restore(xch, fd, domid,
+                          store_evtchn, store_mfn,
+#ifdef XENGUEST_4_2
+                          store_domid,
+#endif
+                          console_evtchn, console_mfn,
+#ifdef XENGUEST_4_2
+                          console_domid,
+#endif
+                          hvm, pae, 0 /*superpages*/
+#ifdef XENGUEST_4_2
+                          ,
+                          no_incr_generationid,
+                          &vm_generationid_addr,
+                          NULL /* restore_callbacks */
+#elif defined(XC_HAS_4_1_NEW_GENERATION_ID_INTERFACE)
+                          ,genid_callback, &genid_cb_data
+#endif
+        );
+    trace_end("restore", "xc_domain_restore", start);
+#ifdef XENGUEST_4_2
+    if (r == 0 && hvm && vm_generationid_addr) {
+        *genid_addr = vm_generationid_addr;
+        snprintf(buf, sizeof(buf), "0x%lx", vm_generationid_addr);
+        if (xenstore_batch_puts(xsb, buf, "hvmloader/generation-id-address"))
+            *xs_err = ENOMEM;
+    }
+#endif
+    return r ? -1 : 0;
+}
+
 CAMLprim value stub_xc_domain_restore(value handle, value fd, value domid,
                                       value store_evtchn, value store_domid,
                                       value console_evtchn, value console_domid,
-                                      value hvm, value no_incr_generationid)
+                                      value hvm, value no_incr_generationid,
+                                      value target_mib)
 {
     CAMLparam5(handle, fd, domid, store_evtchn, console_evtchn);
-    CAMLxparam2(hvm, no_incr_generationid);
+    CAMLxparam3(hvm, no_incr_generationid, target_mib);
     CAMLlocal1(result);
     unsigned long store_mfn = 0, console_mfn = 0;
     domid_t c_store_domid, c_console_domid;
-
-#ifdef XENGUEST_4_2
-    unsigned long c_vm_generationid_addr;
-#endif
-
     unsigned int c_store_evtchn, c_console_evtchn;
-    int r;
-
-#ifdef XC_HAS_4_1_NEW_GENERATION_ID_INTERFACE
-    genid_cb_data_t genid_cb_data = { _D(domid) };
-#endif
+    int r, image = is_regular_file(Int_val(fd));
+    off_t image_start = 0;
+    struct xenstore_batch *xsb;
+    unsigned long genid_addr;
+    uint64_t target_pages = (uint64_t)Int_val(target_mib) << (20 - XC_PAGE_SHIFT);
+    struct pod_stats pod;
+    int xs_err, pod_failed = 0;
+    struct integrity_reader *checker = NULL;
+    int libxc_fd = Int_val(fd), corrupt = 0;
+    char buf[256], why[160];
 
     struct flags f;
     get_flags(&f,_D(domid));
@@ -792,33 +1222,92 @@ CAMLprim value stub_xc_domain_restore(value handle, value fd, value domid,
 #ifdef HVM_PARAM_VIRIDIAN
     xc_set_hvm_param(_H(handle), _D(domid), HVM_PARAM_VIRIDIAN, f.viridian);
 #endif
-    configure_vcpus(_H(handle), _D(domid), f);
+    TRACE("restore", "configure_vcpus", configure_vcpus(_H(handle), _D(domid), f));
+    /* Only scalar flags are used from here on, and every failure below
+       leaves through caml_failwith */
+    free_flags(&f);
+
+    /* A post-copy stream is only ever sent to a socket */
+    if (Bool_val(hvm) && !image && postcopy_is_stream(Int_val(fd))) {
+        struct postcopy_restore_ops ops = {
+            postcopy_restore_transition, NULL
+        };
+
+        caml_enter_blocking_section();
+        TRACE("restore", "postcopy_restore",
+              r = postcopy_restore(_H(handle), Int_val(fd), _D(domid),
+                                   c_store_evtchn, &store_mfn, &console_mfn,
+                                   &ops));
+        caml_leave_blocking_section();
+        if (r)
+            failwith_oss_xc(_H(handle), "postcopy_restore");
+        goto out;
+    }
 
-    caml_enter_blocking_section();
+    /* The xenstore writes of the restore are committed together once it
+       has succeeded */
+    xsb = xenstore_batch_create(_D(domid));
+    if (xsb == NULL)
+        caml_failwith("xc_domain_restore: cannot connect to xenstore");
+
+    /* A checked stream reaches libxc through a thread which verifies it */
+    if (integrity_is_stream(Int_val(fd))) {
+        checker = integrity_reader_start(Int_val(fd), &libxc_fd);
+        if (checker == NULL) {
+            xs_err = errno;
+            xenstore_batch_free(xsb);
+            errno = xs_err;
+            failwith_oss_xc(_H(handle), "integrity_reader_start");
+        }
+    }
 
-    r = xc_domain_restore(_H(handle), Int_val(fd), _D(domid),
-                          c_store_evtchn, &store_mfn,
-#ifdef XENGUEST_4_2
-                          c_store_domid,
-#endif
-                          c_console_evtchn, &console_mfn,
-#ifdef XENGUEST_4_2
-                          c_console_domid,
-#endif
-                          Bool_val(hvm), f.pae, 0 /*superpages*/
-#ifdef XENGUEST_4_2
-                          ,
-                          Bool_val(no_incr_generationid),
-                          &c_vm_generationid_addr,
-                          NULL /* restore_callbacks */
-#elif defined(XC_HAS_4_1_NEW_GENERATION_ID_INTERFACE)
-                          ,genid_callback, &genid_cb_data
-#endif
-        );
+    /* A suspend image is read once, front to back */
+    if (image) {
+        image_start = lseek(Int_val(fd), 0, SEEK_CUR);
+        posix_fadvise(Int_val(fd), image_start, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(Int_val(fd), image_start, 0, POSIX_FADV_WILLNEED);
+    }
+
+    caml_enter_blocking_section();
+    r = restore_stream(_H(handle), libxc_fd, _D(domid),
+                       c_store_evtchn, c_store_domid, &store_mfn,
+                       c_console_evtchn, c_console_domid, &console_mfn,
+                       Bool_val(hvm), f.pae, Bool_val(no_incr_generationid),
+                       xsb, &genid_addr, &xs_err);
+    /* A corrupt stream is usually also a failed restore: say why */
+    if (checker && integrity_reader_finish(checker, r != 0, why, sizeof(why)))
+        corrupt = 1;
+    if (corrupt)
+        r = -1;
+    /* A guest built with less memory than its maximum gets its PoD
+       entries back before it runs */
+    if (r == 0 && Bool_val(hvm) && target_pages &&
+        pod_restore_sparse(_H(handle), _D(domid), target_pages, &pod))
+        pod_failed = 1;
+    if (image)
+        posix_fadvise(Int_val(fd), image_start,
+                      lseek(Int_val(fd), 0, SEEK_CUR) - image_start,
+                      POSIX_FADV_DONTNEED);
+    if (r == 0 && !pod_failed && !xs_err && xenstore_batch_commit(xsb))
+        xs_err = errno;
+    xenstore_batch_free(xsb);
     caml_leave_blocking_section();
+    if (corrupt) {
+        snprintf(buf, sizeof(buf), "xc_domain_restore: stream integrity: %s",
+                 why);
+        caml_failwith(buf);
+    }
     if (r)
         failwith_oss_xc(_H(handle), "xc_domain_restore");
+    if (pod_failed)
+        failwith_oss_xc(_H(handle), "pod_restore_sparse");
+    if (xs_err) {
+        snprintf(buf, sizeof(buf), "xc_domain_restore: xenstore: %s",
+                 strerror(xs_err));
+        caml_failwith(buf);
+    }
 
+out:
     result = caml_alloc_tuple(2);
     Store_field(result, 0, caml_copy_nativeint(store_mfn));
     Store_field(result, 1, caml_copy_nativeint(console_mfn));
@@ -829,7 +1318,187 @@ CAMLprim value stub_xc_domain_restore_bytecode(value * argv, int argn)
 {
     return stub_xc_domain_restore(argv[0], argv[1], argv[2], argv[3],
                                   argv[4], argv[5], argv[6], argv[7],
-                                  argv[8]);
+                                  argv[8], argv[9]);
+}
+
+/* Fan-out restore: see xenguest_fanout.h */
+struct fanout_data {
+    int hvm;
+    int no_incr_generationid;
+    int integrity;              /* the image is a checked stream */
+};
+
+#ifdef XENGUEST_4_2
+/* libxc gives every clone the generation ID in the image: give each the
+   one of its own VM (platform/generation-id, as for genid_callback), so
+   that the guests know they are copies. A VM without one keeps the
+   image's. */
+static int fanout_set_genid(xc_interface *xch, uint32_t domid,
+                            unsigned long addr)
+{
+    unsigned long offset = addr & (XC_PAGE_SIZE - 1);
+    uint64_t genid[2];
+    char *s, *end = NULL;
+    uint8_t *page;
+
+    s = xenstore_gets(domid, "platform/generation-id");
+    if (s == NULL)
+        return 0;
+    errno = 0;
+    genid[0] = strtoull(s, &end, 0);
+    genid[1] = 0;
+    if (end && end[0] == ':')
+        genid[1] = strtoull(end + 1, NULL, 0);
+    free(s);
+    if (errno || genid[0] == 0 || genid[1] == 0)
+        return 0;
+    if (offset + sizeof(genid) > XC_PAGE_SIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    page = xc_map_foreign_range(xch, domid, XC_PAGE_SIZE,
+                                PROT_READ | PROT_WRITE, addr >> XC_PAGE_SHIFT);
+    if (page == NULL)
+        return -1;
+    memcpy(page + offset, genid, sizeof(genid));
+    munmap(page, XC_PAGE_SIZE);
+    printf("domid %u: generation ID %"PRIx64":%"PRIx64,
+           domid, genid[0], genid[1]);
+    return 0;
+}
+#endif
+
+/* Restores one clone, in its own process: nothing here may call into the
+   OCaml runtime, and libxc's hypercall buffers are not inherited across
+   fork, so the clone opens its own handle. */
+static int fanout_restore_clone(int fd, struct fanout_clone *c, void *_data)
+{
+    struct fanout_data *data = _data;
+    struct xenstore_batch *xsb;
+    struct integrity_reader *checker = NULL;
+    xc_interface *xch;
+    unsigned long genid_addr = 0;
+    struct flags f;
+    int r, err = 0, libxc_fd = fd;
+    char why[160];
+
+    xch = xc_interface_open(NULL, NULL, 0);
+    if (xch == NULL)
+        return -1;
+    xsb = xenstore_batch_create(c->domid);
+    if (xsb == NULL) {
+        err = errno;
+        xc_interface_close(xch);
+        errno = err;
+        return -1;
+    }
+    get_flags(&f, c->domid);
+    if (data->integrity) {
+        checker = integrity_reader_start(fd, &libxc_fd);
+        if (checker == NULL) {
+            err = errno;
+            goto out;
+        }
+    }
+
+    r = restore_stream(xch, libxc_fd, c->domid, c->store_evtchn, c->store_domid,
+                       &c->store_mfn, c->console_evtchn, c->console_domid,
+                       &c->console_mfn, data->hvm, f.pae,
+                       data->no_incr_generationid, xsb, &genid_addr, &err);
+    if (r)
+        err = errno ? errno : EIO;
+    if (checker && integrity_reader_finish(checker, r != 0, why, sizeof(why))) {
+        printf("domid %u: stream integrity: %s", c->domid, why);
+        err = errno;
+    }
+#ifdef XENGUEST_4_2
+    if (!err && genid_addr && !data->no_incr_generationid) {
+        if (fanout_set_genid(xch, c->domid, genid_addr))
+            err = errno;
+        c->genid_addr = genid_addr;
+    }
+#endif
+    if (!err && xenstore_batch_commit(xsb))
+        err = errno;
+
+out:
+    free_flags(&f);
+    xenstore_batch_free(xsb);
+    xc_interface_close(xch);
+    errno = err;
+    return err ? -1 : 0;
+}
+
+CAMLprim value stub_xc_domain_restore_fanout(value handle, value fd,
+                                             value clones, value hvm,
+                                             value no_incr_generationid,
+                                             value share)
+{
+    CAMLparam5(handle, fd, clones, hvm, no_incr_generationid);
+    CAMLxparam1(share);
+    CAMLlocal2(result, tuple);
+    struct fanout_clone c[FANOUT_MAX_CLONES];
+    struct fanout_data data;
+    struct fanout_ops ops = { fanout_restore_clone, &data };
+    unsigned int i, nr = Wosize_val(clones);
+    struct flags f;
+    char buf[64];
+    int r;
+
+    if (nr == 0 || nr > FANOUT_MAX_CLONES)
+        caml_invalid_argument("domain_restore_fanout: number of clones");
+
+    data.hvm = Bool_val(hvm);
+    data.no_incr_generationid = Bool_val(no_incr_generationid);
+    data.integrity = integrity_is_stream(Int_val(fd));
+    memset(c, 0, sizeof(c));
+    for (i = 0; i < nr; i++) {
+        c[i].domid = Int_val(Field(Field(clones, i), 0));
+        c[i].store_evtchn = Int_val(Field(Field(clones, i), 1));
+        c[i].store_domid = Int_val(Field(Field(clones, i), 2));
+        c[i].console_evtchn = Int_val(Field(Field(clones, i), 3));
+        c[i].console_domid = Int_val(Field(Field(clones, i), 4));
+
+        get_flags(&f, c[i].domid);
+#ifdef HVM_PARAM_VIRIDIAN
+        xc_set_hvm_param(_H(handle), c[i].domid, HVM_PARAM_VIRIDIAN,
+                         f.viridian);
+#endif
+        configure_vcpus(_H(handle), c[i].domid, f);
+        free_flags(&f);
+    }
+
+    caml_enter_blocking_section();
+    r = fanout_restore(Int_val(fd), c, nr, &ops);
+#ifdef XENGUEST_4_2
+    /* The clones are paused, straight from the same image */
+    if (r > 1 && data.hvm && Bool_val(share) &&
+        fanout_share(_H(handle), c, nr) < 0)
+        printf("fanout: cannot share pages: %s", strerror(errno));
+#endif
+    caml_leave_blocking_section();
+    if (r < 0) {
+        snprintf(buf, sizeof(buf), "fanout_restore: %s", strerror(errno));
+        caml_failwith(buf);
+    }
+
+    result = caml_alloc(nr, 0);
+    for (i = 0; i < nr; i++) {
+        tuple = caml_alloc_tuple(3);
+        Store_field(tuple, 0,
+                    caml_copy_string(c[i].error ? strerror(c[i].error) : ""));
+        Store_field(tuple, 1, caml_copy_nativeint(c[i].store_mfn));
+        Store_field(tuple, 2, caml_copy_nativeint(c[i].console_mfn));
+        Store_field(result, i, tuple);
+    }
+    CAMLreturn(result);
+}
+
+CAMLprim value stub_xc_domain_restore_fanout_bytecode(value *argv, int argn)
+{
+    return stub_xc_domain_restore_fanout(argv[0], argv[1], argv[2], argv[3],
+                                         argv[4], argv[5]);
 }
 
 CAMLprim value stub_xc_domain_dumpcore(value handle, value domid, value file)
@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <ctype.h>
+
+#include "xenguest_vnuma.h"
+#include "xenguest_flags.h"
+
+/* Parse exactly n unsigned integers separated by spaces */
+static int parse_uints(const char *s, unsigned int *out, unsigned int n)
+{
+    unsigned long x;
+    unsigned int i;
+    char *end;
+
+    for (i = 0; i < n; i++) {
+        errno = 0;
+        x = strtoul(s, &end, 10);
+        if (end == s || errno || x > UINT_MAX)
+            return -1;
+        out[i] = x;
+        s = end;
+    }
+    while (isspace((unsigned char)*s))
+        s++;
+    return *s ? -1 : 0;
+}
+
+static int fail(struct vnuma *v, const char *fmt, unsigned int i)
+{
+    snprintf(v->error, sizeof(v->error), fmt, i);
+    v->nr_nodes = 0;
+    return -1;
+}
+
+int vnuma_load(struct vnuma *v, int domid, unsigned int nr_vcpus)
+{
+    unsigned int n, i, j;
+    char *s;
+    int r;
+
+    memset(v, 0, sizeof(*v));
+    n = xenstore_get(domid, "platform/vnuma/nodes");
+    if (n == 0)
+        return 0;
+    if (n > VNUMA_MAX_NODES)
+        return fail(v, "more than %u nodes", VNUMA_MAX_NODES);
+    v->memory_mib = calloc(n, sizeof(*v->memory_mib));
+    v->pnode = calloc(n, sizeof(*v->pnode));
+    v->distance = calloc(n * n, sizeof(*v->distance));
+    v->vcpu_to_vnode = calloc(nr_vcpus ? nr_vcpus : 1,
+                              sizeof(*v->vcpu_to_vnode));
+    if (!v->memory_mib || !v->pnode || !v->distance || !v->vcpu_to_vnode)
+        return fail(v, "out of memory", 0);
+    v->nr_nodes = n;
+    v->nr_vcpus = nr_vcpus;
+
+    for (i = 0; i < n; i++) {
+        v->memory_mib[i] = xenstore_get(domid, "platform/vnuma/%u/memory_mib", i);
+        if (v->memory_mib[i] == 0)
+            return fail(v, "node %u has no memory", i);
+
+        v->pnode[i] = VNUMA_NO_NODE;
+        s = xenstore_gets(domid, "platform/vnuma/%u/pnode", i);
+        if (s) {
+            r = parse_uints(s, &v->pnode[i], 1);
+            free(s);
+            if (r)
+                return fail(v, "node %u: bad pnode", i);
+        }
+
+        s = xenstore_gets(domid, "platform/vnuma/%u/distances", i);
+        if (s) {
+            r = parse_uints(s, v->distance + i * n, n);
+            free(s);
+            if (r)
+                return fail(v, "node %u: bad distances", i);
+        } else {
+            for (j = 0; j < n; j++)
+                v->distance[i * n + j] = i == j ? VNUMA_LOCAL_DISTANCE
+                    : VNUMA_REMOTE_DISTANCE;
+        }
+    }
+
+    s = xenstore_gets(domid, "platform/vnuma/vcpus");
+    if (s) {
+        r = parse_uints(s, v->vcpu_to_vnode, nr_vcpus);
+        free(s);
+        if (r)
+            return fail(v, "vcpus: expected the node of each of %u vCPUs",
+                        nr_vcpus);
+        for (i = 0; i < nr_vcpus; i++)
+            if (v->vcpu_to_vnode[i] >= n)
+                return fail(v, "vcpus: vCPU %u is on no node", i);
+    } else {
+        for (i = 0; i < nr_vcpus; i++)
+            v->vcpu_to_vnode[i] = (uint64_t)i * n / nr_vcpus;
+    }
+    return 0;
+}
+
+void vnuma_free(struct vnuma *v)
+{
+    free(v->memory_mib);
+    free(v->pnode);
+    free(v->distance);
+    free(v->vcpu_to_vnode);
+    v->memory_mib = NULL;
+    v->pnode = v->distance = v->vcpu_to_vnode = NULL;
+    v->nr_nodes = 0;
+}
+
+int vnuma_layout(const struct vnuma *v, uint64_t mem_size,
+                 uint64_t mmio_start, struct vnuma_range *ranges)
+{
+    uint64_t addr = 0, total = 0, left, len;
+    unsigned int i;
+    int nr = 0;
+
+    for (i = 0; i < v->nr_nodes; i++)
+        total += v->memory_mib[i] << 20;
+    if (total != mem_size)
+        return -1;
+
+    for (i = 0; i < v->nr_nodes; i++) {
+        for (left = v->memory_mib[i] << 20; left; left -= len) {
+            if (addr == mmio_start)
+                addr = 1ULL << 32;
+            len = left;
+            if (addr < mmio_start && addr + len > mmio_start)
+                len = mmio_start - addr;
+            ranges[nr].start = addr;
+            ranges[nr].end = addr + len;
+            ranges[nr].node = i;
+            nr++;
+            addr += len;
+        }
+    }
+    return nr;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+#ifndef _XENGUEST_VNUMA_H_
+#define _XENGUEST_VNUMA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Virtual NUMA topology of an HVM guest, read from the platform area of
+   xenstore:
+
+     platform/vnuma/nodes           number of virtual nodes (unset: none,
+                                    the guest sees one flat node)
+     platform/vnuma/<i>/memory_mib  memory of node i; the nodes' memory
+                                    must add up to the guest's
+     platform/vnuma/<i>/pnode       host node to allocate it from
+                                    (default: any)
+     platform/vnuma/<i>/distances   the distances from node i to each node,
+                                    space separated (default: 10 to itself
+                                    and 20 to the others)
+     platform/vnuma/vcpus           the node of each vCPU, space separated
+                                    (default: vCPUs shared out in order)
+
+   Node 0 takes the lowest guest memory, the next node follows it, and so
+   on, skipping the MMIO hole below 4GiB. */
+#define VNUMA_MAX_NODES 64
+#define VNUMA_NO_NODE (~0U)
+#define VNUMA_LOCAL_DISTANCE 10
+#define VNUMA_REMOTE_DISTANCE 20
+
+struct vnuma {
+    unsigned int nr_nodes;          /* 0 without a topology */
+    unsigned int nr_vcpus;
+    uint64_t *memory_mib;           /* per node */
+    unsigned int *pnode;            /* per node, or VNUMA_NO_NODE */
+    unsigned int *distance;         /* nr_nodes x nr_nodes */
+    unsigned int *vcpu_to_vnode;    /* per vCPU */
+    char error[128];                /* why vnuma_load failed */
+};
+
+/* A range of guest physical memory and its node */
+struct vnuma_range {
+    uint64_t start, end;
+    unsigned int node;
+};
+
+/* Read domid's topology for a guest of nr_vcpus. Returns 0, or -1 if the
+   keys are inconsistent, with the reason in v->error (nr_nodes is then 0).
+   vnuma_free must be called either way. */
+extern int vnuma_load(struct vnuma *v, int domid, unsigned int nr_vcpus);
+
+extern void vnuma_free(struct vnuma *v);
+
+/* Lay the nodes out in a guest of mem_size bytes, whose MMIO hole starts
+   at mmio_start, into ranges (room for nr_nodes + 1). Returns the number
+   of ranges, or -1 if the nodes' memory does not add up to mem_size. */
+extern int vnuma_layout(const struct vnuma *v, uint64_t mem_size,
+                        uint64_t mmio_start, struct vnuma_range *ranges);
+
+#endif /* _XENGUEST_VNUMA_H_ */
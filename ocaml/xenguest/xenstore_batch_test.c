@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+/* Commit batches of xenstore writes to the in-process xenstore stand-in
+   (fake_xenstore.c), including through conflicting transactions. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <xenstore.h>
+
+#include "xenguest_flags.h"
+#include "fake_xen.h"
+
+static int failures;
+
+#define check(cond, what) do {                              \
+        if (cond) printf("ok: %s\n", what);                 \
+        else { printf("FAIL: %s\n", what); failures++; }   \
+    } while (0)
+
+static int has(int domid, const char *key, const char *val)
+{
+    char *s = xenstore_gets(domid, "%s", key);
+    int r = s != NULL && !strcmp(s, val);
+
+    free(s);
+    return r;
+}
+
+int main(void)
+{
+    struct xenstore_batch *b = xenstore_batch_create(3);
+    struct xs_handle *xsh;
+    char *s;
+    int ended;
+
+    check(b != NULL, "batch created");
+    if (b == NULL)
+        return 1;
+
+    xenstore_batch_puts(b, "0xfc000000", "hvmloader/generation-id-address");
+    xenstore_batch_puts(b, "7", "store/port");
+    xenstore_batch_puts(b, "1", "/vm/%d/ready", 3);
+    check(xenstore_gets(3, "store/port") == NULL, "nothing written before the commit");
+    ended = fake_xs_fail_transactions(0);
+    check(xenstore_batch_commit(b) == 0, "committed");
+    check(fake_xs_fail_transactions(0) == ended + 1, "in one transaction");
+    check(has(3, "hvmloader/generation-id-address", "0xfc000000") &&
+          has(3, "store/port", "7"), "relative paths written");
+    xsh = xs_daemon_open();
+    s = xs_read(xsh, XBT_NULL, "/vm/3/ready", NULL);
+    check(s != NULL && !strcmp(s, "1"), "absolute path written");
+    free(s);
+    xs_daemon_close(xsh);
+
+    /* Two conflicts, then it goes through */
+    ended = fake_xs_fail_transactions(2);
+    xenstore_batch_puts(b, "2", "store/port");
+    check(xenstore_batch_commit(b) == 0 && has(3, "store/port", "2"),
+          "committed after retrying");
+    check(fake_xs_fail_transactions(0) == ended + 3, "retried twice");
+
+    /* Conflicts every time */
+    ended = fake_xs_fail_transactions(XENSTORE_BATCH_RETRIES + 1);
+    xenstore_batch_puts(b, "3", "store/port");
+    errno = 0;
+    check(xenstore_batch_commit(b) == -1 && errno == EAGAIN,
+          "gives up with EAGAIN");
+    check(fake_xs_fail_transactions(0) == ended + XENSTORE_BATCH_RETRIES + 1,
+          "after the retries");
+
+    ended = fake_xs_fail_transactions(0);
+    check(xenstore_batch_commit(b) == 0 && fake_xs_fail_transactions(0) == ended,
+          "an empty batch needs no transaction");
+
+    xenstore_batch_free(b);
+    return failures ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
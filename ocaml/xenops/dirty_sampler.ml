@@ -0,0 +1,129 @@
+(*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *)
+(** An rrdd plugin publishing how fast each VM writes to its memory and the
+    size of its working set, for predicting what migrating it would cost.
+    They are sampled with the log-dirty mode which migration uses, but only
+    for a few seconds in every period, so that the guests do not pay for
+    it the rest of the time. *)
+
+open Printf
+open Pervasiveext
+open Threadext
+
+module D = Debug.Make(struct let name = "dirty_sampler" end)
+open D
+
+let uid = "xcp-dirty-sampler"
+
+let period = ref 60.
+let interval_ms = ref 1000
+let intervals = ref 5
+
+(* The latest sample of each VM, by uuid *)
+let latest : (string * Domain.dirty_sample) list ref = ref []
+let latest_m = Mutex.create ()
+
+let sample_all xc =
+	let domains = List.filter (fun di ->
+		di.Xenctrl.domid <> 0 && not di.Xenctrl.dying && not di.Xenctrl.shutdown
+	) (Xenctrl.domain_getinfolist xc 0) in
+	let results = Array.make (List.length domains) None in
+	let threads = List.mapi (fun i di ->
+		Thread.create (fun () ->
+			let uuid = Uuid.to_string (Uuid.uuid_of_int_array di.Xenctrl.handle) in
+			try
+				results.(i) <- Some (uuid, Domain.dirty_sample ~interval_ms:!interval_ms ~intervals:!intervals di.Xenctrl.domid)
+			with e ->
+				(* e.g. it is being migrated, which holds log-dirty mode: a
+				   save and a sample exclude each other (domain_lock.h) *)
+				debug "domid = %d; not sampled: %s" di.Xenctrl.domid (Printexc.to_string e)
+		) ()
+	) domains in
+	List.iter Thread.join threads;
+	List.concat (List.map Opt.to_list (Array.to_list results))
+
+let datasources (uuid, s) =
+	let owner = Rpc.String ("vm " ^ uuid) in
+	[
+		"memory_dirty_rate", Rpc.Dict [
+			"description", Rpc.String "Rate at which the VM dirties memory which a migration would have to send again";
+			"owner", owner;
+			"value", Rpc.Float (s.Domain.dirty_pages_per_s *. 4096.);
+			"value_type", Rpc.String "float";
+			"type", Rpc.String "absolute";
+			"units", Rpc.String "B/s";
+			"min", Rpc.String "0.0";
+		];
+		"memory_working_set", Rpc.Dict [
+			"description", Rpc.String (sprintf "Memory written to by the VM within %d ms" (!interval_ms * !intervals));
+			"owner", owner;
+			"value", Rpc.Int (Int64.mul s.Domain.working_set_pages 4096L);
+			"value_type", Rpc.String "int64";
+			"type", Rpc.String "absolute";
+			"units", Rpc.String "B";
+			"min", Rpc.String "0.0";
+		];
+	]
+
+(* The plugin file: a header, the length of the payload and its MD5, then
+   the payload (JSON). rrdd keeps the file open, so it is rewritten in
+   place; a read which races with a write fails the checksum. *)
+let write_payload fd samples =
+	let payload = Jsonrpc.to_string (Rpc.Dict [
+		"timestamp", Rpc.Int (Int64.of_float (Unix.gettimeofday ()));
+		"datasources", Rpc.Dict (List.concat (List.map datasources samples));
+	]) in
+	let contents = sprintf "%s%08x\n%s\n%s" (Rrd_client.Client.Plugin.get_header ())
+		(String.length payload) (Digest.to_hex (Digest.string payload)) payload in
+	ignore (Unix.lseek fd 0 Unix.SEEK_SET);
+	Unixext.really_write_string fd contents;
+	Unix.ftruncate fd (String.length contents)
+
+(* rrdd only takes values from a file which has changed since it last read
+   it, so rewrite it every time, with a new timestamp *)
+let rec publish fd =
+	let wait = Rrd_client.Client.Plugin.register ~uid ~frequency:Rrd.Five_seconds in
+	Thread.delay (max 0. (wait -. 0.5));
+	write_payload fd (Mutex.execute latest_m (fun () -> !latest));
+	Thread.delay 1.;
+	publish fd
+
+let _ =
+	Arg.parse [
+		"-period", Arg.Set_float period, "Seconds from the start of one sample to the next (default 60)";
+		"-interval_ms", Arg.Set_int interval_ms, "Read and clear the dirty bitmap this often while sampling (default 1000)";
+		"-intervals", Arg.Set_int intervals, "Intervals in a sample (default 5)";
+	] (fun x -> eprintf "Ignoring argument: %s\n" x)
+		"Publish the dirty rate and working set of every VM to rrdd";
+	if !interval_ms <= 0 || !intervals <= 0 then failwith "-interval_ms and -intervals must be positive";
+
+	let path = Rrd_client.Client.Plugin.get_path ~uid in
+	Unixext.mkdir_rec (Filename.dirname path) 0o755;
+	let fd = Unix.openfile path [ Unix.O_RDWR; Unix.O_CREAT ] 0o644 in
+	let (_: Thread.t) = Thread.create (fun () ->
+		while true do
+			try publish fd
+			with e ->
+				error "publishing to rrdd: %s" (Printexc.to_string e);
+				Thread.delay 10.
+		done
+	) () in
+	Xenctrl.with_intf (fun xc ->
+		while true do
+			let start = Unix.gettimeofday () in
+			let samples = sample_all xc in
+			Mutex.execute latest_m (fun () -> latest := samples);
+			Thread.delay (max 0. (start +. !period -. Unix.gettimeofday ()))
+		done
+	)
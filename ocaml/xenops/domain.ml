@@ -532,10 +532,12 @@ let build_post ~xc ~xs ~vcpus ~static_max_mib ~target_mib domid
 		  ("store/port", string_of_int store_port);
 		  ("store/ring-ref", sprintf "%nu" store_mfn);
 		] @ ents in
-	Xs.transaction xs (fun t -> t.Xst.writev dom_path ents);
-	if vments <> [] then (
-		let vm_path = xs.Xs.read (dom_path ^ "/vm") in
-		Xs.transaction xs (fun t -> t.Xst.writev vm_path vments)
+	(* All of it in one transaction (retried on conflict), so that nobody
+	   sees half of it *)
+	let vm_path = if vments <> [] then Some (xs.Xs.read (dom_path ^ "/vm")) else None in
+	Xs.transaction xs (fun t ->
+		t.Xst.writev dom_path ents;
+		Opt.iter (fun vm_path -> t.Xst.writev vm_path vments) vm_path
 	);
 	debug "VM = %s; domid = %d; @introduceDomain" (Uuid.to_string uuid) domid;
 	xs.Xs.introduce domid store_mfn store_port
@@ -572,7 +574,7 @@ let build_linux (task: Xenops_task.t) ~xc ~xs ~store_domid ~console_domid ~stati
 	let store_port, console_port = build_pre ~xc ~xs
 		~xen_max_mib ~shadow_mib ~required_host_free_mib ~vcpus domid in
 
-	let line = XenguestHelper.with_connection task xenguest_path domid
+	let result = XenguestHelper.with_connection task xenguest_path domid
 	  [
 	    "-mode"; "linux_build";
 	    "-domid"; string_of_int domid;
@@ -592,12 +594,12 @@ let build_linux (task: Xenops_task.t) ~xc ~xs ~store_domid ~console_domid ~stati
 		XenguestHelper.receive_success in
 
 	let store_mfn, console_mfn, protocol =
-		match String.split ' ' line with
-		| [ store_mfn; console_mfn; protocol ] ->
-			debug "VM = %s; domid = %d; store_mfn = %s; console_mfn = %s; protocol = %s" (Uuid.to_string uuid) domid store_mfn console_mfn protocol;
-		    Nativeint.of_string store_mfn, Nativeint.of_string console_mfn, protocol
+		match result with
+		| Xenguest_protocol.Domain { Xenguest_protocol.store_mfn = store_mfn; console_mfn = console_mfn; protocol = Some protocol } ->
+			debug "VM = %s; domid = %d; store_mfn = %nd; console_mfn = %nd; protocol = %s" (Uuid.to_string uuid) domid store_mfn console_mfn protocol;
+			store_mfn, console_mfn, protocol
 		| _ ->
-			error "VM = %s; domid = %d; domain builder returned invalid result: \"%s\"" (Uuid.to_string uuid) domid line;
+			error "VM = %s; domid = %d; domain builder returned invalid result: \"%s\"" (Uuid.to_string uuid) domid (Xenguest_protocol.string_of_result result);
 		    raise Domain_build_failed in
 
 	let local_stuff = [
@@ -641,7 +643,7 @@ let build_hvm (task: Xenops_task.t) ~xc ~xs ~store_domid ~console_domid ~static_
 	let store_port, console_port = build_pre ~xc ~xs
 		~xen_max_mib ~shadow_mib ~required_host_free_mib ~vcpus domid in
 
-	let line = XenguestHelper.with_connection task xenguest_path domid
+	let result = XenguestHelper.with_connection task xenguest_path domid
 	  [
 	    "-mode"; "hvm_build";
 	    "-domid"; string_of_int domid;
@@ -672,12 +674,12 @@ let build_hvm (task: Xenops_task.t) ~xc ~xs ~store_domid ~console_domid ~static_
 	end;
 
 	let store_mfn, console_mfn =
-		match String.split ' ' line with
-		| [ store_mfn; console_mfn] ->
-			debug "VM = %s; domid = %d; store_mfn = %s; console_mfn = %s" (Uuid.to_string uuid) domid store_mfn console_mfn;
-			Nativeint.of_string store_mfn, Nativeint.of_string console_mfn
+		match result with
+		| Xenguest_protocol.Domain { Xenguest_protocol.store_mfn = store_mfn; console_mfn = console_mfn; protocol = None } ->
+			debug "VM = %s; domid = %d; store_mfn = %nd; console_mfn = %nd" (Uuid.to_string uuid) domid store_mfn console_mfn;
+			store_mfn, console_mfn
 		| _ ->
-			error "VM = %s; domid = %d; domain builder returned invalid result: \"%s\"" (Uuid.to_string uuid) domid line;			
+			error "VM = %s; domid = %d; domain builder returned invalid result: \"%s\"" (Uuid.to_string uuid) domid (Xenguest_protocol.string_of_result result);
 			raise Domain_build_failed in
 
 	let local_stuff = [
@@ -726,7 +728,43 @@ let restore_common (task: Xenops_task.t) ~xc ~xs ~hvm ~store_port ~store_domid ~
 	Unix.clear_close_on_exec fd;
 	let fd_uuid = Uuid.to_string (Uuid.make_uuid ()) in
 
-	let line = XenguestHelper.with_connection task xenguest_path domid
+	(* restore qemu-dm tmp file *)
+	let read_qemu_record () =
+		let read_signature = Io.read fd (String.length qemu_save_signature) in
+		if read_signature <> qemu_save_signature then begin
+			error "VM = %s; domid = %d; read invalid qemu save file signature: \"%s\"" (Uuid.to_string uuid) domid read_signature;
+			raise Restore_signature_mismatch;
+		end;
+		let limit = Int64.of_int (Io.read_int fd) in
+
+		let file = sprintf qemu_restore_path domid in
+		let fd2 = Unix.openfile file [ Unix.O_WRONLY; Unix.O_CREAT; Unix.O_TRUNC; ] 0o640 in
+		finally (fun () ->
+			debug "VM = %s; domid = %d; reading %Ld bytes from %s" (Uuid.to_string uuid) domid limit file;
+			if Unixext.copy_file ~limit fd fd2 <> limit then begin
+				error "VM = %s; domid = %d; qemu save file was truncated" (Uuid.to_string uuid) domid;
+				raise Domain_restore_truncated_hvmstate
+			end
+		) (fun () -> Unix.close fd2) in
+
+	(* A post-copy restore reports the store and console pages as soon as
+	   the guest can start, and keeps fetching the rest of its memory in
+	   the background; the helper has to outlive this function *)
+	let postcopy = ref false in
+	let finish_postcopy cnx =
+		let msg = try XenguestHelper.non_debug_receive cnx with e -> XenguestHelper.Error (Printexc.to_string e) in
+		begin match msg with
+		| XenguestHelper.Result _ ->
+			debug "VM = %s; domid = %d; post-copy restore complete" (Uuid.to_string uuid) domid
+		| msg ->
+			(* The guest may be running without some of its memory *)
+			error "VM = %s; domid = %d; post-copy restore failed: %s; crashing the domain"
+				(Uuid.to_string uuid) domid (XenguestHelper.string_of_message msg);
+			(try Xenctrl.with_intf (fun xc -> Xenctrl.domain_shutdown xc domid Xenctrl.Crash) with _ -> ())
+		end;
+		XenguestHelper.disconnect cnx in
+
+	let result = XenguestHelper.with_connection ~keep:postcopy task xenguest_path domid
 	  ([
 	    "-mode"; if hvm then "hvm_restore" else "restore";
 	    "-domid"; string_of_int domid;
@@ -737,37 +775,30 @@ let restore_common (task: Xenops_task.t) ~xc ~xs ~hvm ~store_port ~store_domid ~
 		"-console_domid"; string_of_int console_domid;
 		"-no_incr_generationid"; string_of_bool no_incr_generationid;
 	    "-fork"; "true";
-	  ] @ extras) [ fd_uuid, fd ] XenguestHelper.receive_success in
+	  ] @ extras) [ fd_uuid, fd ] (fun cnx ->
+		let result = XenguestHelper.receive_success cnx in
+		begin match result with
+		| Xenguest_protocol.Postcopy_ready _ when hvm ->
+			read_qemu_record ();
+			XenguestHelper.send cnx "postcopy:continue\n";
+			postcopy := true;
+			ignore (Thread.create finish_postcopy cnx)
+		| _ -> ()
+		end;
+		result) in
 
 	let store_mfn, console_mfn =
-		match String.split_f String.isspace line with
-		| [ store; console ] ->
-			debug "VM = %s; domid = %d; store_mfn = %s; console_mfn = %s" (Uuid.to_string uuid) domid store console;
-			Nativeint.of_string store, Nativeint.of_string console
+		match result with
+		| Xenguest_protocol.Domain p
+		| Xenguest_protocol.Postcopy_ready p ->
+			debug "VM = %s; domid = %d; store_mfn = %nd; console_mfn = %nd" (Uuid.to_string uuid) domid p.Xenguest_protocol.store_mfn p.Xenguest_protocol.console_mfn;
+			p.Xenguest_protocol.store_mfn, p.Xenguest_protocol.console_mfn
 		| _                  ->
-			error "VM = %s; domid = %d; domain builder returned invalid result: \"%s\"" (Uuid.to_string uuid) domid line;
+			error "VM = %s; domid = %d; domain builder returned invalid result: \"%s\"" (Uuid.to_string uuid) domid (Xenguest_protocol.string_of_result result);
 			raise Domain_restore_failed
 		in
 
-	if hvm then (
-		(* restore qemu-dm tmp file *)
-		let read_signature = Io.read fd (String.length qemu_save_signature) in
-		if read_signature <> qemu_save_signature then begin
-			error "VM = %s; domid = %d; read invalid qemu save file signature: \"%s\"" (Uuid.to_string uuid) domid read_signature;
-			raise Restore_signature_mismatch;
-		end;
-		let limit = Int64.of_int (Io.read_int fd) in
-
-		let file = sprintf qemu_restore_path domid in
-		let fd2 = Unix.openfile file [ Unix.O_WRONLY; Unix.O_CREAT; Unix.O_TRUNC; ] 0o640 in
-		finally (fun () ->
-			debug "VM = %s; domid = %d; reading %Ld bytes from %s" (Uuid.to_string uuid) domid limit file;
-			if Unixext.copy_file ~limit fd fd2 <> limit then begin
-				error "VM = %s; domid = %d; qemu save file was truncated" (Uuid.to_string uuid) domid;
-				raise Domain_restore_truncated_hvmstate
-			end
-		) (fun () -> Unix.close fd2);
-	);
+	if hvm && not !postcopy then read_qemu_record ();
 	store_mfn, console_mfn
 
 let resume (task: Xenops_task.t) ~xc ~xs ~hvm ~cooperative ~qemu_domid domid =
@@ -833,11 +864,17 @@ let hvm_restore (task: Xenops_task.t) ~xc ~xs ~store_domid ~console_domid ~no_in
 	let store_port, console_port = build_pre ~xc ~xs
 		~xen_max_mib ~shadow_mib ~required_host_free_mib ~vcpus domid in
 
+	(* A guest with less memory than its maximum was built with PoD
+	   entries for the rest: so is its restore *)
+	let extras =
+		if target_mib < static_max_mib
+		then [ "-mem_target_mib"; Int64.to_string target_mib ]
+		else [] in
 	let store_mfn, console_mfn = restore_common task ~xc ~xs ~hvm:true
 		~store_port ~store_domid
 		~console_port ~console_domid
 		~no_incr_generationid
-		~vcpus ~extras:[] xenguest_path domid fd in
+		~vcpus ~extras xenguest_path domid fd in
 	let local_stuff = [
 		"serial/0/limit",    string_of_int 65536;
 (*
@@ -864,13 +901,166 @@ let restore (task: Xenops_task.t) ~xc ~xs ~store_domid ~console_domid ~no_incr_g
 	            ~static_max_kib:info.memory_max ~target_kib:info.memory_target ~vcpus:info.vcpus
 	            xenguest_path domid fd
 
-type suspend_flag = Live | Debug
+(* Restore one image into several fresh domains, reading it once: the
+   helper restores them side by side (see its restore_fanout mode). Each
+   clone gets its own event channels and, for HVM, its own generation ID
+   and a copy of the qemu record. Returns the domains which could not be
+   restored; they are left for the caller to destroy. *)
+let restore_clones (task: Xenops_task.t) ~xc ~xs ~store_domid ~console_domid ~no_incr_generationid ~share info timeoffset xenguest_path domids fd =
+	if domids = [] then invalid_arg "Domain.restore_clones";
+	let static_max_mib = Memory.mib_of_kib_used info.memory_max in
+	let target_mib     = Memory.mib_of_kib_used info.memory_target in
+	let vcpus = info.vcpus in
+	assert (target_mib <= static_max_mib);
+	let hvm, xen_max_mib, shadow_mib, required_host_free_mib = match info.priv with
+	| BuildHVM hvminfo ->
+		let m = hvminfo.shadow_multiplier in
+		true, Memory.HVM.xen_max_mib static_max_mib,
+		Memory.HVM.shadow_mib static_max_mib vcpus m,
+		Memory.HVM.footprint_mib target_mib static_max_mib vcpus m
+	| BuildPV _ ->
+		let m = Memory.Linux.shadow_multiplier_default in
+		false, Memory.Linux.xen_max_mib static_max_mib,
+		Memory.Linux.shadow_mib static_max_mib vcpus m,
+		Memory.Linux.footprint_mib target_mib static_max_mib vcpus m in
+
+	let ports = List.map (fun domid ->
+		domid, build_pre ~xc ~xs ~xen_max_mib ~shadow_mib ~required_host_free_mib ~vcpus domid
+	) domids in
+
+	let first = List.hd domids in
+	let read_signature = Io.read fd (String.length save_signature) in
+	if read_signature <> save_signature then begin
+		error "domid = %d; read invalid save file signature: \"%s\"" first read_signature;
+		raise Restore_signature_mismatch;
+	end;
+	Unix.clear_close_on_exec fd;
+	let fd_uuid = Uuid.to_string (Uuid.make_uuid ()) in
+	let clones = String.concat "," (List.map (fun (domid, (store_port, console_port)) ->
+		sprintf "%d:%d:%d:%d:%d" domid store_port store_domid console_port console_domid
+	) ports) in
+	let result = XenguestHelper.with_connection task xenguest_path first
+	  [
+	    "-mode"; if hvm then "hvm_restore_fanout" else "restore_fanout";
+	    "-fd"; fd_uuid;
+	    "-clones"; clones;
+	    "-no_incr_generationid"; string_of_bool no_incr_generationid;
+	    "-share"; string_of_bool share;
+	    "-fork"; "true";
+	  ] [ fd_uuid, fd ] XenguestHelper.receive_success in
+
+	let clones = match result with
+		| Xenguest_protocol.Clones clones -> clones
+		| _ ->
+			error "domid = %d; domain builder returned invalid result: \"%s\"" first (Xenguest_protocol.string_of_result result);
+			raise Domain_restore_failed in
+	let restored, failed = List.partition (fun (_, r) -> r <> None) clones in
+	List.iter (fun (domid, _) -> error "domid = %d; clone not restored" domid) failed;
+
+	(* The qemu record follows the image: every clone starts from the same *)
+	if hvm && restored <> [] then begin
+		let read_signature = Io.read fd (String.length qemu_save_signature) in
+		if read_signature <> qemu_save_signature then begin
+			error "domid = %d; read invalid qemu save file signature: \"%s\"" first read_signature;
+			raise Restore_signature_mismatch;
+		end;
+		let limit = Int64.of_int (Io.read_int fd) in
+		let files = List.map (fun (domid, _) -> sprintf qemu_restore_path domid) restored in
+		let copy src dst =
+			let fd2 = Unix.openfile dst [ Unix.O_WRONLY; Unix.O_CREAT; Unix.O_TRUNC; ] 0o640 in
+			finally (fun () ->
+				if Unixext.copy_file ~limit src fd2 <> limit then begin
+					error "%s: qemu save file was truncated" dst;
+					raise Domain_restore_truncated_hvmstate
+				end
+			) (fun () -> Unix.close fd2) in
+		copy fd (List.hd files);
+		List.iter (fun file ->
+			let src = Unix.openfile (List.hd files) [ Unix.O_RDONLY ] 0 in
+			finally (fun () -> copy src file) (fun () -> Unix.close src)
+		) (List.tl files)
+	end;
+
+	List.iter (fun (domid, r) ->
+		let { Xenguest_protocol.store_mfn = store_mfn; console_mfn = console_mfn } = Opt.unbox r in
+		let store_port, console_port = List.assoc domid ports in
+		let local_stuff, vm_stuff =
+			if hvm then [ "serial/0/limit", string_of_int 65536 ], [ "rtc/timeoffset", timeoffset ]
+			else [
+				"serial/0/limit",    string_of_int 65536;
+				"console/port",     string_of_int console_port;
+				"console/ring-ref", sprintf "%nu" console_mfn;
+			], [] in
+		build_post ~xc ~xs ~vcpus ~target_mib ~static_max_mib
+			domid store_mfn store_port local_stuff vm_stuff
+	) restored;
+	List.map fst failed
+
+type suspend_flag =
+	| Live
+	| Debug
+	| Downtime_ms of int (** measure convergence against this downtime budget *)
+	| Auto_converge      (** throttle the guest if it is not converging *)
+	| Rate_limit of int  (** bytes/s for this stream *)
+	| Host_rate_limit of int (** bytes/s shared by all rate-limited streams *)
+	| Checkpoint of int  (** replicate continuously, one epoch per this many ms *)
+	| Postcopy of int    (** HVM only: post-copy, sampling the working set for this many ms *)
+	| Delta              (** with Checkpoint only: send the pages of each epoch as
+	                         deltas (libxc does not delta-encode the rounds
+	                         of an ordinary live save) *)
+	| Integrity          (** checksum the stream, checked by the restore *)
+
+(* Requests on the suspend pipe with this bit set ask for the domain to be
+   resumed after a checkpoint; keep in sync with xenguest_stubs.c *)
+let suspend_req_resume = 0x80000000
+(* ... and with this bit set, for qemu's state to be written to the stream
+   before the rest of the memory follows (post-copy) *)
+let suspend_req_postcopy = 0x40000000
+
+(* Whether every suspend checksums its stream, as if given Integrity: off by
+   default, since only receivers with the integrity checker can restore it *)
+let suspend_integrity = ref false
+
+(* xenguest helpers currently saving a domain, so that the rate limit of
+   their stream can be changed while they run *)
+let saving : (domid, XenguestHelper.t) Hashtbl.t = Hashtbl.create 10
+let saving_m = Mutex.create ()
+
+let set_suspend_rate_limit domid bytes_per_sec =
+	Threadext.Mutex.execute saving_m (fun () ->
+		if Hashtbl.mem saving domid then begin
+			debug "domid = %d; changing the suspend rate limit to %d bytes/s" domid bytes_per_sec;
+			XenguestHelper.set_rate_limit (Hashtbl.find saving domid) bytes_per_sec;
+			true
+		end else false
+	)
+
+external dirty_sample_stub: domid -> int -> int -> int64 * int64 = "stub_xenops_dirty_sample"
+
+type dirty_sample = {
+	dirty_pages_per_s: float;
+	working_set_pages: int64;
+}
+
+let dirty_sample ~interval_ms ~intervals domid =
+	let dirtied, working_set = dirty_sample_stub domid interval_ms intervals in
+	debug "domid = %d; dirtied %Ld pages (%Ld distinct) in %d x %d ms" domid dirtied working_set intervals interval_ms;
+	{
+		dirty_pages_per_s = Int64.to_float dirtied *. 1000. /. (float_of_int (interval_ms * intervals));
+		working_set_pages = working_set;
+	}
+
+let dirty_rate ?(ms = 1000) domid =
+	(dirty_sample ~interval_ms:ms ~intervals:1 domid).dirty_pages_per_s
 
 (* suspend register the callback function that will be call by linux_save
  * and is in charge to suspend the domain when called. the whole domain
  * context is saved to fd
  *)
 let suspend (task: Xenops_task.t) ~xc ~xs ~hvm xenguest_path domid fd flags ?(progress_callback = fun _ -> ()) ~qemu_domid do_suspend_callback =
+	if List.mem Delta flags && not (List.exists (function Checkpoint _ -> true | _ -> false) flags) then
+		invalid_arg "Domain.suspend: Delta needs Checkpoint";
+	let flags = if !suspend_integrity && not (List.mem Integrity flags) then Integrity :: flags else flags in
 	let uuid = get_uuid ~xc domid in
 	debug "VM = %s; domid = %d; suspend live = %b" (Uuid.to_string uuid) domid (List.mem Live flags);
 	Io.write fd save_signature;
@@ -880,22 +1070,137 @@ let suspend (task: Xenops_task.t) ~xc ~xs ~hvm xenguest_path domid fd flags ?(pr
 		match flag with
 		| Live -> [ "-live"; "true" ]
 		| Debug -> [ "-debug"; "true" ]
+		| Downtime_ms ms -> [ "-downtime_ms"; string_of_int ms ]
+		| Auto_converge -> [ "-auto_converge"; "true" ]
+		| Rate_limit bps -> [ "-rate_limit"; string_of_int bps ]
+		| Host_rate_limit bps -> [ "-host_rate_limit"; string_of_int bps ]
+		| Checkpoint ms -> [ "-checkpoint_interval_ms"; string_of_int ms ]
+		| Postcopy ms -> [ "-postcopy_sample_ms"; string_of_int ms ]
+		| Delta -> [ "-delta"; "true" ]
+		| Integrity -> [ "-integrity"; "true" ]
 		in
 	let flags' = List.map cmdline_to_flag flags in
 
+	let qemu_saved = ref false in
+	let write_qemu_record () =
+		Io.write fd qemu_save_signature;
+		let file = sprintf qemu_save_path domid in
+		let fd2 = Unix.openfile file [ Unix.O_RDONLY ] 0o640 in
+		let size = (Unix.stat file).Unix.st_size in
+
+		finally (fun () ->
+			Io.write_int fd size;
+			let limit = Int64.of_int size in
+			debug "VM = %s; domid = %d; writing %Ld bytes from %s" (Uuid.to_string uuid) domid limit file;
+			if Unixext.copy_file ~limit fd2 fd <> limit
+			then failwith "Failed to write whole qemu-dm state file"
+		) (fun () -> 
+			Unix.unlink file;
+			Unix.close fd2);
+		qemu_saved := true in
+
+	(* The helper asks us to suspend the domain by writing the domid to
+	   suspend_req and waits for a single byte on suspend_ack. *)
+	let suspend_req_r, suspend_req_w = Unix.pipe () in
+	let suspend_ack_r, suspend_ack_w = Unix.pipe () in
+	let suspend_req_uuid = Uuid.to_string (Uuid.make_uuid ()) in
+	let suspend_ack_uuid = Uuid.to_string (Uuid.make_uuid ()) in
+	let to_close = ref [ suspend_req_r; suspend_req_w; suspend_ack_r; suspend_ack_w ] in
+	let close_fd fd =
+		if List.mem fd !to_close then begin
+			to_close := List.filter (fun x -> x <> fd) !to_close;
+			Unix.close fd
+		end in
+
 	let xenguestargs = [
 		"-fd"; fd_uuid;
 		"-mode"; if hvm then "hvm_save" else "save";
 		"-domid"; string_of_int domid;
 		"-fork"; "true";
+		"-suspend_req_fd"; suspend_req_uuid;
+		"-suspend_ack_fd"; suspend_ack_uuid;
 	] @ (List.concat flags') in
 
-	XenguestHelper.with_connection task xenguest_path domid xenguestargs [ fd_uuid, fd ]
+	finally (fun () ->
+	XenguestHelper.with_connection task xenguest_path domid xenguestargs
+		[ fd_uuid, fd; suspend_req_uuid, suspend_req_w; suspend_ack_uuid, suspend_ack_r ]
 		(fun cnx ->
+		(* Only the helper keeps these ends open, so we see EOF if it dies *)
+		close_fd suspend_req_w;
+		close_fd suspend_ack_r;
+		Threadext.Mutex.execute saving_m (fun () -> Hashtbl.replace saving domid cnx);
+		finally (fun () ->
 		debug "VM = %s; domid = %d; waiting for xenguest to call suspend callback" (Uuid.to_string uuid) domid;
 
+		(* Serve the suspend request from a separate thread, so that the
+		   helper's output keeps being drained while the guest is stopped *)
+		let suspended = ref false in
+		let suspend_error = ref None in
+		let serve_request () =
+			let req = Io.read_int suspend_req_r in
+			if req land suspend_req_postcopy <> 0 then begin
+				(* Post-copy: the destination can start the guest once it
+				   has qemu's state; the helper waits for us to append it *)
+				begin
+					try
+						write_qemu_record ();
+						Io.write suspend_ack_w "\001"
+					with e ->
+						(try Io.write suspend_ack_w "\000" with _ -> ());
+						raise e
+				end;
+				debug "VM = %s; domid = %d; qemu state sent ahead of the memory (post-copy)"
+					(Uuid.to_string uuid) domid
+			end else if req land suspend_req_resume <> 0 then begin
+				(* Checkpoint mode: the epoch has been sent, let the guest run *)
+				let t0 = Unix.gettimeofday () in
+				begin
+					try
+						resume task ~xc ~xs ~hvm ~cooperative:true ~qemu_domid domid;
+						Io.write suspend_ack_w "\001"
+					with e ->
+						(try Io.write suspend_ack_w "\000" with _ -> ());
+						raise e
+				end;
+				debug "VM = %s; domid = %d; resumed after checkpoint in %.0fms"
+					(Uuid.to_string uuid) domid ((Unix.gettimeofday () -. t0) *. 1000.)
+			end else begin
+				debug "VM = %s; domid = %d; suspend callback called" (Uuid.to_string uuid) domid;
+				let t0 = Unix.gettimeofday () in
+				try
+					do_suspend_callback ();
+					let t1 = Unix.gettimeofday () in
+					if hvm then (
+						debug "VM = %s; domid = %d; suspending qemu-dm" (Uuid.to_string uuid) domid;
+						Device.Dm.suspend task ~xs ~qemu_domid domid;
+					);
+					let t2 = Unix.gettimeofday () in
+					Io.write suspend_ack_w "\001";
+					suspended := true;
+					debug "VM = %s; domid = %d; suspend handshake: domain %.0fms; qemu %.0fms"
+						(Uuid.to_string uuid) domid ((t1 -. t0) *. 1000.) ((t2 -. t1) *. 1000.)
+				with e ->
+					(try Io.write suspend_ack_w "\000" with _ -> ());
+					raise e
+			end in
+		(* In checkpoint mode there is a suspend and a resume per epoch *)
+		let serve_suspend () =
+			try
+				while true do serve_request () done
+			with
+			| End_of_file ->
+				(* The helper has exited; if it didn't ask, it reports why over the control channel *)
+				()
+			| e ->
+				suspend_error := Some e in
+		let suspend_thread = Thread.create serve_suspend () in
+
 		(* Monitor the debug (stderr) output of the xenguest helper and
-		   spot the progress indicator *)
+		   spot the progress indicator (the framed protocol reports it
+		   separately) *)
+		let progress percent =
+			debug "VM = %s; domid = %d; progress = %d / 100" (Uuid.to_string uuid) domid percent;
+			progress_callback (float_of_int percent /. 100.) in
 		let callback txt =
 			let prefix = "\\b\\b\\b\\b" in
 			if String.startswith prefix txt then
@@ -904,9 +1209,7 @@ let suspend (task: Xenops_task.t) ~xc ~xs ~hvm xenguest_path domid fd flags ?(pr
 				match String.split_f (fun x -> String.isspace x || x = '%') rest with
 				| [ percent ] -> (
 					try
-						let percent = int_of_string percent in
-						debug "VM = %s; domid = %d; progress = %d / 100" (Uuid.to_string uuid) domid percent;
-						progress_callback (float_of_int percent /. 100.)
+						progress (int_of_string percent)
 					with e ->
 						error "VM = %s; domid = %d; failed to parse progress update: \"%s\"" (Uuid.to_string uuid) domid percent;
                         (* MTC: catch exception by progress_callback, for example, 
@@ -918,54 +1221,31 @@ let suspend (task: Xenops_task.t) ~xc ~xs ~hvm xenguest_path domid fd flags ?(pr
 				debug "VM = %s; domid = %d; %s" (Uuid.to_string uuid) domid txt
 			in
 
-		(match XenguestHelper.non_debug_receive ~debug_callback:callback cnx with
-			| XenguestHelper.Suspend ->
-				debug "VM = %s; domid = %d; suspend callback called" (Uuid.to_string uuid) domid;
-			| XenguestHelper.Error x ->
-				error "VM = %s; domid = %d; xenguesthelper failed: \"%s\"" (Uuid.to_string uuid) domid x;
-				raise (Xenguest_failure (Printf.sprintf "Error while waiting for suspend notification: %s" x))
-			| msg ->
-				let err = Printf.sprintf "expected %s got %s"
-					(XenguestHelper.string_of_message XenguestHelper.Suspend)
-					(XenguestHelper.string_of_message msg) in
-				error "VM = %s; domid = %d; xenguesthelper protocol failure %s" (Uuid.to_string uuid) domid err;
-				raise (Xenguest_protocol_failure err));
-		do_suspend_callback ();
-		if hvm then (
-			debug "VM = %s; domid = %d; suspending qemu-dm" (Uuid.to_string uuid) domid;
-			Device.Dm.suspend task ~xs ~qemu_domid domid;
-		);
- 		XenguestHelper.send cnx "done\n";
-
-		let msg = XenguestHelper.non_debug_receive cnx in
+		let msg = XenguestHelper.non_debug_receive ~debug_callback:callback ~progress_callback:progress cnx in
+		Thread.join suspend_thread;
+		(match !suspend_error with
+		| Some e ->
+			error "VM = %s; domid = %d; suspend callback failed: %s" (Uuid.to_string uuid) domid (Printexc.to_string e);
+			raise e
+		| None -> ());
 		progress_callback 1.;
 		match msg with
-		| XenguestHelper.Result x ->
-			debug "VM = %s; domid = %d; xenguesthelper returned \"%s\"" (Uuid.to_string uuid) domid x
+		| XenguestHelper.Result x when !suspended ->
+			debug "VM = %s; domid = %d; xenguesthelper returned \"%s\"" (Uuid.to_string uuid) domid (Xenguest_protocol.string_of_result x)
 		| XenguestHelper.Error x  ->
 			error "VM = %s; domid = %d; xenguesthelper failed: \"%s\"" (Uuid.to_string uuid) domid x;
 		    raise (Xenguest_failure (Printf.sprintf "Received error from xenguesthelper: %s" x))
-		| _                       ->
-			error "VM = %s; domid = %d; xenguesthelper protocol failure" (Uuid.to_string uuid) domid;
-	);
-
-	(* hvm domain need to also save qemu-dm data *)
-	if hvm then (
-		Io.write fd qemu_save_signature;
-		let file = sprintf qemu_save_path domid in
-		let fd2 = Unix.openfile file [ Unix.O_RDONLY ] 0o640 in
-		let size = (Unix.stat file).Unix.st_size in
-
-		finally (fun () ->
-			Io.write_int fd size;
-			let limit = Int64.of_int size in
-			debug "VM = %s; domid = %d; writing %Ld bytes from %s" (Uuid.to_string uuid) domid limit file;
-			if Unixext.copy_file ~limit fd2 fd <> limit
-			then failwith "Failed to write whole qemu-dm state file"
-		) (fun () -> 
-			Unix.unlink file;
-			Unix.close fd2)
-	);
+		| msg ->
+			let err = Printf.sprintf "expected suspend request then result, got %s"
+				(XenguestHelper.string_of_message msg) in
+			error "VM = %s; domid = %d; xenguesthelper protocol failure %s" (Uuid.to_string uuid) domid err;
+			raise (Xenguest_protocol_failure err)
+		) (fun () -> Threadext.Mutex.execute saving_m (fun () -> Hashtbl.remove saving domid))
+	)) (fun () -> List.iter close_fd !to_close);
+
+	(* hvm domain need to also save qemu-dm data; in post-copy mode it has
+	   already been written, ahead of most of the memory *)
+	if hvm && not !qemu_saved then write_qemu_record ();
 	debug "VM = %s; domid = %d; suspend complete" (Uuid.to_string uuid) domid
 
 let send_s3resume ~xc domid =
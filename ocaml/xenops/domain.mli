@@ -156,7 +156,48 @@ val hvm_restore: Xenops_task.Xenops_task.t -> xc: Xenctrl.handle -> xs: Xenstore
 (** Restore a domain using the info provided *)
 val restore: Xenops_task.Xenops_task.t -> xc: Xenctrl.handle -> xs: Xenstore.Xs.xsh -> store_domid:int -> console_domid:int -> no_incr_generationid:bool -> build_info -> string -> string -> domid -> Unix.file_descr -> unit
 
-type suspend_flag = Live | Debug
+(** Restore one image into several fresh domains, reading it once. If share
+    is set, HVM clones share the memory they have in common. Returns the
+    domains which could not be restored. *)
+val restore_clones: Xenops_task.Xenops_task.t -> xc: Xenctrl.handle -> xs: Xenstore.Xs.xsh -> store_domid:int -> console_domid:int -> no_incr_generationid:bool -> share:bool -> build_info -> string -> string -> domid list -> Unix.file_descr -> domid list
+
+type suspend_flag =
+	| Live
+	| Debug
+	| Downtime_ms of int (** measure convergence against this downtime budget *)
+	| Auto_converge      (** throttle the guest if it is not converging *)
+	| Rate_limit of int  (** bytes/s for this stream *)
+	| Host_rate_limit of int (** bytes/s shared by all rate-limited streams *)
+	| Checkpoint of int  (** replicate continuously, one epoch per this many ms *)
+	| Postcopy of int    (** HVM only: post-copy, sampling the working set for this many ms *)
+	| Delta              (** with Checkpoint only: send the pages of each epoch as
+	                         deltas (libxc does not delta-encode the rounds
+	                         of an ordinary live save) *)
+	| Integrity          (** checksum the stream, checked by the restore *)
+
+(** if true, every suspend checksums its stream as if given Integrity
+    (default false: a receiver without the integrity checker cannot restore
+    such a stream); xenopsd sets it from "save-integrity" *)
+val suspend_integrity: bool ref
+
+(** change the rate limit (bytes/s, 0 for none) of a running suspend of the
+    given domain; false if the domain isn't being suspended *)
+val set_suspend_rate_limit: domid -> int -> bool
+
+type dirty_sample = {
+	dirty_pages_per_s: float;
+	working_set_pages: int64; (** distinct pages written during the sample *)
+}
+
+(** watch how a domain writes to its memory, with log-dirty mode, for
+    intervals of interval_ms milliseconds, reading and clearing the dirty
+    bitmap after each; fails at once if the domain is being saved, and a
+    save waits for the sample to finish (they cannot share the mode) *)
+val dirty_sample: interval_ms: int -> intervals: int -> domid -> dirty_sample
+
+(** the rate (pages/s) at which a domain dirties its memory, over ms
+    milliseconds (default 1000) *)
+val dirty_rate: ?ms: int -> domid -> float
 
 (** suspend a domain into the file descriptor *)
 val suspend: Xenops_task.Xenops_task.t -> xc: Xenctrl.handle -> xs: Xenstore.Xs.xsh -> hvm: bool -> string -> domid
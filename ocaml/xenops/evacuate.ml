@@ -0,0 +1,170 @@
+(*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *)
+(** Saving many domains at once, e.g. to evacuate a host: the saves run on
+    a bounded pool of worker threads, the longest first, and share the
+    host's bandwidth. The sharing is not adaptive: a host-wide limit is
+    split equally between the streams running at the time, however fast
+    each could go. *)
+
+open Printf
+open Stringext
+open Threadext
+
+module D = Debug.Make(struct let name = "xenops" end)
+open D
+
+type destination =
+	| File of string
+	| Tcp of string * int (** host, port *)
+
+(** "tcp:host:port", or a file name *)
+let destination_of_string s =
+	match String.split ':' s with
+	| [ "tcp"; host; port ] -> Tcp (host, int_of_string port)
+	| _ -> File s
+
+let string_of_destination = function
+	| File f -> f
+	| Tcp (host, port) -> sprintf "tcp:%s:%d" host port
+
+let open_destination = function
+	| File f -> Unix.openfile f [ Unix.O_WRONLY; Unix.O_CREAT; Unix.O_EXCL ] 0o600
+	| Tcp (host, port) -> Unixext.open_connection_fd host port
+
+type vm = {
+	domid: int;
+	destination: destination;
+	memory_kib: int64;
+	dirty_pages_per_s: float;
+}
+
+type state =
+	| Queued
+	| Saving of float (** fraction done *)
+	| Saved of float  (** seconds taken *)
+	| Failed of string
+
+let string_of_state = function
+	| Queued -> "queued"
+	| Saving p -> sprintf "saving %3.0f%%" (p *. 100.)
+	| Saved s -> sprintf "saved in %.1fs" s
+	| Failed e -> sprintf "failed: %s" e
+
+(* Pre-copy sends the memory once, then what was dirtied meanwhile, and so
+   on: a geometric series in dirty rate / bandwidth. A domain which dirties
+   memory as fast as it can be sent stops converging and is suspended after
+   the iteration limit, so cap the number of passes. *)
+let max_passes = 4.
+
+(** The expected duration (s) of a save at this bandwidth (bytes/s) *)
+let expected_s ~bandwidth vm =
+	let bytes = Int64.to_float vm.memory_kib *. 1024. in
+	let ratio = vm.dirty_pages_per_s *. 4096. /. bandwidth in
+	let passes =
+		if ratio >= 1. -. 1. /. max_passes then max_passes
+		else 1. /. (1. -. ratio) in
+	bytes *. passes /. bandwidth
+
+(** The order to start the saves in: longest first, which keeps a short
+    save from being the only one left running at the end (LPT) *)
+let schedule ~bandwidth vms =
+	let cost = List.map (fun vm -> expected_s ~bandwidth vm, vm) vms in
+	List.map snd (List.stable_sort (fun (a, _) (b, _) -> compare b a) cost)
+
+(** The dirty rate and size of each domain. The rates are sampled
+    concurrently, so that this takes ms whatever the number of domains; a
+    domain whose rate cannot be measured counts as idle. *)
+let measure ~xc ?(ms = 1000) domains =
+	let rates = Array.make (List.length domains) 0. in
+	let threads = List.mapi (fun i (domid, _) ->
+		Thread.create (fun () ->
+			try rates.(i) <- Domain.dirty_rate ~ms domid
+			with e -> warn "domid = %d; cannot measure the dirty rate: %s" domid (Printexc.to_string e)
+		) ()
+	) domains in
+	List.iter Thread.join threads;
+	List.mapi (fun i (domid, destination) ->
+		let di = Xenctrl.domain_getinfo xc domid in
+		{
+			domid = domid;
+			destination = destination;
+			memory_kib = Xenctrl.pages_to_kib (Int64.of_nativeint di.Xenctrl.total_memory_pages);
+			dirty_pages_per_s = rates.(i);
+		}
+	) domains
+
+(** Run [save vm progress] for each vm on [workers] threads, in the order
+    of [schedule], where each of the [workers] concurrent streams gets an
+    equal share of [bandwidth]. The shares only drive the estimates: [save]
+    must enforce [bandwidth] itself, if at all, e.g. with
+    Domain.Host_rate_limit, which splits it the same way.
+    [save] reports its progress (0. to 1.) through [progress]; a save which
+    fails does not stop the others.
+    [report] is called, one call at a time, with every change of state and
+    the overall progress, in which each vm counts for its expected
+    duration. Returns the final state of each vm, in the order they were
+    started. *)
+let run ~workers ~bandwidth ~save ~report vms =
+	let workers = max 1 (min workers (List.length vms)) in
+	let share = bandwidth /. (float_of_int workers) in
+	let order = schedule ~bandwidth:share vms in
+	let weight = Hashtbl.create 16 and states = Hashtbl.create 16 in
+	List.iter (fun vm ->
+		Hashtbl.replace weight vm.domid (expected_s ~bandwidth:share vm);
+		Hashtbl.replace states vm.domid Queued
+	) order;
+	let total = Hashtbl.fold (fun _ w acc -> w +. acc) weight 0. in
+	let overall () =
+		let done_ = Hashtbl.fold (fun domid st acc ->
+			let w = Hashtbl.find weight domid in
+			match st with
+			| Queued -> acc
+			| Saving p -> acc +. w *. p
+			| Saved _ | Failed _ -> acc +. w
+		) states 0. in
+		if total > 0. then done_ /. total else 1. in
+
+	let m = Mutex.create () in
+	let queue = ref order in
+	let update vm st =
+		Mutex.execute m (fun () ->
+			Hashtbl.replace states vm.domid st;
+			report vm st (overall ())
+		) in
+	let next () =
+		Mutex.execute m (fun () ->
+			match !queue with
+			| [] -> None
+			| vm :: rest -> queue := rest; Some vm
+		) in
+	let rec worker () =
+		match next () with
+		| None -> ()
+		| Some vm ->
+			debug "domid = %d; saving to %s (%Ld KiB, %.0f dirty pages/s)" vm.domid
+				(string_of_destination vm.destination) vm.memory_kib vm.dirty_pages_per_s;
+			update vm (Saving 0.);
+			let start = Unix.gettimeofday () in
+			begin
+				try
+					save vm (fun p -> update vm (Saving p));
+					update vm (Saved (Unix.gettimeofday () -. start))
+				with e ->
+					error "domid = %d; save failed: %s" vm.domid (Printexc.to_string e);
+					update vm (Failed (Printexc.to_string e))
+			end;
+			worker () in
+	let threads = Array.to_list (Array.init workers (fun _ -> Thread.create worker ())) in
+	List.iter Thread.join threads;
+	List.map (fun vm -> vm, Hashtbl.find states vm.domid) order
@@ -0,0 +1,79 @@
+(*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *)
+open OUnit
+open Evacuate
+
+let vm domid memory_mib dirty = {
+	domid = domid;
+	destination = File (Printf.sprintf "/tmp/%d" domid);
+	memory_kib = Int64.of_int (memory_mib * 1024);
+	dirty_pages_per_s = dirty;
+}
+
+let bandwidth = 100. *. 1048576.
+
+let cost_test _ =
+	let idle = vm 1 1024 0. and busy = vm 2 1024 12800. and hot = vm 3 1024 1e6 in
+	assert_equal ~printer:string_of_float 10.24 (expected_s ~bandwidth idle);
+	(* half the bandwidth is dirtied again: twice the memory is sent *)
+	assert_equal ~printer:string_of_float 20.48 (expected_s ~bandwidth busy);
+	assert_equal ~printer:string_of_float (10.24 *. max_passes) (expected_s ~bandwidth hot)
+
+let schedule_test _ =
+	let vms = [ vm 1 512 0.; vm 2 4096 0.; vm 3 1024 16000.; vm 4 1024 0. ] in
+	let order = List.map (fun vm -> vm.domid) (schedule ~bandwidth vms) in
+	assert_equal ~printer:(fun l -> String.concat " " (List.map string_of_int l)) [ 2; 3; 4; 1 ] order
+
+(* Saves which take their expected time (scaled down), one of which fails *)
+let run_test _ =
+	let vms = [ vm 1 256 0.; vm 2 1024 0.; vm 3 512 0.; vm 4 128 0.; vm 5 64 0. ] in
+	let m = Mutex.create () in
+	let running = ref 0 and most = ref 0 and last_overall = ref 0. in
+	let save vm progress =
+		Mutex.lock m; incr running; most := max !most !running; Mutex.unlock m;
+		Thread.delay (expected_s ~bandwidth vm /. 100.);
+		progress 0.5;
+		Thread.delay (expected_s ~bandwidth vm /. 100.);
+		Mutex.lock m; decr running; Mutex.unlock m;
+		if vm.domid = 3 then failwith "injected" in
+	let report _ _ overall =
+		assert_bool "overall progress goes backwards" (overall >= !last_overall);
+		last_overall := overall in
+	let results = run ~workers:2 ~bandwidth ~save ~report vms in
+	assert_equal ~printer:string_of_int 2 !most;
+	assert_bool "overall progress ends at 100%" (abs_float (1. -. !last_overall) < 1e-9);
+	List.iter (fun (vm, state) ->
+		match vm.domid, state with
+		| 3, Failed _ -> ()
+		| 3, _ -> assert_failure "domid 3 should have failed"
+		| _, Saved _ -> ()
+		| domid, st -> assert_failure (Printf.sprintf "domid %d: %s" domid (string_of_state st))
+	) results
+
+let _ =
+	let verbose = ref false in
+
+	Arg.parse [
+		"-verbose", Arg.Unit (fun _ -> verbose := true), "Run in verbose mode";
+	] (fun x -> Printf.fprintf stderr "Ignoring argument: %s\n" x)
+		"Test the evacuation scheduler";
+
+	let suite = "evacuate test" >:::
+		[
+			"cost" >:: cost_test;
+			"schedule" >:: schedule_test;
+			"run" >:: run_test;
+		] in
+
+	run_test_tt ~verbose:!verbose suite
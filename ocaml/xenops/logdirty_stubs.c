@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+/* Measurement of how a domain writes to its memory, with the log-dirty
+   mode which the save path uses, without saving anything.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <xenctrl.h>
+
+#include "domain_lock.h"
+
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/alloc.h>
+#include <caml/fail.h>
+#include <caml/signals.h>
+
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
+
+/* Watch domid for nr intervals of ms milliseconds each, reading and
+   clearing the dirty bitmap after each. Returns the number of pages
+   dirtied, summed over the intervals (a page rewritten in two intervals
+   counts twice), and the number of distinct pages dirtied over the whole
+   window: its working set. Log-dirty mode is switched off again
+   afterwards. Fails with EBUSY, without waiting, while the domain is
+   being saved (see domain_lock.h), and leaves the mode alone if it
+   cannot switch it on (e.g. something else has it on). */
+value stub_xenops_dirty_sample(value domid, value ms, value nr)
+{
+	CAMLparam3(domid, ms, nr);
+	CAMLlocal1(result);
+	xc_interface *xch;
+	DECLARE_HYPERCALL_BUFFER(unsigned long, bitmap);
+	unsigned long *seen = NULL, nr_pfns, words = 0, bitmap_pages = 0, i;
+	uint64_t dirtied = 0, working_set = 0;
+	int d = Int_val(domid), n, k, lock_fd, logdirty = 0, r = -1, err;
+	char msg[128];
+
+	xch = xc_interface_open(NULL, NULL, 0);
+	if (xch == NULL)
+		caml_failwith("dirty_sample: xc_interface_open failed");
+
+	caml_enter_blocking_section();
+	lock_fd = domain_lock(d, 0);
+	if (lock_fd < 0)
+		goto out;
+	n = xc_domain_maximum_gpfn(xch, d);
+	if (n < 0)
+		goto out;
+	nr_pfns = (unsigned long)n + 1;
+	words = (nr_pfns + BITS_PER_WORD - 1) / BITS_PER_WORD;
+	bitmap_pages = (words * sizeof(unsigned long) + XC_PAGE_SIZE - 1)
+		/ XC_PAGE_SIZE;
+	bitmap = xc_hypercall_buffer_alloc_pages(xch, bitmap, bitmap_pages);
+	seen = calloc(words, sizeof(*seen));
+	if (bitmap == NULL || seen == NULL) {
+		errno = ENOMEM;
+		goto out;
+	}
+	memset(bitmap, 0, bitmap_pages * XC_PAGE_SIZE);
+
+	if (xc_shadow_control(xch, d, XEN_DOMCTL_SHADOW_OP_ENABLE_LOGDIRTY,
+	                      NULL, 0, NULL, 0, NULL))
+		goto out;
+	logdirty = 1;
+	/* Start from a clean bitmap */
+	if (xc_shadow_control(xch, d, XEN_DOMCTL_SHADOW_OP_CLEAN,
+	                      HYPERCALL_BUFFER(bitmap), nr_pfns,
+	                      NULL, 0, NULL) < 0)
+		goto out;
+
+	for (k = 0; k < Int_val(nr); k++) {
+		usleep(Int_val(ms) * 1000);
+		if (xc_shadow_control(xch, d, XEN_DOMCTL_SHADOW_OP_CLEAN,
+		                      HYPERCALL_BUFFER(bitmap), nr_pfns,
+		                      NULL, 0, NULL) < 0)
+			goto out;
+		for (i = 0; i < words; i++) {
+			if (!bitmap[i])
+				continue;
+			dirtied += __builtin_popcountl(bitmap[i]);
+			working_set += __builtin_popcountl(bitmap[i] & ~seen[i]);
+			seen[i] |= bitmap[i];
+		}
+	}
+	r = 0;
+out:
+	err = errno;
+	if (logdirty)
+		xc_shadow_control(xch, d, XEN_DOMCTL_SHADOW_OP_OFF,
+		                  NULL, 0, NULL, 0, NULL);
+	if (bitmap)
+		xc_hypercall_buffer_free_pages(xch, bitmap, bitmap_pages);
+	free(seen);
+	domain_unlock(lock_fd);
+	caml_leave_blocking_section();
+	xc_interface_close(xch);
+
+	if (r) {
+		snprintf(msg, sizeof(msg), "dirty_sample: domid %d: %s",
+		         d, strerror(err));
+		caml_failwith(msg);
+	}
+	result = caml_alloc_tuple(2);
+	Store_field(result, 0, caml_copy_int64(dirtied));
+	Store_field(result, 1, caml_copy_int64(working_set));
+	CAMLreturn(result);
+}
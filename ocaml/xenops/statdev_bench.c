@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+/* Micro-benchmark of the device number lookup behind
+   Statdev.get_major_minor, on a temporary device tree: a node reached
+   through one symlink, one reached through a chain of them (as under
+   /dev/disk/by-id), and a missing node. See bench.h. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "statdev_stubs.h"
+#include "bench.h"
+
+#define DEVICE "/dev/null"
+
+static char node[PATH_MAX], chain[PATH_MAX], missing[PATH_MAX];
+static unsigned expect_major, expect_minor;
+
+static int lookup(void *arg)
+{
+	unsigned major, minor;
+
+	return statdev_get(arg, &major, &minor) ||
+		major != expect_major || minor != expect_minor;
+}
+
+static int lookup_missing(void *arg)
+{
+	unsigned major, minor;
+
+	return statdev_get(arg, &major, &minor) != ENOENT;
+}
+
+int main(void)
+{
+	char dir[PATH_MAX / 2], by_id[PATH_MAX];
+	const char *tmp = getenv("TMPDIR");
+	int failures = 0;
+
+	snprintf(dir, sizeof(dir), "%s/statdev_bench.XXXXXX", tmp ? tmp : "/tmp");
+	if (mkdtemp(dir) == NULL) {
+		perror(dir);
+		return 1;
+	}
+	snprintf(node, sizeof(node), "%s/xvda", dir);
+	snprintf(by_id, sizeof(by_id), "%s/by-id", dir);
+	snprintf(chain, sizeof(chain), "%s/by-id/xen-vbd-51712", dir);
+	snprintf(missing, sizeof(missing), "%s/xvdb", dir);
+	if (symlink(DEVICE, node) || mkdir(by_id, 0755) ||
+	    symlink("../xvda", chain) ||
+	    statdev_get(DEVICE, &expect_major, &expect_minor)) {
+		perror("creating the device tree");
+		failures++;
+		goto out;
+	}
+
+	failures -= bench_run("statdev", "lookup", lookup, node);
+	failures -= bench_run("statdev", "lookup_symlink_chain", lookup, chain);
+	failures -= bench_run("statdev", "lookup_missing", lookup_missing,
+			      missing);
+ out:
+	unlink(chain);
+	rmdir(by_id);
+	unlink(node);
+	rmdir(dir);
+	return failures ? 1 : 0;
+}
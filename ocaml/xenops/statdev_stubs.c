@@ -26,6 +26,8 @@
 #include <caml/fail.h>
 #include <caml/callback.h>
 
+#include "statdev_stubs.h"
+
 #define MINORBITS	20
 #define MINORMASK	((1U << MINORBITS) - 1)
 
@@ -35,22 +37,14 @@
 value stub_statdev_get_major_minor(value dpath)
 {
 	CAMLparam1(dpath);
-	CAMLlocal2(majmin, errno_value);
-	struct stat statbuf;
+	CAMLlocal1(majmin);
 	unsigned major, minor;
-	int ret;
-
-	errno_value = Val_int(0);
-
-	ret = stat(String_val(dpath), &statbuf);
-	if (ret == -1) 
-		errno_value = Val_int(errno);
+	int err;
 
-	major = (statbuf.st_rdev & 0xfff00) >> 8;
-	minor = (statbuf.st_rdev & 0xff) | ((statbuf.st_rdev >> 12) & 0xfff00);
+	err = statdev_get(String_val(dpath), &major, &minor);
 
 	majmin = caml_alloc_tuple(3);
-	Store_field(majmin, 0, errno_value);
+	Store_field(majmin, 0, Val_int(err));
 	Store_field(majmin, 1, Val_int(major));
 	Store_field(majmin, 2, Val_int(minor));
 	CAMLreturn(majmin);
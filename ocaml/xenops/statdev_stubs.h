@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2006-2009 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+#ifndef _STATDEV_STUBS_H_
+#define _STATDEV_STUBS_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "trace_stub.h"
+
+/* The major and minor numbers of the device node at path (in the
+   encoding of the kernel's new_encode_dev). Returns 0, or the errno of
+   the failed stat. */
+static inline int statdev_get(const char *path, unsigned *major,
+			      unsigned *minor)
+{
+	struct stat statbuf;
+	int ret;
+
+	TRACE("statdev", "stat", ret = stat(path, &statbuf));
+	if (ret == -1) {
+		*major = *minor = 0;
+		return errno;
+	}
+	*major = (statbuf.st_rdev & 0xfff00) >> 8;
+	*minor = (statbuf.st_rdev & 0xff) | ((statbuf.st_rdev >> 12) & 0xfff00);
+	return 0;
+}
+
+#endif /* _STATDEV_STUBS_H_ */
@@ -31,8 +31,15 @@ exception Xenctrl_domain_restore_failure of int * string
 exception Domain_builder_error of string (* function name *) * int (* error code *) * string (* message *)
 
 (** We do all our IO through the buffered channels but pass the 
-    underlying fds as integers to the forked helper on the commandline. *)
-type t = in_channel * out_channel * Unix.file_descr * Unix.file_descr * Forkhelpers.pidty
+    underlying fds as integers to the forked helper on the commandline.
+    The protocol of the control channel is None until the helper has
+    answered the offer of framing. *)
+type t = in_channel * out_channel * Unix.file_descr * Unix.file_descr * Forkhelpers.pidty * Xenguest_protocol.protocol option ref
+
+(** The protocol offered to new helpers, in their environment (see
+    Xenguest_protocol.offer_env): a helper which does not know it ignores
+    the offer and talks text, so only set this to Text to stop offering *)
+let control_protocol = ref Xenguest_protocol.Framed
 
 (** Fork and run a xenguest helper with particular args, leaving 'fds' open 
     (in addition to internal control I/O fds) *)
@@ -51,12 +58,16 @@ let connect path domid (args: string list) (fds: (string * Unix.file_descr) list
 	let slave_to_server_r, slave_to_server_w = Unix.pipe () in
 	let server_to_slave_r, server_to_slave_w = Unix.pipe () in
 
+	let framed = !control_protocol = Xenguest_protocol.Framed in
+	let env = [| "PATH=" ^ (try Sys.getenv "PATH" with Not_found -> "/usr/bin:/bin") |] in
+	let env = if framed then Array.append env [| Xenguest_protocol.offer_env ^ "=framed" |] else env in
 	let args = [ "-controloutfd"; slave_to_server_w_uuid;
 		     "-controlinfd"; server_to_slave_r_uuid;
 		     "-debuglog";
 		     last_log_file
-	] @ (if using_xiu then [ "-fake" ] else []) @ args in
-	let pid = Forkhelpers.safe_close_and_exec None None None 
+	] @ (if using_xiu then [ "-fake" ] else [])
+	  @ args in
+	let pid = Forkhelpers.safe_close_and_exec ~env None None None 
 	  ([ slave_to_server_w_uuid, slave_to_server_w;
 	    server_to_slave_r_uuid, server_to_slave_r ] @ fds)
 	  path args in
@@ -68,19 +79,22 @@ let connect path domid (args: string list) (fds: (string * Unix.file_descr) list
 	Unix.out_channel_of_descr server_to_slave_w,
 	slave_to_server_r,
 	server_to_slave_w,
-	pid
+	pid,
+	ref (if framed then None else Some Xenguest_protocol.Text)
 
 (** Wait for the (hopefully dead) child process *)
-let disconnect (_, _, r, w, pid) =
+let disconnect (_, _, r, w, pid, _) =
 	Unix.close r;
 	Unix.close w;
 	ignore(Forkhelpers.waitpid pid)
 
-let with_connection (task: Xenops_task.t) path domid (args: string list) (fds: (string * Unix.file_descr) list) f =
+(** Run f with a connection to a new helper, which is disconnected afterwards
+    unless f has set keep (f then becomes responsible for it) *)
+let with_connection ?(keep = ref false) (task: Xenops_task.t) path domid (args: string list) (fds: (string * Unix.file_descr) list) f =
 	let t = connect path domid args fds in
 	let cancelled = ref false in
 	let cancel_cb () =
-		let _, _, _, _, pid = t in
+		let _, _, _, _, pid, _ = t in
 		let pid = Forkhelpers.getpid pid in
 		cancelled := true;
 		info "Cancelling task %s by killing xenguest subprocess pid: %d" task.Xenops_task.id pid;
@@ -96,54 +110,62 @@ let with_connection (task: Xenops_task.t) path domid (args: string list) (fds: (
 						then Xenops_task.raise_cancelled task
 						else raise e
 				)
-		) (fun () -> disconnect t)
+		) (fun () -> if not !keep then disconnect t)
 
 (** immediately write a command to the control channel *)
-let send (_, out, _, _, _) txt = output_string out txt; flush out
+let send (_, out, _, _, _, _) txt = output_string out txt; flush out
+
+(** change the rate limit of a running save (bytes/s, 0 for none). The
+    helper only acts on this if it was started with -fork and the suspend
+    fast path (-suspend_req_fd and -suspend_ack_fd), as Domain.suspend does;
+    otherwise it logs an error and ignores the change. *)
+let set_rate_limit cnx bytes_per_sec =
+	send cnx (Printf.sprintf "ratelimit:%d\n" bytes_per_sec)
 
-(** Keep this in sync with xenguest_main *)
-type message =
+type message = Xenguest_protocol.message =
     | Stdout of string (* captured stdout from libxenguest *)
     | Stderr of string (* captured stderr from libxenguest *)
     | Error of string  (* an actual error that we detected *)
     | Suspend          (* request the caller suspends the domain *)
     | Info of string   (* some info that we want to send back *)
-    | Result of string (* the result of the operation *)
-
-let string_of_message = function
-  | Stdout x -> "stdout:" ^ (String.escaped x)
-  | Stderr x -> "stderr:" ^ (String.escaped x)
-  | Error x  -> "error:" ^ (String.escaped x)
-  | Suspend  -> "suspend:"
-  | Info x   -> "info:" ^ (String.escaped x)
-  | Result x -> "result:" ^ (String.escaped x)
-
-let message_of_string x =
-  if not(String.contains x ':') 
-  then failwith (Printf.sprintf "Failed to parse message from xenguesthelper [%s]" x);
-  let i = String.index x ':' in
-  let prefix = String.sub x 0 i
-  and suffix = String.sub x (i + 1) (String.length x - i - 1) in match prefix with
-    | "stdout" -> Stdout suffix
-    | "stderr" -> Stderr suffix
-    | "error" -> Error suffix
-    | "suspend" -> Suspend
-    | "info" -> Info suffix
-    | "result" -> Result suffix
-    | _ -> Error "uncaught exception"
-
-(** return the next output line from the control channel *)
-let receive (infd, _, _, _, _) = message_of_string (input_line infd)
-
-(** return the next output line which is not a debug: line *)
-let rec non_debug_receive ?(debug_callback=(fun s -> debug "%s" s)) cnx = match receive cnx with
-  | Stdout x -> debug_callback x; non_debug_receive ~debug_callback cnx
-  | Stderr x -> debug_callback x; non_debug_receive ~debug_callback cnx
-  | Info x -> debug_callback x; non_debug_receive ~debug_callback cnx
+    | Result of Xenguest_protocol.result (* the result of the operation *)
+    | Progress of int  (* percentage of the memory sent (framed only) *)
+    | Convergence of Xenguest_protocol.convergence (* a live save measured (framed only) *)
+
+let string_of_message = Xenguest_protocol.string_of_message
+
+(** return the next message from the control channel. Until the helper
+    has answered the offer of framing, its first line is read as text: it
+    is either the acknowledgement or (from a helper which declined) the
+    first message. *)
+let rec receive ((infd, _, _, _, _, protocol) as cnx) = match !protocol with
+  | Some Xenguest_protocol.Framed -> Xenguest_protocol.read_framed infd
+  | Some Xenguest_protocol.Text -> Xenguest_protocol.message_of_string (input_line infd)
+  | None ->
+    let line = input_line infd in
+    if line = Xenguest_protocol.ack then begin
+      protocol := Some Xenguest_protocol.Framed;
+      receive cnx
+    end else begin
+      debug "xenguesthelper declined the framed protocol";
+      protocol := Some Xenguest_protocol.Text;
+      Xenguest_protocol.message_of_string line
+    end
+
+(** return the next message which is not debug output, progress or a
+    measurement of convergence *)
+let rec non_debug_receive ?(debug_callback=(fun s -> debug "%s" s)) ?(progress_callback=(fun p -> debug "progress = %d / 100" p)) ?(convergence_callback=(fun c -> debug "%s" (Xenguest_protocol.string_of_convergence c))) cnx =
+  let next () = non_debug_receive ~debug_callback ~progress_callback ~convergence_callback cnx in
+  match receive cnx with
+  | Stdout x -> debug_callback x; next ()
+  | Stderr x -> debug_callback x; next ()
+  | Info x -> debug_callback x; next ()
+  | Progress x -> progress_callback x; next ()
+  | Convergence x -> convergence_callback x; next ()
   | x -> x (* Error or Result or Suspend *)
 
 (* Dump memory statistics on failure *)
-let non_debug_receive ?debug_callback cnx = 
+let non_debug_receive ?debug_callback ?progress_callback ?convergence_callback cnx = 
 	let debug_memory () = 
 		Xenctrl.with_intf (fun xc ->
 			let open Memory in
@@ -157,7 +179,7 @@ let non_debug_receive ?debug_callback cnx =
 				(p.total_pages |> of_nativeint |> mib_of_pages_free)
 		) in
   try
-    match non_debug_receive ?debug_callback cnx with
+    match non_debug_receive ?debug_callback ?progress_callback ?convergence_callback cnx with
     | Error y as x -> 
 	error "Received: %s" y;
 	debug_memory (); x
@@ -186,5 +208,5 @@ let receive_success ?(debug_callback=(fun s -> debug "%s" s)) cnx =
 		end
 	| Suspend -> failwith "xenguesthelper protocol failure; not expecting Suspend"
 	| Result x -> x
-	| Stdout _ | Stderr _ | Info _ -> assert false
+	| Stdout _ | Stderr _ | Info _ | Progress _ | Convergence _ -> assert false
 
@@ -110,7 +110,7 @@ let suspend_domain ~xc ~xs ~domid ~file =
 		in
 	let hvm = is_hvm ~xc domid in
 	let fd = Unix.openfile file [ Unix.O_WRONLY; Unix.O_CREAT; Unix.O_EXCL ] 0o600 in
-	Domain.suspend task ~xc ~xs ~hvm ~qemu_domid:0 default_xenguest domid fd [] suspendfct;
+	Domain.suspend task ~xc ~xs ~hvm ~qemu_domid:0 default_xenguest domid fd [ Domain.Integrity ] suspendfct;
 	Unix.close fd
 
 let suspend_domain_and_resume ~xc ~xs ~domid ~file ~cooperative =
@@ -121,6 +121,38 @@ let suspend_domain_and_destroy ~xc ~xs ~domid ~file =
 	suspend_domain ~xc ~xs ~domid ~file;
 	Domain.destroy task ~xc ~xs ~qemu_domid:0 domid
 
+(* Evacuate the domains given as domid=destination (a file or tcp:host:port)
+   and destroy them once saved *)
+let evacuate ~xc ~xs ~workers ~bandwidth args =
+	let domains = List.map (fun arg ->
+		match String.split ~limit:2 '=' arg with
+		| [ domid; dest ] -> int_of_string domid, Evacuate.destination_of_string dest
+		| _ -> failwith (sprintf "expected domid=destination, not %s" arg)
+	) args in
+	let vms = Evacuate.measure ~xc domains in
+	(* Only a -bandwidth is enforced; without one the saves run unlimited
+	   and a nominal 1Gb/s only orders them *)
+	let flags = [ Domain.Live; Domain.Integrity ] @
+		(match bandwidth with Some bps -> [ Domain.Host_rate_limit bps ] | None -> []) in
+	let bandwidth = float_of_int (Opt.default 125000000 bandwidth) in
+	let save vm progress =
+		let suspendfct () =
+			let path = xs.Xs.getdomainpath vm.Evacuate.domid in
+			xs.Xs.write (Printf.sprintf "%s/control/shutdown" path) "suspend";
+			Unix.sleep 1
+			in
+		let hvm = is_hvm ~xc vm.Evacuate.domid in
+		let fd = Evacuate.open_destination vm.Evacuate.destination in
+		finally (fun () ->
+			Domain.suspend task ~xc ~xs ~hvm ~qemu_domid:0 default_xenguest vm.Evacuate.domid fd flags
+				~progress_callback:progress suspendfct
+		) (fun () -> Unix.close fd);
+		Domain.destroy task ~xc ~xs ~qemu_domid:0 vm.Evacuate.domid in
+	let report vm state overall =
+		printf "%3.0f%% domid %d: %s\n%!" (overall *. 100.) vm.Evacuate.domid (Evacuate.string_of_state state) in
+	let results = Evacuate.run ~workers ~bandwidth ~save ~report vms in
+	if List.exists (function (_, Evacuate.Failed _) -> true | _ -> false) results then exit 1
+
 let balloon_domain ~xs ~domid ~mem_mib =
 	if mem_mib <= 16L then
 		failwith (sprintf "cannot balloon domain below 16Mb: %Ld requested" mem_mib);
@@ -482,7 +514,9 @@ let do_cmd_parsing subcmd init_pos =
 	and irq = ref (-1)
 	and otherargs = ref []
 	and slot = ref (-1)
-	and timeout = ref (-1l) in
+	and timeout = ref (-1l)
+	and workers = ref 4
+	and bandwidth = ref None in
 
 	let set_int64 r s =
 		try r := Int64.of_string s
@@ -582,6 +616,10 @@ let do_cmd_parsing subcmd init_pos =
 		"-slot", Arg.Set_int slot, "slot";
 		"-timeout", Arg.String (fun x -> timeout := Int32.of_string x), "timeout";
 	]
+	and evacuate_args = [
+		"-workers", Arg.Set_int workers, "Number of concurrent saves (default 4)";
+		"-bandwidth", Arg.Int (fun x -> bandwidth := Some x), "Limit the saves to this many bytes/s in total (default: no limit, scheduled as 125000000)";
+	]
 	and backend_args = [
 		"-backend-domid", Arg.Set_int backend_domid, "Domain ID of backend domain (default: 0)";
 	] in
@@ -593,6 +631,7 @@ let do_cmd_parsing subcmd init_pos =
 		("setmaxmem"      , common @ setmaxmem_args);
 		("save_domain"    , common @ common_suspend);
 		("chkpoint_domain", common @ common_suspend @ resume_args);
+		("evacuate"       , evacuate_args);
 		("shutdown_domain", common @ shutdown_args);
 		("hard_shutdown_domain", common @ shutdown_args);
 		("sysrq_domain"   , common @ sysrq_args);
@@ -654,7 +693,7 @@ let do_cmd_parsing subcmd init_pos =
 		!mode, !phystype, !params, !device_number, !dev_type, !devid, !mac, !pci,
 		!reason, !sysrq, !script, !sync, !netty, !weight, !cap, !bitmap, !cooperative,
 		!boot, !ioport_start, !ioport_end, !iomem_start, !iomem_end, !irq,
-		!slot, !timeout, List.rev !otherargs, allcommands
+		!slot, !timeout, !workers, !bandwidth, List.rev !otherargs, allcommands
 
 let _ = try
 
@@ -670,7 +709,7 @@ let _ = try
                phystype, params, device_number, dev_type, devid, mac, pci, reason, sysrq,
                script, sync, netty, weight, cap, bitmap, cooperative,
                boot, ioport_start, ioport_end, iomem_start, iomem_end, irq,
-               slot, timeout, otherargs, allcommands = do_cmd_parsing subcmd init_pos in
+               slot, timeout, workers, bandwidth, otherargs, allcommands = do_cmd_parsing subcmd init_pos in
 
 	let is_domain_hvm xc domid = (Xenctrl.domain_getinfo xc domid).Xenctrl.hvm_guest in
 
@@ -708,6 +747,9 @@ let _ = try
 	| "chkpoint_domain" ->
 		assert_domid (); assert_file ();
 		with_xc_and_xs (fun xc xs -> suspend_domain_and_resume ~xc ~xs ~domid ~file ~cooperative)
+	| "evacuate" ->
+		if otherargs = [] then error "domid=destination";
+		with_xc_and_xs (fun xc xs -> evacuate ~xc ~xs ~workers ~bandwidth otherargs)
 	| "shutdown_domain" -> (
 		assert_domid ();
 		match reason with
@@ -53,6 +53,7 @@ let config_spec = [
 		);
 	"worker-pool-size", Config.Set_int worker_pool_size;
 	"database-path", Config.Set_string Xenops_utils.root;
+	"save-integrity", Config.Set_bool Domain.suspend_integrity;
 ]
 
 let read_config_file () =
@@ -72,7 +73,8 @@ let dump_config_file () : unit =
 	debug "persist = %b" !persist;
 	debug "daemon = %b" !daemon;
 	debug "worker-pool-size = %d" !worker_pool_size;
-	debug "database-path = %s" !Xenops_utils.root
+	debug "database-path = %s" !Xenops_utils.root;
+	debug "save-integrity = %b" !Domain.suspend_integrity
 
 let socket : Http_svr.socket option ref = ref None
 let server = Http_svr.Server.empty (Xenops_server.make_context ())